@@ -0,0 +1,266 @@
+#include "billing.h"
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+#include "fmt_fixed.h"
+#include "mem_budget.h"
+#include "trace.h"
+
+#define BILLING_TIME_VALID     ( ( time_t ) 1577836800 )   /* 2020-01-01, SNTP has run */
+
+static const char *TAG = "BILLING";
+
+typedef struct {
+    int32_t month;          /* year * 12 + month, -1 not known yet */
+    tariff_acc_t acc;
+} billing_month_t;
+
+/* The inactive table belongs to the writer, the active one is read under _mux */
+static tariff_table_t _tables[ 2 ];
+static uint8_t _active = 0;
+static tariff_acc_t _today;
+static billing_month_t _month = { .month = -1 };
+static int64_t _creditUrp = 0;
+static uint8_t _bandNow = 0;
+static uint32_t _samples = 0;
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Day cache, PMonTask only */
+static time_t _dayStart = 0;
+static time_t _dayEnd = 0;
+static int _wday = 1;
+static int _mon = 1;
+static int _mday = 1;
+static int32_t _monthId = -1;
+
+static uint64_t billing_uwh( float wh )
+{
+    return ( wh > 0 ) ? ( uint64_t ) ( ( double ) wh * 1e6 + 0.5 ) : 0;
+}
+
+/**
+ * @brief Local midnight to midnight around now, a mktime each way so a
+ *        short or long day is still one day
+ * @param now
+ */
+static void billing_new_day( time_t now )
+{
+    struct tm tm;
+
+    localtime_r( &now, &tm );
+    _wday = tm.tm_wday;
+    _mon = tm.tm_mon + 1;
+    _mday = tm.tm_mday;
+    _monthId = ( tm.tm_year + 1900 ) * 12 + tm.tm_mon;
+
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    _dayStart = mktime( &tm );
+    tm.tm_mday++;
+    tm.tm_isdst = -1;
+    _dayEnd = mktime( &tm );
+}
+
+static void billing_store_month( const billing_month_t *m )
+{
+    nvs_handle_t handle;
+
+    if ( nvs_open( BILLING_NAMESPACE, NVS_READWRITE, &handle ) == ESP_OK ) {
+        nvs_set_blob( handle, BILLING_KEY_MONTH, m, sizeof( *m ) );
+        TRACE_BEGIN( TRACE_EV_NVS_COMMIT, 0 );
+        esp_err_t err = nvs_commit( handle );
+        TRACE_END( TRACE_EV_NVS_COMMIT, err == ESP_OK );
+        nvs_close( handle );
+    }
+}
+
+/**
+ * @brief Load this month's accumulators, call once from app_main before the first tariff
+ */
+void billing_init( void )
+{
+    nvs_handle_t handle;
+    billing_month_t m;
+    size_t len = sizeof( m );
+
+    MEM_STATIC( MEM_SUB_METER, _tables );
+
+    if ( nvs_open( BILLING_NAMESPACE, NVS_READONLY, &handle ) == ESP_OK ) {
+        if ( ( nvs_get_blob( handle, BILLING_KEY_MONTH, &m, &len ) == ESP_OK ) && ( len == sizeof( m ) ) ) {
+            portENTER_CRITICAL( &_mux );
+            _month = m;
+            portEXIT_CRITICAL( &_mux );
+        }
+        nvs_close( handle );
+    }
+}
+
+/**
+ * @brief Compile a schedule (see tariff.h) and make it the active tariff
+ * @param spec
+ * @param err_pos   offset in spec of what was refused
+ * @return false when spec does not compile, the active tariff is kept
+ */
+bool billing_set_tariff( const char *spec, int *err_pos )
+{
+    uint8_t next = _active ^ 1;   /* only this writer changes _active */
+
+    if ( !tariff_compile( spec, &_tables[ next ], err_pos ) ) {
+        ESP_LOGW( TAG, "tariff refused at %d: %s", *err_pos, spec );
+        return false;
+    }
+
+    portENTER_CRITICAL( &_mux );
+    _active = next;
+    portEXIT_CRITICAL( &_mux );
+    return true;
+}
+
+/**
+ * @brief Account one sample, PMonTask
+ * @param now         wall clock of the sample
+ * @param energy_wh   measured, goes to the energy accumulators and the blocks
+ * @param billed_wh   taken from the balance, is what costs money
+ * @return int64_t    credit left, micro rupiah
+ */
+int64_t billing_sample( time_t now, float energy_wh, float billed_wh )
+{
+    bool synced = ( now >= BILLING_TIME_VALID );
+    uint32_t minute = 0;
+
+    if ( synced ) {
+        if ( ( now < _dayStart ) || ( now >= _dayEnd ) ) {
+            billing_new_day( now );
+        }
+        minute = ( uint32_t ) ( now - _dayStart ) / 60;
+    }
+    uint64_t uwh = billing_uwh( energy_wh );
+    uint64_t billed_uwh = billing_uwh( billed_wh );
+
+    portENTER_CRITICAL( &_mux );
+    const tariff_table_t *t = &_tables[ _active ];
+    if ( synced && ( _month.month != _monthId ) ) {
+        memset( &_month.acc, 0, sizeof( _month.acc ) );
+        _month.month = _monthId;
+    }
+    uint8_t band = synced ? tariff_band( t, tariff_day_type( t, _wday, _mon, _mday ), minute ) : 0;
+    int64_t cost = tariff_cost_urp( billed_uwh, tariff_rate_sen( t, band, tariff_acc_energy( &_month.acc ) ) );
+
+    _today.energy_uwh[ band ] += uwh;
+    _today.cost_urp[ band ] += cost;
+    _month.acc.energy_uwh[ band ] += uwh;
+    _month.acc.cost_urp[ band ] += cost;
+    _creditUrp = ( cost < _creditUrp ) ? _creditUrp - cost : 0;
+    _bandNow = band;
+    _samples++;
+    int64_t credit = _creditUrp;
+    portEXIT_CRITICAL( &_mux );
+
+    return credit;
+}
+
+/**
+ * @brief Start today's accumulators over and store the month's, from the daily rollover
+ */
+void billing_day_reset( void )
+{
+    billing_month_t m;
+
+    portENTER_CRITICAL( &_mux );
+    memset( &_today, 0, sizeof( _today ) );
+    m = _month;
+    portEXIT_CRITICAL( &_mux );
+
+    billing_store_month( &m );
+}
+
+/**
+ * @brief Value the whole kWh balance at the band 0 rate, at start and after a reset
+ * @param balance_wh
+ */
+void billing_credit_set( float balance_wh )
+{
+    uint64_t uwh = billing_uwh( balance_wh );
+
+    portENTER_CRITICAL( &_mux );
+    _creditUrp = tariff_cost_urp( uwh, _tables[ _active ].rate_sen[ 0 ] );
+    portEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief A top-up, valued at the band 0 rate
+ * @param wh
+ */
+void billing_credit_add( float wh )
+{
+    uint64_t uwh = billing_uwh( wh );
+
+    portENTER_CRITICAL( &_mux );
+    _creditUrp += tariff_cost_urp( uwh, _tables[ _active ].rate_sen[ 0 ] );
+    portEXIT_CRITICAL( &_mux );
+}
+
+int64_t billing_credit_urp( void )
+{
+    portENTER_CRITICAL( &_mux );
+    int64_t credit = _creditUrp;
+    portEXIT_CRITICAL( &_mux );
+    return credit;
+}
+
+void billing_get_stats( billing_stats_t *stats )
+{
+    portENTER_CRITICAL( &_mux );
+    const tariff_table_t *t = &_tables[ _active ];
+    stats->today = _today;
+    stats->month = _month.acc;
+    stats->credit_urp = _creditUrp;
+    stats->bands = t->bands;
+    memcpy( stats->rate_sen, t->rate_sen, sizeof( stats->rate_sen ) );
+    stats->band_now = _bandNow;
+    stats->samples = _samples;
+    portEXIT_CRITICAL( &_mux );
+}
+
+/* kWh with 3 decimals and rupiah with 2, fixed point all the way */
+static void billing_put_acc( fmt_buf_t *b, const char *label, uint64_t uwh, int64_t urp )
+{
+    fmt_str( b, label );
+    fmt_fixed( b, ( int32_t ) ( uwh / 1000000 ), 3 );
+    fmt_str( b, " kWh Rp " );
+    fmt_fixed( b, ( int32_t ) ( urp / 10000 ), 2 );
+}
+
+/**
+ * @brief Rates, per band energy and cost today and this month, credit
+ */
+void billing_report( void )
+{
+    billing_stats_t s;
+    char line[ 128 ];
+    fmt_buf_t b;
+
+    billing_get_stats( &s );
+    for ( uint8_t i = 0; i < s.bands; i++ ) {
+        fmt_begin( &b, line, sizeof( line ) );
+        fmt_str( &b, "band " );
+        fmt_fixed( &b, i, 0 );
+        fmt_str( &b, ( i == s.band_now ) ? "* Rp " : "  Rp " );
+        fmt_fixed( &b, ( int32_t ) s.rate_sen[ i ], 2 );
+        fmt_str( &b, "/kWh" );
+        billing_put_acc( &b, ", today ", s.today.energy_uwh[ i ], s.today.cost_urp[ i ] );
+        billing_put_acc( &b, ", month ", s.month.energy_uwh[ i ], s.month.cost_urp[ i ] );
+        fmt_end( &b );
+        ESP_LOGI( TAG, "%s", line );
+    }
+
+    fmt_begin( &b, line, sizeof( line ) );
+    billing_put_acc( &b, "all bands month ", tariff_acc_energy( &s.month ), tariff_acc_cost( &s.month ) );
+    fmt_str( &b, ", credit Rp " );
+    fmt_fixed( &b, ( int32_t ) ( s.credit_urp / 10000 ), 2 );
+    fmt_end( &b );
+    ESP_LOGI( TAG, "%s, %u samples", line, ( unsigned ) s.samples );
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "tariff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Runtime side of the tariff engine
+ *
+ * Two compiled tables, one active. billing_set_tariff() compiles into the
+ * other one and swaps the index under the spinlock, so PMonTask never sees a
+ * half built table and never waits on the parser. Only one writer at a time:
+ * app_main before the console starts, then the console worker.
+ *
+ * billing_sample() resolves the band of the sample from a cached day (one
+ * localtime_r per day, not per sample), adds the energy to today's and this
+ * month's per band accumulators and takes the cost from the rupiah credit.
+ * Until SNTP has set the clock every sample is band 0 of a weekday.
+ *
+ * The credit is worth the kWh balance at the band 0 rate when it is set or
+ * topped up, after that only costs are taken off, so the rupiah shown follows
+ * the bands actually used. It lives in RAM: after a restart it is valued from
+ * the kWh balance again. The month accumulators are stored in NVS on every
+ * daily rollover and start over when the calendar month changes.
+ */
+#define BILLING_NAMESPACE      "billing"
+#define BILLING_KEY_MONTH      "month"
+
+typedef struct {
+    tariff_acc_t today;         /* since the last daily rollover */
+    tariff_acc_t month;         /* this calendar month */
+    int64_t credit_urp;         /* micro rupiah */
+    uint8_t bands;
+    uint32_t rate_sen[ TARIFF_MAX_BANDS ];
+    uint8_t band_now;           /* band of the last sample */
+    uint32_t samples;
+} billing_stats_t;
+
+void billing_init( void );
+bool billing_set_tariff( const char *spec, int *err_pos );
+
+int64_t billing_sample( time_t now, float energy_wh, float billed_wh );
+void billing_day_reset( void );
+
+void billing_credit_set( float balance_wh );
+void billing_credit_add( float wh );
+int64_t billing_credit_urp( void );
+
+void billing_get_stats( billing_stats_t *stats );
+void billing_report( void );
+
+#ifdef __cplusplus
+}
+#endif
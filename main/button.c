@@ -0,0 +1,134 @@
+#include "button.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "BUTTON";
+
+static button_config_t _cfg;
+static esp_timer_handle_t _debounce = NULL;
+static esp_timer_handle_t _long = NULL;
+static volatile bool _pressed = false;   /* debounced state */
+static bool _longFired = false;
+static button_stats_t _stats = {0};
+
+/**
+ * @brief First edge of a press or release, the interrupt stays off until the contact settled
+ */
+static void IRAM_ATTR button_isr( void *arg )
+{
+    gpio_intr_disable( _cfg.gpio );
+    _stats.edges++;
+    esp_timer_start_once( _debounce, ( uint64_t ) _cfg.debounce_ms * 1000ULL );
+}
+
+static void button_long_cb( void *arg )
+{
+    _longFired = true;
+    _stats.long_presses++;
+    if ( _cfg.on_long ) {
+        _cfg.on_long( _cfg.arg );
+    }
+}
+
+static void button_debounce_cb( void *arg )
+{
+    bool pressed = ( gpio_get_level( _cfg.gpio ) == _cfg.active_level );
+
+    if ( pressed && !_pressed ) {
+        _pressed = true;
+        _longFired = false;
+        esp_timer_start_once( _long, ( uint64_t ) _cfg.long_press_ms * 1000ULL );
+    } else if ( !pressed && _pressed ) {
+        _pressed = false;
+        esp_timer_stop( _long );
+        if ( !_longFired ) {
+            _stats.short_presses++;
+            if ( _cfg.on_short ) {
+                _cfg.on_short( _cfg.arg );
+            }
+        }
+    }
+
+    gpio_intr_enable( _cfg.gpio );
+
+    /* An edge between the read and the enable was lost, look again */
+    if ( ( gpio_get_level( _cfg.gpio ) == _cfg.active_level ) != _pressed ) {
+        gpio_intr_disable( _cfg.gpio );
+        esp_timer_start_once( _debounce, ( uint64_t ) _cfg.debounce_ms * 1000ULL );
+    }
+}
+
+/**
+ * @brief Watch one push button with an edge interrupt, nothing runs while it is idle
+ * @param config  copied
+ * @return esp_err_t
+ */
+esp_err_t button_init( const button_config_t *config )
+{
+    _cfg = *config;
+    if ( _cfg.debounce_ms == 0 ) {
+        _cfg.debounce_ms = BUTTON_DEBOUNCE_MS;
+    }
+    if ( _cfg.long_press_ms == 0 ) {
+        _cfg.long_press_ms = BUTTON_LONG_PRESS_MS;
+    }
+
+    const esp_timer_create_args_t debounce_args = {
+        .callback = button_debounce_cb,
+        .name = "btn_debounce",
+    };
+    const esp_timer_create_args_t long_args = {
+        .callback = button_long_cb,
+        .name = "btn_long",
+    };
+    esp_timer_create( &debounce_args, &_debounce );
+    esp_timer_create( &long_args, &_long );
+
+    /* GPIO34..39 have no internal pulls, the board provides one */
+    gpio_config_t io_conf = {
+        .pin_bit_mask = ( 1ULL << _cfg.gpio ),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    esp_err_t err = gpio_config( &io_conf );
+    if ( err != ESP_OK ) {
+        return err;
+    }
+
+    err = gpio_install_isr_service( 0 );
+    if ( ( err != ESP_OK ) && ( err != ESP_ERR_INVALID_STATE ) ) {
+        /* INVALID_STATE: another driver installed the service already */
+        ESP_LOGE( TAG, "ISR service: %s", esp_err_to_name( err ) );
+        return err;
+    }
+
+    _pressed = ( gpio_get_level( _cfg.gpio ) == _cfg.active_level );
+    _longFired = _pressed;   /* held through boot, not a press */
+
+#if CONFIG_PM_ENABLE
+    /*
+     * Edges are not seen in light sleep. Waking on the active level turns the pin
+     * interrupt level triggered: while held the debounce timer re-arms every
+     * debounce_ms, the release is found by button_debounce_cb as before.
+     */
+    err = gpio_wakeup_enable( _cfg.gpio, _cfg.active_level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL );
+    if ( err != ESP_OK ) {
+        ESP_LOGW( TAG, "No light sleep wake-up: %s", esp_err_to_name( err ) );
+    }
+#endif
+
+    return gpio_isr_handler_add( _cfg.gpio, button_isr, NULL );
+}
+
+bool button_is_pressed( void )
+{
+    return _pressed;
+}
+
+void button_get_stats( button_stats_t *stats )
+{
+    *stats = _stats;
+}
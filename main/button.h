@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUTTON_DEBOUNCE_MS     30     /* contact must be stable this long */
+#define BUTTON_LONG_PRESS_MS   2000
+
+/**
+ * @brief Press action, runs in the esp_timer task, keep it short
+ */
+typedef void ( *button_cb_t )( void *arg );
+
+typedef struct {
+    gpio_num_t gpio;
+    int active_level;           /* level while pressed */
+    uint32_t debounce_ms;
+    uint32_t long_press_ms;
+    button_cb_t on_short;       /* released before long_press_ms, may be NULL */
+    button_cb_t on_long;        /* held for long_press_ms, fires once per press, may be NULL */
+    void *arg;
+} button_config_t;
+
+typedef struct {
+    uint32_t edges;             /* interrupts taken, bounces included */
+    uint32_t short_presses;
+    uint32_t long_presses;
+} button_stats_t;
+
+esp_err_t button_init( const button_config_t *config );
+bool button_is_pressed( void );
+void button_get_stats( button_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
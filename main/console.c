@@ -0,0 +1,387 @@
+#include "console.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "pzem004tv3.h"
+#include "core.h"
+#include "mem_budget.h"
+#include "pm_mode.h"
+
+static const char *TAG = "CONSOLE";
+
+static uart_port_t _port;
+static QueueHandle_t _events = NULL;
+static QueueHandle_t _jobs = NULL;
+static const console_cmd_t *_cmds = NULL;
+static size_t _cmdCount = 0;
+static console_stats_t _stats = {0};
+static console_frame_handler_t _frameHandler = NULL;
+static SemaphoreHandle_t _txLock = NULL;   /* receive (BUSY) and worker both reply */
+
+/* Bytes read up to each ETX, only the receive task touches it */
+static uint8_t _rx[ CONSOLE_FRAME_MAX ];
+static size_t _rxLen = 0;
+
+/* A validated text command or a binary frame, copied by value into the worker queue */
+typedef struct {
+    const console_cmd_t *cmd;           /* NULL for a binary frame */
+    uint8_t argc;
+    uint8_t argv[ CONSOLE_MAX_ARGS ];   /* offsets into data */
+    uint16_t len;
+    uint8_t data[ CONSOLE_FRAME_MAX ];  /* text line, or seq + type + payload */
+} console_job_t;
+
+static console_job_t _rxJob;   /* staging copy, too big for the receive task's stack */
+static console_job_t _workJob; /* the worker's copy */
+
+static StaticQueue_t _jobsBuf;
+static uint8_t _jobsStorage[ CONSOLE_JOB_QUEUE * sizeof( console_job_t ) ];
+static StaticSemaphore_t _txLockBuf;
+
+static int console_cmd_compare( const void *key, const void *elem )
+{
+    return strcmp( ( const char * ) key, ( ( const console_cmd_t * ) elem )->name );
+}
+
+static void console_observe( uint32_t *last, uint32_t *max, int64_t start )
+{
+    uint32_t us = ( uint32_t ) ( esp_timer_get_time() - start );
+
+    *last = us;
+    if ( us > *max ) {
+        *max = us;
+    }
+}
+
+/**
+ * @brief Split a frame body in place, validate it and queue it for the worker
+ * @param line  text between STX and ETX, modified
+ */
+void console_dispatch( char *line )
+{
+    char *argv[ CONSOLE_MAX_ARGS ];
+    int64_t start = esp_timer_get_time();
+
+    int argc = core_split_fields( line, argv, CONSOLE_MAX_ARGS );
+    if ( argc < 0 ) {
+        _stats.rejected++;
+        ESP_LOGW( TAG, "Too many fields" );
+        ESP_LOGI( TAG, "<NAK,%s>", line );
+        return;
+    }
+
+    _stats.frames++;
+
+    const console_cmd_t *cmd = bsearch( argv[ 0 ], _cmds, _cmdCount, sizeof( console_cmd_t ), console_cmd_compare );
+    if ( cmd == NULL ) {
+        _stats.unknown++;
+        ESP_LOGW( TAG, "Unknown command %s", argv[ 0 ] );
+        ESP_LOGI( TAG, "<NAK,%s>", argv[ 0 ] );
+        return;
+    }
+    if ( !core_args_valid( cmd->args, cmd->flags & CONSOLE_ARGS_OPTIONAL, argc, argv ) ) {
+        _stats.rejected++;
+        ESP_LOGW( TAG, "Bad arguments for %s, expected %d (%s)", cmd->name, ( int ) strlen( cmd->args ), cmd->args );
+        ESP_LOGI( TAG, "<NAK,%s>", cmd->name );
+        return;
+    }
+
+    /* Fields are NUL separated already, keep only their offsets */
+    size_t len = ( argv[ argc - 1 ] - line ) + strlen( argv[ argc - 1 ] ) + 1;
+    _rxJob.cmd = cmd;
+    _rxJob.argc = argc;
+    for ( int i = 0; i < argc; i++ ) {
+        _rxJob.argv[ i ] = argv[ i ] - line;
+    }
+    memcpy( _rxJob.data, line, len );
+
+    if ( xQueueSend( _jobs, &_rxJob, 0 ) != pdTRUE ) {
+        _stats.busy++;
+        ESP_LOGI( TAG, "<BUSY,%s>", cmd->name );
+        return;
+    }
+    ESP_LOGI( TAG, "<ACK,%s>", cmd->name );
+    console_observe( &_stats.last_dispatch_us, &_stats.max_dispatch_us, start );
+}
+
+/**
+ * @brief Runs commands one at a time, a handler may block without stalling receive
+ */
+static void console_worker_task( void *arg )
+{
+    console_job_t *job = &_workJob;
+    char *argv[ CONSOLE_MAX_ARGS ];
+
+    for ( ;; ) {
+        if ( xQueueReceive( _jobs, job, portMAX_DELAY ) != pdTRUE ) {
+            continue;
+        }
+
+        pm_busy_begin( PM_BUSY_CONSOLE );
+        int64_t start = esp_timer_get_time();
+
+        if ( job->cmd == NULL ) {
+            if ( _frameHandler ) {
+                _frameHandler( job->data[ 0 ], job->data[ 1 ], &job->data[ 2 ], job->len - 2 );
+            }
+            console_observe( &_stats.last_exec_us, &_stats.max_exec_us, start );
+            pm_busy_end( PM_BUSY_CONSOLE );
+            continue;
+        }
+
+        for ( int i = 0; i < job->argc; i++ ) {
+            argv[ i ] = ( char * ) &job->data[ job->argv[ i ] ];
+        }
+
+        esp_err_t err = job->cmd->handler( job->argc, argv );
+        console_observe( &_stats.last_exec_us, &_stats.max_exec_us, start );
+        pm_busy_end( PM_BUSY_CONSOLE );
+
+        ESP_LOGI( TAG, "<DONE,%s,%s>", job->cmd->name, ( err == ESP_OK ) ? "OK" : "ERR" );
+    }
+}
+
+static void console_drop( size_t n )
+{
+    memmove( _rx, &_rx[ n ], _rxLen - n );
+    _rxLen -= n;
+}
+
+static void console_queue_frame( const uint8_t *frame, size_t total )
+{
+    size_t len = total - CONSOLE_FRAME_HDR - 3 + 2;   /* seq + type + payload */
+
+    _stats.binary_frames++;
+    if ( !PzemCheckCRC( frame, total - 1 ) ) {
+        /* No reply, the host retries on timeout */
+        _stats.crc_errors++;
+        return;
+    }
+
+    _rxJob.cmd = NULL;
+    _rxJob.len = len;
+    memcpy( _rxJob.data, &frame[ 4 ], len );
+    if ( xQueueSend( _jobs, &_rxJob, 0 ) != pdTRUE ) {
+        _stats.busy++;
+        console_send_frame( frame[ 4 ], CONSOLE_FRAME_BUSY, NULL, 0 );
+    }
+}
+
+/**
+ * @brief Split what was read so far into text and binary frames
+ * @return false when a binary frame is still incomplete
+ */
+static bool console_scan( void )
+{
+    while ( _rxLen > 0 ) {
+        uint8_t *etx = memchr( _rx, CONSOLE_ETX, _rxLen );
+        uint8_t *sync = NULL;
+
+        for ( size_t i = 0; i + 1 < _rxLen; i++ ) {
+            if ( ( _rx[ i ] == CONSOLE_SYNC0 ) && ( _rx[ i + 1 ] == CONSOLE_SYNC1 ) ) {
+                sync = &_rx[ i ];
+                break;
+            }
+        }
+
+        if ( ( sync != NULL ) && ( ( etx == NULL ) || ( sync < etx ) ) ) {
+            console_drop( sync - _rx );
+            if ( _rxLen < CONSOLE_FRAME_HDR ) {
+                return false;
+            }
+
+            size_t total = 4 + ( _rx[ 2 ] | ( _rx[ 3 ] << 8 ) ) + 3;
+            if ( ( total < CONSOLE_FRAME_HDR + 3 ) || ( total > CONSOLE_FRAME_MAX ) ) {
+                console_drop( 1 );   /* not a frame, look for the next sync */
+                continue;
+            }
+            if ( _rxLen < total ) {
+                return false;        /* an ETX inside the payload woke us early */
+            }
+            if ( _rx[ total - 1 ] == CONSOLE_ETX ) {
+                console_queue_frame( _rx, total );
+                console_drop( total );
+            } else {
+                console_drop( 1 );
+            }
+            continue;
+        }
+
+        if ( etx == NULL ) {
+            return true;
+        }
+
+        /* Text frame, noise before it is skipped and the last STX starts it */
+        size_t end = etx - _rx;
+        _rx[ end ] = '\0';
+        char *body = strrchr( ( char * ) _rx, CONSOLE_STX );
+        if ( body != NULL ) {
+            if ( ( size_t ) ( ( char * ) etx - body - 1 ) > CONSOLE_LINE_MAX ) {
+                _stats.overflows++;
+                ESP_LOGW( TAG, "Buffer overflow. Frame dropped." );
+            } else {
+                console_dispatch( body + 1 );
+            }
+        }
+        console_drop( end + 1 );
+    }
+    return true;
+}
+
+/**
+ * @brief Take everything up to and including the ETX at pos out of the ring buffer
+ */
+static void console_take_frame( int pos )
+{
+    size_t len = pos + 1;
+
+    if ( _rxLen + len > sizeof( _rx ) ) {
+        /* Longer than any frame, drain it without looking */
+        uint8_t scratch[ 64 ];
+        while ( len > 0 ) {
+            int n = uart_read_bytes( _port, scratch, ( len < sizeof( scratch ) ) ? len : sizeof( scratch ), 0 );
+            if ( n <= 0 ) {
+                break;
+            }
+            len -= n;
+        }
+        _rxLen = 0;
+        _stats.overflows++;
+        ESP_LOGW( TAG, "Buffer overflow. Frame dropped." );
+        return;
+    }
+
+    int n = uart_read_bytes( _port, &_rx[ _rxLen ], len, 0 );
+    if ( n > 0 ) {
+        _rxLen += n;
+    }
+    console_scan();
+}
+
+/**
+ * @brief Sleeps on the UART event queue, wakes up once per ETX
+ */
+static void console_task( void *arg )
+{
+    uart_event_t event;
+
+    for ( ;; ) {
+        if ( xQueueReceive( _events, &event, portMAX_DELAY ) != pdTRUE ) {
+            continue;
+        }
+
+        switch ( event.type ) {
+        case UART_PATTERN_DET: {
+            int pos = uart_pattern_pop_pos( _port );
+            if ( pos < 0 ) {
+                /* Position queue overflowed, the ring buffer no longer lines up with it */
+                uart_flush_input( _port );
+                _rxLen = 0;
+                _stats.overflows++;
+            } else {
+                console_take_frame( pos );
+            }
+            break;
+        }
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            /* Never an ETX in sight, drop what piled up */
+            uart_flush_input( _port );
+            xQueueReset( _events );
+            uart_pattern_queue_reset( _port, CONSOLE_PATTERN_QUEUE );
+            _rxLen = 0;
+            _stats.overflows++;
+            ESP_LOGW( TAG, "RX overflow, input flushed" );
+            break;
+        default:
+            /* UART_DATA, bytes wait in the ring buffer for their ETX */
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Install the UART driver with ETX pattern detection and start the receive and worker tasks
+ * @param port
+ * @param cmds   sorted by name (strcmp order), looked up with a binary search
+ * @param count
+ */
+void console_init( uart_port_t port, const console_cmd_t *cmds, size_t count )
+{
+    _port = port;
+    _cmds = cmds;
+    _cmdCount = count;
+
+    for ( size_t i = 1; i < count; i++ ) {
+        if ( strcmp( cmds[ i - 1 ].name, cmds[ i ].name ) >= 0 ) {
+            ESP_LOGE( TAG, "Command table not sorted at %s", cmds[ i ].name );
+        }
+    }
+
+    uart_driver_install( port, CONSOLE_RX_BUF, 0, CONSOLE_EVENT_QUEUE, &_events, 0 );
+    uart_enable_pattern_det_baud_intr( port, CONSOLE_ETX, 1, 9, 0, 0 );
+    uart_pattern_queue_reset( port, CONSOLE_PATTERN_QUEUE );
+
+    _jobs = xQueueCreateStatic( CONSOLE_JOB_QUEUE, sizeof( console_job_t ), _jobsStorage, &_jobsBuf );
+    _txLock = xSemaphoreCreateMutexStatic( &_txLockBuf );
+    MEM_STATIC( MEM_SUB_CONSOLE, _jobsStorage );
+    MEM_STATIC( MEM_SUB_CONSOLE, _rx );
+    MEM_STATIC( MEM_SUB_CONSOLE, _rxJob );
+    MEM_STATIC( MEM_SUB_CONSOLE, _workJob );
+
+    /* Receive only parses, the worker carries the stack for NVS, HTTP and TLS */
+    mem_task_start( MEM_TASK_CONSOLE, console_task, NULL );
+    mem_task_start( MEM_TASK_CONSOLE_WORKER, console_worker_task, NULL );
+}
+
+void console_get_stats( console_stats_t *stats )
+{
+    *stats = _stats;
+}
+
+void console_set_frame_handler( console_frame_handler_t handler )
+{
+    _frameHandler = handler;
+}
+
+/**
+ * @brief Write one binary frame, log lines from other tasks may still land between frames
+ * @param seq      the request's sequence number
+ * @param type
+ * @param payload
+ * @param len      up to CONSOLE_PAYLOAD_MAX
+ * @return esp_err_t
+ */
+esp_err_t console_send_frame( uint8_t seq, uint8_t type, const uint8_t *payload, size_t len )
+{
+    static uint8_t frame[ CONSOLE_FRAME_MAX ];
+
+    if ( len > CONSOLE_PAYLOAD_MAX ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake( _txLock, portMAX_DELAY );
+    size_t total = CONSOLE_FRAME_HDR + len + 3;
+    frame[ 0 ] = CONSOLE_SYNC0;
+    frame[ 1 ] = CONSOLE_SYNC1;
+    frame[ 2 ] = ( len + 2 ) & 0xFF;
+    frame[ 3 ] = ( len + 2 ) >> 8;
+    frame[ 4 ] = seq;
+    frame[ 5 ] = type;
+    if ( len > 0 ) {
+        memcpy( &frame[ CONSOLE_FRAME_HDR ], payload, len );
+    }
+    PzemSetCRC( frame, total - 1 );
+    frame[ total - 1 ] = CONSOLE_ETX;
+
+    int written = uart_write_bytes( _port, frame, total );
+    xSemaphoreGive( _txLock );
+
+    return ( written == ( int ) total ) ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONSOLE_STX            '<'
+#define CONSOLE_ETX            '>'
+#define CONSOLE_LINE_MAX       192    /* between STX and ETX, fits a telemetry URL */
+#define CONSOLE_MAX_ARGS       8      /* including the command name */
+#define CONSOLE_RX_BUF         1024   /* ring buffer, holds two full binary frames */
+#define CONSOLE_EVENT_QUEUE    16
+#define CONSOLE_PATTERN_QUEUE  32     /* ETX positions, binary payloads may carry a few */
+#define CONSOLE_JOB_QUEUE      4      /* commands waiting for the worker, more are answered BUSY */
+
+/*
+ * Binary frames share the port with the text commands, all fields little endian
+ *   0  0xA5 0x5A
+ *   2  length, u16: seq + type + payload
+ *   4  sequence, echoed in the reply
+ *   5  type
+ *   6  payload ...
+ *   n  CRC16/MODBUS of everything before it, low byte first
+ * n+2  CONSOLE_ETX, so the pattern interrupt also wakes the receiver for
+ *      binary frames, an ETX inside the payload only wakes it early
+ */
+#define CONSOLE_SYNC0          0xA5
+#define CONSOLE_SYNC1          0x5A
+#define CONSOLE_FRAME_HDR      6
+#define CONSOLE_FRAME_MAX      512    /* whole binary frame, trailer included */
+#define CONSOLE_PAYLOAD_MAX    ( CONSOLE_FRAME_MAX - CONSOLE_FRAME_HDR - 3 )
+#define CONSOLE_FRAME_BUSY     0x7E   /* reply type when the worker queue is full, empty payload */
+
+/*
+ * Frames are "<name,arg1,arg2,...>". Fields are split in place, empty
+ * fields are kept so "<1,ssid,>" passes an empty password.
+ *
+ * The receive task only parses and validates, then hands the command to a
+ * worker and answers right away, so input keeps flowing while a command
+ * sleeps or talks to NVS and the network:
+ *   <ACK,name>          queued
+ *   <BUSY,name>         worker queue full, command dropped
+ *   <NAK,name>          unknown command or arguments do not match the schema
+ *   <DONE,name,OK|ERR>  handler returned
+ *
+ * Argument schema, one character per argument:
+ *   's'  any text, may be empty
+ *   'n'  decimal number
+ *   'i'  integer
+ */
+#define CONSOLE_ARGS_OPTIONAL  0x01   /* no arguments at all is also accepted, e.g. get vs set */
+
+/* Runs in the worker task, argv points into the worker's own copy of the frame */
+typedef esp_err_t ( *console_handler_t )( int argc, char **argv );
+
+/* Binary frame with a good CRC, runs in the worker task */
+typedef void ( *console_frame_handler_t )( uint8_t seq, uint8_t type, const uint8_t *payload, size_t len );
+
+typedef struct {
+    const char *name;
+    const char *args;
+    uint8_t flags;
+    console_handler_t handler;
+} console_cmd_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t unknown;
+    uint32_t rejected;       /* argument count or type did not match the schema */
+    uint32_t overflows;      /* frame longer than CONSOLE_LINE_MAX or RX buffer full */
+    uint32_t busy;           /* worker queue full */
+    uint32_t binary_frames;
+    uint32_t crc_errors;
+    uint32_t last_dispatch_us;
+    uint32_t max_dispatch_us;  /* receive side: parse, validate, enqueue */
+    uint32_t last_exec_us;
+    uint32_t max_exec_us;
+} console_stats_t;
+
+void console_init( uart_port_t port, const console_cmd_t *cmds, size_t count );
+void console_dispatch( char *line );
+void console_get_stats( console_stats_t *stats );
+void console_set_frame_handler( console_frame_handler_t handler );
+esp_err_t console_send_frame( uint8_t seq, uint8_t type, const uint8_t *payload, size_t len );
+
+#ifdef __cplusplus
+}
+#endif
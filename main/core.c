@@ -0,0 +1,302 @@
+#include "core.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The CRC runs while a PZEM or console reply is handled, keep its table out of flash */
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#define CORE_DRAM      DRAM_ATTR
+#else
+#define CORE_DRAM
+#endif
+
+/* Pre Calculated CRC lookup table */
+/* source: https://www.modbustools.com/modbus_crc16.html */
+static const CORE_DRAM uint16_t _crcTable[ 256 ] = {
+    0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
+    0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
+    0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
+    0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
+    0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
+    0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
+    0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
+    0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
+    0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
+    0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
+    0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
+    0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
+    0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
+    0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
+    0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
+    0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
+    0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
+    0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
+    0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
+    0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
+    0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
+    0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
+    0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
+    0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
+    0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
+    0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
+    0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
+    0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
+    0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
+    0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
+    0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
+    0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040
+};
+
+/* PLN power class (VA) to the active power limit (W) for protection and the LCD bar */
+static const struct {
+    uint16_t va;
+    uint16_t limit_w;
+} _classes[] = {
+    { 450, 400 },
+    { 900, 700 },
+    { 1300, 1100 },
+    { 2200, 1800 },
+    { 3500, 2500 },
+};
+
+/**
+ * @brief Modbus RTU CRC, table driven
+ * @param data
+ * @param len
+ * @return uint16_t  low byte goes first on the wire
+ */
+uint16_t core_crc16( const uint8_t *data, uint16_t len )
+{
+    uint16_t crc = 0xFFFF;
+
+    while ( len-- ) {
+        uint8_t idx = *data++ ^ crc;
+        crc >>= 8;
+        crc ^= _crcTable[ idx ];
+    }
+    return crc;
+}
+
+/**
+ * @brief Write the CRC of buf[ 0 .. len - 3 ] into the last two bytes
+ * @param buf
+ * @param len   including the CRC
+ */
+void core_set_crc( uint8_t *buf, uint16_t len )
+{
+    if ( len <= 2 ) {
+        return;
+    }
+
+    uint16_t crc = core_crc16( buf, len - 2 );
+    buf[ len - 2 ] = crc & 0xFF;
+    buf[ len - 1 ] = ( crc >> 8 ) & 0xFF;
+}
+
+/**
+ * @brief Check the CRC in the last two bytes
+ * @param buf
+ * @param len   including the CRC
+ * @return bool
+ */
+bool core_check_crc( const uint8_t *buf, uint16_t len )
+{
+    if ( len <= 2 ) {
+        return false;
+    }
+    return ( ( uint16_t ) buf[ len - 2 ] | ( uint16_t ) buf[ len - 1 ] << 8 ) == core_crc16( buf, len - 2 );
+}
+
+/**
+ * @brief Big-endian register words of a validated read reply
+ * @param resp   address, function, byte count, then the data
+ * @param count
+ * @param regs
+ */
+void core_unpack_regs( const uint8_t *resp, uint16_t count, uint16_t *regs )
+{
+    for ( uint16_t i = 0; i < count; i++ ) {
+        regs[ i ] = ( ( uint16_t ) resp[ 3 + ( 2 * i ) ] << 8 ) | resp[ 4 + ( 2 * i ) ];
+    }
+}
+
+/**
+ * @brief 32 bit value of a low / high register pair
+ */
+uint32_t core_reg32( uint16_t lo, uint16_t hi )
+{
+    return ( ( uint32_t ) hi << 16 ) | lo;
+}
+
+/**
+ * @brief Measured and derived values from RG_VOLTAGE .. RG_ALARM
+ * @param regs   CORE_INPUT_REGS words
+ * @param out
+ */
+void core_decode_input( const uint16_t *regs, _current_values_t *out )
+{
+    out->voltage = regs[ 0 ] / 10.0f;                            /* 0.1 V */
+    out->current = core_reg32( regs[ 1 ], regs[ 2 ] ) / 1000.0f; /* 0.001 A */
+    out->power = core_reg32( regs[ 3 ], regs[ 4 ] ) / 10.0f;     /* 0.1 W */
+    out->energy = core_reg32( regs[ 5 ], regs[ 6 ] ) / 1000.0f;  /* 1 Wh */
+    out->frequency = regs[ 7 ] / 10.0f;                          /* 0.1 Hz */
+    out->pf = regs[ 8 ] / 100.0f;                                /* 0.01 */
+    out->alarms = regs[ 9 ];
+
+    /* Not produced by the sensor */
+    out->apparent_power = out->voltage * out->current;
+
+    /* FI, Angle between Apparent and real Power
+        https://www.electricaltechnology.org/2013/07/power-factor.html
+    */
+    out->fi = 360.0F * ( acosf( out->pf ) / ( 2.0F * 3.14159265F ) );
+
+    /* Reactive Power (Q, VAr), S x sin(acos(pf)); fi above is in degrees */
+    out->reactive_power = ( out->pf < 1.0f ) ? out->apparent_power * sqrtf( 1.0f - out->pf * out->pf ) : 0;
+}
+
+/**
+ * @brief Energy of one sample, the interval covers timer periods missed since the last one
+ * @param power_w     V x I x PF
+ * @param ticks       timer periods since the previous sample
+ * @param period_us
+ * @return float  Wh
+ */
+float core_sample_energy_wh( float power_w, uint32_t ticks, uint32_t period_us )
+{
+    float interval_s = ticks * ( period_us / 1000000.0f );
+    return power_w * interval_s / 3600.0f;
+}
+
+/**
+ * @brief Add a sample to the daily usage. Past the limit the sample is not billed,
+ *        the relay opens instead.
+ * @param used_today_wh
+ * @param daily_limit_wh
+ * @param energy_wh
+ * @return core_bill_t
+ */
+core_bill_t core_bill_sample( float used_today_wh, float daily_limit_wh, float energy_wh )
+{
+    core_bill_t bill;
+
+    bill.used_today_wh = used_today_wh + energy_wh;
+    bill.daily_limit = ( bill.used_today_wh >= daily_limit_wh );
+    bill.consume_wh = bill.daily_limit ? 0 : energy_wh;
+    return bill;
+}
+
+/**
+ * @brief Balance after taking consume_wh, never below 0
+ */
+float core_balance_after( float balance_wh, float consume_wh )
+{
+    float left = balance_wh - consume_wh;
+    return ( left < 0 ) ? 0 : left;
+}
+
+/**
+ * @brief Below the kWh level that starts the low balance notices
+ */
+bool core_balance_low( float balance_wh, float limit_kwh )
+{
+    return ( balance_wh / 1000 ) < limit_kwh;
+}
+
+/**
+ * @brief Balance in kWh rounded down to 0.1, as shown on the LCD and in notices
+ */
+float core_balance_kwh_shown( float balance_wh )
+{
+    float kwh = balance_wh / 1000.0f;
+    return floorf( kwh * 10 ) / 10;
+}
+
+/**
+ * @brief Active power limit of a power class
+ * @param va
+ * @return uint16_t  W, 0 for an unknown class
+ */
+uint16_t core_class_limit_w( int va )
+{
+    for ( size_t i = 0; i < sizeof( _classes ) / sizeof( _classes[ 0 ] ); i++ ) {
+        if ( _classes[ i ].va == va ) {
+            return _classes[ i ].limit_w;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Split a console line at commas in place
+ * @param line   modified, commas become NUL
+ * @param argv   receives up to max fields
+ * @param max
+ * @return int   number of fields, -1 when there are more than max
+ */
+int core_split_fields( char *line, char **argv, int max )
+{
+    int argc = 0;
+
+    argv[ argc++ ] = line;
+    for ( char *p = line; *p; p++ ) {
+        if ( *p != ',' ) {
+            continue;
+        }
+        if ( argc == max ) {
+            return -1;
+        }
+        *p = '\0';
+        argv[ argc++ ] = p + 1;
+    }
+    return argc;
+}
+
+/**
+ * @brief One argument against its schema letter: s any text, n number, i integer
+ */
+bool core_arg_valid( char type, const char *arg )
+{
+    char *end;
+
+    switch ( type ) {
+    case 's':
+        return true;
+    case 'n':
+        strtof( arg, &end );
+        return ( end != arg ) && ( *end == '\0' );
+    case 'i':
+        strtol( arg, &end, 10 );
+        return ( end != arg ) && ( *end == '\0' );
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Arguments after the command name against a schema such as "nnii"
+ * @param types
+ * @param optional   no arguments at all is also accepted
+ * @param argc       including the command name
+ * @param argv
+ * @return bool
+ */
+bool core_args_valid( const char *types, bool optional, int argc, char **argv )
+{
+    int want = strlen( types );
+    int got = argc - 1;
+
+    if ( ( got == 0 ) && optional ) {
+        return true;
+    }
+    if ( got != want ) {
+        return false;
+    }
+    for ( int i = 0; i < want; i++ ) {
+        if ( !core_arg_valid( types[ i ], argv[ i + 1 ] ) ) {
+            return false;
+        }
+    }
+    return true;
+}
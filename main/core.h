@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Metering core: Modbus CRC, PZEM register decode, energy and billing steps,
+ * power class limits and console field parsing.
+ *
+ * Plain C without ESP-IDF, FreeRTOS or I/O, so it builds and runs on the host
+ * as well: the firmware feeds it bytes and numbers it read and acts on what it
+ * returns. tools/core_bench.c times every function here in ns/op.
+ */
+#define CORE_INPUT_REGS        10     /* RG_VOLTAGE .. RG_ALARM */
+
+/***
+ * https://en.wikipedia.org/wiki/AC_power
+*/
+typedef struct _current_values {
+    float voltage;
+    float current;
+    float power;            // Active Power P. or Real Power W.
+    float energy;
+    float frequency;
+    float pf;               // Ratio of active to apparent power, cos(fi), eg pf = 0.77, 77% of current is doing the real work
+    float apparent_power;   // product of RMS values (VA)
+    float reactive_power;   // Reactive Power Q. exist when V and I are not in Phase. (VAr)
+    float fi;               // Phase angle between S and P (Apparent and Real).
+    uint16_t alarms;
+} _current_values_t;         /* Measured values */
+
+/* One sample through the daily limit, see core_bill_sample() */
+typedef struct {
+    float used_today_wh;    /* daily usage after this sample */
+    float consume_wh;       /* to take from the balance, 0 once the daily limit is reached */
+    bool daily_limit;       /* usage reached the daily limit */
+} core_bill_t;
+
+uint16_t core_crc16( const uint8_t *data, uint16_t len );
+void core_set_crc( uint8_t *buf, uint16_t len );
+bool core_check_crc( const uint8_t *buf, uint16_t len );
+
+void core_unpack_regs( const uint8_t *resp, uint16_t count, uint16_t *regs );
+void core_decode_input( const uint16_t *regs, _current_values_t *out );
+uint32_t core_reg32( uint16_t lo, uint16_t hi );
+
+float core_sample_energy_wh( float power_w, uint32_t ticks, uint32_t period_us );
+core_bill_t core_bill_sample( float used_today_wh, float daily_limit_wh, float energy_wh );
+float core_balance_after( float balance_wh, float consume_wh );
+bool core_balance_low( float balance_wh, float limit_kwh );
+float core_balance_kwh_shown( float balance_wh );
+
+uint16_t core_class_limit_w( int va );
+
+int core_split_fields( char *line, char **argv, int max );
+bool core_arg_valid( char type, const char *arg );
+bool core_args_valid( const char *types, bool optional, int argc, char **argv );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,261 @@
+#include "display.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "i2c-lcd.h"
+#include "fmt_fixed.h"
+#include "mem_budget.h"
+
+static const char *TAG = "DISPLAY";
+
+typedef enum {
+    MAINS_UNKNOWN = 0,
+    MAINS_PRESENT,
+    MAINS_ABSENT,
+} mains_t;
+
+/* Latest value of every field, written by producers and read by the display task */
+typedef struct {
+    bool ready;                  /* first balance posted, until then the boot banner is shown */
+    float balance_kwh;
+    float power_w;
+    float capacity_w;            /* 0 hides the bar graph */
+    mains_t mains;
+    bool status_is_usage;
+    float usage_wh;
+    char status[ DISPLAY_STATUS_LEN + 1 ];
+    char message[ DISPLAY_STATUS_LEN + 1 ];
+    int64_t message_until_us;
+} display_state_t;
+
+static const uint8_t _heartIcon[ 8 ] = {
+    0b00000,
+    0b01010,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b01110,
+    0b00100,
+    0b00000
+};
+
+/* Bar cells filled 1..4 columns from the left, 0 and 5 use space and the ROM full block */
+static uint8_t _barGlyph[ 4 ][ 8 ];
+
+static display_state_t _state = {0};
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void display_copy_text( char *dst, const char *src )
+{
+    strncpy( dst, src, DISPLAY_STATUS_LEN );
+    dst[ DISPLAY_STATUS_LEN ] = '\0';
+}
+
+static void display_init_glyphs( void )
+{
+    for ( int n = 1; n <= 4; n++ ) {
+        memset( _barGlyph[ n - 1 ], ( 0x1F << ( 5 - n ) ) & 0x1F, 8 );
+    }
+}
+
+/**
+ * @brief Load bar with one column resolution, glyphs come from the LCD glyph cache
+ *        so once loaded a changing bar only rewrites the cells that moved
+ * @param fraction  power / capacity, clipped to 0 .. 1
+ */
+static void display_render_bar( float fraction )
+{
+    int steps = DISPLAY_BAR_CELLS * 5;
+    int filled = ( int ) ( fraction * steps + 0.5f );
+
+    if ( filled < 0 ) {
+        filled = 0;
+    } else if ( filled > steps ) {
+        filled = steps;
+    }
+
+    for ( int i = 0; i < DISPLAY_BAR_CELLS; i++ ) {
+        int n = filled - ( i * 5 );
+        if ( n >= 5 ) {
+            lcd_send_data( 0xFF );
+        } else if ( n <= 0 ) {
+            lcd_send_data( ' ' );
+        } else {
+            lcd_send_data( lcd_glyph( _barGlyph[ n - 1 ] ) );
+        }
+    }
+}
+
+/**
+ * @brief Left aligned number in a fixed width field, an overflow shows as '#'
+ */
+static void display_field( fmt_buf_t *row, float value, uint8_t decimals, size_t width )
+{
+    char field[ 12 ];
+    size_t end = row->len + width;
+
+    fmt_float_str( field, ( width < sizeof( field ) ) ? width + 1 : sizeof( field ), value, decimals );
+    fmt_str( row, field );
+    fmt_pad( row, end );
+}
+
+static void display_render( const display_state_t *st, bool heart_on )
+{
+    char text[ LCD_COLS + 1 ];
+    fmt_buf_t row;
+
+    fmt_begin( &row, text, sizeof( text ) );
+    if ( st->ready ) {
+        fmt_str( &row, "Kwh:" );
+        display_field( &row, st->balance_kwh, 1, 6 );
+        fmt_str( &row, "P:" );
+        /* 4 columns: 9.99, 99.9, then whole watts up to the 3500 VA class */
+        display_field( &row, st->power_w, ( st->power_w < 9.995f ) ? 2 : ( st->power_w < 99.95f ) ? 1 : 0, 4 );
+    } else {
+        fmt_str( &row, "Initialize.." );
+    }
+    fmt_pad( &row, LCD_COLS );
+    lcd_put_cur( 0, 0 );
+    lcd_send_string( text );
+
+    bool bar = false;
+    fmt_begin( &row, text, DISPLAY_STATUS_LEN + 1 );
+    if ( esp_timer_get_time() < st->message_until_us ) {
+        fmt_str( &row, st->message );
+    } else if ( st->status_is_usage ) {
+        /* Bounded width when the bar takes the rest of the line */
+        bar = st->capacity_w > 0;
+        fmt_str( &row, "Wh:" );
+        display_field( &row, st->usage_wh, ( st->usage_wh < 1000 ) ? 2 : 0,
+                       ( bar ? DISPLAY_STATUS_LEN - DISPLAY_BAR_CELLS : DISPLAY_STATUS_LEN ) - 3 );
+    } else {
+        fmt_str( &row, st->status );
+    }
+    fmt_pad( &row, bar ? DISPLAY_STATUS_LEN - DISPLAY_BAR_CELLS : DISPLAY_STATUS_LEN );
+    lcd_put_cur( 1, 0 );
+    lcd_send_string( text );
+    if ( bar ) {
+        display_render_bar( st->power_w / st->capacity_w );
+    }
+
+    lcd_put_cur( 1, 15 );
+    if ( st->mains == MAINS_UNKNOWN ) {
+        lcd_send_data( 0xFF );
+    } else {
+        /* Blinking only swaps the cell between the cached glyph and a space */
+        lcd_send_data( heart_on ? lcd_glyph( _heartIcon ) : ' ' );
+    }
+}
+
+/**
+ * @brief Only task that talks to the LCD, a NAK-ing backpack stalls nothing but this loop
+ */
+static void display_task( void *arg )
+{
+    display_state_t st;
+    bool heart_on = false;
+    int64_t blink_us = 0;
+
+    display_init_glyphs();
+
+    for ( ;; ) {
+        taskENTER_CRITICAL( &_mux );
+        st = _state;
+        taskEXIT_CRITICAL( &_mux );
+
+        int64_t now = esp_timer_get_time();
+        if ( now - blink_us >= ( int64_t ) DISPLAY_BLINK_MS * 1000 ) {
+            blink_us = now;
+            heart_on = ( st.mains == MAINS_PRESENT ) && !heart_on;
+        }
+
+        display_render( &st, heart_on );
+        lcd_flush();
+
+        vTaskDelay( pdMS_TO_TICKS( DISPLAY_REFRESH_MS ) );
+    }
+}
+
+/**
+ * @brief Start the display task, call after lcd_init()
+ */
+void display_init( void )
+{
+    if ( mem_task_start( MEM_TASK_DISPLAY, display_task, NULL ) == NULL ) {
+        ESP_LOGE( TAG, "Failed to start display task" );
+    }
+}
+
+void display_set_balance( float kwh )
+{
+    taskENTER_CRITICAL( &_mux );
+    _state.balance_kwh = kwh;
+    _state.ready = true;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+void display_set_power( float watts )
+{
+    taskENTER_CRITICAL( &_mux );
+    _state.power_w = watts;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief Load that fills the bar graph, e.g. the usable watts of the subscribed class
+ * @param watts  0 hides the bar
+ */
+void display_set_capacity( float watts )
+{
+    taskENTER_CRITICAL( &_mux );
+    _state.capacity_w = watts;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+void display_set_mains( bool present )
+{
+    taskENTER_CRITICAL( &_mux );
+    _state.mains = present ? MAINS_PRESENT : MAINS_ABSENT;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief Steady status line, hidden while a message is held
+ * @param text  clipped to DISPLAY_STATUS_LEN
+ */
+void display_set_status( const char *text )
+{
+    taskENTER_CRITICAL( &_mux );
+    display_copy_text( _state.status, text );
+    _state.status_is_usage = false;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief Status line showing today's usage, formatted by the display task
+ * @param wh
+ */
+void display_set_usage( float wh )
+{
+    taskENTER_CRITICAL( &_mux );
+    _state.usage_wh = wh;
+    _state.status_is_usage = true;
+    taskEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief Show a message on the status line for a while, e.g. a console acknowledgement
+ * @param text
+ * @param hold_ms
+ */
+void display_show_message( const char *text, uint32_t hold_ms )
+{
+    int64_t until = esp_timer_get_time() + ( int64_t ) hold_ms * 1000;
+
+    taskENTER_CRITICAL( &_mux );
+    display_copy_text( _state.message, text );
+    _state.message_until_us = until;
+    taskEXIT_CRITICAL( &_mux );
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DISPLAY_REFRESH_MS     200    /* render period of the display task */
+#define DISPLAY_BLINK_MS       1000   /* heart icon half period while mains is present */
+#define DISPLAY_MESSAGE_MS     3000   /* default hold time of a console message */
+#define DISPLAY_STATUS_LEN     15     /* row 1, column 15 is the heart icon */
+#define DISPLAY_BAR_CELLS      6      /* load bar at the end of the usage status, 5 steps per cell */
+
+/*
+ * Screen layout, 16x2
+ *   row 0  "Kwh:" balance (6) "P:" power (4)
+ *   row 1  status line (15) heart
+ *          or "Wh:" usage (9) load bar (6) heart
+ *
+ * Setters only copy into a shared state and never touch I2C, each one
+ * overwrites the previous value so a slow panel cannot make producers wait
+ * or build up a backlog.
+ */
+void display_init( void );
+void display_set_balance( float kwh );
+void display_set_power( float watts );
+void display_set_capacity( float watts );
+void display_set_mains( bool present );
+void display_set_status( const char *text );
+void display_set_usage( float wh );
+void display_show_message( const char *text, uint32_t hold_ms );
+
+#ifdef __cplusplus
+}
+#endif
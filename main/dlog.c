@@ -0,0 +1,277 @@
+#include "dlog.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "fmt_fixed.h"
+#include "mem_budget.h"
+
+#define DLOG_STR_WORDS     ( DLOG_STR_MAX / sizeof( uint32_t ) )
+#define DLOG_LINE_MAX      128
+
+_Static_assert( ( DLOG_RING_RECORDS & ( DLOG_RING_RECORDS - 1 ) ) == 0, "DLOG_RING_RECORDS must be a power of two" );
+_Static_assert( ( DLOG_STR_MAX % sizeof( uint32_t ) ) == 0, "DLOG_STR_MAX must be whole words" );
+_Static_assert( DLOG_COUNT <= UINT16_MAX, "dlog ids are stored in 16 bits" );
+
+static const char *TAG = "DLOG";
+
+typedef struct {
+    esp_log_level_t level;
+    const char *tag;
+    const char *kinds;
+    const char *format;
+} dlog_def_t;
+
+static const dlog_def_t _defs[ DLOG_COUNT ] = {
+#define DLOG_DEF( id, level, tag, kinds, format )   [ DLOG_##id ] = { level, tag, kinds, format },
+    DLOG_TABLE( DLOG_DEF )
+#undef DLOG_DEF
+};
+
+typedef struct {
+    uint32_t ts_ms;         /* esp_log_timestamp() at capture */
+    uint16_t id;
+    uint16_t reserved;
+    uint32_t words[ DLOG_MAX_WORDS ];
+} dlog_rec_t;
+
+_Static_assert( sizeof( dlog_rec_t ) == 48, "dlog_rec_t is one 48 byte slot" );
+
+/* Producers and the dlog task copy whole slots under the spinlock */
+static dlog_rec_t _ring[ DLOG_RING_RECORDS ];
+static uint32_t _head = 0;      /* records written, the slot is head % DLOG_RING_RECORDS */
+static uint32_t _tail = 0;      /* records taken by the dlog task */
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+static dlog_stats_t _stats = {0};
+
+static TaskHandle_t _task = NULL;
+static char _line[ DLOG_LINE_MAX ];    /* dlog task only */
+
+static uint32_t dlog_kind_words( char kind )
+{
+    return ( kind == 's' ) ? DLOG_STR_WORDS : 1;
+}
+
+/**
+ * @brief Each conversion in the format must match the next kind, and the words must fit a slot
+ * @param def
+ * @return true
+ * @return false
+ */
+static bool dlog_check( const dlog_def_t *def )
+{
+    const char *kind = def->kinds;
+    uint32_t words = 0;
+
+    for ( const char *f = def->format; *f != '\0'; f++ ) {
+        if ( *f != '%' ) {
+            continue;
+        }
+        f++;
+        if ( *f == '%' ) {
+            continue;
+        }
+        if ( ( *f == '.' ) && ( f[ 1 ] >= '0' ) && ( f[ 1 ] <= '0' + FMT_MAX_DECIMALS ) ) {
+            f += 2;
+        }
+
+        bool match = ( ( *f == 'f' ) && ( *kind == 'f' ) ) || ( ( *f == 's' ) && ( *kind == 's' ) ) ||
+                     ( ( *f == 'd' ) && ( *kind == 'i' ) ) ||
+                     ( ( ( *f == 'u' ) || ( *f == 'x' ) ) && ( ( *kind == 'u' ) || ( *kind == 'i' ) ) );
+        if ( !match ) {
+            return false;
+        }
+        words += dlog_kind_words( *kind++ );
+    }
+    return ( *kind == '\0' ) && ( words <= DLOG_MAX_WORDS );
+}
+
+/**
+ * @brief Record one message, never blocks and never formats
+ * @param id   row of DLOG_TABLE, followed by its arguments
+ */
+void dlog( dlog_id_t id, ... )
+{
+    if ( ( unsigned ) id >= DLOG_COUNT ) {
+        return;
+    }
+
+    dlog_rec_t rec;
+    rec.ts_ms = esp_log_timestamp();
+    rec.id = ( uint16_t ) id;
+    rec.reserved = 0;
+
+    uint32_t *w = rec.words;
+    const uint32_t *end = rec.words + DLOG_MAX_WORDS;
+    va_list ap;
+    va_start( ap, id );
+    for ( const char *kind = _defs[ id ].kinds; ( *kind != '\0' ) && ( w + dlog_kind_words( *kind ) <= end ); kind++ ) {
+        switch ( *kind ) {
+        case 'f': {
+            float v = ( float ) va_arg( ap, double );
+            memcpy( w++, &v, sizeof( v ) );
+            break;
+        }
+        case 's': {
+            const char *s = va_arg( ap, const char * );
+            size_t n = ( s != NULL ) ? strnlen( s, DLOG_STR_MAX - 1 ) : 0;
+            memcpy( w, s, n );
+            ( ( char * ) w )[ n ] = '\0';
+            w += DLOG_STR_WORDS;
+            break;
+        }
+        case 'i':
+            *w++ = ( uint32_t ) va_arg( ap, int );
+            break;
+        default:
+            *w++ = va_arg( ap, unsigned );
+            break;
+        }
+    }
+    va_end( ap );
+
+    bool wake = false;
+    portENTER_CRITICAL( &_mux );
+    uint32_t waiting = _head - _tail;
+    if ( waiting >= DLOG_RING_RECORDS ) {
+        _stats.dropped++;
+    } else {
+        wake = ( waiting == 0 );
+        memcpy( &_ring[ _head++ & ( DLOG_RING_RECORDS - 1 ) ], &rec, sizeof( rec ) );
+        _stats.logged++;
+        if ( waiting + 1 > _stats.peak ) {
+            _stats.peak = waiting + 1;
+        }
+    }
+    portEXIT_CRITICAL( &_mux );
+
+    /* Only on empty to non-empty, the task drains everything per wake-up */
+    if ( wake && ( _task != NULL ) ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+static void dlog_format( const dlog_rec_t *rec, fmt_buf_t *b )
+{
+    const dlog_def_t *def = &_defs[ rec->id ];
+    const char *kind = def->kinds;
+    const uint32_t *w = rec->words;
+    char one[ 2 ] = {0};
+    char num[ 12 ];
+
+    for ( const char *f = def->format; *f != '\0'; f++ ) {
+        if ( ( *f != '%' ) || ( f[ 1 ] == '%' ) ) {
+            one[ 0 ] = *f;
+            fmt_str( b, one );
+            f += ( *f == '%' );
+            continue;
+        }
+        /* Same stop as dlog(), a bad row is reported by dlog_init */
+        if ( ( *kind == '\0' ) || ( w + dlog_kind_words( *kind ) > rec->words + DLOG_MAX_WORDS ) ) {
+            break;
+        }
+        f++;
+        uint8_t decimals = ( *kind == 'f' ) ? 6 : 0;
+        if ( *f == '.' ) {
+            decimals = ( uint8_t ) ( f[ 1 ] - '0' );
+            f += 2;
+        }
+
+        /* The kind picks the rendering, so a wrong conversion cannot read past the slot */
+        if ( *kind == 'f' ) {
+            float v;
+            memcpy( &v, w, sizeof( v ) );
+            fmt_float( b, v, decimals );
+        } else if ( *kind == 's' ) {
+            fmt_str( b, ( const char * ) w );
+        } else if ( ( *f != 'x' ) && ( *kind == 'i' ) ) {
+            fmt_fixed( b, ( int32_t ) *w, decimals );
+        } else if ( *f == 'x' ) {
+            snprintf( num, sizeof( num ), "%" PRIx32, *w );
+            fmt_str( b, num );
+        } else {
+            snprintf( num, sizeof( num ), "%" PRIu32, *w );
+            fmt_str( b, num );
+        }
+        w += dlog_kind_words( *kind++ );
+    }
+}
+
+static void dlog_task( void *arg )
+{
+    static const char letters[] = "NEWIDV";
+    uint32_t reported = 0;
+    dlog_rec_t rec;
+    fmt_buf_t b;
+
+    for ( ;; ) {
+        ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+
+        portENTER_CRITICAL( &_mux );
+        uint32_t dropped = _stats.dropped;
+        portEXIT_CRITICAL( &_mux );
+        if ( dropped != reported ) {
+            ESP_LOGW( TAG, "%" PRIu32 " records dropped, ring full", dropped - reported );
+            reported = dropped;
+        }
+
+        for ( ;; ) {
+            bool have = false;
+            portENTER_CRITICAL( &_mux );
+            if ( _tail != _head ) {
+                memcpy( &rec, &_ring[ _tail++ & ( DLOG_RING_RECORDS - 1 ) ], sizeof( rec ) );
+                have = true;
+            }
+            portEXIT_CRITICAL( &_mux );
+            if ( !have ) {
+                break;
+            }
+
+            const dlog_def_t *def = &_defs[ rec.id ];
+            if ( def->level > esp_log_level_get( def->tag ) ) {
+                continue;
+            }
+
+            fmt_begin( &b, _line, sizeof( _line ) );
+            dlog_format( &rec, &b );
+            fmt_end( &b );
+            esp_log_write( def->level, def->tag, "%c (%" PRIu32 ") %s: %s\n", letters[ def->level ], rec.ts_ms,
+                           def->tag, _line );
+
+            portENTER_CRITICAL( &_mux );
+            _stats.printed++;
+            portEXIT_CRITICAL( &_mux );
+        }
+    }
+}
+
+/**
+ * @brief Check the table and start the dlog task, call once from app_main.
+ *        Records written before this wait in the ring.
+ */
+void dlog_init( void )
+{
+    MEM_STATIC( MEM_SUB_CONSOLE, _ring );
+    MEM_STATIC( MEM_SUB_CONSOLE, _line );
+
+    for ( int i = 0; i < DLOG_COUNT; i++ ) {
+        if ( !dlog_check( &_defs[ i ] ) ) {
+            ESP_LOGE( TAG, "format %d does not match its kinds: %s", i, _defs[ i ].format );
+        }
+    }
+
+    _task = mem_task_start( MEM_TASK_DLOG, dlog_task, NULL );
+    if ( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+void dlog_get_stats( dlog_stats_t *stats )
+{
+    portENTER_CRITICAL( &_mux );
+    *stats = _stats;
+    portEXIT_CRITICAL( &_mux );
+}
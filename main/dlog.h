@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Deferred log for the metering hot path
+ *
+ * dlog() stores a format ID, the ESP log timestamp and the raw arguments in a
+ * fixed 48 byte slot: floats as their bits, integers as 32 bit words, strings
+ * copied (the caller's buffer may be gone by the time the line is printed).
+ * No formatting, no UART and no blocking happens in the caller, only the copy
+ * under a spinlock. When the ring is full the record is counted as dropped.
+ *
+ * The dlog task at idle priority + 1 on core 0 formats the records with
+ * fmt_fixed and writes them through the ESP log, with the capture time, in
+ * the usual "I (ms) TAG: text" layout, and reports how many were dropped on
+ * its next wake-up.
+ *
+ * Every message is a row of DLOG_TABLE: id, level, tag, argument kinds and
+ * format. Kinds are one letter per argument: f float, i int32_t, u uint32_t,
+ * s string (at most DLOG_STR_MAX - 1 characters, longer ones are cut). The
+ * format understands %d %u %x %s %% and %.Nf, one per kind in order. %.Nd
+ * prints an int32_t in units of 10^-N with N decimals, e.g. sen as rupiah.
+ */
+#define DLOG_RING_RECORDS      64     /* power of two */
+#define DLOG_MAX_WORDS         10
+#define DLOG_STR_MAX           16     /* bytes per string argument, NUL included */
+
+/* Rows: id, level, tag, argument kinds, format */
+#define DLOG_TABLE( X ) \
+    X( PMON_LIMIT,     ESP_LOG_INFO, "meteran_online", "",     "Limit Kwh kurang!" ) \
+    X( PMON_AKUMULASI, ESP_LOG_INFO, "meteran_online", "f",    "Beban akumulasi : %.3f Wh" ) \
+    X( PMON_LISTRIK,   ESP_LOG_INFO, "meteran_online", "ffff", "Vrms: %.1fV - Irms: %.3fA - P: %.1fW - E: %.2fWh" ) \
+    X( PMON_FREQ,      ESP_LOG_INFO, "meteran_online", "ff",   "Freq: %.1fHz - PF: %.2f" ) \
+    X( PMON_PEMAKAIAN, ESP_LOG_INFO, "meteran_online", "ffi",  "Pemakaian: %.3f Wh | Sisa Pulsa: %.1f Wh (Rp %.2d)" ) \
+    X( NILM_EVENT,     ESP_LOG_INFO, "meteran_online", "iiff", "Alat #%d nyala=%d dP: %.1f W dQ: %.1f var" ) \
+    X( PZEM_VALUES_OK, ESP_LOG_INFO, "PZ_GETVALUES",   "",     "CRC check OK for GetValues()" ) \
+    X( NVS_SAVED,      ESP_LOG_INFO, "NVS",            "ss",   "Berhasil simpan key %s dengan nilai %s" )
+
+typedef enum {
+#define DLOG_ID( id, level, tag, kinds, format )   DLOG_##id,
+    DLOG_TABLE( DLOG_ID )
+#undef DLOG_ID
+    DLOG_COUNT
+} dlog_id_t;
+
+typedef struct {
+    uint32_t logged;
+    uint32_t dropped;           /* ring full */
+    uint32_t printed;
+    uint32_t peak;              /* most records waiting at once */
+} dlog_stats_t;
+
+void dlog_init( void );
+void dlog( dlog_id_t id, ... );
+
+void dlog_get_stats( dlog_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
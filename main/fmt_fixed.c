@@ -0,0 +1,205 @@
+#include "fmt_fixed.h"
+#include <string.h>
+
+#define FMT_DIGITS_MAX         12     /* "-4294967295" plus a decimal point */
+
+static const float _scale[ FMT_MAX_DECIMALS + 1 ] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f };
+static const int32_t _pow10[ FMT_MAX_DECIMALS + 1 ] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+/**
+ * @brief Digits of magnitude with decimals after the point, written backwards
+ * @param end   one past the last character
+ * @return      first character
+ */
+static char *fmt_digits( char *end, bool neg, uint32_t u, uint8_t decimals )
+{
+    char *p = end;
+    int digits = 0;
+
+    do {
+        *--p = '0' + ( u % 10 );
+        u /= 10;
+        if ( ++digits == decimals ) {
+            *--p = '.';
+        }
+    } while ( ( u != 0 ) || ( digits <= decimals ) );
+
+    if ( neg ) {
+        *--p = '-';
+    }
+    return p;
+}
+
+static int fmt_field( char *dst, size_t width, bool neg, uint32_t u, uint8_t decimals )
+{
+    char tmp[ FMT_DIGITS_MAX + FMT_MAX_DECIMALS ];
+    char *end = tmp + sizeof( tmp );
+
+    if ( decimals > FMT_MAX_DECIMALS ) {
+        memset( dst, FMT_OVERFLOW_CHAR, width );
+        return FMT_OVERFLOW;
+    }
+
+    char *p = fmt_digits( end, neg, u, decimals );
+    size_t n = end - p;
+
+    if ( n > width ) {
+        memset( dst, FMT_OVERFLOW_CHAR, width );
+        return FMT_OVERFLOW;
+    }
+    memset( dst, ' ', width - n );
+    memcpy( dst + width - n, p, n );
+    return ( int ) width;
+}
+
+int fmt_fixed_field( char *dst, size_t width, int32_t value, uint8_t decimals )
+{
+    bool neg = value < 0;
+    return fmt_field( dst, width, neg, neg ? ( 0u - ( uint32_t ) value ) : ( uint32_t ) value, decimals );
+}
+
+int fmt_ufixed_field( char *dst, size_t width, uint32_t value, uint8_t decimals )
+{
+    return fmt_field( dst, width, false, value, decimals );
+}
+
+/**
+ * @brief Round a float to a fixed point integer, single precision only.
+ *        Integer and fraction are scaled apart so large values keep their
+ *        last digit, value * 10^decimals alone would round in float first.
+ * @return false for NaN and results outside int32 range
+ */
+bool fmt_float_to_fixed( float value, uint8_t decimals, int32_t *out )
+{
+    if ( decimals > FMT_MAX_DECIMALS ) {
+        return false;
+    }
+
+    /* Also false for NaN, comparisons with it fail */
+    if ( !( value > -2147483520.0f && value < 2147483520.0f ) ) {
+        return false;
+    }
+
+    int32_t ip = ( int32_t ) value;
+    float frac = value - ( float ) ip;  /* exact */
+    int32_t fp = ( int32_t ) ( frac * _scale[ decimals ] + ( ( frac < 0 ) ? -0.5f : 0.5f ) );
+    int64_t fixed = ( int64_t ) ip * _pow10[ decimals ] + fp;
+
+    if ( ( fixed > INT32_MAX ) || ( fixed < -INT32_MAX ) ) {
+        return false;
+    }
+    *out = ( int32_t ) fixed;
+    return true;
+}
+
+void fmt_begin( fmt_buf_t *b, char *buf, size_t size )
+{
+    b->buf = buf;
+    b->size = size;
+    b->len = 0;
+    b->overflow = ( size == 0 );
+    if ( size > 0 ) {
+        buf[ 0 ] = '\0';
+    }
+}
+
+/**
+ * @brief Append text, clipped at the end of the buffer
+ */
+void fmt_str( fmt_buf_t *b, const char *s )
+{
+    while ( *s ) {
+        if ( b->len + 1 >= b->size ) {
+            b->overflow = true;
+            break;
+        }
+        b->buf[ b->len++ ] = *s++;
+    }
+    if ( b->size > 0 ) {
+        b->buf[ b->len ] = '\0';
+    }
+}
+
+static void fmt_mark_overflow( fmt_buf_t *b, size_t n )
+{
+    b->overflow = true;
+    while ( ( n-- > 0 ) && ( b->len + 1 < b->size ) ) {
+        b->buf[ b->len++ ] = FMT_OVERFLOW_CHAR;
+    }
+    if ( b->size > 0 ) {
+        b->buf[ b->len ] = '\0';
+    }
+}
+
+void fmt_fixed( fmt_buf_t *b, int32_t value, uint8_t decimals )
+{
+    char tmp[ FMT_DIGITS_MAX + FMT_MAX_DECIMALS ];
+    bool neg = value < 0;
+
+    if ( decimals > FMT_MAX_DECIMALS ) {
+        fmt_mark_overflow( b, 1 );
+        return;
+    }
+
+    char *end = tmp + sizeof( tmp );
+    char *p = fmt_digits( end, neg, neg ? ( 0u - ( uint32_t ) value ) : ( uint32_t ) value, decimals );
+    size_t n = end - p;
+
+    /* All or nothing, a clipped number reads as a different value */
+    if ( b->len + n >= b->size ) {
+        fmt_mark_overflow( b, n );
+        return;
+    }
+    memcpy( &b->buf[ b->len ], p, n );
+    b->len += n;
+    b->buf[ b->len ] = '\0';
+}
+
+void fmt_float( fmt_buf_t *b, float value, uint8_t decimals )
+{
+    int32_t fixed;
+
+    if ( !fmt_float_to_fixed( value, decimals, &fixed ) ) {
+        fmt_mark_overflow( b, 1 );
+        return;
+    }
+    fmt_fixed( b, fixed, decimals );
+}
+
+/**
+ * @brief Pad with spaces up to column, for fixed layouts
+ */
+void fmt_pad( fmt_buf_t *b, size_t column )
+{
+    while ( b->len < column ) {
+        if ( b->len + 1 >= b->size ) {
+            b->overflow = true;
+            break;
+        }
+        b->buf[ b->len++ ] = ' ';
+    }
+    if ( b->size > 0 ) {
+        b->buf[ b->len ] = '\0';
+    }
+}
+
+/**
+ * @return length written, or FMT_OVERFLOW if anything was clipped or marked
+ */
+int fmt_end( fmt_buf_t *b )
+{
+    return b->overflow ? FMT_OVERFLOW : ( int ) b->len;
+}
+
+/**
+ * @brief Bounded replacement for sprintf( buf, "%.Nf", value )
+ * @return length, or FMT_OVERFLOW with buf holding the overflow marker
+ */
+int fmt_float_str( char *buf, size_t size, float value, uint8_t decimals )
+{
+    fmt_buf_t b;
+
+    fmt_begin( &b, buf, size );
+    fmt_float( &b, value, decimals );
+    return fmt_end( &b );
+}
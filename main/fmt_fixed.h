@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FMT_OVERFLOW           ( -1 )
+#define FMT_MAX_DECIMALS       6
+#define FMT_OVERFLOW_CHAR      '#'
+
+/*
+ * Decimal text from fixed point integers, no heap, no double promotion and
+ * no output past the given size. Plain C so it builds on the host as well.
+ *
+ * A number that does not fit is never cut: its place is filled with
+ * FMT_OVERFLOW_CHAR and the call reports FMT_OVERFLOW.
+ */
+
+/* Appending writer, buf stays NUL terminated */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} fmt_buf_t;
+
+void fmt_begin( fmt_buf_t *b, char *buf, size_t size );
+void fmt_str( fmt_buf_t *b, const char *s );
+void fmt_fixed( fmt_buf_t *b, int32_t value, uint8_t decimals );
+void fmt_float( fmt_buf_t *b, float value, uint8_t decimals );
+void fmt_pad( fmt_buf_t *b, size_t column );
+int fmt_end( fmt_buf_t *b );
+
+int fmt_float_str( char *buf, size_t size, float value, uint8_t decimals );
+bool fmt_float_to_fixed( float value, uint8_t decimals, int32_t *out );
+
+/* Right aligned into exactly width characters, not NUL terminated */
+int fmt_fixed_field( char *dst, size_t width, int32_t value, uint8_t decimals );
+int fmt_ufixed_field( char *dst, size_t width, uint32_t value, uint8_t decimals );
+
+#ifdef __cplusplus
+}
+#endif
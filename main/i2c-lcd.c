@@ -2,9 +2,14 @@
 /** Put this in the src folder **/
 
 #include "i2c-lcd.h"
+#include "trace.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/i2c.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "unistd.h"
+#include <string.h>
 
 #define SLAVE_ADDRESS_LCD 0x4E>>1 // change this according to ur setup
 
@@ -12,69 +17,253 @@ esp_err_t err;
 
 #define I2C_NUM I2C_NUM_0
 
+/* One cell or command is 4 expander bytes: high nibble with EN pulse, low nibble with EN pulse */
+#define LCD_BYTES_PER_OP   4
+#define LCD_FLUSH_MAX      ( LCD_ROWS * LCD_COLS * 2 * LCD_BYTES_PER_OP )
+
 static const char *TAG = "LCD";
 
+/* What callers want on screen, and what the panel currently shows */
+static char lcd_fb[LCD_ROWS][LCD_COLS];
+static char lcd_panel[LCD_ROWS][LCD_COLS];
+static int cur_row = 0;
+static int cur_col = 0;
+
+/* Panel address counter, -1 when unknown (after CGRAM access or a raw command) */
+static int panel_row = -1;
+static int panel_col = -1;
+
+/* CGRAM contents as loaded, so a glyph already in a slot is never sent again */
+static uint8_t cgram[LCD_CGRAM_SLOTS][8];
+static uint8_t cgram_valid = 0;  // bit per slot
+static uint32_t cgram_used[LCD_CGRAM_SLOTS];
+static uint32_t cgram_clock = 0;
+
+static uint8_t flush_buf[LCD_FLUSH_MAX];
+static lcd_stats_t stats;
+static SemaphoreHandle_t lcd_lock = NULL;  // console and PowerMon both flush
+static StaticSemaphore_t lcd_lock_buf;
+
+static int lcd_pack(uint8_t *out, char value, uint8_t rs)
+{
+	char data_u = (value&0xf0);
+	char data_l = ((value<<4)&0xf0);
+	out[0] = data_u|0x0C|rs;  //en=1
+	out[1] = data_u|0x08|rs;  //en=0
+	out[2] = data_l|0x0C|rs;  //en=1
+	out[3] = data_l|0x08|rs;  //en=0
+	return LCD_BYTES_PER_OP;
+}
+
+static esp_err_t lcd_write(const uint8_t *buf, size_t len)
+{
+	int64_t start = esp_timer_get_time();
+	esp_err_t ret = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, buf, len, 1000);
+	stats.bus_time_us += (uint64_t)(esp_timer_get_time() - start);
+	stats.transactions++;
+	stats.bytes += len;
+	return ret;
+}
+
 void lcd_send_cmd (char cmd)
 {
-  char data_u, data_l;
 	uint8_t data_t[4];
-	data_u = (cmd&0xf0);
-	data_l = ((cmd<<4)&0xf0);
-	data_t[0] = data_u|0x0C;  //en=1, rs=0
-	data_t[1] = data_u|0x08;  //en=0, rs=0
-	data_t[2] = data_l|0x0C;  //en=1, rs=0
-	data_t[3] = data_l|0x08;  //en=0, rs=0
-	err = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, data_t, 4, 1000);
+	lcd_pack(data_t, cmd, 0x00);  // rs=0
+	if (lcd_lock) xSemaphoreTake(lcd_lock, portMAX_DELAY);
+	err = lcd_write(data_t, 4);
 	if (err!=0) ESP_LOGI(TAG, "Error in sending command");
+	panel_row = -1;
+	if (lcd_lock) xSemaphoreGive(lcd_lock);
 }
 
 void lcd_clear_row(int row)
 {
     if (row < 0 || row > 1) return; // hanya 2 baris: 0 dan 1
 
-    lcd_put_cur(row, 0);  // Pindah ke awal baris
-    for (int i = 0; i < 16; i++)  // Hapus seluruh baris dengan spasi
-    {
-        lcd_send_data(' ');
-    }
+    memset(lcd_fb[row], ' ', LCD_COLS);  // Hapus seluruh baris dengan spasi
     lcd_put_cur(row, 0);  // Kembalikan kursor ke awal baris
 }
 
 void lcd_send_data (char data)
 {
-	char data_u, data_l;
-	uint8_t data_t[4];
-	data_u = (data&0xf0);
-	data_l = ((data<<4)&0xf0);
-	data_t[0] = data_u|0x0D;  //en=1, rs=0
-	data_t[1] = data_u|0x09;  //en=0, rs=0
-	data_t[2] = data_l|0x0D;  //en=1, rs=0
-	data_t[3] = data_l|0x09;  //en=0, rs=0
-	err = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, data_t, 4, 1000);
-	if (err!=0) ESP_LOGI(TAG, "Error in sending data");
+	if (cur_col < LCD_COLS)
+	{
+		lcd_fb[cur_row][cur_col] = data;
+	}
+	cur_col++;
 }
 
 void lcd_clear (void)
 {
 	lcd_send_cmd (0x01);
 	usleep(5000);
+	memset(lcd_fb, ' ', sizeof(lcd_fb));
+	memset(lcd_panel, ' ', sizeof(lcd_panel));
+	cur_row = 0;
+	cur_col = 0;
 }
 
 void lcd_put_cur(int row, int col)
 {
-    switch (row)
-    {
-        case 0:
-            col |= 0x80;
-            break;
-        case 1:
-            col |= 0xC0;
-            break;
-    }
-
-    lcd_send_cmd (col);
+    if (row < 0 || row >= LCD_ROWS) return;
+
+    cur_row = row;
+    cur_col = col;
+}
+
+/**
+ * @brief Upload a 5x8 glyph, cells showing the slot change without being rewritten
+ * @param slot    0 .. 7
+ * @param bitmap  8 rows, low 5 bits used
+ */
+static void lcd_write_cgram(uint8_t slot, const uint8_t *bitmap)
+{
+	uint8_t buf[9 * LCD_BYTES_PER_OP];
+	int len = lcd_pack(buf, 0x40 | ((slot & 0x07) << 3), 0x00);
+
+	for (int i = 0; i < 8; i++)
+	{
+		len += lcd_pack(&buf[len], bitmap[i], 0x01);
+	}
+
+	err = lcd_write(buf, len);
+	panel_row = -1;  // address counter now points into CGRAM
+	if (err!=0)
+	{
+		ESP_LOGI(TAG, "Error in sending glyph");
+		cgram_valid &= ~(1 << slot);
+		return;
+	}
+	memcpy(cgram[slot], bitmap, 8);
+	cgram_valid |= (1 << slot);
+	stats.glyph_loads++;
+}
+
+void lcd_load_cgram(uint8_t slot, const uint8_t *bitmap)
+{
+	slot &= 0x07;
+	xSemaphoreTake(lcd_lock, portMAX_DELAY);
+	lcd_write_cgram(slot, bitmap);
+	cgram_used[slot] = ++cgram_clock;
+	xSemaphoreGive(lcd_lock);
+}
+
+/**
+ * @brief Character code for a custom glyph, uploading it only when no slot holds it yet.
+ *        With more than 8 distinct glyphs the least recently used slot is replaced,
+ *        cells still showing it change with it.
+ * @param bitmap  8 rows, low 5 bits used
+ * @return char   0 .. 7, to be written with lcd_send_data
+ */
+char lcd_glyph(const uint8_t *bitmap)
+{
+	int slot = -1;
+	int victim = 0;
+
+	xSemaphoreTake(lcd_lock, portMAX_DELAY);
+	for (int i = 0; i < LCD_CGRAM_SLOTS; i++)
+	{
+		if ((cgram_valid & (1 << i)) && memcmp(cgram[i], bitmap, 8) == 0)
+		{
+			slot = i;
+			break;
+		}
+		if (!(cgram_valid & (1 << victim)))
+		{
+			continue;  // keep the first empty slot
+		}
+		if (!(cgram_valid & (1 << i)) || cgram_used[i] < cgram_used[victim])
+		{
+			victim = i;
+		}
+	}
+
+	if (slot < 0)
+	{
+		slot = victim;
+		lcd_write_cgram(slot, bitmap);
+	}
+	cgram_used[slot] = ++cgram_clock;
+	xSemaphoreGive(lcd_lock);
+
+	return (char)slot;
+}
+
+/**
+ * @brief Send the cells that differ from the panel in a single I2C transaction.
+ *        Runs separated by one unchanged cell are merged, rewriting it costs the
+ *        same as the cursor move it saves.
+ */
+void lcd_flush(void)
+{
+	int len = 0;
+
+	xSemaphoreTake(lcd_lock, portMAX_DELAY);
+	stats.flushes++;
+
+	for (int row = 0; row < LCD_ROWS; row++)
+	{
+		int col = 0;
+		while (col < LCD_COLS)
+		{
+			if (lcd_fb[row][col] == lcd_panel[row][col])
+			{
+				col++;
+				continue;
+			}
+
+			int end = col + 1;
+			for (int i = end; i < LCD_COLS; i++)
+			{
+				if (lcd_fb[row][i] != lcd_panel[row][i])
+				{
+					end = i + 1;
+				}
+				else if (i - end >= 1)
+				{
+					break;
+				}
+			}
+
+			if (panel_row != row || panel_col != col)
+			{
+				len += lcd_pack(&flush_buf[len], (row == 0 ? 0x80 : 0xC0) | col, 0x00);
+			}
+			for (int i = col; i < end; i++)
+			{
+				len += lcd_pack(&flush_buf[len], lcd_fb[row][i], 0x01);
+			}
+			stats.cells_written += end - col;
+
+			panel_row = row;
+			panel_col = end;
+			col = end;
+		}
+	}
+
+	if (len > 0)
+	{
+		TRACE_BEGIN(TRACE_EV_LCD_FLUSH, len);
+		err = lcd_write(flush_buf, len);
+		TRACE_END(TRACE_EV_LCD_FLUSH, err == 0);
+		if (err!=0)
+		{
+			ESP_LOGI(TAG, "Error in flushing display");
+			panel_row = -1;  // retry everything next time
+			memset(lcd_panel, 0xFE, sizeof(lcd_panel));
+		}
+		else
+		{
+			memcpy(lcd_panel, lcd_fb, sizeof(lcd_panel));
+		}
+	}
+	xSemaphoreGive(lcd_lock);
 }
 
+void lcd_get_stats(lcd_stats_t *out)
+{
+	*out = stats;
+}
 
 void lcd_init (void)
 {
@@ -101,10 +290,13 @@ void lcd_init (void)
 	usleep(1000);
 	lcd_send_cmd (0x0C); //Display on/off control --> D = 1, C and B = 0. (Cursor and blink, last two bits)
 	usleep(1000);
+
+	memset(lcd_fb, ' ', sizeof(lcd_fb));
+	memset(lcd_panel, ' ', sizeof(lcd_panel));
+	lcd_lock = xSemaphoreCreateMutexStatic(&lcd_lock_buf);
 }
 
 void lcd_send_string (char *str)
 {
 	while (*str) lcd_send_data (*str++);
 }
-
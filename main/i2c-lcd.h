@@ -1,15 +1,39 @@
+#pragma once
 
+#include <stdint.h>
+
+#define LCD_ROWS 2
+#define LCD_COLS 16
+#define LCD_CGRAM_SLOTS 8
+
+/* I2C cost of the display, exported on /metrics */
+typedef struct {
+    uint32_t transactions;
+    uint32_t bytes;
+    uint64_t bus_time_us;   /* 32 bits wrap after 71 min on the bus */
+    uint32_t flushes;
+    uint32_t cells_written;
+    uint32_t glyph_loads;
+} lcd_stats_t;
 
 void lcd_init (void);   // initialize lcd
 
-void lcd_send_cmd (char cmd);  // send command to the lcd
+void lcd_send_cmd (char cmd);  // send command to the lcd, goes out immediately
 
-void lcd_send_data (char data);  // send data to the lcd
+void lcd_send_data (char data);  // put data into the framebuffer at the cursor
 
-void lcd_send_string (char *str);  // send string to the lcd
+void lcd_send_string (char *str);  // put string into the framebuffer at the cursor
 
 void lcd_put_cur(int row, int col);  // put cursor at the entered position row (0 or 1), col (0-15);
 
 void lcd_clear (void);
 
-void lcd_clear_row(int row);
\ No newline at end of file
+void lcd_clear_row(int row);
+
+void lcd_load_cgram(uint8_t slot, const uint8_t *bitmap);  // upload custom glyph 0-7
+
+char lcd_glyph(const uint8_t *bitmap);  // slot holding this glyph, loaded on first use
+
+void lcd_flush (void);  // write changed cells to the panel in one transaction
+
+void lcd_get_stats(lcd_stats_t *out);
@@ -0,0 +1,209 @@
+#include "mem_budget.h"
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "MEM";
+
+static const char *_subNames[ MEM_SUB_COUNT ] = {
+    "meter", "console", "display", "net", "telemetry", "metrics", "wifi",
+};
+
+/* Fails the build when the table outgrows the budget */
+enum {
+#define MEM_STACK_SUM( id, name, prio, stack, core, sub ) + ( stack )
+    MEM_STACK_TOTAL = 0 TASK_TABLE( MEM_STACK_SUM )
+#undef MEM_STACK_SUM
+};
+_Static_assert( MEM_STACK_TOTAL <= TASK_STACK_BUDGET, "TASK_TABLE stacks exceed TASK_STACK_BUDGET" );
+
+#define MEM_TASK_STORAGE( id, name, prio, stack, core, sub ) \
+    static WORD_ALIGNED_ATTR StackType_t _stack_##id[ stack ]; \
+    static StaticTask_t _tcb_##id;
+TASK_TABLE( MEM_TASK_STORAGE )
+#undef MEM_TASK_STORAGE
+
+typedef struct {
+    const char *name;
+    UBaseType_t prio;
+    uint32_t stack;
+    BaseType_t core;
+    mem_sub_t sub;
+    StackType_t *stack_buf;
+    StaticTask_t *tcb;
+} mem_task_slot_t;
+
+static const mem_task_slot_t _tasks[ MEM_TASK_COUNT ] = {
+#define MEM_TASK_SLOT( id, name, prio, stack, core, sub ) \
+    [ MEM_TASK_##id ] = { name, prio, stack, core, MEM_SUB_##sub, _stack_##id, &_tcb_##id },
+    TASK_TABLE( MEM_TASK_SLOT )
+#undef MEM_TASK_SLOT
+};
+
+static TaskHandle_t _handles[ MEM_TASK_COUNT ] = {0};
+static uint32_t _static[ MEM_SUB_COUNT ] = {0};
+static uint32_t _heap[ MEM_SUB_COUNT ] = {0};
+static uint32_t _heapMark = 0;
+
+/* Network pool, blocks are handed out under the spinlock, the semaphore counts free ones */
+static WORD_ALIGNED_ATTR uint8_t _pool[ MEM_POOL_BLOCKS ][ MEM_POOL_BLOCK_SIZE ];
+static bool _poolBusy[ MEM_POOL_BLOCKS ] = {0};
+static StaticSemaphore_t _poolSemBuf;
+static SemaphoreHandle_t _poolSem = NULL;
+static portMUX_TYPE _poolMux = portMUX_INITIALIZER_UNLOCKED;
+static mem_pool_stats_t _poolStats = {0};
+
+/**
+ * @brief Call first in app_main, before any task or pool user
+ */
+void mem_budget_init( void )
+{
+    _poolSem = xSemaphoreCreateCountingStatic( MEM_POOL_BLOCKS, MEM_POOL_BLOCKS, &_poolSemBuf );
+    MEM_STATIC( MEM_SUB_NET, _pool );
+
+    for ( int i = 0; i < MEM_TASK_COUNT; i++ ) {
+        _static[ _tasks[ i ].sub ] += _tasks[ i ].stack + sizeof( StaticTask_t );
+    }
+}
+
+/**
+ * @brief Create a task from its TASK_TABLE row, each row can be started once
+ * @param id
+ * @param fn
+ * @param arg
+ * @return TaskHandle_t  NULL when the row was already started
+ */
+TaskHandle_t mem_task_start( mem_task_t id, TaskFunction_t fn, void *arg )
+{
+    const mem_task_slot_t *t = &_tasks[ id ];
+
+    if ( _handles[ id ] != NULL ) {
+        ESP_LOGE( TAG, "%s already started", t->name );
+        return NULL;
+    }
+
+    _handles[ id ] = xTaskCreateStaticPinnedToCore( fn, t->name, t->stack, arg, t->prio, t->stack_buf, t->tcb, t->core );
+    return _handles[ id ];
+}
+
+/**
+ * @brief Account a static object to a subsystem, for the report only
+ */
+void mem_static( mem_sub_t sub, size_t bytes )
+{
+    _static[ sub ] += bytes;
+}
+
+/**
+ * @brief Start measuring heap taken by a subsystem's init, start-up only
+ */
+void mem_heap_begin( void )
+{
+    _heapMark = esp_get_free_heap_size();
+}
+
+void mem_heap_end( mem_sub_t sub )
+{
+    uint32_t now = esp_get_free_heap_size();
+    if ( now < _heapMark ) {
+        _heap[ sub ] += _heapMark - now;
+    }
+}
+
+/**
+ * @brief Borrow one MEM_POOL_BLOCK_SIZE buffer
+ * @param wait
+ * @return void*  NULL when none became free in time
+ */
+void *mem_pool_take( TickType_t wait )
+{
+    if ( xSemaphoreTake( _poolSem, wait ) != pdTRUE ) {
+        portENTER_CRITICAL( &_poolMux );
+        _poolStats.timeouts++;
+        portEXIT_CRITICAL( &_poolMux );
+        return NULL;
+    }
+
+    void *block = NULL;
+    portENTER_CRITICAL( &_poolMux );
+    for ( int i = 0; i < MEM_POOL_BLOCKS; i++ ) {
+        if ( !_poolBusy[ i ] ) {
+            _poolBusy[ i ] = true;
+            block = _pool[ i ];
+            break;
+        }
+    }
+    _poolStats.takes++;
+    if ( ++_poolStats.in_use > _poolStats.peak ) {
+        _poolStats.peak = _poolStats.in_use;
+    }
+    portEXIT_CRITICAL( &_poolMux );
+
+    return block;
+}
+
+void mem_pool_give( void *block )
+{
+    for ( int i = 0; i < MEM_POOL_BLOCKS; i++ ) {
+        if ( block == _pool[ i ] ) {
+            portENTER_CRITICAL( &_poolMux );
+            _poolBusy[ i ] = false;
+            _poolStats.in_use--;
+            portEXIT_CRITICAL( &_poolMux );
+            xSemaphoreGive( _poolSem );
+            return;
+        }
+    }
+    ESP_LOGE( TAG, "%p is not a pool block", block );
+}
+
+void mem_pool_get_stats( mem_pool_stats_t *stats )
+{
+    portENTER_CRITICAL( &_poolMux );
+    *stats = _poolStats;
+    portEXIT_CRITICAL( &_poolMux );
+}
+
+/**
+ * @brief Static, stack and start-up heap per subsystem, then the pool and heap fragmentation
+ */
+void mem_report( void )
+{
+    uint32_t stack[ MEM_SUB_COUNT ] = {0};
+    uint32_t used[ MEM_SUB_COUNT ] = {0};
+
+    for ( int i = 0; i < MEM_TASK_COUNT; i++ ) {
+        mem_sub_t sub = _tasks[ i ].sub;
+        stack[ sub ] += _tasks[ i ].stack;
+        if ( _handles[ i ] != NULL ) {
+            used[ sub ] += _tasks[ i ].stack - uxTaskGetStackHighWaterMark( _handles[ i ] );
+        }
+    }
+
+    uint32_t total_static = 0;
+    uint32_t total_heap = 0;
+    ESP_LOGI( TAG, "%-10s %8s %8s %8s %8s", "subsystem", "static", "stack", "used", "heap" );
+    for ( int i = 0; i < MEM_SUB_COUNT; i++ ) {
+        ESP_LOGI( TAG, "%-10s %8u %8u %8u %8u", _subNames[ i ], ( unsigned ) _static[ i ], ( unsigned ) stack[ i ],
+                  ( unsigned ) used[ i ], ( unsigned ) _heap[ i ] );
+        total_static += _static[ i ];
+        total_heap += _heap[ i ];
+    }
+    ESP_LOGI( TAG, "%-10s %8u %8u %8s %8u", "total", ( unsigned ) total_static, ( unsigned ) MEM_STACK_TOTAL, "",
+              ( unsigned ) total_heap );
+    ESP_LOGI( TAG, "static includes stacks, stack budget %u", ( unsigned ) TASK_STACK_BUDGET );
+
+    mem_pool_stats_t pool;
+    mem_pool_get_stats( &pool );
+    ESP_LOGI( TAG, "pool %d x %d: in use %u peak %u takes %u timeouts %u", MEM_POOL_BLOCKS, MEM_POOL_BLOCK_SIZE,
+              ( unsigned ) pool.in_use, ( unsigned ) pool.peak, ( unsigned ) pool.takes, ( unsigned ) pool.timeouts );
+
+    size_t heap_free = heap_caps_get_free_size( MALLOC_CAP_8BIT );
+    size_t largest = heap_caps_get_largest_free_block( MALLOC_CAP_8BIT );
+    unsigned frag = ( heap_free == 0 ) ? 0 : ( unsigned ) ( 100 - ( largest * 100 ) / heap_free );
+    ESP_LOGI( TAG, "heap free %u min %u largest %u, fragmentation %u%%", ( unsigned ) heap_free,
+              ( unsigned ) heap_caps_get_minimum_free_size( MALLOC_CAP_8BIT ), ( unsigned ) largest, frag );
+}
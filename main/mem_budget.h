@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "task_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Static memory budget
+ *
+ * Long-lived tasks come from TASK_TABLE, their stacks and TCBs are .bss here.
+ * Queues, mutexes and buffers stay in their modules as static storage and are
+ * accounted with MEM_STATIC so <mem> can group them. Heap taken while a
+ * subsystem starts (Wi-Fi, lwIP, httpd, esp_http_client) is measured around its
+ * init with mem_heap_begin/mem_heap_end. After start-up only the network pool
+ * hands out transient buffers, nothing in the steady state allocates.
+ */
+#define MEM_POOL_BLOCKS        2
+#define MEM_POOL_BLOCK_SIZE    768
+
+typedef enum {
+    MEM_SUB_METER = 0,
+    MEM_SUB_CONSOLE,
+    MEM_SUB_DISPLAY,
+    MEM_SUB_NET,
+    MEM_SUB_TELEMETRY,
+    MEM_SUB_METRICS,
+    MEM_SUB_WIFI,
+    MEM_SUB_COUNT
+} mem_sub_t;
+
+typedef enum {
+#define MEM_TASK_ID( id, name, prio, stack, core, sub ) MEM_TASK_##id,
+    TASK_TABLE( MEM_TASK_ID )
+#undef MEM_TASK_ID
+    MEM_TASK_COUNT
+} mem_task_t;
+
+typedef struct {
+    uint32_t in_use;
+    uint32_t peak;
+    uint32_t takes;
+    uint32_t timeouts;     /* every block was busy for the whole wait */
+} mem_pool_stats_t;
+
+void mem_budget_init( void );
+TaskHandle_t mem_task_start( mem_task_t id, TaskFunction_t fn, void *arg );
+
+void mem_static( mem_sub_t sub, size_t bytes );
+#define MEM_STATIC( sub, object )    mem_static( ( sub ), sizeof( object ) )
+
+void mem_heap_begin( void );
+void mem_heap_end( mem_sub_t sub );
+
+void *mem_pool_take( TickType_t wait );
+void mem_pool_give( void *block );
+void mem_pool_get_stats( mem_pool_stats_t *stats );
+
+void mem_report( void );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,238 @@
+#include "meter_state.h"
+#include "esp_log.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+
+/* Set while nobody holds the balance lock, PMonTask blocks on it */
+#define METER_EV_UNLOCKED      ( 1 << 0 )
+#define METER_EV_REBOOT        ( 1 << 1 )
+#define METER_EV_ROLLOVER      ( 1 << 2 )
+#define METER_EV_USAGE_RESET   ( 1 << 3 )
+
+static const char *TAG = "METER";
+
+static SemaphoreHandle_t _lock = NULL;
+static EventGroupHandle_t _events = NULL;
+static StaticSemaphore_t _lockBuf;
+static StaticEventGroup_t _eventsBuf;
+
+/* Guarded by _lock */
+static bool _depleted = false;
+static bool _dailyLimit = false;
+static uint32_t _lockDepth = 0;
+static meter_override_t _override = METER_RELAY_AUTO;
+static bool _tripped = false;
+
+static const char *_modeNames[] = {
+    "normal", "daily limit", "depleted", "locked", "rebooting",
+};
+
+static meter_mode_t meter_mode_locked( void )
+{
+    if ( xEventGroupGetBits( _events ) & METER_EV_REBOOT ) {
+        return METER_REBOOTING;
+    }
+    if ( _lockDepth > 0 ) {
+        return METER_LOCKED;
+    }
+    if ( _depleted ) {
+        return METER_DEPLETED;
+    }
+    if ( _dailyLimit ) {
+        return METER_DAILY_LIMIT;
+    }
+    return METER_NORMAL;
+}
+
+static bool meter_relay_locked( void )
+{
+    if ( _tripped ) {
+        return false;
+    }
+
+    switch ( _override ) {
+    case METER_RELAY_FORCE_ON:
+        return true;
+    case METER_RELAY_FORCE_OFF:
+        return false;
+    default:
+        return !_depleted && !_dailyLimit;
+    }
+}
+
+/**
+ * @brief Log mode changes, called with _lock held
+ */
+static void meter_log_transition( meter_mode_t before )
+{
+    meter_mode_t after = meter_mode_locked();
+    if ( after != before ) {
+        ESP_LOGI( TAG, "%s -> %s", _modeNames[ before ], _modeNames[ after ] );
+    }
+}
+
+void meter_state_init( void )
+{
+    _lock = xSemaphoreCreateMutexStatic( &_lockBuf );
+    _events = xEventGroupCreateStatic( &_eventsBuf );
+    xEventGroupSetBits( _events, METER_EV_UNLOCKED );
+}
+
+void meter_get( meter_state_t *out )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    out->mode = meter_mode_locked();
+    out->override = _override;
+    out->depleted = _depleted;
+    out->daily_limit = _dailyLimit;
+    out->tripped = _tripped;
+    out->relay_on = meter_relay_locked();
+    xSemaphoreGive( _lock );
+}
+
+meter_mode_t meter_mode( void )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    meter_mode_t mode = meter_mode_locked();
+    xSemaphoreGive( _lock );
+    return mode;
+}
+
+bool meter_relay_wanted( void )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    bool on = meter_relay_locked();
+    xSemaphoreGive( _lock );
+    return on;
+}
+
+/**
+ * @brief Feed the current balance
+ * @param saldo_wh
+ * @return true   only on the transition into depleted
+ */
+bool meter_set_balance( float saldo_wh )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    meter_mode_t before = meter_mode_locked();
+    bool entered = ( saldo_wh <= 0 ) && !_depleted;
+    _depleted = ( saldo_wh <= 0 );
+    meter_log_transition( before );
+    xSemaphoreGive( _lock );
+    return entered;
+}
+
+/**
+ * @brief Feed whether today's usage reached the limit
+ * @param reached
+ * @return true   only on the transition into the limit
+ */
+bool meter_set_daily_limit( bool reached )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    meter_mode_t before = meter_mode_locked();
+    bool entered = reached && !_dailyLimit;
+    _dailyLimit = reached;
+    meter_log_transition( before );
+    xSemaphoreGive( _lock );
+    return entered;
+}
+
+void meter_set_override( meter_override_t override )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _override = override;
+    xSemaphoreGive( _lock );
+}
+
+/**
+ * @brief Set by the protect task, the caller drives the relay afterwards
+ * @param tripped
+ */
+void meter_set_trip( bool tripped )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _tripped = tripped;
+    xSemaphoreGive( _lock );
+}
+
+/**
+ * @brief Hold PMonTask before its next sample while the balance is rewritten, nests
+ */
+void meter_lock( void )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    meter_mode_t before = meter_mode_locked();
+    if ( _lockDepth++ == 0 ) {
+        xEventGroupClearBits( _events, METER_EV_UNLOCKED );
+    }
+    meter_log_transition( before );
+    xSemaphoreGive( _lock );
+}
+
+void meter_unlock( void )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    meter_mode_t before = meter_mode_locked();
+    if ( ( _lockDepth > 0 ) && ( --_lockDepth == 0 ) ) {
+        xEventGroupSetBits( _events, METER_EV_UNLOCKED );
+    }
+    meter_log_transition( before );
+    xSemaphoreGive( _lock );
+}
+
+/**
+ * @brief Block, without polling, until no top-up or reset holds the lock
+ */
+void meter_wait_unlocked( void )
+{
+    xEventGroupWaitBits( _events, METER_EV_UNLOCKED | METER_EV_REBOOT, pdFALSE, pdFALSE, portMAX_DELAY );
+}
+
+/**
+ * @brief Stop the sampling loop, waiters are released so they can see it
+ */
+void meter_request_reboot( void )
+{
+    xEventGroupSetBits( _events, METER_EV_REBOOT );
+    ESP_LOGI( TAG, "-> %s", _modeNames[ METER_REBOOTING ] );
+}
+
+bool meter_rebooting( void )
+{
+    return ( xEventGroupGetBits( _events ) & METER_EV_REBOOT ) != 0;
+}
+
+/**
+ * @brief Mark a daily rollover for PMonTask, safe from the esp_timer task
+ */
+void meter_request_rollover( void )
+{
+    xEventGroupSetBits( _events, METER_EV_ROLLOVER );
+}
+
+/**
+ * @brief Consume a pending rollover
+ * @return true  at most once per request
+ */
+bool meter_take_rollover( void )
+{
+    return ( xEventGroupClearBits( _events, METER_EV_ROLLOVER ) & METER_EV_ROLLOVER ) != 0;
+}
+
+/**
+ * @brief Mark a reset of today's usage for PMonTask, safe from the esp_timer task
+ */
+void meter_request_usage_reset( void )
+{
+    xEventGroupSetBits( _events, METER_EV_USAGE_RESET );
+}
+
+/**
+ * @brief Consume a pending usage reset
+ * @return true  at most once per request
+ */
+bool meter_take_usage_reset( void )
+{
+    return ( xEventGroupClearBits( _events, METER_EV_USAGE_RESET ) & METER_EV_USAGE_RESET ) != 0;
+}
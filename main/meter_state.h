@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Meter state, one owner for what used to be loose bool flags
+ *
+ *   METER_REBOOTING    a reboot was requested, PMonTask leaves its loop
+ *   METER_LOCKED       a top-up or reset is rewriting the balance, PMonTask waits
+ *   METER_DEPLETED     balance is zero
+ *   METER_DAILY_LIMIT  today's usage reached the daily limit
+ *   METER_NORMAL
+ *
+ * The mode is derived from the conditions in the order above. The relay
+ * test override (<11>, <12>, <15>) is kept next to it: it decides the relay
+ * but does not change the billing mode. An over-power trip from protection.c
+ * opens the relay over both, the override included.
+ */
+typedef enum {
+    METER_NORMAL = 0,
+    METER_DAILY_LIMIT,
+    METER_DEPLETED,
+    METER_LOCKED,
+    METER_REBOOTING,
+} meter_mode_t;
+
+typedef enum {
+    METER_RELAY_AUTO = 0,   /* on while neither depleted nor over the daily limit */
+    METER_RELAY_FORCE_ON,
+    METER_RELAY_FORCE_OFF,
+} meter_override_t;
+
+typedef struct {
+    meter_mode_t mode;
+    meter_override_t override;
+    bool depleted;
+    bool daily_limit;
+    bool tripped;           /* over-power protection holds the relay open */
+    bool relay_on;          /* what the relay should be driven to */
+} meter_state_t;
+
+void meter_state_init( void );
+void meter_get( meter_state_t *out );
+meter_mode_t meter_mode( void );
+bool meter_relay_wanted( void );
+
+bool meter_set_balance( float saldo_wh );
+bool meter_set_daily_limit( bool reached );
+void meter_set_override( meter_override_t override );
+void meter_set_trip( bool tripped );
+
+void meter_lock( void );
+void meter_unlock( void );
+void meter_wait_unlocked( void );
+
+void meter_request_reboot( void );
+bool meter_rebooting( void );
+
+void meter_request_rollover( void );
+bool meter_take_rollover( void );
+
+void meter_request_usage_reset( void );
+bool meter_take_usage_reset( void );
+
+#ifdef __cplusplus
+}
+#endif
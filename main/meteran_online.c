@@ -9,6 +9,7 @@
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_chip_info.h"
 #include "esp_flash.h"
 #include "esp_system.h"
@@ -26,6 +27,27 @@
 #include "telegram_root_cert.h"
 #include "esp_log.h"
 #include "pzem004tv3.h"
+#include "modbus_tcp.h"
+#include "telemetry.h"
+#include "metrics.h"
+#include "wifi_sta.h"
+#include "rollover.h"
+#include "display.h"
+#include "fmt_fixed.h"
+#include "console.h"
+#include "prov.h"
+#include "profiler.h"
+#include "button.h"
+#include "meter_state.h"
+#include "sample_timer.h"
+#include "pm_mode.h"
+#include "mem_budget.h"
+#include "protection.h"
+#include "trace.h"
+#include "dlog.h"
+#include "core.h"
+#include "billing.h"
+#include "nilm.h"
 #include "esp_sntp.h"
 #include <time.h>
 
@@ -34,9 +56,6 @@
 #define PZEMTXD_PIN 17
 #define PZEMRXD_PIN 16
 
-#define BUF_SIZE 1024
-#define STX '<'
-#define ETX '>'
 
 /* Begin Configuration  I2C */
 #define I2C_MASTER_SCL_IO GPIO_NUM_22 /*!< GPIO number used for I2C master clock */
@@ -62,21 +81,54 @@
 #define KEY_CURRENT_WH_USE "current_wh_use"
 #define KEY_HOUR "jam"
 #define KEY_MINUTE "menit"
+#define KEY_COLLECTOR_URL "collector_url"
+#define KEY_PM_MODE "pm_mode"
+#define KEY_KAPASITAS "kapasitas"
+#define KEY_TOU "tou"
 /* End Key Configuration */
 
+/* Begin Tag Provisioning, jangan diubah setelah dirilis */
+enum {
+    PROV_TAG_WIFI_SSID = 0x01,
+    PROV_TAG_WIFI_PASSWORD,
+    PROV_TAG_BOT_TOKEN,
+    PROV_TAG_RECIPIENT_ID,
+    PROV_TAG_KWH_MINIMUM,
+    PROV_TAG_DAILY_LIMIT,
+    PROV_TAG_TIME_SAMPLING,
+    PROV_TAG_TDL,
+    PROV_TAG_HOUR,
+    PROV_TAG_MINUTE,
+    PROV_TAG_COLLECTOR_URL,
+    PROV_TAG_LAST_WH,
+    PROV_TAG_PM_MODE,
+    PROV_TAG_KAPASITAS,
+    PROV_TAG_TOU,
+};
+/* End Tag Provisioning */
+
 /* Begin Token Split */
-#define MAX_TOKENS 20    // Maksimal jumlah token
-#define MAX_TOKEN_LEN 64 // Maksimal panjang tiap token
+#define NUMBER_STR_LEN 16 // angka di NVS, muat int32 fixed-point beserta tanda dan titik
 /* End Token Split */
 
 /* Begin Batas Listrik KVA */
-#define KAPASITAS_450VA 400
-#define KAPASITAS_900VA 700
-#define KAPASITAS_1300VA 1100
-#define KAPASITAS_2200VA 1800
-#define KAPASITAS_3500VA 2500
+// kelas daya PLN -> batas daya aktif (W) ada di core_class_limit_w()
+#define KAPASITAS_DEFAULT_VA 1300 // bila belum diatur lewat <kap> / provisioning
+static uint16_t kapasitas_load(void);
 /* End Batas Listrik KVA*/
 
+/* Begin Sampling */
+// baca PZEM gagal (bus sibuk / tanpa balasan): periodenya ditagih bersama sampel berikutnya,
+// lebih dari sekian periode sensor dianggap putus dan periode itu tidak ditagih
+#define SAMPEL_TERTUNDA_MAX 10
+/* End Sampling */
+
+/* Begin Tarif */
+// jadwal tarif waktu pemakaian di KEY_TOU (format di tariff.h), kosong berarti satu tarif TDL
+static bool tarif_reload(void);
+static bool tarif_valid(const char *spec);
+/* End Tarif */
+
 /* Begin Wifi Configuration */
 // Ganti dengan Wi-Fi & Bot kamu
 // #define WIFI_SSID      "POCOMF"
@@ -87,40 +139,32 @@
 
 /* Begin Interface function */
 static const char *TAG = "meteran_online";
-void uart_rx_task(void *arg);
-void parse_serial(uint8_t byte);
 static esp_err_t i2c_master_init(void);
-uint16_t modbus_crc(uint8_t *buf, uint8_t len);
-void login_main(char *route);
 void init_nvs();
 void save_string_to_nvs(const char *key, const char *value);
 void read_string_from_nvs(const char *key, char *out_value, size_t max_len);
-int split_and_store_tokens(char *input, char tokens[][MAX_TOKEN_LEN]);
-void read_gpio_task(void *arg);
-static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+static void console_start(void);
 void wifi_init_sta(void);
 void send_telegram_message(const char *message);
+void telegram_post(const char *message);
 void PMonTask(void *pz);
 void init_sntp_time();
 void wait_for_time_sync();
-void print_current_time();
+void daily_rollover(time_t boundary, uint32_t crossed);
+void apply_daily_rollover();
+float saldo_consume(float wh);
+bool saldo_add(float wh);
+static float saldo_load(void);
+void saldo_reset(void);
 
 /* End Interface function */
 
-bool receiving = false;
-char buffer[50];
-int buf_index = 0;
-
 /* Begin GPIO INPUT */
-static int push_count = 0;
-static bool is_fire = false;
-const int WAIT_PUSH_IN_SECONDS = 2;
+#define BUTTON_RESET_GPIO GPIO_NUM_36 // tombol hijau, aktif LOW, pull-up di board
+static void button_reset_short(void *arg);
+static void button_reset_long(void *arg);
 /* End GPIO INPUT */
 
-/* Begin Flag relay test switch ON or OFF */
-static int is_test_relay_on = 0;
-/* End Flag relay test switch ON or OFF*/
-
 /* Begin PZEM sensor */
 /* @brief Set ESP32  Serial Configuration */
 pzem_setup_t pzConf =
@@ -135,26 +179,63 @@ TaskHandle_t PMonTHandle = NULL;
 _current_values_t pzValues; /* Measured values */
 /* End PZEM sensor */
 
-/* Begin LCD Lock Text */
-bool is_reboot = false;
-bool is_beep = false;
-bool is_saldo_lock = false;
-bool is_reset_0_lock = false;
-bool is_relay_on = false;
-bool is_daily_limit = false;
-bool is_auto_topup = false;
-/* End LCD Lock Text */
+/* Begin Relay */
+#define RELAY_GPIO GPIO_NUM_33
+static SemaphoreHandle_t relay_mutex = NULL; // PMonTask, console dan task proteksi menulis relay bergantian
+static StaticSemaphore_t relay_mutex_buf;
+static void relay_apply(void);
+/* End Relay */
+
+/* Begin Saldo */
+static SemaphoreHandle_t saldo_mutex = NULL; // semua baca-ubah-tulis KEY_LAST_WH lewat fungsi saldo_*
+static StaticSemaphore_t saldo_mutex_buf;
+/* End Saldo */
+
+/* Begin Deteksi Alat */
+// diisi PMonTask tiap sampel, console hanya menyalin di bawah mutex
+static nilm_t nilm;
+static SemaphoreHandle_t nilm_mutex = NULL;
+static StaticSemaphore_t nilm_mutex_buf;
+#define NILM_REPORT_TOP 3 // alat terbesar di laporan harian telegram
+static void nilm_send_daily(void);
+/* End Deteksi Alat */
+
+/* Begin Telegram antrian, TLS berjalan di core jaringan bukan di PMonTask */
+#define TELEGRAM_QUEUE_LEN 4
+#define TELEGRAM_MSG_MAX 160
+#define TELEGRAM_URL_MAX 256 // url + body = satu blok pool jaringan
+#define TELEGRAM_BODY_MAX (MEM_POOL_BLOCK_SIZE - TELEGRAM_URL_MAX)
+static QueueHandle_t telegram_queue = NULL;
+static StaticQueue_t telegram_queue_buf;
+static uint8_t telegram_queue_storage[TELEGRAM_QUEUE_LEN * TELEGRAM_MSG_MAX];
+static esp_http_client_handle_t telegram_client = NULL; // dipakai ulang, koneksi TLS tetap terbuka
+static char telegram_client_token[64] = {0};
+static void telegram_task(void *arg);
+/* End Telegram antrian */
 
 /* Begin telegram counting next message */
 int count_next_message = 0;
 const int NEXT_SEND_TELEGRAM = 60; // 60 detik dikirim kembali
-bool is_single_message_telegram = false;
 /* End telegram counting next message */
 
 void app_main(void)
 {
+    // stack, TCB, antrian dan buffer statis; setelah start-up heap tidak dipakai lagi kecuali oleh stack jaringan
+    mem_budget_init();
+    trace_init(); // ring per core, <trace> untuk dump
+    dlog_init(); // log sampel diformat oleh task dlog, bukan oleh PMonTask
+
     /* BEGIN INIT NVS*/
     init_nvs();
+    saldo_mutex = xSemaphoreCreateMutexStatic(&saldo_mutex_buf);
+    relay_mutex = xSemaphoreCreateMutexStatic(&relay_mutex_buf);
+    nilm_mutex = xSemaphoreCreateMutexStatic(&nilm_mutex_buf);
+    nilm_init(&nilm);
+    MEM_STATIC(MEM_SUB_METER, nilm);
+    meter_state_init(); // mode meter, kunci topup, reboot dan rollover
+    billing_init(); // akumulator bulan ini dari NVS
+    tarif_reload();
+    billing_credit_set(saldo_load()); // sisa rupiah setelah restart dinilai ulang dengan tarif band 0
     /* END INIT NVS */
 
     /* BEGIN KONFIGURASI DARI UART0 UNTUK TERIMA DATA KONFIGURASI */
@@ -164,13 +245,20 @@ void app_main(void)
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = PM_UART_SCLK}; // REF_TICK saat PM aktif, baud tidak ikut turun bersama APB
     // Inisialisasi UART driver
     uart_param_config(UART_PORT, &uart_config);
-    uart_driver_install(UART_NUM_0, 1024, 0, 0, NULL, 0); // queue_size = 0, queue = NULL
 
-    // Buat task UART RX
-    xTaskCreate(uart_rx_task, "uart_rx_task", 8192, NULL, 10, NULL);
+    // Mode daya sebelum task manapun memakai pm_busy_begin, UART0 dan tombol membangunkan dari light sleep
+    char pm_mode_data[4] = {0};
+    read_string_from_nvs(KEY_PM_MODE, pm_mode_data, sizeof(pm_mode_data));
+    pm_mode_init(atoi(pm_mode_data) == 1 ? PM_MODE_LOW_POWER : PM_MODE_PERFORMANCE, UART_PORT);
+
+    // Task console tidur sampai ada frame lengkap (deteksi pola ETX)
+    mem_heap_begin();
+    console_start();
+    mem_heap_end(MEM_SUB_CONSOLE); // buffer driver UART
     /* END KONFIGURASI DARI UART0 UNTUK TERIMA DATA KONFIGURASI */
 
     /* BEGIN I2C FOR DISPLAY 16x2 */
@@ -187,35 +275,36 @@ void app_main(void)
     //    lcd_put_cur(1, 0);
     //    lcd_send_string("from ESP32");
 
-    char *lcd_text = "Initialize..";
-    sprintf(buffer, "%s", lcd_text);
-    lcd_put_cur(0, 0);
-    lcd_send_string(buffer);
+    /* task display satu-satunya yang mengakses LCD, menampilkan "Initialize.." sampai saldo pertama */
+    display_init();
     /* END I2C FOR DISPLAY 16x2 */
 
     /* BEGIN PZEM SENSOR INIT */
     /* Initialize/Configure UART */
     PzemInit(&pzConf);
-    xTaskCreate(PMonTask, "PowerMon", (5120), NULL, tskIDLE_PRIORITY, &PMonTHandle);
+    telegram_queue = xQueueCreateStatic(TELEGRAM_QUEUE_LEN, TELEGRAM_MSG_MAX, telegram_queue_storage, &telegram_queue_buf);
+    MEM_STATIC(MEM_SUB_NET, telegram_queue_storage);
+    mem_task_start(MEM_TASK_TELEGRAM, telegram_task, NULL);
+    // sampler, proteksi dan relay sendirian di core 1 (lihat task_config.h)
+    PMonTHandle = mem_task_start(MEM_TASK_POWERMON, PMonTask, NULL);
     /* END PZEM SENSOR INIT */
 
     /* Begin INPUT 36 */
-    // Konfigurasi GPIO36 sebagai input
-    gpio_config_t io_conf_36 = {
-        .pin_bit_mask = (1ULL << GPIO_NUM_36),
-        .mode = GPIO_MODE_INPUT,
-        .pull_up_en = GPIO_PULLUP_DISABLE,
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE};
-    gpio_config(&io_conf_36);
-
-    // Buat task untuk membaca GPIO
-    xTaskCreate(read_gpio_task, "read_gpio_task", 2048, NULL, 10, NULL);
+    // Interrupt tepi + timer debounce, tidak ada task yang bangun selama tombol diam
+    button_config_t button_conf = {
+        .gpio = BUTTON_RESET_GPIO,
+        .active_level = 0,
+        .debounce_ms = BUTTON_DEBOUNCE_MS,
+        .long_press_ms = BUTTON_LONG_PRESS_MS, // tahan 2 detik untuk reset pemakaian harian
+        .on_short = button_reset_short,
+        .on_long = button_reset_long,
+    };
+    ESP_ERROR_CHECK(button_init(&button_conf));
     /* End INPUT 36 */
 
     /* Begin GPIO Output 33 relay */
     gpio_config_t io_conf_33 = {
-        .pin_bit_mask = (1ULL << GPIO_NUM_33), // Ganti dengan GPIO yang benar
+        .pin_bit_mask = (1ULL << RELAY_GPIO), // Ganti dengan GPIO yang benar
         .mode = GPIO_MODE_OUTPUT,
         .pull_up_en = GPIO_PULLUP_DISABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
@@ -223,348 +312,471 @@ void app_main(void)
     gpio_config(&io_conf_33);
     /* End GPIO Output 34 relay*/
 
+    /* Begin Proteksi beban lebih */
+    // batas dibaca dari NVS sekali di sini, setelah itu proteksi hanya memakai RAM dan bus PZEM
+    ESP_ERROR_CHECK(protection_start(&pzConf, kapasitas_load(), relay_apply));
+    /* End Proteksi beban lebih */
+
     /* Begin init Wi-Fi*/
+    mem_heap_begin();
     wifi_init_sta();
+    mem_heap_end(MEM_SUB_WIFI); // driver Wi-Fi, netif dan lwIP dari heap
     /* End init Wi-Fi */
 
+    /* Begin Modbus TCP gateway */
+    modbus_tcp_start(&pzConf);
+    /* End Modbus TCP gateway */
+
+    /* Begin Telemetry uploader */
+    char collector_url[TLM_URL_MAX] = {0};
+    read_string_from_nvs(KEY_COLLECTOR_URL, collector_url, sizeof(collector_url));
+    mem_heap_begin();
+    telemetry_init(collector_url);
+    mem_heap_end(MEM_SUB_TELEMETRY);
+    /* End Telemetry uploader */
+
+    /* Begin Metrics endpoint */
+    mem_heap_begin();
+    metrics_init();
+    mem_heap_end(MEM_SUB_METRICS); // task dan socket httpd
+    /* End Metrics endpoint */
+
     /* Begin Init RTC Internal */
+    char hour_data[10] = {0};
+    read_string_from_nvs(KEY_HOUR, hour_data, sizeof(hour_data));
+    char minute_data[10] = {0};
+    read_string_from_nvs(KEY_MINUTE, minute_data, sizeof(minute_data));
+    rollover_init(atoi(hour_data), atoi(minute_data), daily_rollover);
+
     init_sntp_time();
     wait_for_time_sync();
-    print_current_time();
     /* End Init RTC Internal */
 }
 
-void uart_rx_task(void *arg)
+/**
+ * @brief i2c master initialization
+ */
+static esp_err_t i2c_master_init(void)
 {
-    uint8_t data[BUF_SIZE];
+    int i2c_master_port = I2C_MASTER_NUM;
 
-    while (!is_reboot)
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = I2C_MASTER_SDA_IO,
+        .scl_io_num = I2C_MASTER_SCL_IO,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = I2C_MASTER_FREQ_HZ,
+    };
+
+    i2c_param_config(i2c_master_port, &conf);
+
+    return i2c_driver_install(i2c_master_port, conf.mode, I2C_MASTER_RX_BUF_DISABLE, I2C_MASTER_TX_BUF_DISABLE, 0);
+}
+
+/* Begin Console commands */
+/* Set: <1,ssid,password>  Get: <1> */
+static esp_err_t cmd_wifi(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        int len = uart_read_bytes(UART_PORT, data, BUF_SIZE - 1, pdMS_TO_TICKS(10));
-        for (int i = 0; i < len; i++)
-        {
-            parse_serial(data[i]);
-        }
+        save_string_to_nvs(KEY_WIFI_SSID, argv[1]);
+        save_string_to_nvs(KEY_WIFI_PASSWORD, argv[2]);
+        ESP_LOGI(TAG, "OK");
+        return ESP_OK;
     }
+
+    char wifi_ssid[64];
+    read_string_from_nvs(KEY_WIFI_SSID, wifi_ssid, sizeof(wifi_ssid));
+    char wifi_password[64];
+    read_string_from_nvs(KEY_WIFI_PASSWORD, wifi_password, sizeof(wifi_password));
+    ESP_LOGI(TAG, "<1,%s,%s>", wifi_ssid, wifi_password);
+    return ESP_OK;
 }
 
-void parse_serial(uint8_t byte)
+/* Set: <2,kwh_minimum,daily_limit,time_sampling,tdl,jam,menit>  Get: <2> */
+static esp_err_t cmd_pulse(int argc, char **argv)
 {
-    if (byte == STX)
+    if (argc > 1)
     {
-        receiving = true;
-        buf_index = 0;
-        return;
+        save_string_to_nvs(KEY_KWH_MINIMUM, argv[1]);
+        save_string_to_nvs(KEY_DAILY_LIMIT, argv[2]);
+        save_string_to_nvs(KEY_TIME_SAMPLING, argv[3]);
+        save_string_to_nvs(KEY_TDL, argv[4]);
+        save_string_to_nvs(KEY_HOUR, argv[5]);
+        save_string_to_nvs(KEY_MINUTE, argv[6]);
+        rollover_set_time(atoi(argv[5]), atoi(argv[6]));
+        tarif_reload(); // TDL dipakai langsung bila jadwal <tou> kosong
+        ESP_LOGI(TAG, "OK");
+        return ESP_OK;
     }
 
-    if (byte == ETX && receiving)
+    char topup_kwh[10];
+    read_string_from_nvs(KEY_TOPUP_KWH, topup_kwh, sizeof(topup_kwh));
+    char kwh_minimum[10];
+    read_string_from_nvs(KEY_KWH_MINIMUM, kwh_minimum, sizeof(kwh_minimum));
+    char daily_limit[10];
+    read_string_from_nvs(KEY_DAILY_LIMIT, daily_limit, sizeof(daily_limit));
+    char last_wh[NUMBER_STR_LEN];
+    read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
+    float sisa_kwh_rounded = core_balance_kwh_shown(atof(last_wh));
+
+    char buffer_convert_to_kwh[NUMBER_STR_LEN];
+    fmt_float_str(buffer_convert_to_kwh, sizeof(buffer_convert_to_kwh), sisa_kwh_rounded, 1); // 1 digit di belakang koma
+
+    char sampling_time[10];
+    read_string_from_nvs(KEY_TIME_SAMPLING, sampling_time, sizeof(sampling_time));
+    char tdl[10];
+    read_string_from_nvs(KEY_TDL, tdl, sizeof(tdl));
+
+    char hour_data[10];
+    read_string_from_nvs(KEY_HOUR, hour_data, sizeof(hour_data));
+
+    char minute_data[10];
+    read_string_from_nvs(KEY_MINUTE, minute_data, sizeof(minute_data));
+
+    /* Print ESP-LOG */
+    ESP_LOGI(TAG, "<2,%s,%s,%s,%s,%s,%s,%s,%s>", topup_kwh, kwh_minimum, daily_limit, buffer_convert_to_kwh, sampling_time, tdl, hour_data, minute_data);
+    return ESP_OK;
+}
+
+/* Set: <3,bot_token,recipient_id>  Get: <3> */
+static esp_err_t cmd_telegram(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        buffer[buf_index] = '\0'; // Null-terminate
-        receiving = false;
-        // ESP_LOGI(TAG, "Command: %s", buffer);
-        login_main(buffer);
-        return;
+        save_string_to_nvs(KEY_BOT_TOKEN, argv[1]);
+        save_string_to_nvs(KEY_RECIPIENT_ID, argv[2]);
+        ESP_LOGI(TAG, "OK");
+        return ESP_OK;
     }
 
-    if (receiving)
+    char bot_token[64];
+    read_string_from_nvs(KEY_BOT_TOKEN, bot_token, sizeof(bot_token));
+    char recipient_id[64];
+    read_string_from_nvs(KEY_RECIPIENT_ID, recipient_id, sizeof(recipient_id));
+    ESP_LOGI(TAG, "<3,%s,%s>", bot_token, recipient_id);
+    return ESP_OK;
+}
+
+/* Topup: <4,kwh> */
+static esp_err_t cmd_topup(int argc, char **argv)
+{
+    save_string_to_nvs(KEY_TOPUP_KWH, argv[1]);
+
+    // PMonTask menunggu (tanpa polling) sampai saldo selesai ditulis
+    float topup_kwh_float = atof(argv[1]);
+    meter_lock();
+    bool ok = saldo_add(topup_kwh_float * 1000);
+    meter_unlock();
+    if (!ok)
+        return ESP_FAIL;
+
+    telemetry_push_event(TLM_EV_TOPUP, (int32_t)(topup_kwh_float * 1000));
+    ESP_LOGI(TAG, "OK");
+    return ESP_OK;
+}
+
+/* Set: <5,url>  Get: <5> */
+static esp_err_t cmd_collector_url(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        if (buf_index < sizeof(buffer) - 1)
-        {
-            buffer[buf_index++] = byte;
-        }
-        else
-        {
-            // Buffer overflow, reset reception
-            receiving = false;
-            buf_index = 0;
-            ESP_LOGW(TAG, "Buffer overflow. Frame dropped.");
-        }
+        save_string_to_nvs(KEY_COLLECTOR_URL, argv[1]);
+        telemetry_set_url(argv[1]);
+        ESP_LOGI(TAG, "OK");
+        return ESP_OK;
     }
+
+    char collector_url[TLM_URL_MAX] = {0};
+    read_string_from_nvs(KEY_COLLECTOR_URL, collector_url, sizeof(collector_url));
+    ESP_LOGI(TAG, "<5,%s>", collector_url);
+    return ESP_OK;
 }
 
-/**
- * @brief i2c master initialization
- */
-static esp_err_t i2c_master_init(void)
+/* Relay ON: <11> */
+static esp_err_t cmd_relay_on(int argc, char **argv)
 {
-    int i2c_master_port = I2C_MASTER_NUM;
+    meter_set_override(METER_RELAY_FORCE_ON);
+    relay_apply(); // HIGH
+    display_show_message("Switch ON", DISPLAY_MESSAGE_MS);
+    ESP_LOGI(TAG, "OK");
+    return ESP_OK;
+}
 
-    i2c_config_t conf = {
-        .mode = I2C_MODE_MASTER,
-        .sda_io_num = I2C_MASTER_SDA_IO,
-        .scl_io_num = I2C_MASTER_SCL_IO,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = I2C_MASTER_FREQ_HZ,
-    };
+/* Relay OFF: <12> */
+static esp_err_t cmd_relay_off(int argc, char **argv)
+{
+    meter_set_override(METER_RELAY_FORCE_OFF);
+    relay_apply(); // LOW
+    display_show_message("Relay OFF", DISPLAY_MESSAGE_MS);
+    ESP_LOGI(TAG, "OK");
+    return ESP_OK;
+}
 
-    i2c_param_config(i2c_master_port, &conf);
+/* Send Telegram: <13> */
+static esp_err_t cmd_send_telegram(int argc, char **argv)
+{
+    display_show_message("Send telegram", DISPLAY_MESSAGE_MS);
+    // do send telegram
+    telegram_post("OK");
+    ESP_LOGI(TAG, "OK");
+    return ESP_OK;
+}
 
-    return i2c_driver_install(i2c_master_port, conf.mode, I2C_MASTER_RX_BUF_DISABLE, I2C_MASTER_TX_BUF_DISABLE, 0);
+/* Reboot: <14> */
+static esp_err_t cmd_reboot(int argc, char **argv)
+{
+    meter_request_reboot(); // stop all threads
+    display_show_message("Rebooting...", 2000);
+    vTaskDelay(pdMS_TO_TICKS(2000));
+    // reboot
+    esp_restart();
+    return ESP_OK;
+}
+
+/* Normally Relay: <15> */
+static esp_err_t cmd_relay_auto(int argc, char **argv)
+{
+    meter_set_override(METER_RELAY_AUTO); // ikut saldo dan batas harian
+
+    // set text
+    char *lcd_text = "Relay OFF";
+    if (meter_relay_wanted())
+        lcd_text = "Relay ON";
+    relay_apply();
+
+    display_show_message(lcd_text, DISPLAY_MESSAGE_MS);
+    ESP_LOGI(TAG, "OK");
+    return ESP_OK;
+}
+
+/* Reset 0: <20> */
+static esp_err_t cmd_reset_kwh(int argc, char **argv)
+{
+    display_show_message("Reset Kwh", DISPLAY_MESSAGE_MS);
+
+    // set last KWH
+    meter_lock();
+    saldo_reset();
+    meter_unlock();
+    display_set_balance(0);
+    telemetry_push_event(TLM_EV_RESET_KWH, 0);
+    return ESP_OK;
 }
 
-uint16_t modbus_crc(uint8_t *buf, uint8_t len)
+/* Profiling: <top>, CPU per task sejak <top> sebelumnya, stack, heap dan waktu loop PMonTask */
+static esp_err_t cmd_top(int argc, char **argv)
 {
-    uint16_t crc = 0xFFFF;
-    for (uint8_t pos = 0; pos < len; pos++)
+    prof_report();
+    return ESP_OK;
+}
+
+/* Mode daya: <pm> laporan duty cycle dan waktu per frekuensi, <pm,1> hemat daya, <pm,0> performa */
+static esp_err_t cmd_pm(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        crc ^= (uint16_t)buf[pos];
-        for (int i = 0; i < 8; i++)
-        {
-            if ((crc & 0x0001) != 0)
-            {
-                crc >>= 1;
-                crc ^= 0xA001;
-            }
-            else
-            {
-                crc >>= 1;
-            }
-        }
+        int mode = atoi(argv[1]);
+        if (mode != PM_MODE_PERFORMANCE && mode != PM_MODE_LOW_POWER)
+            return ESP_ERR_INVALID_ARG;
+        save_string_to_nvs(KEY_PM_MODE, argv[1]);
+        return pm_mode_set((pm_mode_t)mode);
     }
-    return crc;
+
+    pm_report();
+    return ESP_OK;
 }
 
-void login_main(char *route)
+/* Kapasitas: <kap> status proteksi beban lebih, <kap,1300> ganti kelas daya (450/900/1300/2200/3500 VA) */
+static esp_err_t cmd_kapasitas(int argc, char **argv)
 {
-    if (strchr(route, ','))
+    if (argc > 1)
     {
-        char tokens[MAX_TOKENS][MAX_TOKEN_LEN];
-        int token_count = split_and_store_tokens(route, tokens);
-        // for (int i = 0; i < token_count; i++) {
-        //     ESP_LOGI(TAG, "Token %d: %s\n", i, tokens[i]);
-        // }
-        if (token_count >= 2)
-        {
-            /* Begin Wifi Save to NVS */
-            if (strcmp(tokens[0], "1") == 0)
-            {
-                save_string_to_nvs(KEY_WIFI_SSID, tokens[1]);
-                save_string_to_nvs(KEY_WIFI_PASSWORD, tokens[2]);
-                ESP_LOGI(TAG, "OK");
-            }
-            /* End Wifi Save to NVS */
-            /* Begin Data Save to NVS */
-            if (strcmp(tokens[0], "2") == 0)
-            {
-                save_string_to_nvs(KEY_KWH_MINIMUM, tokens[1]);
-                save_string_to_nvs(KEY_DAILY_LIMIT, tokens[2]);
-                save_string_to_nvs(KEY_TIME_SAMPLING, tokens[3]);
-                save_string_to_nvs(KEY_TDL, tokens[4]);
-                save_string_to_nvs(KEY_HOUR, tokens[5]);
-                save_string_to_nvs(KEY_MINUTE, tokens[6]);
-                ESP_LOGI(TAG, "OK");
-            }
-            /* End Data Save to NVS */
-            /* Begin Telegram Token */
-            if (strcmp(tokens[0], "3") == 0)
-            {
-                save_string_to_nvs(KEY_BOT_TOKEN, tokens[1]);
-                save_string_to_nvs(KEY_RECIPIENT_ID, tokens[2]);
-                ESP_LOGI(TAG, "OK");
-            }
-            /* End Telegram Token */
-            /* Begin Topup KWH */
-            if (strcmp(tokens[0], "4") == 0)
-            {
+        uint16_t batas_w = core_class_limit_w(atoi(argv[1]));
+        if (batas_w == 0)
+            return ESP_ERR_INVALID_ARG;
+        protection_set_limit(batas_w); // langsung berlaku, NVS hanya untuk boot berikutnya
+        display_set_capacity(batas_w);
+        save_string_to_nvs(KEY_KAPASITAS, argv[1]);
+        return ESP_OK;
+    }
 
-                is_saldo_lock = true;
-                vTaskDelay(pdMS_TO_TICKS(1000));
+    protection_report();
+    return ESP_OK;
+}
 
-                save_string_to_nvs(KEY_TOPUP_KWH, tokens[1]);
+/* Tarif: <tou> tarif per band, energi dan biaya hari ini / bulan ini, <tou,r0=1444.70 r1=2166 w1700-2200=1> ganti jadwal */
+static esp_err_t cmd_tou(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        int err_pos = 0;
+        if (strlen(argv[1]) > TARIFF_SPEC_MAX || !billing_set_tariff(argv[1], &err_pos))
+            return ESP_ERR_INVALID_ARG; // tarif lama tetap berlaku
+        save_string_to_nvs(KEY_TOU, argv[1]);
+        return ESP_OK;
+    }
 
-                char last_kwh[10];
-                read_string_from_nvs(KEY_LAST_WH, last_kwh, sizeof(last_kwh));
-                float kwh_float = atof(last_kwh);
-                float topup_kwh_float = atof(tokens[1]);
-                float total_wh_float = kwh_float + (topup_kwh_float * 1000);
+    billing_report();
+    return ESP_OK;
+}
 
-                char buffer_total_wh[10];
-                sprintf(buffer_total_wh, "%.2f", total_wh_float);
-                save_string_to_nvs(KEY_LAST_WH, buffer_total_wh);
+/* Alat: <alat> tanda tangan alat yang dikenali dari lonjakan daya, energi hari ini dan total */
+static esp_err_t cmd_alat(int argc, char **argv)
+{
+    static nilm_t salinan; // worker console saja
+    xSemaphoreTake(nilm_mutex, portMAX_DELAY);
+    salinan = nilm;
+    xSemaphoreGive(nilm_mutex);
 
-                vTaskDelay(pdMS_TO_TICKS(1000));
-                is_saldo_lock = false;
-                ESP_LOGI(TAG, "OK");
-            }
-            /* End Topup KWH */
-        }
+    ESP_LOGI(TAG, "%u event, %u tak cocok", (unsigned)salinan.events, (unsigned)salinan.unmatched);
+    for (int i = 0; i < salinan.sigs; i++)
+    {
+        const nilm_sig_t *sig = &salinan.sig[i];
+        char line[96];
+        fmt_buf_t b;
+        fmt_begin(&b, line, sizeof(line));
+        fmt_str(&b, "#");
+        fmt_fixed(&b, i, 0);
+        fmt_str(&b, sig->running ? " nyala " : " mati  ");
+        fmt_float(&b, sig->p_w, 0);
+        fmt_str(&b, " W ");
+        fmt_float(&b, sig->q_var, 0);
+        fmt_str(&b, " var, hari ini ");
+        fmt_fixed(&b, (int32_t)(sig->today_uwh / 1000000), 3);
+        fmt_str(&b, " kWh, total ");
+        fmt_fixed(&b, (int32_t)(sig->total_uwh / 1000000), 3);
+        fmt_str(&b, " kWh");
+        fmt_end(&b);
+        ESP_LOGI(TAG, "%s", line);
     }
-    else
+    char lain[NUMBER_STR_LEN];
+    fmt_buf_t b;
+    fmt_begin(&b, lain, sizeof(lain));
+    fmt_fixed(&b, (int32_t)(salinan.other_today_uwh / 1000000), 3); // beban dasar dan alat tak dikenal
+    fmt_end(&b);
+    ESP_LOGI(TAG, "lainnya hari ini %s kWh", lain);
+    return ESP_OK;
+}
+
+/* Trace: <trace> dump ring per core (tools/trace2chrome.py), <trace,0> berhenti, <trace,1> kosongkan lalu rekam */
+static esp_err_t cmd_trace(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        /* Begin Relay ON */
-        if (strcmp(route, "11") == 0)
-        {
-            is_test_relay_on = 1; // set flag on
-            is_relay_on = true;
-            gpio_set_level(GPIO_NUM_33, 1); // Set ke HIGH
-            // clear LCD
-            lcd_clear_row(1);
-            // set text
-            char *lcd_text = "Switch ON";
-            char buffer_relay[20];
-            sprintf(buffer_relay, "%s", lcd_text);
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_relay);
-            ESP_LOGI(TAG, "OK");
-        }
-        /* End Relay ON */
-        /* Begin Relay OFF */
-        if (strcmp(route, "12") == 0)
-        {
-            is_test_relay_on = 2; // set flag off
-            is_relay_on = false;
-            gpio_set_level(GPIO_NUM_33, 0); // Set ke LOW
-            // clear LCD
-            lcd_clear_row(1);
-            // set text
-            char *lcd_text = "Relay OFF";
-            char buffer_relay[20];
-            sprintf(buffer_relay, "%s", lcd_text);
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_relay);
-            ESP_LOGI(TAG, "OK");
-        }
-        /* End Relay ON */
-        /* Begin Send Telegram */
-        if (strcmp(route, "13") == 0)
-        {
-            // clear LCD
-            lcd_clear_row(1);
-            // set text
-            char buffer_telegram[20];
-            sprintf(buffer_telegram, "%s", "Send telegram");
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_telegram);
-            // do send telegram
-            send_telegram_message("OK");
-            ESP_LOGI(TAG, "OK");
-        }
-        /* End Send Telegram */
+        bool on = atoi(argv[1]) != 0;
+        if (on)
+            trace_clear();
+        trace_set_enabled(on);
+        return ESP_OK;
+    }
 
-        /* Begin Send Reboot */
-        if (strcmp(route, "14") == 0)
-        {
-            is_reboot = true; // stop all threads
-            // clear LCD
-            lcd_clear();
-            // set text
-            char buffer_telegram[20];
-            sprintf(buffer_telegram, "%s", "Rebooting...");
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_telegram);
-            vTaskDelay(pdMS_TO_TICKS(2000));
-            // reboot
-            esp_restart();
-        }
-        /* End Send Reboot */
+    trace_dump();
+    return ESP_OK;
+}
+
+/* Memori: <mem> statis, stack dan heap per subsistem, pool jaringan dan fragmentasi heap */
+static esp_err_t cmd_mem(int argc, char **argv)
+{
+    mem_report();
+    return ESP_OK;
+}
+
+/* Urut berdasarkan strcmp, dicari dengan binary search */
+static const console_cmd_t console_commands[] = {
+    {"1", "ss", CONSOLE_ARGS_OPTIONAL, cmd_wifi},
+    {"11", "", 0, cmd_relay_on},
+    {"12", "", 0, cmd_relay_off},
+    {"13", "", 0, cmd_send_telegram},
+    {"14", "", 0, cmd_reboot},
+    {"15", "", 0, cmd_relay_auto},
+    {"2", "nninii", CONSOLE_ARGS_OPTIONAL, cmd_pulse},
+    {"20", "", 0, cmd_reset_kwh},
+    {"3", "ss", CONSOLE_ARGS_OPTIONAL, cmd_telegram},
+    {"4", "n", 0, cmd_topup},
+    {"5", "s", CONSOLE_ARGS_OPTIONAL, cmd_collector_url},
+    {"alat", "", 0, cmd_alat},
+    {"kap", "i", CONSOLE_ARGS_OPTIONAL, cmd_kapasitas},
+    {"mem", "", 0, cmd_mem},
+    {"pm", "i", CONSOLE_ARGS_OPTIONAL, cmd_pm},
+    {"top", "", 0, cmd_top},
+    {"tou", "s", CONSOLE_ARGS_OPTIONAL, cmd_tou},
+    {"trace", "i", CONSOLE_ARGS_OPTIONAL, cmd_trace},
+};
+
+/* Konfigurasi biner dari tools/provision.py, key sama dengan perintah teks di atas */
+static const prov_field_t prov_fields[] = {
+    {PROV_TAG_WIFI_SSID, KEY_WIFI_SSID, PROV_STR, 0, 32, 0, 0, NULL},
+    {PROV_TAG_WIFI_PASSWORD, KEY_WIFI_PASSWORD, PROV_STR, 0, 63, 0, 0, NULL},
+    {PROV_TAG_BOT_TOKEN, KEY_BOT_TOKEN, PROV_STR, 0, 63, 0, 0, NULL},
+    {PROV_TAG_RECIPIENT_ID, KEY_RECIPIENT_ID, PROV_STR, 0, 32, 0, 0, NULL},
+    {PROV_TAG_KWH_MINIMUM, KEY_KWH_MINIMUM, PROV_NUM, 0, NUMBER_STR_LEN - 1, 0, 0, NULL},
+    {PROV_TAG_DAILY_LIMIT, KEY_DAILY_LIMIT, PROV_NUM, 0, NUMBER_STR_LEN - 1, 0, 0, NULL},
+    {PROV_TAG_TIME_SAMPLING, KEY_TIME_SAMPLING, PROV_INT, 0, 9, 100, 60000, NULL}, // ms
+    {PROV_TAG_TDL, KEY_TDL, PROV_NUM, 0, NUMBER_STR_LEN - 1, 0, 0, NULL}, // Rp/kWh, mis. 1444.70
+    {PROV_TAG_HOUR, KEY_HOUR, PROV_INT, 0, 2, 0, 23, NULL},
+    {PROV_TAG_MINUTE, KEY_MINUTE, PROV_INT, 0, 2, 0, 59, NULL},
+    {PROV_TAG_COLLECTOR_URL, KEY_COLLECTOR_URL, PROV_STR, 0, TLM_URL_MAX - 1, 0, 0, NULL},
+    {PROV_TAG_LAST_WH, KEY_LAST_WH, PROV_NUM, PROV_READONLY, NUMBER_STR_LEN - 1, 0, 0, NULL}, // saldo hanya lewat topup
+    {PROV_TAG_PM_MODE, KEY_PM_MODE, PROV_INT, 0, 1, 0, 1, NULL}, // 0 performa, 1 hemat daya
+    {PROV_TAG_KAPASITAS, KEY_KAPASITAS, PROV_INT, 0, 4, 450, 3500, NULL}, // VA, kelas lain diabaikan
+    {PROV_TAG_TOU, KEY_TOU, PROV_STR, 0, TARIFF_SPEC_MAX, 0, 0, tarif_valid}, // jadwal tarif, lihat tariff.h
+};
+
+/* Dipanggil worker console setelah SET tersimpan, nilai yang dipakai saat jalan langsung diterapkan */
+static void prov_apply(const prov_field_t *const *fields, size_t count)
+{
+    bool rollover_changed = false;
 
-        /* Begin Send Normally Relay */
-        if (strcmp(route, "15") == 0)
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fields[i]->tag == PROV_TAG_HOUR || fields[i]->tag == PROV_TAG_MINUTE)
         {
-            is_test_relay_on = 0; // reset
-            is_relay_on = false;
-            // clear LCD
-            lcd_clear_row(1);
-            // tunggu proses clear selesai
-            vTaskDelay(pdMS_TO_TICKS(500));
-            char last_kwh[10];
-            read_string_from_nvs(KEY_LAST_WH, last_kwh, sizeof(last_kwh));
-            float total_last_wh = atof(last_kwh);
-
-            // set text
-            char *lcd_text = "Relay OFF";
-            if (total_last_wh > 0)
-                lcd_text = "Relay ON";
-
-            char buffer_relay[20];
-            sprintf(buffer_relay, "%s", lcd_text);
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_relay);
-            ESP_LOGI(TAG, "OK");
+            rollover_changed = true;
         }
-        /* End Send Normally Relay */
-
-        /* Begin Get Wifi */
-        if (strcmp(route, "1") == 0)
+        else if (fields[i]->tag == PROV_TAG_COLLECTOR_URL)
         {
-            char wifi_ssid[64];
-            read_string_from_nvs(KEY_WIFI_SSID, wifi_ssid, sizeof(wifi_ssid));
-            char wifi_password[64];
-            read_string_from_nvs(KEY_WIFI_PASSWORD, wifi_password, sizeof(wifi_password));
-            ESP_LOGI(TAG, "<1,%s,%s>", wifi_ssid, wifi_password);
+            char collector_url[TLM_URL_MAX] = {0};
+            read_string_from_nvs(KEY_COLLECTOR_URL, collector_url, sizeof(collector_url));
+            telemetry_set_url(collector_url);
         }
-        /* End Get Wifi */
-
-        /* Begin Pulse KWH */
-        if (strcmp(route, "2") == 0)
+        else if (fields[i]->tag == PROV_TAG_PM_MODE)
         {
-            char topup_kwh[10];
-            read_string_from_nvs(KEY_TOPUP_KWH, topup_kwh, sizeof(topup_kwh));
-            char kwh_minimum[10];
-            read_string_from_nvs(KEY_KWH_MINIMUM, kwh_minimum, sizeof(kwh_minimum));
-            char daily_limit[10];
-            read_string_from_nvs(KEY_DAILY_LIMIT, daily_limit, sizeof(daily_limit));
-            char last_wh[10];
-            read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
-            float pembulatan_kwh = atof(last_wh) / 1000.0;
-            float sisa_kwh_rounded = floorf(pembulatan_kwh * 10) / 10;
-
-            char buffer_convert_to_kwh[10];                           // pastikan cukup besar
-            sprintf(buffer_convert_to_kwh, "%.1f", sisa_kwh_rounded); // format 2 digit di belakang koma
-
-            char sampling_time[10];
-            read_string_from_nvs(KEY_TIME_SAMPLING, sampling_time, sizeof(sampling_time));
-            char tdl[10];
-            read_string_from_nvs(KEY_TDL, tdl, sizeof(tdl));
-
-            char hour_data[10];
-            read_string_from_nvs(KEY_HOUR, hour_data, sizeof(hour_data));
-
-            char minute_data[10];
-            read_string_from_nvs(KEY_MINUTE, minute_data, sizeof(minute_data));
-
-            /* Print ESP-LOG */
-            ESP_LOGI(TAG, "<2,%s,%s,%s,%s,%s,%s,%s,%s>", topup_kwh, kwh_minimum, daily_limit, buffer_convert_to_kwh, sampling_time, tdl, hour_data, minute_data);
+            char pm_mode_data[4] = {0};
+            read_string_from_nvs(KEY_PM_MODE, pm_mode_data, sizeof(pm_mode_data));
+            pm_mode_set(atoi(pm_mode_data) == 1 ? PM_MODE_LOW_POWER : PM_MODE_PERFORMANCE);
         }
-        /* End Pulse KWH */
-
-        /* Begin Bot Token */
-        if (strcmp(route, "3") == 0)
+        else if (fields[i]->tag == PROV_TAG_KAPASITAS)
         {
-            char bot_token[64];
-            read_string_from_nvs(KEY_BOT_TOKEN, bot_token, sizeof(bot_token));
-            char recipient_id[64];
-            read_string_from_nvs(KEY_RECIPIENT_ID, recipient_id, sizeof(recipient_id));
-            ESP_LOGI(TAG, "<3,%s,%s>", bot_token, recipient_id);
+            uint16_t batas_w = kapasitas_load(); // kelas tak dikenal jatuh ke default
+            protection_set_limit(batas_w);
+            display_set_capacity(batas_w);
         }
-        /* End Bot Token */
-
-        /* Begin Send Reset 0 */
-        if (strcmp(route, "20") == 0)
+        else if (fields[i]->tag == PROV_TAG_TDL || fields[i]->tag == PROV_TAG_TOU)
         {
-            is_reset_0_lock = true;
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            // clear LCD
-            lcd_clear_row(1);
-            // set text
-            char buffer_reset_kwh[20];
-            sprintf(buffer_reset_kwh, "%s", "Reset Kwh");
-            lcd_put_cur(1, 0);
-            lcd_send_string(buffer_reset_kwh);
-
-            sprintf(buffer_reset_kwh, "%s", "      ");
-            lcd_put_cur(0, 4);
-            lcd_send_string(buffer_reset_kwh);
-
-            // set last KWH
-            save_string_to_nvs(KEY_LAST_WH, "0");
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            is_reset_0_lock = false;
+            tarif_reload(); // jadwal salah ditolak, tarif lama tetap berlaku
         }
-        /* End Send Reset 0 */
     }
+
+    if (rollover_changed)
+    {
+        char hour_data[10] = {0};
+        read_string_from_nvs(KEY_HOUR, hour_data, sizeof(hour_data));
+        char minute_data[10] = {0};
+        read_string_from_nvs(KEY_MINUTE, minute_data, sizeof(minute_data));
+        rollover_set_time(atoi(hour_data), atoi(minute_data));
+    }
+    // Wi-Fi dan token telegram dibaca ulang saat dipakai / setelah reboot, sama seperti <1> dan <3>
+    display_show_message("Config OK", DISPLAY_MESSAGE_MS);
+}
+
+static void console_start(void)
+{
+    console_init(UART_PORT, console_commands, sizeof(console_commands) / sizeof(console_commands[0]));
+    prov_init("storage", prov_fields, sizeof(prov_fields) / sizeof(prov_fields[0]), prov_apply);
 }
+/* End Console commands */
 
 void init_nvs()
 {
@@ -595,14 +807,16 @@ void save_string_to_nvs(const char *key, const char *value)
         return;
     }
 
+    TRACE_BEGIN(TRACE_EV_NVS_COMMIT, 0);
     err = nvs_commit(handle);
+    TRACE_END(TRACE_EV_NVS_COMMIT, err == ESP_OK);
     if (err != ESP_OK)
     {
         ESP_LOGE("NVS", "nvs_commit gagal: %s", esp_err_to_name(err));
     }
     else
     {
-        ESP_LOGI("NVS", "Berhasil simpan key %s dengan nilai %s", key, value);
+        dlog(DLOG_NVS_SAVED, key, value); // value disalin, buffer pemanggil boleh hilang
     }
 
     nvs_close(handle);
@@ -625,66 +839,75 @@ void read_string_from_nvs(const char *key, char *out_value, size_t max_len)
     }
 }
 
-int split_and_store_tokens(char *input, char tokens[][MAX_TOKEN_LEN])
+/* Satu-satunya tempat yang menggerakkan relay */
+/* Baca keputusan dan tulis GPIO di bawah satu mutex, supaya trip tidak tertimpa keputusan lama */
+static void relay_apply(void)
 {
-    int count = 0;
-    char *token = strtok(input, ",");
+    xSemaphoreTake(relay_mutex, portMAX_DELAY);
+    bool on = meter_relay_wanted();
+    gpio_set_level(RELAY_GPIO, on ? 1 : 0);
+    TRACE_INSTANT(TRACE_EV_RELAY, on);
+    xSemaphoreGive(relay_mutex);
+    metrics_set(METRIC_RELAY_ON, on);
+}
 
-    while (token != NULL && count < MAX_TOKENS)
+static uint16_t kapasitas_load(void)
+{
+    char kapasitas_data[8] = {0};
+    read_string_from_nvs(KEY_KAPASITAS, kapasitas_data, sizeof(kapasitas_data));
+    uint16_t batas_w = core_class_limit_w(atoi(kapasitas_data));
+    if (batas_w == 0)
+        batas_w = core_class_limit_w(KAPASITAS_DEFAULT_VA);
+    return batas_w;
+}
+
+/* Pasang jadwal dari NVS, atau satu band dengan TDL bila jadwal kosong */
+static bool tarif_reload(void)
+{
+    char spec[TARIFF_SPEC_MAX + 1] = {0};
+    int err_pos = 0;
+    read_string_from_nvs(KEY_TOU, spec, sizeof(spec));
+    if (spec[0] != '\0')
     {
-        strncpy(tokens[count], token, MAX_TOKEN_LEN - 1);
-        tokens[count][MAX_TOKEN_LEN - 1] = '\0'; // Null-terminate
-        count++;
-        token = strtok(NULL, ",");
+        if (billing_set_tariff(spec, &err_pos))
+            return true;
+        // jadwal rusak di NVS jangan sampai membuat semua tarif Rp 0
+        ESP_LOGW(TAG, "Jadwal tou ditolak di posisi %d, pakai TDL", err_pos);
     }
 
-    return count; // Jumlah token yang disimpan
+    // TDL dibulatkan ke sen supaya selalu lolos tariff_compile
+    char key_tdl[NUMBER_STR_LEN] = {0};
+    read_string_from_nvs(KEY_TDL, key_tdl, sizeof(key_tdl));
+    float tdl = atof(key_tdl);
+    char rate[NUMBER_STR_LEN];
+    if (fmt_float_str(rate, sizeof(rate), tdl > 0 ? tdl : 0, 2) < 0)
+        snprintf(rate, sizeof(rate), "0");
+    snprintf(spec, sizeof(spec), "r0=%s", rate);
+    return billing_set_tariff(spec, &err_pos);
 }
 
-void read_gpio_task(void *arg)
+/* Validasi provisioning: jadwal yang tidak bisa dikompilasi tidak disimpan */
+static bool tarif_valid(const char *spec)
 {
-    while (!is_reboot)
-    {
-        int level = gpio_get_level(GPIO_NUM_36);
-        if (level == 0)
-        {
-            if (push_count >= WAIT_PUSH_IN_SECONDS)
-            {
-                if (!is_fire)
-                {
-                    is_fire = true;
-                    ESP_LOGI(TAG, "Reset Wh");
-                    save_string_to_nvs(KEY_CURRENT_WH_USE, "0");
-                }
-            }
-            push_count++;
-        }
-        else
-        {
-            push_count = 0; // reset
-            is_fire = false;
-        }
-        vTaskDelay(pdMS_TO_TICKS(50)); // delay 500ms
-    }
+    static tariff_table_t uji; // hanya worker console yang memanggil
+    int err_pos = 0;
+    return tariff_compile(spec, &uji, &err_pos);
 }
 
-// Wi-Fi event handler
-static void wifi_event_handler(void *arg, esp_event_base_t event_base,
-                               int32_t event_id, void *event_data)
+/* Tekan singkat: petunjuk di LCD saja */
+static void button_reset_short(void *arg)
 {
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
-    {
-        esp_wifi_connect();
-    }
-    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
-    {
-        ESP_LOGI(TAG, "Wi-Fi Connected");
-    }
-    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
-    {
-        ESP_LOGI(TAG, "Wi-Fi Disconnected, retrying...");
-        esp_wifi_connect();
-    }
+    display_show_message("Tahan 2 detik", DISPLAY_MESSAGE_MS);
+}
+
+/* Tahan: reset pemakaian harian, jalan di task esp_timer, tulis NVS dilakukan oleh PMonTask */
+static void button_reset_long(void *arg)
+{
+    if (meter_rebooting())
+        return;
+
+    meter_request_usage_reset();
+    display_show_message("Reset Wh", DISPLAY_MESSAGE_MS);
 }
 
 void wifi_init_sta(void)
@@ -696,43 +919,41 @@ void wifi_init_sta(void)
     char wifi_password[64];
     read_string_from_nvs(KEY_WIFI_PASSWORD, wifi_password, sizeof(wifi_password));
 
-    // Inisialisasi WiFi
-    esp_netif_init();
-    esp_event_loop_create_default();
-    esp_netif_create_default_wifi_sta();
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    esp_wifi_init(&cfg);
-
-    esp_event_handler_instance_register(WIFI_EVENT,
-                                        ESP_EVENT_ANY_ID,
-                                        &wifi_event_handler,
-                                        NULL,
-                                        NULL);
-    esp_event_handler_instance_register(IP_EVENT,
-                                        IP_EVENT_STA_GOT_IP,
-                                        &wifi_event_handler,
-                                        NULL,
-                                        NULL);
-
-    // Inisialisasi struct wifi_config dan masukkan SSID + Password
-    wifi_config_t wifi_config = {0};
-
-    strncpy((char *)wifi_config.sta.ssid, wifi_ssid, sizeof(wifi_config.sta.ssid));
-    wifi_config.sta.ssid[sizeof(wifi_config.sta.ssid) - 1] = '\0';
+    // Koneksi cepat ke AP terakhir, retry dengan backoff (lihat wifi_sta.c)
+    wifi_sta_start(wifi_ssid, wifi_password);
+}
 
-    strncpy((char *)wifi_config.sta.password, wifi_password, sizeof(wifi_config.sta.password));
-    wifi_config.sta.password[sizeof(wifi_config.sta.password) - 1] = '\0';
+/* Antrikan pesan, tidak pernah menunggu jaringan. Pesan dibuang bila antrian penuh */
+void telegram_post(const char *message)
+{
+    char msg[TELEGRAM_MSG_MAX];
+    snprintf(msg, sizeof(msg), "%s", message);
+    if (xQueueSend(telegram_queue, msg, 0) != pdTRUE)
+        ESP_LOGW(TAG, "Antrian telegram penuh, pesan dibuang");
+}
 
-    wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+static void telegram_task(void *arg)
+{
+    char msg[TELEGRAM_MSG_MAX];
+    for (;;)
+    {
+        if (xQueueReceive(telegram_queue, msg, portMAX_DELAY) == pdTRUE)
+        {
+            pm_busy_begin(PM_BUSY_NET); // TLS dengan CPU penuh, lalu boleh tidur lagi
+            send_telegram_message(msg);
+            pm_busy_end(PM_BUSY_NET);
+        }
+    }
+}
 
-    // Set konfigurasi dan mulai koneksi
-    esp_wifi_set_mode(WIFI_MODE_STA);
-    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
-    esp_wifi_start();
+// Kirim pesan ke Telegram, hanya dari telegram_task
+/* Fase HTTP (connect, header, data, selesai) masuk trace di antara begin dan end */
+static esp_err_t telegram_http_event(esp_http_client_event_t *evt)
+{
+    TRACE_INSTANT(TRACE_EV_HTTP_PHASE, evt->event_id);
+    return ESP_OK;
 }
 
-// Kirim pesan ke Telegram
 void send_telegram_message(const char *message)
 {
     char bot_token[64];
@@ -740,33 +961,58 @@ void send_telegram_message(const char *message)
     char recipient_id[64];
     read_string_from_nvs(KEY_RECIPIENT_ID, recipient_id, sizeof(recipient_id));
 
-    char url[256];
-    snprintf(url, sizeof(url), "https://api.telegram.org/bot%s/sendMessage", bot_token);
-
-    char post_data[512];
-    snprintf(post_data, sizeof(post_data), "chat_id=%s&text=%s", recipient_id, message);
-
-    esp_http_client_config_t config = {
-        .url = url,
-        .cert_pem = telegram_root_cert,
-        .method = HTTP_METHOD_POST,
-    };
+    // url dan body dari pool jaringan, bukan stack atau malloc per pesan
+    char *url = mem_pool_take(pdMS_TO_TICKS(1000));
+    if (url == NULL)
+    {
+        ESP_LOGW(TAG, "Pool jaringan penuh, pesan telegram dibuang");
+        return;
+    }
+    char *post_data = url + TELEGRAM_URL_MAX;
+    snprintf(url, TELEGRAM_URL_MAX, "https://api.telegram.org/bot%s/sendMessage", bot_token);
+    snprintf(post_data, TELEGRAM_BODY_MAX, "chat_id=%s&text=%s", recipient_id, message);
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
-    esp_http_client_set_post_field(client, post_data, strlen(post_data));
+    // client dan sesi TLS dibuat sekali, dibuat ulang hanya setelah gagal atau token berganti
+    if (telegram_client != NULL && strcmp(telegram_client_token, bot_token) != 0)
+    {
+        esp_http_client_cleanup(telegram_client);
+        telegram_client = NULL;
+    }
+    if (telegram_client == NULL)
+    {
+        esp_http_client_config_t config = {
+            .url = url,
+            .cert_pem = telegram_root_cert,
+            .method = HTTP_METHOD_POST,
+            .keep_alive_enable = true,
+            .event_handler = telegram_http_event,
+        };
+        telegram_client = esp_http_client_init(&config);
+        if (telegram_client == NULL)
+        {
+            mem_pool_give(url);
+            return;
+        }
+        esp_http_client_set_header(telegram_client, "Content-Type", "application/x-www-form-urlencoded");
+        snprintf(telegram_client_token, sizeof(telegram_client_token), "%s", bot_token);
+    }
+    esp_http_client_set_post_field(telegram_client, post_data, strlen(post_data));
 
-    esp_err_t err = esp_http_client_perform(client);
+    TRACE_BEGIN(TRACE_EV_HTTP, TRACE_HTTP_TELEGRAM);
+    esp_err_t err = esp_http_client_perform(telegram_client);
+    TRACE_END(TRACE_EV_HTTP, err == ESP_OK ? esp_http_client_get_status_code(telegram_client) : 0);
     if (err == ESP_OK)
     {
-        ESP_LOGI(TAG, "Telegram sent! Status = %d", esp_http_client_get_status_code(client));
+        ESP_LOGI(TAG, "Telegram sent! Status = %d", esp_http_client_get_status_code(telegram_client));
     }
     else
     {
         ESP_LOGE(TAG, "Telegram send failed: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(telegram_client);
+        telegram_client = NULL;
     }
 
-    esp_http_client_cleanup(client);
+    mem_pool_give(url); // client menyalin url saat init, body hanya dipakai selama perform
 }
 
 void PMonTask(void *pz)
@@ -777,7 +1023,7 @@ void PMonTask(void *pz)
     char sampling_time[10];
     read_string_from_nvs(KEY_TIME_SAMPLING, sampling_time, sizeof(sampling_time));
 
-    char last_wh[10];
+    char last_wh[NUMBER_STR_LEN];
     read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
 
     char limit_kwh_char[10];
@@ -787,60 +1033,104 @@ void PMonTask(void *pz)
     ESP_LOGI(TAG, "Key TDL : %s, Sampling Time : %s, last KWH : %s", key_tdl, sampling_time, last_wh);
 
     float saldo_wh = atof(last_wh) * 1000; // last kwh
-    float tarif_per_kwh = atof(key_tdl);
     int pdmsDelay = atoi(sampling_time);
-    lcd_clear();
-    lcd_put_cur(0, 0);
-    lcd_send_string("Kwh:");
-    lcd_put_cur(0, 10);
-    lcd_send_string("P:");
-    lcd_put_cur(1, 15);
-    lcd_send_data(0xFF);
-
-    while (!is_reboot)
+    if (pdmsDelay <= 0)
+        pdmsDelay = 1000; // default 1 detik
+    display_set_capacity(protection_get_limit()); // skala bar beban di LCD
+    uint32_t trip_terlapor = 0; // trip proteksi yang sudah dilaporkan
+    // periode dari esp_timer periodik, tidak bergeser dan tidak dibulatkan ke tick FreeRTOS
+    ESP_ERROR_CHECK(sample_timer_start(pdmsDelay));
+    sample_tick_t tick;
+    uint32_t ticks_tertunda = 0; // periode dari sampel yang gagal dibaca
+
+    while (!meter_rebooting())
     {
+        // tidur sampai timer berbunyi, tick.ticks > 1 berarti ada periode yang terlewat
+        if (!sample_timer_wait(&tick, portMAX_DELAY))
+            continue;
+
+        // selama topup / reset berjalan task ini tidur di event group, tidak berputar
+        meter_wait_unlocked();
+
+        // CPU penuh dan tanpa light sleep sampai akhir iterasi, di antara sampel chip boleh tidur
+        pm_busy_begin(PM_BUSY_SAMPLER);
+        TRACE_SYNC(); // CCOUNT berhenti saat light sleep, jam trace disetel ulang di sini
+        TRACE_BEGIN(TRACE_EV_SAMPLE, tick.seq);
+
+        prof_loop_begin(); // waktu per fase: uart, nvs, lcd, net
+        int64_t t_phase = prof_begin();
 
         /* Begin read Last KWH */
         read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
         saldo_wh = atof(last_wh); // last kwh
         /* Last read Last KWH */
+        prof_end(PROF_NVS, t_phase);
 
         // cancel semua aktifitas
-        if (is_reboot || is_saldo_lock || is_reset_0_lock)
+        if (meter_rebooting())
             continue;
 
-        if (saldo_wh > 0)
-            is_single_message_telegram = false; // reset sekali pesan flag
+        /* Begin daily rollover, dijadwalkan oleh rollover.c */
+        if (meter_take_rollover())
+            apply_daily_rollover();
+        /* End daily rollover */
+
+        /* Begin reset Wh dari tombol, di task yang sama dengan baca-tulis KEY_CURRENT_WH_USE */
+        if (meter_take_usage_reset())
+        {
+            ESP_LOGI(TAG, "Reset Wh");
+            save_string_to_nvs(KEY_CURRENT_WH_USE, "0");
+        }
+        /* End reset Wh */
+
+        bool baru_habis = meter_set_balance(saldo_wh); // true sekali saat saldo menjadi 0
+
+        /* Begin laporan proteksi, relay sudah diputus oleh task proteksi, di sini hanya notifikasi */
+        prot_stats_t prot;
+        protection_get_stats(&prot);
+        if (prot.trips != trip_terlapor)
+        {
+            trip_terlapor = prot.trips;
+            t_phase = prof_begin();
+            display_show_message("Beban lebih!", DISPLAY_MESSAGE_MS);
+            telemetry_push_event(TLM_EV_OVERLOAD, (int32_t)prot.trip_power_w);
+            telegram_post("Beban melebihi kapasitas, listrik diputus sementara dan akan tersambung kembali otomatis.");
+            prof_end(PROF_NET, t_phase);
+        }
+        /* End laporan proteksi */
+        meter_state_t meter;
+        meter_get(&meter);
 
         // limit untuk kirim notifikasi
-        if ((saldo_wh / 1000) < limit_kwh)
+        t_phase = prof_begin();
+        if (core_balance_low(saldo_wh, limit_kwh))
         {
-            ESP_LOGI(TAG, "Limit Kwh kurang!");
+            dlog(DLOG_PMON_LIMIT);
             if (count_next_message < 1)
             {
                 char info_pulsa[100];
                 if (saldo_wh > 0)
                 {
-                    if (is_daily_limit)
+                    if (meter.daily_limit)
                     {
-                        sprintf(info_pulsa, "%s", "Anda telah melewati penggunaan batas harian. Silahkan tekan tombol hijau untuk menambah Kwh."); // save to kwh
-                        send_telegram_message(info_pulsa);
+                        telegram_post("Anda telah melewati penggunaan batas harian. Silahkan tekan tombol hijau untuk menambah Kwh.");
                     }
                     else
                     {
-                        float pembulatan_kwh = saldo_wh / 1000.0;
-                        float sisa_kwh_rounded = floorf(pembulatan_kwh * 10) / 10;
-                        sprintf(info_pulsa, "Pulsa listrik anda akan segera habis, sisa Kwh:%.1f", sisa_kwh_rounded); // save to kwh
-                        send_telegram_message(info_pulsa);
+                        float sisa_kwh_rounded = core_balance_kwh_shown(saldo_wh);
+                        fmt_buf_t msg;
+                        fmt_begin(&msg, info_pulsa, sizeof(info_pulsa));
+                        fmt_str(&msg, "Pulsa listrik anda akan segera habis, sisa Kwh:");
+                        fmt_float(&msg, sisa_kwh_rounded, 1);
+                        telegram_post(info_pulsa);
                     }
                 }
                 else
                 {
-                    if (!is_single_message_telegram)
+                    if (baru_habis)
                     {
-                        is_single_message_telegram = true;
-                        sprintf(info_pulsa, "Pulsa listrik anda telah habis"); // save to kwh
-                        send_telegram_message(info_pulsa);
+                        telemetry_push_event(TLM_EV_DEPLETED, 0);
+                        telegram_post("Pulsa listrik anda telah habis");
                     }
                 }
             }
@@ -852,222 +1142,167 @@ void PMonTask(void *pz)
                 count_next_message = 0; // reset
             }
         }
+        prof_end(PROF_NET, t_phase);
 
-        // Ambil data dari PZEM
-        PzemGetValues(&pzConf, &pzValues);
+        // Ambil data dari PZEM, jitter = keterlambatan baca terhadap waktu nominal sampel
+        t_phase = prof_begin();
+        uint32_t jitter_us = (uint32_t)(t_phase - tick.t_us);
+        prof_record(PROF_JITTER, jitter_us);
+
+        bool baca_ok = PzemGetValues(&pzConf, &pzValues);
+        prof_end(PROF_UART, t_phase);
+        if (!baca_ok)
+        {
+            // nilai sudah dinolkan, jangan diteruskan ke tagihan, LCD, NILM dan telemetry
+            ticks_tertunda += tick.ticks;
+            if (ticks_tertunda > SAMPEL_TERTUNDA_MAX)
+                ticks_tertunda = SAMPEL_TERTUNDA_MAX;
+            TRACE_END(TRACE_EV_SAMPLE, tick.seq);
+            pm_busy_end(PM_BUSY_SAMPLER);
+            continue;
+        }
+        tick.ticks += ticks_tertunda; // energi sampel ikut menutup periode yang gagal
+        ticks_tertunda = 0;
+        int64_t data_us = esp_timer_get_time(); // data sensor siap, awal waktu reaksi relay
 
         // ============ Begin Rumus yang digunakan ====================
         // Daya (W)=V×I
         // Energi Per Jam (Wh)=Daya (W)×Waktu (jam)
-        // Energy Per Detik (wh)=Energy Per Jam / 3600 detik
+        // Energi Sampel (Wh)=Daya (W)×Interval (detik) / 3600 detik
+        // Interval = periode timer × jumlah periode sejak sampel sebelumnya, jadi
+        // sampel yang terlewat tetap tertagih dan periode selain 1 detik benar
 
         float daya = pzValues.voltage * pzValues.current * pzValues.pf;
-        float energy_per_jam = daya * 1;
-        float energy_per_detik = energy_per_jam / 3600.0;
+        float energi_sampel = core_sample_energy_wh(daya, tick.ticks, tick.period_us);
 
         // ============ End Rumus yang digunakan ====================
 
-        if (is_reboot || is_saldo_lock || is_reset_0_lock)
+        if (meter_rebooting())
             continue; // barrier ke 2
 
-        if (daya <= KAPASITAS_1300VA)
+        if (daya <= protection_get_limit())
         {
+            float pemakaian_wh = 0; // yang dipotong dari saldo di akhir
 
             // Kurangi saldo
             if (saldo_wh > 0)
             {
-
-                char buffer_current_wh_use[10];
+                t_phase = prof_begin();
+                char buffer_current_wh_use[NUMBER_STR_LEN];
                 read_string_from_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use, sizeof(buffer_current_wh_use));
-                float current_wh_use = atof(buffer_current_wh_use);
-
-                // tambahkan nilai penggunaan energi disini
-                // data ini akan disimpan sebagai state penggunaan harian
-                current_wh_use = current_wh_use + energy_per_detik;
-
                 char data_daily_limit[10];
                 read_string_from_nvs(KEY_DAILY_LIMIT, data_daily_limit, sizeof(data_daily_limit));
-                float daily_limit = atof(data_daily_limit);
+                prof_end(PROF_NVS, t_phase);
 
-                print_current_time();
+                // tambahkan nilai penggunaan energi disini
+                // data ini akan disimpan sebagai state penggunaan harian
+                core_bill_t tagihan = core_bill_sample(atof(buffer_current_wh_use), atof(data_daily_limit), energi_sampel);
+                float current_wh_use = tagihan.used_today_wh;
 
-                if (current_wh_use >= daily_limit)
+                if (tagihan.daily_limit)
                 { // daily limit in Wh
-                    if (is_test_relay_on == 0)
-                        is_relay_on = false; // matikan relay
+                    t_phase = prof_begin();
+                    display_set_status(">Batas Harian!");
+                    prof_end(PROF_LCD, t_phase);
 
-                    char buffer_batas_harian[20];
-                    sprintf(buffer_batas_harian, "%s", ">Batas Harian!");
-                    lcd_put_cur(1, 0);
-                    lcd_send_string(buffer_batas_harian);
-
-                    if(!is_daily_limit){
+                    // relay mati lewat meter_relay_wanted(), kecuali mode tes
+                    if (meter_set_daily_limit(true)) {
                         // Save current Wh
-                        sprintf(buffer_current_wh_use, "%.3f", current_wh_use); // save to kwh
-                        save_string_to_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use);
+                        t_phase = prof_begin();
+                        if (fmt_float_str(buffer_current_wh_use, sizeof(buffer_current_wh_use), current_wh_use, 3) >= 0)
+                            save_string_to_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use);
+                        prof_end(PROF_NVS, t_phase);
 
-                        is_daily_limit = true;
+                        telemetry_push_event(TLM_EV_DAILY_LIMIT, (int32_t)current_wh_use);
                     }
                 }
                 else
                 {
-                    char buffer_batas_harian[20];
-
-                    if (is_relay_on == false)
-                    {
-                        lcd_put_cur(1, 0);
-                        lcd_clear_row(1);
-                        sprintf(buffer_batas_harian, "Wh:");
-                        lcd_send_string(buffer_batas_harian);
-                    }
-
-                    if (is_test_relay_on == 0)
-                        is_relay_on = true; // hidupkan relay
-
                     // simpan current Wh
-                    saldo_wh = saldo_wh - energy_per_detik;
-                    sprintf(buffer_current_wh_use, "%.3f", current_wh_use); // save to kwh
-                    save_string_to_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use);
+                    pemakaian_wh = tagihan.consume_wh;
+                    t_phase = prof_begin();
+                    if (fmt_float_str(buffer_current_wh_use, sizeof(buffer_current_wh_use), current_wh_use, 3) >= 0)
+                        save_string_to_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use);
+                    prof_end(PROF_NVS, t_phase);
+                    metrics_set_float(METRIC_DAILY_USAGE_WH, current_wh_use);
 
-                    ESP_LOGI(TAG, "Beban akumulasi : %.3f Wh", current_wh_use);
+                    dlog(DLOG_PMON_AKUMULASI, current_wh_use);
 
-                    lcd_put_cur(1, 3);
-                    sprintf(buffer_batas_harian, "%.2f", current_wh_use);
-                    lcd_send_string(buffer_batas_harian);
+                    t_phase = prof_begin();
+                    display_set_usage(current_wh_use);
+                    prof_end(PROF_LCD, t_phase);
 
-                    is_daily_limit = false;
-                    is_auto_topup = false;
+                    meter_set_daily_limit(false); // relay hidup lagi (mode auto)
                 }
             }
-            else
-                saldo_wh = 0;
 
-            // update saldo terbaru
-
-            /* Begin save last kwh */
-            char buffer_saldo_kwh[10];
-            sprintf(buffer_saldo_kwh, "%.2f", saldo_wh); // save to kwh
-            save_string_to_nvs(KEY_LAST_WH, buffer_saldo_kwh);
-            /* End save last kwh */
-
-            // Hitung sisa pulsa dalam rupiah
-            float sisa_rupiah = (saldo_wh / 1000.0) * tarif_per_kwh;
-
-            // Tampilkan info
-            ESP_LOGI(TAG, "Vrms: %.1fV - Irms: %.3fA - P: %.1fW - E: %.2fWh", pzValues.voltage, pzValues.current, pzValues.power, pzValues.energy);
-            ESP_LOGI(TAG, "Freq: %.1fHz - PF: %.2f", pzValues.frequency, pzValues.pf);
-            ESP_LOGI(TAG, "Pemakaian: %.3f Wh | Sisa Pulsa: %.1f Wh (Rp %.2f)", energy_per_detik, saldo_wh, sisa_rupiah);
-
-            if (is_reboot || is_saldo_lock || is_reset_0_lock)
+            // update saldo terbaru, topup yang masuk selama loop ini ikut terhitung
+            t_phase = prof_begin();
+            saldo_wh = saldo_consume(pemakaian_wh);
+            prof_end(PROF_NVS, t_phase);
+
+            // Deteksi alat dari lonjakan daya, waktu per sampel terbatas (nilm.h)
+            nilm_event_t ev;
+            xSemaphoreTake(nilm_mutex, portMAX_DELAY);
+            bool ada_event = nilm_feed(&nilm, daya, pzValues.pf, energi_sampel, &ev);
+            xSemaphoreGive(nilm_mutex);
+            if (ada_event)
+                dlog(DLOG_NILM_EVENT, ev.sig, ev.on, ev.dp_w, ev.dq_var);
+
+            // Sisa pulsa dalam rupiah: kredit dikurangi biaya per band (tariff.h), tanpa float
+            int64_t sisa_urp = billing_sample(time(NULL), energi_sampel, pemakaian_wh);
+
+            // Tampilkan info, hanya disalin ke ring; task dlog yang memformat dan menulis ke UART0
+            dlog(DLOG_PMON_LISTRIK, pzValues.voltage, pzValues.current, pzValues.power, pzValues.energy);
+            dlog(DLOG_PMON_FREQ, pzValues.frequency, pzValues.pf);
+            dlog(DLOG_PMON_PEMAKAIAN, energi_sampel, saldo_wh, (int32_t)(sisa_urp / 10000)); // sen
+
+            t_phase = prof_begin();
+            telemetry_push_sample(&pzValues, saldo_wh, tick.t_us);
+
+            metrics_set_float(METRIC_VOLTAGE, pzValues.voltage);
+            metrics_set_float(METRIC_CURRENT, pzValues.current);
+            metrics_set_float(METRIC_POWER, pzValues.power);
+            metrics_set_float(METRIC_ENERGY, pzValues.energy);
+            metrics_set_float(METRIC_FREQUENCY, pzValues.frequency);
+            metrics_set_float(METRIC_PF, pzValues.pf);
+            metrics_set_float(METRIC_BALANCE_WH, saldo_wh);
+            meter_get(&meter);
+            metrics_set(METRIC_DAILY_LIMIT, meter.daily_limit);
+            prof_end(PROF_NET, t_phase);
+
+            if (meter_rebooting())
                 continue; // barrier ke 3
 
             /* Begin info KWH */
-            float pembulatan_kwh = saldo_wh / 1000.0;
-            float sisa_kwh_rounded = floorf(pembulatan_kwh * 10) / 10;
-            char buffer_saldo_wh[10];
-            lcd_put_cur(0, 4);
-            sprintf(buffer_saldo_wh, "%.1f", sisa_kwh_rounded); // wh jadi kwh jadi di bagi 1000
-
-            lcd_send_string(buffer_saldo_wh);
-
-            lcd_put_cur(0, 12);
-            sprintf(buffer_saldo_wh, "%.2f", daya);
-            lcd_send_string(buffer_saldo_wh);
-
-            // cek apakah ada tegangan ?
-            if (pzValues.voltage > 100)
-            {
-                if (!is_beep)
-                {
-                    is_beep = true;
-                    lcd_put_cur(1, 15);
-                    lcd_send_string(" ");
-                }
-                else
-                {
-                    is_beep = false;
-                    uint8_t love_icon[8] = {
-                        0b00000,
-                        0b01010,
-                        0b11111,
-                        0b11111,
-                        0b11111,
-                        0b01110,
-                        0b00100,
-                        0b00000};
-
-                    lcd_send_cmd(0x40); // CGRAM address for slot 0
-                    for (int i = 0; i < 8; i++)
-                    {
-                        lcd_send_data(love_icon[i]);
-                    }
-
-                    lcd_put_cur(1, 15); // Baris 1 (indeks 0), kolom paling kanan (indeks 15)
-                    lcd_send_data(0);   // Tampilkan karakter CGRAM slot 0
-                }
-            }
+            float sisa_kwh_rounded = core_balance_kwh_shown(saldo_wh);
+            t_phase = prof_begin();
+            display_set_balance(sisa_kwh_rounded); // wh jadi kwh jadi di bagi 1000
+            display_set_power(daya);
+
+            // cek apakah ada tegangan ? ikon hati berkedip selama ada tegangan
+            display_set_mains(pzValues.voltage > 100);
+            prof_end(PROF_LCD, t_phase);
             /* End info KWH */
 
-            // Kontrol relay
-            if (saldo_wh > 0)
-            {
-                /* Begin Relay ON */
-                if (is_test_relay_on == 1)
-                {
-                    gpio_set_level(GPIO_NUM_33, 1);
-                }
-                else if (is_test_relay_on == 2)
-                {
-                    gpio_set_level(GPIO_NUM_33, 0);
-                }
-                else
-                {
-                    if (is_relay_on)
-                    {
-                        gpio_set_level(GPIO_NUM_33, 1);
-                    }
-                    else
-                    {
-                        gpio_set_level(GPIO_NUM_33, 0);
-                    }
-                }
-                /* End Relay ON */
-            }
-            else
-            {
-                /* Begin Relay OFF */
-                if (is_test_relay_on == 1)
-                {
-                    gpio_set_level(GPIO_NUM_33, 1);
-                }
-                else if (is_test_relay_on == 2)
-                {
-                    gpio_set_level(GPIO_NUM_33, 0);
-                }
-                else
-                {
-                    if (is_relay_on)
-                    {
-                        gpio_set_level(GPIO_NUM_33, 1);
-                    }
-                    else
-                    {
-                        gpio_set_level(GPIO_NUM_33, 0);
-                    }
-                }
-                /* End Relay OFF */
-            }
+            // Kontrol relay: mode tes (<11>/<12>) atau otomatis dari saldo dan batas harian
+            relay_apply();
 
-            // ESP_LOGI(TAG, "Stack High Water Mark: %ld Bytes free",
-            //          (unsigned long int)uxTaskGetStackHighWaterMark(NULL));
+            uint32_t react_us = (uint32_t)(esp_timer_get_time() - data_us);
+            prof_record(PROF_REACT, react_us);
+            metrics_observe_timing(jitter_us, react_us);
         }
         else
         {
-            ESP_LOGE(TAG, "Tegangan over / gangguan signal");
+            // relay diputus oleh task proteksi (protection.c), event dikirim di laporan proteksi
+            ESP_LOGE(TAG, "Beban melebihi kapasitas / gangguan signal");
         }
 
-        vTaskDelay(pdMS_TO_TICKS(pdmsDelay));
+        metrics_observe_loop(prof_loop_end());
+        TRACE_END(TRACE_EV_SAMPLE, tick.seq);
+        pm_busy_end(PM_BUSY_SAMPLER);
     }
+    pm_busy_end(PM_BUSY_SAMPLER); // keluar lewat barrier reboot di tengah iterasi
 
     vTaskDelete(NULL);
 }
@@ -1090,55 +1325,112 @@ void wait_for_time_sync() {
     ESP_LOGI("TIME", "Waktu tersinkronisasi: %s", asctime(&timeinfo));
 }
 
-int test_1 = 0;
-void print_current_time() {
-    // Set timezone ke WIB (UTC+7)
-    setenv("TZ", "WIB-7", 1);
-    tzset();
+/* Begin Saldo */
+static float saldo_load(void)
+{
+    char last_wh[NUMBER_STR_LEN];
+    read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
+    return atof(last_wh);
+}
 
-    time_t now;
-    struct tm timeinfo;
+static bool saldo_store(float wh)
+{
+    char buffer_saldo_wh[NUMBER_STR_LEN];
+    if (fmt_float_str(buffer_saldo_wh, sizeof(buffer_saldo_wh), wh, 2) < 0)
+    {
+        ESP_LOGE(TAG, "Saldo di luar jangkauan, tidak disimpan");
+        return false;
+    }
+    save_string_to_nvs(KEY_LAST_WH, buffer_saldo_wh);
+    return true;
+}
 
-    time(&now); // ambil waktu sekarang (epoch)
-    localtime_r(&now, &timeinfo); // konversi ke format lokal (struct tm)
+/* Potong pemakaian dari saldo, tidak kurang dari 0. Mengembalikan saldo terbaru */
+float saldo_consume(float wh)
+{
+    xSemaphoreTake(saldo_mutex, portMAX_DELAY);
+    float saldo = saldo_load();
+    float sisa = core_balance_after(saldo, wh);
+    if (sisa != saldo && !saldo_store(sisa))
+        sisa = saldo;
+    xSemaphoreGive(saldo_mutex);
+    return sisa;
+}
 
-    // Format waktu ke string
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
-    ESP_LOGI("TIME", "Waktu sekarang: %s WIB", time_str);
+bool saldo_add(float wh)
+{
+    xSemaphoreTake(saldo_mutex, portMAX_DELAY);
+    bool ok = saldo_store(saldo_load() + wh);
+    if (ok)
+        billing_credit_add(wh);
+    xSemaphoreGive(saldo_mutex);
+    return ok;
+}
 
-    char hour_data[10];
-    read_string_from_nvs(KEY_HOUR, hour_data, sizeof(hour_data));
-    int hour_data_int = atoi(hour_data);
+void saldo_reset(void)
+{
+    xSemaphoreTake(saldo_mutex, portMAX_DELAY);
+    saldo_store(0);
+    billing_credit_set(0);
+    xSemaphoreGive(saldo_mutex);
+}
+/* End Saldo */
 
-    char minute_data[10];
-    read_string_from_nvs(KEY_MINUTE, minute_data, sizeof(minute_data));
-    int minute_data_int = atoi(minute_data);
+/* Dipanggil dari task esp_timer, pekerjaan NVS dilakukan oleh PMonTask */
+void daily_rollover(time_t boundary, uint32_t crossed)
+{
+    ESP_LOGW("TIME", "Sudah melewati jam & menit yang telah ditetapkan.");
+    meter_request_rollover();
+}
 
-    // Deteksi jam 12 malam (00:00)
-    if (timeinfo.tm_hour == hour_data_int && timeinfo.tm_min == minute_data_int) {
-        ESP_LOGW("TIME", "Sudah melewati jam & menit yang telah ditetapkan.");
+void apply_daily_rollover()
+{
+    billing_day_reset(); // energi dan biaya per band hari ini mulai dari 0, bulan ini disimpan
+    nilm_send_daily(); // energi per alat lewat telegram, lalu hari ini mulai dari 0
 
-        char data_daily_limit[10];
-        read_string_from_nvs(KEY_DAILY_LIMIT, data_daily_limit, sizeof(data_daily_limit));
-        float daily_limit = atof(data_daily_limit);
+    char data_daily_limit[10];
+    read_string_from_nvs(KEY_DAILY_LIMIT, data_daily_limit, sizeof(data_daily_limit));
+    float daily_limit = atof(data_daily_limit);
 
-        char last_wh[10];
-        read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
-        float saldo_wh = atof(last_wh); // masih bentuk Wh, jika diubah Kwh harus dibagi 1000
-
-        char buffer_current_wh_use[10];
-        read_string_from_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use, sizeof(buffer_current_wh_use));
-        float current_wh_use = atof(buffer_current_wh_use);
-
-        if(saldo_wh > daily_limit && !is_auto_topup){
-            is_auto_topup = true;
-            ESP_LOGI(TAG, "Penambahan Kwh / Auto topup.");
-            current_wh_use = current_wh_use - daily_limit; // mengurangi jumlah kwh pemakaian
-            sprintf(buffer_current_wh_use, "%.3f", current_wh_use); // save to kwh
-            //save_string_to_nvs(KEY_CURRENT_WH_USE, buffer_current_wh_use);
-            save_string_to_nvs(KEY_CURRENT_WH_USE, "0");
-            vTaskDelay(pdMS_TO_TICKS(50)); // delay 500ms
-        }
+    char last_wh[NUMBER_STR_LEN];
+    read_string_from_nvs(KEY_LAST_WH, last_wh, sizeof(last_wh));
+    float saldo_wh = atof(last_wh); // masih bentuk Wh, jika diubah Kwh harus dibagi 1000
+
+    if (saldo_wh > daily_limit)
+    {
+        ESP_LOGI(TAG, "Penambahan Kwh / Auto topup.");
+        save_string_to_nvs(KEY_CURRENT_WH_USE, "0");
+    }
+}
+
+/* Laporan harian per alat, dari apply_daily_rollover di PMonTask */
+static void nilm_send_daily(void)
+{
+    uint8_t urutan[NILM_REPORT_TOP];
+    char msg[TELEGRAM_MSG_MAX];
+    fmt_buf_t b;
+
+    xSemaphoreTake(nilm_mutex, portMAX_DELAY);
+    int n = nilm_top_today(&nilm, urutan, NILM_REPORT_TOP);
+    fmt_begin(&b, msg, sizeof(msg));
+    fmt_str(&b, "Pemakaian per alat hari ini:");
+    for (int i = 0; i < n; i++)
+    {
+        const nilm_sig_t *sig = &nilm.sig[urutan[i]];
+        fmt_str(&b, i == 0 ? " #" : ", #");
+        fmt_fixed(&b, urutan[i], 0);
+        fmt_str(&b, " (");
+        fmt_float(&b, sig->p_w, 0);
+        fmt_str(&b, " W) ");
+        fmt_fixed(&b, (int32_t)(sig->today_uwh / 10000000), 2);
+        fmt_str(&b, " kWh");
     }
+    fmt_str(&b, n > 0 ? ", lainnya " : " lainnya ");
+    fmt_fixed(&b, (int32_t)(nilm.other_today_uwh / 10000000), 2);
+    fmt_str(&b, " kWh");
+    nilm_day_reset(&nilm);
+    xSemaphoreGive(nilm_mutex);
+
+    fmt_end(&b); // terpotong bila lebih panjang dari satu pesan
+    telegram_post(msg);
 }
@@ -0,0 +1,352 @@
+#include "metrics.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "pzem004tv3.h"
+#include "i2c-lcd.h"
+#include "fmt_fixed.h"
+#include "console.h"
+#include "wifi_sta.h"
+#include "sample_timer.h"
+#include "pm_mode.h"
+#include "task_config.h"
+#include "mem_budget.h"
+#include "protection.h"
+#include "dlog.h"
+
+static const char *TAG = "METRICS";
+
+/* Series sampled by the scrape handler itself */
+enum {
+    MX_BUS_TRANSACTIONS = METRIC_PRODUCER_COUNT,
+    MX_BUS_TIMEOUTS,
+    MX_BUS_CRC_ERRORS,
+    MX_SAMPLE_TICKS,
+    MX_SAMPLE_OVERRUNS,
+    MX_SAMPLE_LATE_MAX_US,
+    MX_PM_BUSY_DS,
+    MX_PROT_TRIPPED,
+    MX_PROT_TRIPS,
+    MX_PROT_POLL_ERRORS,
+    MX_PROT_LATENCY_LAST_US,
+    MX_PROT_LATENCY_MAX_US,
+    MX_DLOG_DROPPED,
+    MX_HEAP_FREE,
+    MX_HEAP_MIN_FREE,
+    MX_STACK_FIRST,
+    MX_STACK_LAST = MX_STACK_FIRST + 10,
+    MX_WIFI_ATTEMPTS,
+    MX_WIFI_DISCONNECTS,
+    MX_WIFI_ONLINE_LAST_MS,
+    MX_WIFI_ONLINE_MAX_MS,
+    MX_LCD_TRANSACTIONS,
+    MX_LCD_BYTES,
+    MX_LCD_BUSY_MS,
+    MX_LCD_CELLS,
+    MX_LCD_GLYPH_LOADS,
+    MX_CONSOLE_FRAMES,
+    MX_CONSOLE_REJECTED,
+    MX_CONSOLE_DISPATCH_LAST_US,
+    MX_CONSOLE_DISPATCH_MAX_US,
+    MX_CONSOLE_EXEC_LAST_US,
+    MX_CONSOLE_EXEC_MAX_US,
+    MX_SCRAPES,
+    MX_COUNT
+};
+
+typedef struct {
+    const char *type_line;  /* NULL when a previous series already declared it */
+    const char *series;
+    uint8_t decimals;
+    bool is_unsigned;
+} mx_def_t;
+
+static const mx_def_t _defs[ MX_COUNT ] = {
+    [ METRIC_VOLTAGE ]        = { "# TYPE pzem_voltage_volts gauge\n", "pzem_voltage_volts", 1, false },
+    [ METRIC_CURRENT ]        = { "# TYPE pzem_current_amperes gauge\n", "pzem_current_amperes", 3, false },
+    [ METRIC_POWER ]          = { "# TYPE pzem_power_watts gauge\n", "pzem_power_watts", 1, false },
+    [ METRIC_ENERGY ]         = { "# TYPE pzem_energy_kwh counter\n", "pzem_energy_kwh", 3, false },
+    [ METRIC_FREQUENCY ]      = { "# TYPE pzem_frequency_hertz gauge\n", "pzem_frequency_hertz", 1, false },
+    [ METRIC_PF ]             = { "# TYPE pzem_power_factor gauge\n", "pzem_power_factor", 2, false },
+    [ METRIC_BALANCE_WH ]     = { "# TYPE meter_balance_wh gauge\n", "meter_balance_wh", 1, false },
+    [ METRIC_DAILY_USAGE_WH ] = { "# TYPE meter_daily_usage_wh gauge\n", "meter_daily_usage_wh", 3, false },
+    [ METRIC_RELAY_ON ]       = { "# TYPE meter_relay_on gauge\n", "meter_relay_on", 0, false },
+    [ METRIC_DAILY_LIMIT ]    = { "# TYPE meter_daily_limit_reached gauge\n", "meter_daily_limit_reached", 0, false },
+    [ METRIC_LOOP_LAST_US ]   = { "# TYPE pmon_loop_microseconds gauge\n", "pmon_loop_microseconds{stat=\"last\"}", 0, true },
+    [ METRIC_LOOP_MAX_US ]    = { NULL, "pmon_loop_microseconds{stat=\"max\"}", 0, true },
+    [ METRIC_JITTER_LAST_US ] = { "# TYPE pmon_period_jitter_microseconds gauge\n", "pmon_period_jitter_microseconds{stat=\"last\"}", 0, true },
+    [ METRIC_JITTER_MAX_US ]  = { NULL, "pmon_period_jitter_microseconds{stat=\"max\"}", 0, true },
+    [ METRIC_REACT_LAST_US ]  = { "# TYPE pmon_read_to_relay_microseconds gauge\n", "pmon_read_to_relay_microseconds{stat=\"last\"}", 0, true },
+    [ METRIC_REACT_MAX_US ]   = { NULL, "pmon_read_to_relay_microseconds{stat=\"max\"}", 0, true },
+    [ MX_BUS_TRANSACTIONS ]   = { "# TYPE pzem_bus_transactions_total counter\n", "pzem_bus_transactions_total", 0, true },
+    [ MX_BUS_TIMEOUTS ]       = { "# TYPE pzem_bus_errors_total counter\n", "pzem_bus_errors_total{kind=\"timeout\"}", 0, true },
+    [ MX_BUS_CRC_ERRORS ]     = { NULL, "pzem_bus_errors_total{kind=\"crc\"}", 0, true },
+    [ MX_SAMPLE_TICKS ]       = { "# TYPE pmon_sample_periods_total counter\n", "pmon_sample_periods_total", 0, true },
+    [ MX_SAMPLE_OVERRUNS ]    = { "# TYPE pmon_sample_overruns_total counter\n", "pmon_sample_overruns_total", 0, true },
+    [ MX_SAMPLE_LATE_MAX_US ] = { "# TYPE pmon_sample_late_max_microseconds gauge\n", "pmon_sample_late_max_microseconds", 0, true },
+    [ MX_PM_BUSY_DS ]         = { "# TYPE pm_busy_seconds_total counter\n", "pm_busy_seconds_total", 1, true },
+    [ MX_PROT_TRIPPED ]       = { "# TYPE protect_tripped gauge\n", "protect_tripped", 0, true },
+    [ MX_PROT_TRIPS ]         = { "# TYPE protect_trips_total counter\n", "protect_trips_total", 0, true },
+    [ MX_PROT_POLL_ERRORS ]   = { "# TYPE protect_poll_errors_total counter\n", "protect_poll_errors_total", 0, true },
+    [ MX_PROT_LATENCY_LAST_US ] = { "# TYPE protect_poll_to_relay_microseconds gauge\n", "protect_poll_to_relay_microseconds{stat=\"last\"}", 0, true },
+    [ MX_PROT_LATENCY_MAX_US ] = { NULL, "protect_poll_to_relay_microseconds{stat=\"max\"}", 0, true },
+    [ MX_DLOG_DROPPED ]       = { "# TYPE log_records_dropped_total counter\n", "log_records_dropped_total", 0, true },
+    [ MX_HEAP_FREE ]          = { "# TYPE heap_free_bytes gauge\n", "heap_free_bytes", 0, true },
+    [ MX_HEAP_MIN_FREE ]      = { "# TYPE heap_min_free_bytes gauge\n", "heap_min_free_bytes", 0, true },
+    [ MX_STACK_FIRST + 0 ]    = { "# TYPE task_stack_free_min_bytes gauge\n", "task_stack_free_min_bytes{task=\"console\"}", 0, true },
+    [ MX_STACK_FIRST + 1 ]    = { NULL, "task_stack_free_min_bytes{task=\"PowerMon\"}", 0, true },
+    [ MX_STACK_FIRST + 2 ]    = { NULL, "task_stack_free_min_bytes{task=\"esp_timer\"}", 0, true },
+    [ MX_STACK_FIRST + 3 ]    = { NULL, "task_stack_free_min_bytes{task=\"modbus_tcp\"}", 0, true },
+    [ MX_STACK_FIRST + 4 ]    = { NULL, "task_stack_free_min_bytes{task=\"telemetry\"}", 0, true },
+    [ MX_STACK_FIRST + 5 ]    = { NULL, "task_stack_free_min_bytes{task=\"httpd\"}", 0, true },
+    [ MX_STACK_FIRST + 6 ]    = { NULL, "task_stack_free_min_bytes{task=\"display\"}", 0, true },
+    [ MX_STACK_FIRST + 7 ]    = { NULL, "task_stack_free_min_bytes{task=\"console_worker\"}", 0, true },
+    [ MX_STACK_FIRST + 8 ]    = { NULL, "task_stack_free_min_bytes{task=\"telegram\"}", 0, true },
+    [ MX_STACK_FIRST + 9 ]    = { NULL, "task_stack_free_min_bytes{task=\"protect\"}", 0, true },
+    [ MX_STACK_FIRST + 10 ]   = { NULL, "task_stack_free_min_bytes{task=\"dlog\"}", 0, true },
+    [ MX_WIFI_ATTEMPTS ]      = { "# TYPE wifi_connect_attempts_total counter\n", "wifi_connect_attempts_total", 0, true },
+    [ MX_WIFI_DISCONNECTS ]   = { "# TYPE wifi_disconnects_total counter\n", "wifi_disconnects_total", 0, true },
+    [ MX_WIFI_ONLINE_LAST_MS ] = { "# TYPE wifi_time_to_online_milliseconds gauge\n", "wifi_time_to_online_milliseconds{stat=\"last\"}", 0, true },
+    [ MX_WIFI_ONLINE_MAX_MS ] = { NULL, "wifi_time_to_online_milliseconds{stat=\"max\"}", 0, true },
+    [ MX_LCD_TRANSACTIONS ]   = { "# TYPE lcd_i2c_transactions_total counter\n", "lcd_i2c_transactions_total", 0, true },
+    [ MX_LCD_BYTES ]          = { "# TYPE lcd_i2c_bytes_total counter\n", "lcd_i2c_bytes_total", 0, true },
+    [ MX_LCD_BUSY_MS ]        = { "# TYPE lcd_i2c_busy_seconds_total counter\n", "lcd_i2c_busy_seconds_total", 3, true },
+    [ MX_LCD_CELLS ]          = { "# TYPE lcd_cells_written_total counter\n", "lcd_cells_written_total", 0, true },
+    [ MX_LCD_GLYPH_LOADS ]    = { "# TYPE lcd_glyph_loads_total counter\n", "lcd_glyph_loads_total", 0, true },
+    [ MX_CONSOLE_FRAMES ]     = { "# TYPE console_frames_total counter\n", "console_frames_total", 0, true },
+    [ MX_CONSOLE_REJECTED ]   = { "# TYPE console_rejected_total counter\n", "console_rejected_total", 0, true },
+    [ MX_CONSOLE_DISPATCH_LAST_US ] = { "# TYPE console_dispatch_microseconds gauge\n", "console_dispatch_microseconds{stat=\"last\"}", 0, true },
+    [ MX_CONSOLE_DISPATCH_MAX_US ]  = { NULL, "console_dispatch_microseconds{stat=\"max\"}", 0, true },
+    [ MX_CONSOLE_EXEC_LAST_US ] = { "# TYPE console_exec_microseconds gauge\n", "console_exec_microseconds{stat=\"last\"}", 0, true },
+    [ MX_CONSOLE_EXEC_MAX_US ]  = { NULL, "console_exec_microseconds{stat=\"max\"}", 0, true },
+    [ MX_SCRAPES ]            = { "# TYPE metrics_scrapes_total counter\n", "metrics_scrapes_total", 0, true },
+};
+
+static const char *const _stackTasks[] = {
+    "console", "PowerMon", "esp_timer", "modbus_tcp", "telemetry", "httpd", "display", "console_worker", "telegram",
+    "protect", "dlog",
+};
+
+/* Producers store scaled integers, a 32 bit store is atomic so no lock is needed */
+static volatile int32_t _values[ MX_COUNT ] = {0};
+
+/* Only the httpd task touches the text and the rendered copy */
+static char _text[ METRICS_BUF_SIZE ];
+static size_t _textLen = 0;
+static uint16_t _slot[ MX_COUNT ];
+static int32_t _rendered[ MX_COUNT ];
+static TaskHandle_t _stackHandles[ MX_STACK_LAST - MX_STACK_FIRST + 1 ] = {0};
+
+/**
+ * @brief Write a fixed point value right aligned into its slot
+ * @param slot      METRICS_VALUE_WIDTH characters
+ * @param v
+ * @param def
+ */
+static void mx_render_value( char *slot, int32_t v, const mx_def_t *def )
+{
+    if ( def->is_unsigned ) {
+        fmt_ufixed_field( slot, METRICS_VALUE_WIDTH, ( uint32_t ) v, def->decimals );
+    } else {
+        fmt_fixed_field( slot, METRICS_VALUE_WIDTH, v, def->decimals );
+    }
+}
+
+/**
+ * @brief Lay out every series once, values are patched into their slots later
+ */
+static void mx_build_text( void )
+{
+    size_t pos = 0;
+
+    for ( int id = 0; id < MX_COUNT; id++ ) {
+        const mx_def_t *def = &_defs[ id ];
+        size_t need = ( def->type_line ? strlen( def->type_line ) : 0 ) + strlen( def->series ) + 1 + METRICS_VALUE_WIDTH + 1;
+
+        if ( pos + need > sizeof( _text ) ) {
+            ESP_LOGE( TAG, "METRICS_BUF_SIZE too small" );
+            break;
+        }
+
+        if ( def->type_line ) {
+            memcpy( &_text[ pos ], def->type_line, strlen( def->type_line ) );
+            pos += strlen( def->type_line );
+        }
+        memcpy( &_text[ pos ], def->series, strlen( def->series ) );
+        pos += strlen( def->series );
+        _text[ pos++ ] = ' ';
+
+        _slot[ id ] = pos;
+        _rendered[ id ] = _values[ id ];
+        mx_render_value( &_text[ pos ], _rendered[ id ], def );
+        pos += METRICS_VALUE_WIDTH;
+        _text[ pos++ ] = '\n';
+    }
+
+    _textLen = pos;
+}
+
+/**
+ * @brief Refresh the values owned by the handler
+ */
+static void mx_sample_system( void )
+{
+    pzem_bus_stats_t bus;
+    wifi_sta_stats_t wifi;
+    lcd_stats_t lcd;
+    console_stats_t con;
+    sample_timer_stats_t smp;
+    pm_stats_t pm;
+    prot_stats_t prot;
+    dlog_stats_t dlg;
+
+    PzemGetBusStats( &bus );
+    sample_timer_get_stats( &smp );
+    pm_get_stats( &pm );
+    protection_get_stats( &prot );
+    dlog_get_stats( &dlg );
+    lcd_get_stats( &lcd );
+    console_get_stats( &con );
+    wifi_sta_get_stats( &wifi );
+    _values[ MX_WIFI_ATTEMPTS ] = wifi.connect_attempts;
+    _values[ MX_WIFI_DISCONNECTS ] = wifi.disconnects;
+    _values[ MX_WIFI_ONLINE_LAST_MS ] = wifi.last_online_ms;
+    _values[ MX_WIFI_ONLINE_MAX_MS ] = wifi.max_online_ms;
+    _values[ MX_BUS_TRANSACTIONS ] = bus.transactions;
+    _values[ MX_BUS_TIMEOUTS ] = bus.timeouts;
+    _values[ MX_BUS_CRC_ERRORS ] = bus.crc_errors;
+    _values[ MX_SAMPLE_TICKS ] = smp.ticks;
+    _values[ MX_SAMPLE_OVERRUNS ] = smp.overruns;
+    _values[ MX_SAMPLE_LATE_MAX_US ] = smp.late_max_us;
+    /* The 64 bit totals go out coarse enough for 32 bits: 0.1 s lasts 13 years, 1 ms 49 days on the bus */
+    _values[ MX_PM_BUSY_DS ] = ( uint32_t ) ( pm.busy_us / 100000 );   /* full speed, no sleep */
+    _values[ MX_PROT_TRIPPED ] = ( prot.state == PROT_TRIPPED );
+    _values[ MX_PROT_TRIPS ] = prot.trips;
+    _values[ MX_PROT_POLL_ERRORS ] = prot.poll_errors;
+    _values[ MX_PROT_LATENCY_LAST_US ] = prot.latency_last_us;
+    _values[ MX_PROT_LATENCY_MAX_US ] = prot.latency_max_us;
+    _values[ MX_DLOG_DROPPED ] = dlg.dropped;
+    _values[ MX_LCD_TRANSACTIONS ] = lcd.transactions;
+    _values[ MX_LCD_BYTES ] = lcd.bytes;
+    _values[ MX_LCD_BUSY_MS ] = ( uint32_t ) ( lcd.bus_time_us / 1000 );
+    _values[ MX_LCD_CELLS ] = lcd.cells_written;
+    _values[ MX_LCD_GLYPH_LOADS ] = lcd.glyph_loads;
+    _values[ MX_CONSOLE_FRAMES ] = con.frames;
+    _values[ MX_CONSOLE_REJECTED ] = con.rejected + con.unknown + con.overflows + con.busy;
+    _values[ MX_CONSOLE_DISPATCH_LAST_US ] = con.last_dispatch_us;
+    _values[ MX_CONSOLE_DISPATCH_MAX_US ] = con.max_dispatch_us;
+    _values[ MX_CONSOLE_EXEC_LAST_US ] = con.last_exec_us;
+    _values[ MX_CONSOLE_EXEC_MAX_US ] = con.max_exec_us;
+    _values[ MX_HEAP_FREE ] = esp_get_free_heap_size();
+    _values[ MX_HEAP_MIN_FREE ] = esp_get_minimum_free_heap_size();
+    _values[ MX_SCRAPES ]++;
+
+    for ( int i = 0; i <= MX_STACK_LAST - MX_STACK_FIRST; i++ ) {
+        if ( _stackHandles[ i ] == NULL ) {
+            _stackHandles[ i ] = xTaskGetHandle( _stackTasks[ i ] );
+        }
+        if ( _stackHandles[ i ] != NULL ) {
+            _values[ MX_STACK_FIRST + i ] = uxTaskGetStackHighWaterMark( _stackHandles[ i ] );
+        }
+    }
+}
+
+static esp_err_t metrics_get_handler( httpd_req_t *req )
+{
+    mx_sample_system();
+
+    /* Only slots whose value moved since the last scrape are rewritten */
+    for ( int id = 0; id < MX_COUNT; id++ ) {
+        int32_t v = _values[ id ];
+        if ( v != _rendered[ id ] ) {
+            _rendered[ id ] = v;
+            mx_render_value( &_text[ _slot[ id ] ], v, &_defs[ id ] );
+        }
+    }
+
+    httpd_resp_set_type( req, "text/plain; version=0.0.4" );
+    return httpd_resp_send( req, _text, _textLen );
+}
+
+/**
+ * @brief Store a value already scaled by the series' decimals
+ * @param id
+ * @param scaled
+ */
+void metrics_set( metric_id_t id, int32_t scaled )
+{
+    _values[ id ] = scaled;
+}
+
+void metrics_set_float( metric_id_t id, float value )
+{
+    int32_t scaled;
+
+    if ( fmt_float_to_fixed( value, _defs[ id ].decimals, &scaled ) ) {
+        _values[ id ] = scaled;
+    }
+}
+
+/**
+ * @brief Record the duration of one PMonTask iteration
+ * @param us
+ */
+void metrics_observe_loop( uint32_t us )
+{
+    _values[ METRIC_LOOP_LAST_US ] = us;
+    if ( us > ( uint32_t ) _values[ METRIC_LOOP_MAX_US ] ) {
+        _values[ METRIC_LOOP_MAX_US ] = us;
+    }
+}
+
+/**
+ * @brief Sampling period jitter and the delay from sensor read to relay output
+ */
+void metrics_observe_timing( uint32_t jitter_us, uint32_t react_us )
+{
+    _values[ METRIC_JITTER_LAST_US ] = jitter_us;
+    if ( jitter_us > ( uint32_t ) _values[ METRIC_JITTER_MAX_US ] ) {
+        _values[ METRIC_JITTER_MAX_US ] = jitter_us;
+    }
+    _values[ METRIC_REACT_LAST_US ] = react_us;
+    if ( react_us > ( uint32_t ) _values[ METRIC_REACT_MAX_US ] ) {
+        _values[ METRIC_REACT_MAX_US ] = react_us;
+    }
+}
+
+/**
+ * @brief Build the exposition text and serve it on http://<ip>/metrics
+ */
+void metrics_init( void )
+{
+    httpd_handle_t server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+
+    mx_build_text();
+    MEM_STATIC( MEM_SUB_METRICS, _text );
+
+    /* Off the sampler core, a scrape never delays a sample */
+    config.server_port = METRICS_PORT;
+    config.task_priority = TASK_HTTPD_PRIO;
+    config.stack_size = TASK_HTTPD_STACK;
+    config.core_id = TASK_HTTPD_CORE;
+    config.lru_purge_enable = true;
+
+    if ( httpd_start( &server, &config ) != ESP_OK ) {
+        ESP_LOGE( TAG, "Unable to start HTTP server" );
+        return;
+    }
+
+    httpd_uri_t uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_get_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler( server, &uri );
+
+    ESP_LOGI( TAG, "Serving /metrics on port %d, %u bytes", METRICS_PORT, ( unsigned ) _textLen );
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_PORT           80
+#define METRICS_BUF_SIZE       4608
+#define METRICS_VALUE_WIDTH    14     /* fixed slot, values are right aligned */
+
+/* Values written by producers, the remaining series are sampled at scrape time */
+typedef enum {
+    METRIC_VOLTAGE = 0,
+    METRIC_CURRENT,
+    METRIC_POWER,
+    METRIC_ENERGY,
+    METRIC_FREQUENCY,
+    METRIC_PF,
+    METRIC_BALANCE_WH,
+    METRIC_DAILY_USAGE_WH,
+    METRIC_RELAY_ON,
+    METRIC_DAILY_LIMIT,
+    METRIC_LOOP_LAST_US,
+    METRIC_LOOP_MAX_US,
+    METRIC_JITTER_LAST_US,
+    METRIC_JITTER_MAX_US,
+    METRIC_REACT_LAST_US,
+    METRIC_REACT_MAX_US,
+    METRIC_PRODUCER_COUNT
+} metric_id_t;
+
+void metrics_init( void );
+void metrics_set( metric_id_t id, int32_t scaled );
+void metrics_set_float( metric_id_t id, float value );
+void metrics_observe_loop( uint32_t us );
+void metrics_observe_timing( uint32_t jitter_us, uint32_t react_us );
+
+#ifdef __cplusplus
+}
+#endif
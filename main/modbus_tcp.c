@@ -0,0 +1,292 @@
+#include "modbus_tcp.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "mem_budget.h"
+
+#define MB_MBAP_LEN           7
+#define MB_MAX_PDU            253
+#define MB_FRAME_MAX          ( MB_MBAP_LEN + MB_MAX_PDU )
+
+#define MB_FC_READ_HOLDING    0x03
+#define MB_FC_READ_INPUT      0x04
+#define MB_FC_WRITE_SINGLE    0x06
+
+#define MB_EX_ILLEGAL_FUNC    0x01
+#define MB_EX_ILLEGAL_ADDR    0x02
+#define MB_EX_ILLEGAL_VALUE   0x03
+#define MB_EX_GW_NO_RESPONSE  0x0B
+
+#define MB_HOLDING_FIRST      WREG_ALARM_THR
+#define MB_HOLDING_COUNT      2
+
+static const char *TAG = "MB_TCP";
+
+typedef struct {
+    int sock;
+    uint16_t len;
+    uint8_t rx[ MB_FRAME_MAX ];
+} mb_client_t;
+
+static pzem_setup_t *_pz = NULL;
+static mb_client_t _clients[ MB_MAX_CLIENTS ];
+static mb_tcp_stats_t _stats = {0};
+
+static uint16_t _holding[ MB_HOLDING_COUNT ] = {0};
+static int64_t _holdingTime = -1;
+
+/**
+ * @brief Holding block, re-read from the sensor only when stale
+ * @return bool
+ */
+static bool mb_holding_refresh( void )
+{
+    int64_t now = esp_timer_get_time();
+
+    if ( ( _holdingTime >= 0 ) && ( ( now - _holdingTime ) <= ( ( int64_t ) MB_HOLDING_MAX_AGE_MS * 1000 ) ) ) {
+        return true;
+    }
+
+    _stats.holding_reads++;
+    if ( !PzemReadRegisters( _pz, CMD_RHR, MB_HOLDING_FIRST, MB_HOLDING_COUNT, _holding ) ) {
+        return false;
+    }
+
+    _holdingTime = esp_timer_get_time();
+    return true;
+}
+
+static uint16_t mb_exception( uint8_t *pdu, uint8_t code )
+{
+    _stats.exceptions++;
+    pdu[ 0 ] |= 0x80;
+    pdu[ 1 ] = code;
+    return 2;
+}
+
+static uint16_t mb_put_regs( uint8_t *pdu, const uint16_t *regs, uint16_t count )
+{
+    pdu[ 1 ] = 2 * count;
+    for ( uint16_t i = 0; i < count; i++ ) {
+        pdu[ 2 + ( 2 * i ) ] = regs[ i ] >> 8;
+        pdu[ 3 + ( 2 * i ) ] = regs[ i ] & 0xFF;
+    }
+    return 2 + ( 2 * count );
+}
+
+/**
+ * @brief Execute one request PDU in place
+ * @param pdu   request, overwritten with the response
+ * @param len   request PDU length
+ * @return response PDU length
+ */
+static uint16_t mb_handle_pdu( uint8_t *pdu, uint16_t len )
+{
+    if ( len < 5 ) {
+        return mb_exception( pdu, MB_EX_ILLEGAL_VALUE );
+    }
+
+    const uint8_t fc = pdu[ 0 ];
+    const uint16_t addr = ( ( uint16_t ) pdu[ 1 ] << 8 ) | pdu[ 2 ];
+    const uint16_t val = ( ( uint16_t ) pdu[ 3 ] << 8 ) | pdu[ 4 ];
+
+    switch ( fc ) {
+    case MB_FC_READ_INPUT: {
+        uint16_t regs[ PZ_INPUT_REGS ];
+
+        if ( ( val == 0 ) || ( ( uint32_t ) addr + val > PZ_INPUT_REGS ) ) {
+            return mb_exception( pdu, MB_EX_ILLEGAL_ADDR );
+        }
+        if ( !PzemReadInputCached( _pz, MB_INPUT_MAX_AGE_MS, regs ) ) {
+            _stats.bus_errors++;
+            return mb_exception( pdu, MB_EX_GW_NO_RESPONSE );
+        }
+        return mb_put_regs( pdu, &regs[ addr ], val );
+    }
+
+    case MB_FC_READ_HOLDING:
+        if ( ( val == 0 ) || ( addr < MB_HOLDING_FIRST ) ||
+                ( ( uint32_t ) addr + val > MB_HOLDING_FIRST + MB_HOLDING_COUNT ) ) {
+            return mb_exception( pdu, MB_EX_ILLEGAL_ADDR );
+        }
+        if ( !mb_holding_refresh() ) {
+            _stats.bus_errors++;
+            return mb_exception( pdu, MB_EX_GW_NO_RESPONSE );
+        }
+        return mb_put_regs( pdu, &_holding[ addr - MB_HOLDING_FIRST ], val );
+
+    case MB_FC_WRITE_SINGLE:
+        /* WREG_ALARM_THR belongs to protection.c, the trip level follows the power class */
+        if ( addr != WREG_ADDR ) {
+            return mb_exception( pdu, MB_EX_ILLEGAL_ADDR );
+        }
+        if ( ( val < 0x01 ) || ( val > 0xF7 ) ) {
+            return mb_exception( pdu, MB_EX_ILLEGAL_VALUE );
+        }
+        if ( !PzemWriteRegister( _pz, addr, val ) ) {
+            _stats.bus_errors++;
+            return mb_exception( pdu, MB_EX_GW_NO_RESPONSE );
+        }
+        if ( _holdingTime >= 0 ) {
+            _holding[ addr - MB_HOLDING_FIRST ] = val;
+        }
+        return 5; /* echo of the request */
+
+    default:
+        return mb_exception( pdu, MB_EX_ILLEGAL_FUNC );
+    }
+}
+
+static void mb_client_close( mb_client_t *cl )
+{
+    close( cl->sock );
+    cl->sock = -1;
+    cl->len = 0;
+}
+
+/**
+ * @brief Consume received bytes, answering every complete ADU
+ * @param cl
+ * @return bool false when the connection has to be dropped
+ */
+static bool mb_client_process( mb_client_t *cl )
+{
+    while ( cl->len >= MB_MBAP_LEN ) {
+        const uint16_t proto = ( ( uint16_t ) cl->rx[ 2 ] << 8 ) | cl->rx[ 3 ];
+        const uint16_t follow = ( ( uint16_t ) cl->rx[ 4 ] << 8 ) | cl->rx[ 5 ];
+
+        if ( ( proto != 0 ) || ( follow < 2 ) || ( follow > MB_MAX_PDU + 1 ) ) {
+            ESP_LOGW( TAG, "Bad MBAP header, closing" );
+            return false;
+        }
+
+        const uint16_t frameLen = 6 + follow;
+        if ( cl->len < frameLen ) {
+            return true; /* wait for the rest */
+        }
+
+        _stats.requests++;
+
+        uint8_t resp[ MB_FRAME_MAX ];
+        memcpy( resp, cl->rx, MB_MBAP_LEN );
+        memcpy( &resp[ MB_MBAP_LEN ], &cl->rx[ MB_MBAP_LEN ], follow - 1 );
+
+        uint16_t pduLen = mb_handle_pdu( &resp[ MB_MBAP_LEN ], follow - 1 );
+        resp[ 4 ] = ( pduLen + 1 ) >> 8;
+        resp[ 5 ] = ( pduLen + 1 ) & 0xFF;
+
+        if ( send( cl->sock, resp, MB_MBAP_LEN + pduLen, 0 ) < 0 ) {
+            return false;
+        }
+
+        cl->len -= frameLen;
+        memmove( cl->rx, &cl->rx[ frameLen ], cl->len );
+    }
+
+    return true;
+}
+
+static void modbus_tcp_task( void *arg )
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons( MB_TCP_PORT ),
+        .sin_addr.s_addr = htonl( INADDR_ANY ),
+    };
+
+    int listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    int opt = 1;
+    setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof( opt ) );
+
+    if ( ( listener < 0 ) ||
+            ( bind( listener, ( struct sockaddr * ) &addr, sizeof( addr ) ) != 0 ) ||
+            ( listen( listener, 2 ) != 0 ) ) {
+        ESP_LOGE( TAG, "Unable to listen on port %d", MB_TCP_PORT );
+        if ( listener >= 0 ) {
+            close( listener );
+        }
+        vTaskDelete( NULL );
+        return;
+    }
+
+    ESP_LOGI( TAG, "Listening on port %d", MB_TCP_PORT );
+
+    for ( int i = 0; i < MB_MAX_CLIENTS; i++ ) {
+        _clients[ i ].sock = -1;
+    }
+
+    while ( 1 ) {
+        fd_set rfds;
+        FD_ZERO( &rfds );
+        FD_SET( listener, &rfds );
+        int maxfd = listener;
+
+        for ( int i = 0; i < MB_MAX_CLIENTS; i++ ) {
+            if ( _clients[ i ].sock >= 0 ) {
+                FD_SET( _clients[ i ].sock, &rfds );
+                maxfd = ( _clients[ i ].sock > maxfd ) ? _clients[ i ].sock : maxfd;
+            }
+        }
+
+        if ( select( maxfd + 1, &rfds, NULL, NULL, NULL ) <= 0 ) {
+            continue;
+        }
+
+        if ( FD_ISSET( listener, &rfds ) ) {
+            int sock = accept( listener, NULL, NULL );
+            if ( sock >= 0 ) {
+                mb_client_t *slot = NULL;
+                for ( int i = 0; i < MB_MAX_CLIENTS; i++ ) {
+                    if ( _clients[ i ].sock < 0 ) {
+                        slot = &_clients[ i ];
+                        break;
+                    }
+                }
+
+                if ( slot == NULL ) {
+                    ESP_LOGW( TAG, "Too many clients" );
+                    close( sock );
+                } else {
+                    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof( opt ) );
+                    slot->sock = sock;
+                    slot->len = 0;
+                }
+            }
+        }
+
+        /* Clients that became readable in the same round share the sensor read */
+        for ( int i = 0; i < MB_MAX_CLIENTS; i++ ) {
+            mb_client_t *cl = &_clients[ i ];
+            if ( ( cl->sock < 0 ) || !FD_ISSET( cl->sock, &rfds ) ) {
+                continue;
+            }
+
+            int n = recv( cl->sock, &cl->rx[ cl->len ], sizeof( cl->rx ) - cl->len, 0 );
+            if ( n <= 0 ) {
+                mb_client_close( cl );
+                continue;
+            }
+
+            cl->len += n;
+            if ( !mb_client_process( cl ) ) {
+                mb_client_close( cl );
+            }
+        }
+    }
+}
+
+/**
+ * @brief Start the Modbus TCP server in front of the sensor
+ * @param pzSetup  sensor shared with PMonTask, the bus lock in the driver serialises access
+ */
+void modbus_tcp_start( pzem_setup_t *pzSetup )
+{
+    _pz = pzSetup;
+    MEM_STATIC( MEM_SUB_NET, _clients );
+    mem_task_start( MEM_TASK_MODBUS_TCP, modbus_tcp_task, NULL );
+}
+
+void modbus_tcp_get_stats( mb_tcp_stats_t *stats )
+{
+    *stats = _stats;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "pzem004tv3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_TCP_PORT               502
+#define MB_MAX_CLIENTS            4
+#define MB_INPUT_MAX_AGE_MS       1000   /* RG_VOLTAGE .. RG_ALARM served from cache within this age */
+#define MB_HOLDING_MAX_AGE_MS     30000  /* WREG_ALARM_THR / WREG_ADDR only change through writes */
+
+/*
+ * Register map (single downstream sensor, unit id is ignored)
+ *   FC 0x04 input   0x0000 .. 0x0009  RG_VOLTAGE .. RG_ALARM
+ *   FC 0x03 holding 0x0001 .. 0x0002  WREG_ALARM_THR, WREG_ADDR
+ *   FC 0x06 holding 0x0002            WREG_ADDR, the alarm threshold is owned by protection.c
+ */
+
+typedef struct {
+    uint32_t requests;
+    uint32_t exceptions;
+    uint32_t bus_errors;
+    uint32_t holding_reads;   /* serial reads of the holding block, input reads are shared with PMonTask */
+} mb_tcp_stats_t;
+
+void modbus_tcp_start( pzem_setup_t *pzSetup );
+void modbus_tcp_get_stats( mb_tcp_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,274 @@
+#include "nilm.h"
+#include <math.h>
+#include <string.h>
+
+void nilm_init( nilm_t *n )
+{
+    memset( n, 0, sizeof( *n ) );
+}
+
+/* Reactive power from P and the unsigned power factor of the PZEM */
+static float nilm_reactive( float power_w, float pf )
+{
+    if ( ( pf <= 0.01f ) || ( pf >= 1.0f ) ) {
+        return 0;
+    }
+    return power_w * sqrtf( 1.0f - pf * pf ) / pf;
+}
+
+static float nilm_tolerance( float base, float value )
+{
+    return base + fabsf( value ) * ( NILM_MATCH_PCT / 100.0f );
+}
+
+/**
+ * @brief Distance of a step to a signature, each axis scaled by its tolerance
+ * @return < 0 when either axis is out of tolerance
+ */
+static float nilm_distance( const nilm_sig_t *s, float p, float q )
+{
+    float dp = fabsf( p - s->p_w ) / nilm_tolerance( NILM_MATCH_W, s->p_w );
+    float dq = fabsf( q - s->q_var ) / nilm_tolerance( NILM_MATCH_VAR, s->q_var );
+    return ( ( dp > 1.0f ) || ( dq > 1.0f ) ) ? -1.0f : dp + dq;
+}
+
+/**
+ * @brief Closest signature to a step
+ * @param running_only   off steps only match what is on
+ * @return index, -1 when none is within tolerance
+ */
+static int nilm_match( const nilm_t *n, float p, float q, bool running_only )
+{
+    int best = -1;
+    float best_d = 0;
+
+    for ( int i = 0; i < n->sigs; i++ ) {
+        if ( running_only && ( n->sig[ i ].running == 0 ) ) {
+            continue;
+        }
+        float d = nilm_distance( &n->sig[ i ], p, q );
+        if ( ( d >= 0 ) && ( ( best < 0 ) || ( d < best_d ) ) ) {
+            best = i;
+            best_d = d;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Slot for a new signature: a free one, or the one seen once that is
+ *        not running and used the least energy
+ */
+static int nilm_new_sig( nilm_t *n )
+{
+    int victim = -1;
+
+    if ( n->sigs < NILM_MAX_SIGS ) {
+        return n->sigs++;
+    }
+    for ( int i = 0; i < NILM_MAX_SIGS; i++ ) {
+        const nilm_sig_t *s = &n->sig[ i ];
+        if ( ( s->running == 0 ) && ( s->events <= 1 ) &&
+             ( ( victim < 0 ) || ( s->total_uwh < n->sig[ victim ].total_uwh ) ) ) {
+            victim = i;
+        }
+    }
+    if ( victim >= 0 ) {
+        n->other_today_uwh += n->sig[ victim ].today_uwh;
+        n->other_total_uwh += n->sig[ victim ].total_uwh;
+    }
+    return victim;
+}
+
+static void nilm_step( nilm_t *n, float dp, float dq, nilm_event_t *ev )
+{
+    ev->on = ( dp > 0 );
+    ev->dp_w = dp;
+    ev->dq_var = dq;
+    n->events++;
+
+    if ( !ev->on ) {
+        int i = nilm_match( n, -dp, -dq, true );
+        ev->sig = ( int8_t ) i;
+        if ( i < 0 ) {
+            n->unmatched++;
+        } else {
+            n->sig[ i ].running--;
+        }
+        return;
+    }
+
+    int i = nilm_match( n, dp, dq, false );
+    if ( i >= 0 ) {
+        nilm_sig_t *s = &n->sig[ i ];
+        float w = 1.0f / ( ( s->events < NILM_AVG_MAX ) ? s->events + 1 : NILM_AVG_MAX );
+        s->p_w += ( dp - s->p_w ) * w;
+        s->q_var += ( dq - s->q_var ) * w;
+        if ( s->events < UINT16_MAX ) {
+            s->events++;
+        }
+        if ( s->running < NILM_MAX_RUNNING ) {
+            s->running++;
+        }
+    } else {
+        i = nilm_new_sig( n );
+        if ( i < 0 ) {
+            n->unmatched++;
+        } else {
+            n->sig[ i ] = ( nilm_sig_t ) { .p_w = dp, .q_var = dq, .events = 1, .running = 1 };
+        }
+    }
+    ev->sig = ( int8_t ) i;
+}
+
+/**
+ * @brief Running signatures that no longer fit under the level missed their
+ *        off step (it was too small or came during a ramp), turn them off
+ */
+static void nilm_settle( nilm_t *n )
+{
+    for ( int k = 0; k < NILM_MAX_SIGS; k++ ) {
+        float sum = 0;
+        for ( int i = 0; i < n->sigs; i++ ) {
+            sum += n->sig[ i ].p_w * n->sig[ i ].running;
+        }
+        float excess = sum - n->level_p;
+        if ( excess <= nilm_tolerance( NILM_MATCH_W, n->level_p ) ) {
+            return;
+        }
+
+        int best = -1;
+        for ( int i = 0; i < n->sigs; i++ ) {
+            if ( ( n->sig[ i ].running > 0 ) &&
+                 ( ( best < 0 ) || ( fabsf( n->sig[ i ].p_w - excess ) < fabsf( n->sig[ best ].p_w - excess ) ) ) ) {
+                best = i;
+            }
+        }
+        n->sig[ best ].running--;
+    }
+}
+
+/* The sample's energy to the running signatures by their P, the rest to other */
+static void nilm_attribute( nilm_t *n, float power_w, float energy_wh )
+{
+    uint64_t uwh = ( energy_wh > 0 ) ? ( uint64_t ) ( ( double ) energy_wh * 1e6 + 0.5 ) : 0;
+    uint64_t given = 0;
+    float sum = 0;
+
+    for ( int i = 0; i < n->sigs; i++ ) {
+        sum += n->sig[ i ].p_w * n->sig[ i ].running;
+    }
+    if ( sum > 0 ) {
+        float scale = 1.0f / ( ( sum > power_w ) ? sum : power_w );
+        for ( int i = 0; i < n->sigs; i++ ) {
+            nilm_sig_t *s = &n->sig[ i ];
+            if ( s->running == 0 ) {
+                continue;
+            }
+            uint64_t part = ( uint64_t ) ( uwh * ( double ) ( s->p_w * s->running * scale ) );
+            /* The float shares can round past 1, never give more than the sample had */
+            if ( part > uwh - given ) {
+                part = uwh - given;
+            }
+            s->today_uwh += part;
+            s->total_uwh += part;
+            given += part;
+        }
+    }
+    n->other_today_uwh += uwh - given;
+    n->other_total_uwh += uwh - given;
+}
+
+/**
+ * @brief One sample
+ * @param n
+ * @param power_w     active power of the sample
+ * @param pf
+ * @param energy_wh   energy of the sample, shared between the signatures
+ * @param ev          filled when an event is returned
+ * @return true on an on or off event
+ */
+bool nilm_feed( nilm_t *n, float power_w, float pf, float energy_wh, nilm_event_t *ev )
+{
+    bool event = false;
+
+    n->win_p[ n->win_pos ] = power_w;
+    n->win_q[ n->win_pos ] = nilm_reactive( power_w, pf );
+    n->win_pos = ( n->win_pos + 1 ) % NILM_WINDOW;
+    if ( n->win_len < NILM_WINDOW ) {
+        n->win_len++;
+    }
+
+    if ( n->win_len == NILM_WINDOW ) {
+        float lo = n->win_p[ 0 ];
+        float hi = n->win_p[ 0 ];
+        float mean_p = 0;
+        float mean_q = 0;
+        for ( int i = 0; i < NILM_WINDOW; i++ ) {
+            lo = fminf( lo, n->win_p[ i ] );
+            hi = fmaxf( hi, n->win_p[ i ] );
+            mean_p += n->win_p[ i ];
+            mean_q += n->win_q[ i ];
+        }
+        mean_p /= NILM_WINDOW;
+        mean_q /= NILM_WINDOW;
+
+        if ( hi - lo <= NILM_STEADY_W + mean_p * ( NILM_STEADY_PCT / 100.0f ) ) {
+            float dp = mean_p - n->level_p;
+            float dq = mean_q - n->level_q;
+            if ( n->have_level && ( fabsf( dp ) >= NILM_MIN_STEP_W ) ) {
+                nilm_step( n, dp, dq, ev );
+                event = true;
+            }
+            /* Below the step size the level follows slow drift */
+            n->level_p = mean_p;
+            n->level_q = mean_q;
+            n->have_level = true;
+            nilm_settle( n );
+        }
+    }
+
+    nilm_attribute( n, power_w, energy_wh );
+    return event;
+}
+
+/**
+ * @brief Start today's energies over, from the daily rollover
+ */
+void nilm_day_reset( nilm_t *n )
+{
+    for ( int i = 0; i < n->sigs; i++ ) {
+        n->sig[ i ].today_uwh = 0;
+    }
+    n->other_today_uwh = 0;
+}
+
+/**
+ * @brief Signatures with energy today, most first
+ * @param n
+ * @param idx   indexes into n->sig
+ * @param max
+ * @return int  how many were written
+ */
+int nilm_top_today( const nilm_t *n, uint8_t *idx, int max )
+{
+    int count = 0;
+
+    for ( int i = 0; i < n->sigs; i++ ) {
+        uint64_t e = n->sig[ i ].today_uwh;
+        if ( e == 0 ) {
+            continue;
+        }
+        int j = ( count < max ) ? count++ : max;
+        while ( ( j > 0 ) && ( n->sig[ idx[ j - 1 ] ].today_uwh < e ) ) {
+            if ( j < max ) {
+                idx[ j ] = idx[ j - 1 ];
+            }
+            j--;
+        }
+        if ( j < max ) {
+            idx[ j ] = ( uint8_t ) i;
+        }
+    }
+    return count;
+}
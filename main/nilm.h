@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Appliance events from the aggregate power, plain C like core.c
+ *
+ * Every sample goes into a window of NILM_WINDOW samples. The window is
+ * steady when its power spread is within NILM_STEADY_W plus NILM_STEADY_PCT
+ * of its mean. A steady window that sits NILM_MIN_STEP_W or more away from
+ * the last steady level is an event: the step in active power P and reactive
+ * power Q (from the power factor) is the appliance switching on or off.
+ *
+ * An on step joins the signature it is close to (within NILM_MATCH_W in P
+ * and NILM_MATCH_VAR in Q, both plus NILM_MATCH_PCT) and moves its mean a
+ * little, or starts a new signature. An off step turns off the running
+ * signature it matches. Each sample's energy is shared by the running
+ * signatures in proportion to their P, what is left (base load, unknown
+ * loads) is "other".
+ *
+ * All state is the fixed nilm_t, no allocation. A sample costs one pass over
+ * the window and a few over at most NILM_MAX_SIGS signatures; a running
+ * signature left on by a missed off step is dropped when the level no longer
+ * has room for it, at most NILM_MAX_SIGS passes. The table lives in RAM and
+ * is learned again after a restart. tools/nilm_replay.c feeds it recorded or
+ * synthetic traces on the host.
+ */
+#define NILM_WINDOW            3
+#define NILM_STEADY_W          8.0f
+#define NILM_STEADY_PCT        3
+#define NILM_MIN_STEP_W        30.0f
+#define NILM_MATCH_W           12.0f
+#define NILM_MATCH_VAR         40.0f   /* Q comes from the 0.01 step power factor, coarse at high load */
+#define NILM_MATCH_PCT         8
+#define NILM_AVG_MAX           16      /* mean weight cap, an old signature still follows drift */
+#define NILM_MAX_SIGS          12
+#define NILM_MAX_RUNNING       4       /* same appliance on at once, e.g. identical lamps */
+
+typedef struct {
+    float p_w;              /* on step, mean */
+    float q_var;
+    uint16_t events;        /* on steps matched */
+    uint8_t running;        /* instances on now */
+    uint64_t today_uwh;
+    uint64_t total_uwh;
+} nilm_sig_t;
+
+typedef struct {
+    int8_t sig;             /* -1 when nothing matched and the table is full */
+    bool on;
+    float dp_w;
+    float dq_var;
+} nilm_event_t;
+
+typedef struct {
+    float win_p[ NILM_WINDOW ];
+    float win_q[ NILM_WINDOW ];
+    uint8_t win_len;
+    uint8_t win_pos;
+    bool have_level;
+    float level_p;          /* last steady level */
+    float level_q;
+    uint8_t sigs;
+    nilm_sig_t sig[ NILM_MAX_SIGS ];
+    uint64_t other_today_uwh;
+    uint64_t other_total_uwh;
+    uint32_t events;
+    uint32_t unmatched;     /* off without a running match, on with a full table */
+} nilm_t;
+
+void nilm_init( nilm_t *n );
+bool nilm_feed( nilm_t *n, float power_w, float pf, float energy_wh, nilm_event_t *ev );
+void nilm_day_reset( nilm_t *n );
+int nilm_top_today( const nilm_t *n, uint8_t *idx, int max );
+
+#ifdef __cplusplus
+}
+#endif
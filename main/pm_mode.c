@@ -0,0 +1,222 @@
+#include "pm_mode.h"
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "PM";
+
+static const char *_busyNames[ PM_BUSY_COUNT ] = {
+    "sampler", "console", "net", "protect", "pzem",
+};
+
+static pm_mode_t _mode = PM_MODE_PERFORMANCE;
+
+/* Busy accounting, called from tasks on both cores */
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t _depth[ PM_BUSY_COUNT ] = {0};
+static int64_t _heldSince[ PM_BUSY_COUNT ] = {0};
+static uint8_t _holders = 0;
+static int64_t _busySince = 0;
+static pm_stats_t _stats = {0};
+static pm_stats_t _lastReport = {0};   /* <pm> also prints the window since the previous one */
+
+#if CONFIG_PM_ENABLE
+/* Counted by esp_pm, every begin acquires and every end releases */
+static esp_pm_lock_handle_t _locks[ PM_BUSY_COUNT ] = {0};
+#endif
+
+static esp_err_t pm_mode_apply( pm_mode_t mode )
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = ( mode == PM_MODE_LOW_POWER ) ? CONFIG_XTAL_FREQ : CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .light_sleep_enable = ( mode == PM_MODE_LOW_POWER ),
+    };
+    esp_err_t err = esp_pm_configure( &config );
+    if ( err != ESP_OK ) {
+        ESP_LOGE( TAG, "esp_pm_configure: %s", esp_err_to_name( err ) );
+        return err;
+    }
+#else
+    if ( mode == PM_MODE_LOW_POWER ) {
+        ESP_LOGW( TAG, "CONFIG_PM_ENABLE is off, only Wi-Fi modem sleep changes" );
+    }
+#endif
+
+    _mode = mode;
+    pm_mode_apply_wifi();
+    ESP_LOGI( TAG, "%s", ( mode == PM_MODE_LOW_POWER ) ? "low power" : "performance" );
+    return ESP_OK;
+}
+
+/**
+ * @brief Create the busy locks, arm the wake-up sources and apply the mode, call before any task uses pm_busy_*
+ * @param mode
+ * @param wake_uart  console UART, UART0 or UART1 can wake the chip
+ * @return esp_err_t
+ */
+esp_err_t pm_mode_init( pm_mode_t mode, uart_port_t wake_uart )
+{
+#if CONFIG_PM_ENABLE
+    for ( int i = 0; i < PM_BUSY_COUNT; i++ ) {
+        esp_err_t err = esp_pm_lock_create( ESP_PM_CPU_FREQ_MAX, 0, _busyNames[ i ], &_locks[ i ] );
+        if ( err != ESP_OK ) {
+            return err;
+        }
+    }
+
+    /* Only consulted while light sleep is enabled, so they stay armed in both modes */
+    uart_set_wakeup_threshold( wake_uart, PM_UART_WAKEUP_EDGES );
+    esp_sleep_enable_uart_wakeup( wake_uart );
+    esp_sleep_enable_gpio_wakeup();
+#endif
+
+    return pm_mode_apply( mode );
+}
+
+/**
+ * @brief Switch mode at run time, from <pm> or provisioning
+ */
+esp_err_t pm_mode_set( pm_mode_t mode )
+{
+    if ( ( mode != PM_MODE_PERFORMANCE ) && ( mode != PM_MODE_LOW_POWER ) ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return pm_mode_apply( mode );
+}
+
+pm_mode_t pm_mode_get( void )
+{
+    return _mode;
+}
+
+/**
+ * @brief Wi-Fi power save for the current mode, also called by wifi_sta once Wi-Fi started
+ */
+void pm_mode_apply_wifi( void )
+{
+    /* ESP_ERR_WIFI_NOT_INIT before Wi-Fi starts, wifi_sta calls again then */
+    esp_wifi_set_ps( ( _mode == PM_MODE_LOW_POWER ) ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM );
+}
+
+/**
+ * @brief Full CPU speed and no light sleep until the matching pm_busy_end, nests
+ * @param who
+ */
+void pm_busy_begin( pm_busy_t who )
+{
+#if CONFIG_PM_ENABLE
+    if ( _locks[ who ] != NULL ) {
+        esp_pm_lock_acquire( _locks[ who ] );
+    }
+#endif
+
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL( &_mux );
+    if ( _depth[ who ]++ == 0 ) {
+        _heldSince[ who ] = now;
+        _stats.acquires[ who ]++;
+        if ( _holders++ == 0 ) {
+            _busySince = now;
+        }
+    }
+    portEXIT_CRITICAL( &_mux );
+}
+
+/**
+ * @brief Release one pm_busy_begin, without one held it does nothing
+ * @param who
+ */
+void pm_busy_end( pm_busy_t who )
+{
+    int64_t now = esp_timer_get_time();
+    bool held = false;
+
+    portENTER_CRITICAL( &_mux );
+    if ( _depth[ who ] > 0 ) {
+        held = true;
+        if ( --_depth[ who ] == 0 ) {
+            _stats.held_us[ who ] += now - _heldSince[ who ];
+            if ( --_holders == 0 ) {
+                _stats.busy_us += now - _busySince;
+            }
+        }
+    }
+    portEXIT_CRITICAL( &_mux );
+
+#if CONFIG_PM_ENABLE
+    if ( held && ( _locks[ who ] != NULL ) ) {
+        esp_pm_lock_release( _locks[ who ] );
+    }
+#else
+    ( void ) held;
+#endif
+}
+
+/**
+ * @brief Snapshot, time under a lock that is still held is included
+ */
+void pm_get_stats( pm_stats_t *stats )
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL( &_mux );
+    *stats = _stats;
+    for ( int i = 0; i < PM_BUSY_COUNT; i++ ) {
+        if ( _depth[ i ] > 0 ) {
+            stats->held_us[ i ] += now - _heldSince[ i ];
+        }
+    }
+    if ( _holders > 0 ) {
+        stats->busy_us += now - _busySince;
+    }
+    portEXIT_CRITICAL( &_mux );
+
+    stats->up_us = now;
+}
+
+/* Share in tenths of a percent */
+static unsigned pm_permille( uint64_t part, uint64_t whole )
+{
+    return ( whole == 0 ) ? 0 : ( unsigned ) ( ( part * 1000 ) / whole );
+}
+
+/**
+ * @brief Print duty cycle per busy lock, total and since the previous report, then frequency residency
+ */
+void pm_report( void )
+{
+    pm_stats_t s;
+    pm_get_stats( &s );
+
+    uint64_t window = s.up_us - _lastReport.up_us;
+    unsigned total = pm_permille( s.busy_us, s.up_us );
+    unsigned recent = pm_permille( s.busy_us - _lastReport.busy_us, window );
+
+    ESP_LOGI( TAG, "mode %s, cpu %u..%u MHz", ( _mode == PM_MODE_LOW_POWER ) ? "low power" : "performance",
+              ( _mode == PM_MODE_LOW_POWER ) ? ( unsigned ) CONFIG_XTAL_FREQ : ( unsigned ) CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+              ( unsigned ) CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ );
+    ESP_LOGI( TAG, "busy %u.%u%% since boot, %u.%u%% in the last %u s", total / 10, total % 10,
+              recent / 10, recent % 10, ( unsigned ) ( window / 1000000 ) );
+    ESP_LOGI( TAG, "%-8s %10s %6s %8s", "lock", "held ms", "duty%", "acquires" );
+    for ( int i = 0; i < PM_BUSY_COUNT; i++ ) {
+        unsigned duty = pm_permille( s.held_us[ i ], s.up_us );
+        ESP_LOGI( TAG, "%-8s %10u %4u.%u %8u", _busyNames[ i ], ( unsigned ) ( s.held_us[ i ] / 1000 ),
+                  duty / 10, duty % 10, ( unsigned ) s.acquires[ i ] );
+    }
+    _lastReport = s;
+
+#if CONFIG_PM_PROFILING
+    /* Time at CPU_MAX, APB_MAX, APB_MIN and in light sleep, with every lock including the drivers' */
+    esp_pm_dump_locks( stdout );
+#else
+    ESP_LOGI( TAG, "time per frequency needs CONFIG_PM_PROFILING" );
+#endif
+}
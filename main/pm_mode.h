@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Power management
+ *
+ *   PM_MODE_PERFORMANCE  CPU fixed at the default frequency, Wi-Fi min modem sleep
+ *   PM_MODE_LOW_POWER    DFS down to XTAL, automatic light sleep with tickless idle,
+ *                        Wi-Fi max modem sleep, UART0 and the button wake the chip
+ *
+ * Modules hold a busy lock only while they work: the sampler from wake-up to the
+ * end of its iteration, the protect task per poll, the console worker per
+ * command, uploads per batch, and every PZEM transaction while it owns the
+ * sensor bus (UART2 cannot wake the chip, its reply would be lost). While any is held the CPU runs at full speed and
+ * the chip does not sleep. The UARTs run from REF_TICK under CONFIG_PM_ENABLE so
+ * their baud rate does not follow APB.
+ */
+#define PM_WIFI_LISTEN_INTERVAL   3     /* beacons skipped in max modem sleep */
+#define PM_UART_WAKEUP_EDGES      3     /* RX edges that wake the chip, those bytes are lost */
+
+#if CONFIG_PM_ENABLE
+#define PM_UART_SCLK              UART_SCLK_REF_TICK
+#else
+#define PM_UART_SCLK              UART_SCLK_APB
+#endif
+
+typedef enum {
+    PM_MODE_PERFORMANCE = 0,
+    PM_MODE_LOW_POWER,
+} pm_mode_t;
+
+typedef enum {
+    PM_BUSY_SAMPLER = 0,
+    PM_BUSY_CONSOLE,
+    PM_BUSY_NET,
+    PM_BUSY_PROTECT,
+    PM_BUSY_PZEM,
+    PM_BUSY_COUNT
+} pm_busy_t;
+
+typedef struct {
+    uint64_t up_us;                         /* since boot */
+    uint64_t busy_us;                       /* at least one busy lock held */
+    uint64_t held_us[ PM_BUSY_COUNT ];
+    uint32_t acquires[ PM_BUSY_COUNT ];
+} pm_stats_t;
+
+esp_err_t pm_mode_init( pm_mode_t mode, uart_port_t wake_uart );
+esp_err_t pm_mode_set( pm_mode_t mode );
+pm_mode_t pm_mode_get( void );
+void pm_mode_apply_wifi( void );
+
+void pm_busy_begin( pm_busy_t who );
+void pm_busy_end( pm_busy_t who );
+
+void pm_get_stats( pm_stats_t *stats );
+void pm_report( void );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,206 @@
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "PROF";
+
+static const char *_phaseNames[ PROF_PHASE_COUNT ] = {
+    "uart", "nvs", "lcd", "net", "other", "total", "jitter", "react",
+};
+
+/* Written by PMonTask only, the reader copies under the spinlock */
+static uint32_t _ring[ PROF_PHASE_COUNT ][ PROF_WINDOW ];
+static uint32_t _head = 0;
+static uint32_t _count = 0;
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t _loopStart = 0;
+static uint32_t _acc[ PROF_PHASE_COUNT ];
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+/* Previous run time per task, so the report shows the share since the last one */
+typedef struct {
+    UBaseType_t number;
+    configRUN_TIME_COUNTER_TYPE runtime;
+} prof_task_time_t;
+
+static prof_task_time_t _prevTasks[ PROF_MAX_TASKS ];
+static size_t _prevCount = 0;
+static configRUN_TIME_COUNTER_TYPE _prevTotal = 0;
+#endif
+
+void prof_loop_begin( void )
+{
+    memset( _acc, 0, sizeof( _acc ) );
+    _loopStart = esp_timer_get_time();
+}
+
+int64_t prof_begin( void )
+{
+    return esp_timer_get_time();
+}
+
+/**
+ * @brief Add the time since start to a phase, a phase may be entered several times per iteration
+ */
+void prof_end( prof_phase_t phase, int64_t start )
+{
+    if ( phase < PROF_OTHER ) {
+        _acc[ phase ] += ( uint32_t ) ( esp_timer_get_time() - start );
+    }
+}
+
+/**
+ * @brief Set a measured value of this iteration, e.g. PROF_JITTER
+ */
+void prof_record( prof_phase_t phase, uint32_t us )
+{
+    if ( phase > PROF_TOTAL && phase < PROF_PHASE_COUNT ) {
+        _acc[ phase ] = us;
+    }
+}
+
+/**
+ * @brief Close the iteration and store every phase in the window
+ * @return uint32_t  iteration time in us
+ */
+uint32_t prof_loop_end( void )
+{
+    uint32_t total = ( uint32_t ) ( esp_timer_get_time() - _loopStart );
+    uint32_t claimed = 0;
+
+    for ( int i = 0; i < PROF_OTHER; i++ ) {
+        claimed += _acc[ i ];
+    }
+    _acc[ PROF_OTHER ] = ( total > claimed ) ? total - claimed : 0;
+    _acc[ PROF_TOTAL ] = total;
+
+    taskENTER_CRITICAL( &_mux );
+    for ( int i = 0; i < PROF_PHASE_COUNT; i++ ) {
+        _ring[ i ][ _head ] = _acc[ i ];
+    }
+    _head = ( _head + 1 ) % PROF_WINDOW;
+    if ( _count < PROF_WINDOW ) {
+        _count++;
+    }
+    taskEXIT_CRITICAL( &_mux );
+
+    return total;
+}
+
+static int prof_compare( const void *a, const void *b )
+{
+    uint32_t x = *( const uint32_t * ) a;
+    uint32_t y = *( const uint32_t * ) b;
+    return ( x > y ) - ( x < y );
+}
+
+/**
+ * @brief Percentiles over the last PROF_WINDOW iterations
+ * @param phase
+ * @param out   all zero before the first iteration
+ */
+void prof_get_summary( prof_phase_t phase, prof_summary_t *out )
+{
+    uint32_t sorted[ PROF_WINDOW ];
+    uint32_t n;
+
+    memset( out, 0, sizeof( *out ) );
+    if ( phase >= PROF_PHASE_COUNT ) {
+        return;
+    }
+
+    taskENTER_CRITICAL( &_mux );
+    n = _count;
+    memcpy( sorted, _ring[ phase ], sizeof( sorted ) );
+    taskEXIT_CRITICAL( &_mux );
+
+    if ( n == 0 ) {
+        return;
+    }
+
+    /* Before the window fills, slots n .. end are still zero and sort first */
+    qsort( sorted, PROF_WINDOW, sizeof( sorted[ 0 ] ), prof_compare );
+    uint32_t *v = &sorted[ PROF_WINDOW - n ];
+
+    out->samples = n;
+    out->p50_us = v[ ( n - 1 ) * 50 / 100 ];
+    out->p99_us = v[ ( n - 1 ) * 99 / 100 ];
+    out->max_us = v[ n - 1 ];
+}
+
+static void prof_report_tasks( void )
+{
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    static TaskStatus_t tasks[ PROF_MAX_TASKS ];
+    static prof_task_time_t now[ PROF_MAX_TASKS ];
+    configRUN_TIME_COUNTER_TYPE total = 0;
+
+    UBaseType_t n = uxTaskGetSystemState( tasks, PROF_MAX_TASKS, &total );
+    if ( n == 0 ) {
+        ESP_LOGW( TAG, "More than %d tasks, raise PROF_MAX_TASKS", PROF_MAX_TASKS );
+        return;
+    }
+
+    /* Run time counts per core, the idle tasks fill whatever the others leave */
+    uint64_t elapsed = ( uint64_t ) ( total - _prevTotal ) * portNUM_PROCESSORS;
+
+    ESP_LOGI( TAG, "%-16s %4s %6s %8s", "task", "prio", "cpu%", "stack" );
+    for ( UBaseType_t i = 0; i < n; i++ ) {
+        configRUN_TIME_COUNTER_TYPE prev = 0;
+        for ( size_t j = 0; j < _prevCount; j++ ) {
+            if ( _prevTasks[ j ].number == tasks[ i ].xTaskNumber ) {
+                prev = _prevTasks[ j ].runtime;
+                break;
+            }
+        }
+
+        /* Tenths of a percent, integer only */
+        uint32_t share = elapsed ? ( uint32_t ) ( ( uint64_t ) ( tasks[ i ].ulRunTimeCounter - prev ) * 1000 / elapsed ) : 0;
+        ESP_LOGI( TAG, "%-16s %4u %4u.%u %8u", tasks[ i ].pcTaskName, ( unsigned ) tasks[ i ].uxCurrentPriority,
+                  ( unsigned ) ( share / 10 ), ( unsigned ) ( share % 10 ), ( unsigned ) tasks[ i ].usStackHighWaterMark );
+
+        now[ i ].number = tasks[ i ].xTaskNumber;
+        now[ i ].runtime = tasks[ i ].ulRunTimeCounter;
+    }
+
+    memcpy( _prevTasks, now, n * sizeof( now[ 0 ] ) );
+    _prevCount = n;
+    _prevTotal = total;
+#else
+    /* Without the trace facility only the tasks this firmware creates can be looked up */
+    static const char *names[] = { "PowerMon", "console", "console_worker", "esp_timer", "display", "telemetry", "modbus_tcp", "telegram" };
+
+    ESP_LOGW( TAG, "CPU share needs CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS" );
+    ESP_LOGI( TAG, "%-16s %8s", "task", "stack" );
+    for ( size_t i = 0; i < sizeof( names ) / sizeof( names[ 0 ] ); i++ ) {
+        TaskHandle_t handle = xTaskGetHandle( names[ i ] );
+        if ( handle != NULL ) {
+            ESP_LOGI( TAG, "%-16s %8u", names[ i ], ( unsigned ) uxTaskGetStackHighWaterMark( handle ) );
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Log a top style report: per task CPU share since the previous report and
+ *        stack high-water marks (bytes never used), heap, and PMonTask phase timing
+ */
+void prof_report( void )
+{
+    prof_report_tasks();
+
+    ESP_LOGI( TAG, "heap free %u min %u", ( unsigned ) esp_get_free_heap_size(), ( unsigned ) esp_get_minimum_free_heap_size() );
+
+    ESP_LOGI( TAG, "%-6s %8s %8s %8s  (us, last %d loops)", "phase", "p50", "p99", "max", PROF_WINDOW );
+    for ( int i = 0; i < PROF_PHASE_COUNT; i++ ) {
+        prof_summary_t s;
+        prof_get_summary( ( prof_phase_t ) i, &s );
+        ESP_LOGI( TAG, "%-6s %8u %8u %8u", _phaseNames[ i ], ( unsigned ) s.p50_us, ( unsigned ) s.p99_us, ( unsigned ) s.max_us );
+    }
+}
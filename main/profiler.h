@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROF_WINDOW            128    /* most recent PMonTask iterations kept per phase */
+#define PROF_MAX_TASKS         32
+
+/* Where one PMonTask iteration spends its time, PROF_OTHER is what no phase claimed */
+typedef enum {
+    PROF_UART = 0,          /* PZEM Modbus transaction */
+    PROF_NVS,
+    PROF_LCD,               /* display state updates, the I2C writes run in the display task */
+    PROF_NET,               /* Telegram, telemetry and metrics */
+    PROF_OTHER,
+    PROF_TOTAL,
+    PROF_JITTER,            /* sample instant against the nominal period, not part of total */
+    PROF_REACT,             /* sensor read to relay written, not part of total */
+    PROF_PHASE_COUNT
+} prof_phase_t;
+
+typedef struct {
+    uint32_t samples;       /* iterations in the window */
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} prof_summary_t;
+
+void prof_loop_begin( void );
+int64_t prof_begin( void );
+void prof_end( prof_phase_t phase, int64_t start );
+void prof_record( prof_phase_t phase, uint32_t us );
+uint32_t prof_loop_end( void );
+
+void prof_get_summary( prof_phase_t phase, prof_summary_t *out );
+void prof_report( void );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,223 @@
+#include "protection.h"
+#include "core.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "meter_state.h"
+#include "mem_budget.h"
+#include "pm_mode.h"
+#include "trace.h"
+
+/* RG_POWER_L .. RG_ALARM in one read */
+#define PROT_POWER_REGS    ( RG_ALARM - RG_POWER_L + 1 )
+
+static const char *TAG = "PROT";
+
+static const char *_stateNames[] = {
+    "armed", "tripped", "confirm",
+};
+
+static pzem_setup_t *_pz = NULL;
+static prot_relay_cb_t _relayApply = NULL;
+
+/* Written by <kap> and provisioning, picked up by the task on its next poll */
+static volatile uint16_t _limitW = 0;
+static volatile bool _limitChanged = false;
+
+/* Written by the protect task only, copied out under the spinlock */
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+static prot_stats_t _stats = {0};
+
+/**
+ * @brief Open the relay, the hold-off grows when the previous restore did not hold
+ * @param state      state the trip happened in
+ * @param holdoff    in/out, ms
+ * @param pollStart
+ * @return uint32_t latency from poll start, us
+ */
+static uint32_t prot_trip( prot_state_t state, uint32_t *holdoff, int64_t pollStart )
+{
+    meter_set_trip( true );
+    _relayApply();
+    uint32_t latency = ( uint32_t ) ( esp_timer_get_time() - pollStart );
+
+    if ( state == PROT_CONFIRM ) {
+        *holdoff = ( *holdoff >= PROT_HOLDOFF_MAX_MS / 2 ) ? PROT_HOLDOFF_MAX_MS : *holdoff * 2;
+    }
+    return latency;
+}
+
+static void protection_task( void *arg )
+{
+    TickType_t wake = xTaskGetTickCount();
+    prot_state_t state = PROT_ARMED;
+    uint32_t holdoff = PROT_HOLDOFF_MS;
+    int64_t trippedAt = 0;
+    int64_t belowSince = 0;     /* CONFIRM only, 0 while above the restore band */
+    int64_t verifiedAt = 0;
+    bool thrSet = false;
+
+    for ( ;; ) {
+        vTaskDelayUntil( &wake, pdMS_TO_TICKS( PROT_POLL_MS ) );
+
+        /* Flag first, so a limit set right after is written on the next poll */
+        if ( _limitChanged ) {
+            _limitChanged = false;
+            thrSet = false;
+        }
+        uint16_t limit = _limitW;
+
+        pm_busy_begin( PM_BUSY_PROTECT );
+        TRACE_BEGIN( TRACE_EV_PROTECT_POLL, state );
+        int64_t t0 = esp_timer_get_time();
+
+        uint16_t regs[ PROT_POWER_REGS ] = {0};
+        bool ok = true;
+        bool over = false;
+        uint32_t power_w = 0;
+
+        /* Nothing to watch while the relay is open. The limit is checked here as
+           well, the meter alarm only follows what WREG_ALARM_THR holds right now */
+        if ( state != PROT_TRIPPED ) {
+            ok = PzemReadRegisters( _pz, CMD_RIR, RG_POWER_L, PROT_POWER_REGS, regs );
+            power_w = core_reg32( regs[ 0 ], regs[ 1 ] ) / 10;   /* raw 0.1 W */
+            over = ok && ( ( thrSet && regs[ PROT_POWER_REGS - 1 ] != 0 ) || ( power_w >= limit ) );
+        }
+
+        TRACE_END( TRACE_EV_PROTECT_POLL, over );
+
+        if ( over ) {
+            uint32_t latency = prot_trip( state, &holdoff, t0 );
+            ESP_LOGW( TAG, "trip at %u W, limit %u W, relay open after %u us, closes in %u ms",
+                      ( unsigned ) power_w, ( unsigned ) limit, ( unsigned ) latency, ( unsigned ) holdoff );
+            state = PROT_TRIPPED;
+            trippedAt = t0;
+
+            portENTER_CRITICAL( &_mux );
+            _stats.trips++;
+            _stats.trip_power_w = power_w;
+            _stats.latency_last_us = latency;
+            if ( latency > _stats.latency_max_us ) {
+                _stats.latency_max_us = latency;
+            }
+            portEXIT_CRITICAL( &_mux );
+        } else if ( ( state == PROT_TRIPPED ) && ( t0 - trippedAt >= ( int64_t ) holdoff * 1000 ) ) {
+            meter_set_trip( false );
+            _relayApply();
+            ESP_LOGI( TAG, "relay closed after %u ms", ( unsigned ) holdoff );
+            state = PROT_CONFIRM;
+            belowSince = 0;
+
+            portENTER_CRITICAL( &_mux );
+            _stats.restores++;
+            portEXIT_CRITICAL( &_mux );
+        } else if ( state == PROT_CONFIRM ) {
+            if ( ok && ( power_w * 100 < ( uint32_t ) limit * PROT_RESTORE_PCT ) ) {
+                if ( belowSince == 0 ) {
+                    belowSince = t0;
+                } else if ( t0 - belowSince >= ( int64_t ) PROT_STABLE_MS * 1000 ) {
+                    ESP_LOGI( TAG, "load stable below %u%%, armed", PROT_RESTORE_PCT );
+                    state = PROT_ARMED;
+                    holdoff = PROT_HOLDOFF_MS;
+                }
+            } else {
+                belowSince = 0;
+            }
+        }
+
+        /* Threshold upkeep after the decision, it never delays a trip */
+        if ( ok && ( state != PROT_TRIPPED ) ) {
+            if ( !thrSet ) {
+                thrSet = PzemWriteRegister( _pz, WREG_ALARM_THR, limit );
+                verifiedAt = t0;
+                if ( thrSet ) {
+                    ESP_LOGI( TAG, "meter alarm at %u W", ( unsigned ) limit );
+                }
+            } else if ( t0 - verifiedAt >= ( int64_t ) PROT_VERIFY_MS * 1000 ) {
+                uint16_t thr = 0;
+                verifiedAt = t0;
+                if ( PzemReadRegisters( _pz, CMD_RHR, WREG_ALARM_THR, 1, &thr ) && ( thr != limit ) ) {
+                    ESP_LOGW( TAG, "meter alarm changed to %u W, restoring", ( unsigned ) thr );
+                    thrSet = false;
+                }
+            }
+        }
+
+        pm_busy_end( PM_BUSY_PROTECT );
+
+        portENTER_CRITICAL( &_mux );
+        _stats.state = state;
+        _stats.limit_w = limit;
+        _stats.threshold_set = thrSet;
+        _stats.holdoff_ms = holdoff;
+        if ( state != PROT_TRIPPED ) {
+            _stats.polls++;
+            if ( !ok ) {
+                _stats.poll_errors++;
+            }
+        }
+        portEXIT_CRITICAL( &_mux );
+    }
+}
+
+/**
+ * @brief Program the meter alarm and start the protect task, the relay GPIO must be configured
+ * @param pz
+ * @param limit_w       trip level, W
+ * @param relay_apply   drives the relay from meter_relay_wanted(), must not block on NVS or the network
+ * @return esp_err_t
+ */
+esp_err_t protection_start( pzem_setup_t *pz, uint16_t limit_w, prot_relay_cb_t relay_apply )
+{
+    if ( ( pz == NULL ) || ( relay_apply == NULL ) || ( limit_w == 0 ) ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    _pz = pz;
+    _relayApply = relay_apply;
+    protection_set_limit( limit_w );
+
+    if ( mem_task_start( MEM_TASK_PROTECT, protection_task, NULL ) == NULL ) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Change the trip level, RAM only, the caller persists it
+ * @param limit_w
+ */
+void protection_set_limit( uint16_t limit_w )
+{
+    if ( limit_w == 0 ) {
+        return;
+    }
+    _limitW = limit_w;
+    _limitChanged = true;
+}
+
+uint16_t protection_get_limit( void )
+{
+    return _limitW;
+}
+
+void protection_get_stats( prot_stats_t *stats )
+{
+    portENTER_CRITICAL( &_mux );
+    *stats = _stats;
+    portEXIT_CRITICAL( &_mux );
+}
+
+void protection_report( void )
+{
+    prot_stats_t s;
+    protection_get_stats( &s );
+
+    ESP_LOGI( TAG, "%s, limit %u W, meter alarm %s, hold-off %u ms", _stateNames[ s.state ], ( unsigned ) _limitW,
+              s.threshold_set ? "set" : "pending", ( unsigned ) s.holdoff_ms );
+    ESP_LOGI( TAG, "polls %u every %u ms, errors %u", ( unsigned ) s.polls, PROT_POLL_MS, ( unsigned ) s.poll_errors );
+    ESP_LOGI( TAG, "trips %u restores %u, last at %u W", ( unsigned ) s.trips, ( unsigned ) s.restores,
+              ( unsigned ) s.trip_power_w );
+    ESP_LOGI( TAG, "poll to relay %u us last, %u us max", ( unsigned ) s.latency_last_us, ( unsigned ) s.latency_max_us );
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "pzem004tv3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Over-power protection, independent of the billing loop
+ *
+ * The PZEM compares active power with its alarm threshold (WREG_ALARM_THR, in W)
+ * on every measurement and sets RG_ALARM. The protect task reads RG_POWER_L ..
+ * RG_ALARM every PROT_POLL_MS, 8 bytes out and 19 back, and opens the relay as
+ * soon as the alarm is set or the power reaches its own limit: the meter alarm
+ * alone would follow whatever the threshold register holds. Only this task
+ * writes the threshold, the Modbus TCP gateway refuses it. Nothing on this path touches NVS, the network or PMonTask:
+ * the limit lives in RAM, the caller reads it from NVS once at start and
+ * <kap> / provisioning change it after that.
+ *
+ * Latency from the meter raising the alarm to GPIO33 low is at most one poll
+ * period, one bus transaction queued ahead of ours (PZ_BUS_TIMEOUT) and our
+ * own. The part after the poll starts is measured on every trip.
+ *
+ * The relay cuts the load the meter measures, so after a trip the power reads
+ * zero and cannot tell when the overload is gone. The relay closes again after
+ * a hold-off and stays on probation until the load has been below
+ * PROT_RESTORE_PCT of the limit for PROT_STABLE_MS. A trip on probation doubles
+ * the hold-off, up to PROT_HOLDOFF_MAX_MS, passing it resets the hold-off to
+ * PROT_HOLDOFF_MS.
+ */
+#define PROT_POLL_MS            100
+#define PROT_HOLDOFF_MS         5000
+#define PROT_HOLDOFF_MAX_MS     ( 5 * 60 * 1000 )
+#define PROT_STABLE_MS          30000
+#define PROT_RESTORE_PCT        90
+#define PROT_VERIFY_MS          60000   /* re-read WREG_ALARM_THR, a PZEM power cycle or a bad write loses it */
+
+typedef enum {
+    PROT_ARMED = 0,         /* relay allowed, hold-off at its base */
+    PROT_TRIPPED,           /* relay open, waiting out the hold-off */
+    PROT_CONFIRM,           /* relay closed again, on probation */
+} prot_state_t;
+
+/* Drives the relay from meter_relay_wanted(), called from the protect task */
+typedef void ( *prot_relay_cb_t )( void );
+
+typedef struct {
+    prot_state_t state;
+    uint16_t limit_w;
+    bool threshold_set;         /* meter alarm programmed with limit_w */
+    uint32_t polls;
+    uint32_t poll_errors;
+    uint32_t trips;
+    uint32_t restores;
+    uint32_t holdoff_ms;
+    uint32_t trip_power_w;      /* last trip */
+    uint32_t latency_last_us;   /* poll start to relay low */
+    uint32_t latency_max_us;
+} prot_stats_t;
+
+esp_err_t protection_start( pzem_setup_t *pz, uint16_t limit_w, prot_relay_cb_t relay_apply );
+void protection_set_limit( uint16_t limit_w );
+uint16_t protection_get_limit( void );
+
+void protection_get_stats( prot_stats_t *stats );
+void protection_report( void );
+
+#ifdef __cplusplus
+}
+#endif
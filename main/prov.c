@@ -0,0 +1,241 @@
+#include "prov.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "nvs.h"
+#include "console.h"
+#include "trace.h"
+
+#define PROV_MAX_FIELDS        24
+
+static const char *TAG = "PROV";
+
+static const char *_namespace = NULL;
+static const prov_field_t *_fields = NULL;
+static size_t _fieldCount = 0;
+static prov_apply_cb_t _onApply = NULL;
+
+_Static_assert( 2 + PROV_VALUE_MAX <= CONSOLE_PAYLOAD_MAX, "a PROV_VALUE_MAX field must fit in one frame" );
+
+/* Only the console worker runs the handler */
+static uint8_t _reply[ CONSOLE_PAYLOAD_MAX ];
+
+static const prov_field_t *prov_find( uint8_t tag )
+{
+    for ( size_t i = 0; i < _fieldCount; i++ ) {
+        if ( _fields[ i ].tag == tag ) {
+            return &_fields[ i ];
+        }
+    }
+    return NULL;
+}
+
+static prov_status_t prov_check( const prov_field_t *field, const uint8_t *value, uint8_t len )
+{
+    char text[ PROV_VALUE_MAX + 1 ];
+    char *end;
+
+    if ( field == NULL ) {
+        return PROV_ERR_TAG;
+    }
+    if ( field->flags & PROV_READONLY ) {
+        return PROV_ERR_READONLY;
+    }
+    if ( ( len > field->max_len ) || ( len > PROV_VALUE_MAX ) || ( memchr( value, '\0', len ) != NULL ) ) {
+        return PROV_ERR_VALUE;
+    }
+
+    memcpy( text, value, len );
+    text[ len ] = '\0';
+
+    switch ( field->type ) {
+    case PROV_NUM:
+        strtof( text, &end );
+        if ( ( end == text ) || ( *end != '\0' ) ) {
+            return PROV_ERR_VALUE;
+        }
+        break;
+    case PROV_INT: {
+        long v = strtol( text, &end, 10 );
+        if ( ( end == text ) || ( *end != '\0' ) || ( v < field->min ) || ( v > field->max ) ) {
+            return PROV_ERR_VALUE;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    /* Before the commit, a value the firmware cannot use is never stored */
+    return ( ( field->valid == NULL ) || field->valid( text ) ) ? PROV_OK : PROV_ERR_VALUE;
+}
+
+static void prov_result( uint8_t seq, prov_status_t status, uint8_t tag, uint8_t applied )
+{
+    uint8_t payload[ 3 ] = { status, tag, applied };
+    console_send_frame( seq, PROV_T_RESULT, payload, sizeof( payload ) );
+}
+
+/**
+ * @brief Append a TLV to the config reply, a full reply is sent as
+ *        PROV_T_CONFIG_MORE first and the TLV starts the next frame
+ * @return position after the TLV
+ */
+static size_t prov_put( uint8_t seq, size_t pos, uint8_t tag, const void *value, size_t len )
+{
+    if ( len > PROV_VALUE_MAX ) {
+        ESP_LOGW( TAG, "Config value too long, tag 0x%02x left out", tag );
+        return pos;
+    }
+    if ( pos + 2 + len > sizeof( _reply ) ) {
+        console_send_frame( seq, PROV_T_CONFIG_MORE, _reply, pos );
+        pos = 0;
+    }
+    _reply[ pos ] = tag;
+    _reply[ pos + 1 ] = ( uint8_t ) len;
+    memcpy( &_reply[ pos + 2 ], value, len );
+    return pos + 2 + len;
+}
+
+static void prov_get( uint8_t seq )
+{
+    nvs_handle_t handle;
+    uint8_t mac[ 6 ] = {0};
+    char value[ PROV_VALUE_MAX + 1 ];
+    size_t pos;
+
+    esp_read_mac( mac, ESP_MAC_WIFI_STA );
+    pos = prov_put( seq, 0, PROV_TAG_MAC, mac, sizeof( mac ) );
+
+    if ( nvs_open( _namespace, NVS_READONLY, &handle ) != ESP_OK ) {
+        /* Nothing stored yet, the MAC alone still identifies the unit */
+        console_send_frame( seq, PROV_T_CONFIG, _reply, pos );
+        return;
+    }
+
+    for ( size_t i = 0; i < _fieldCount; i++ ) {
+        size_t len = sizeof( value );
+        if ( nvs_get_str( handle, _fields[ i ].key, value, &len ) != ESP_OK ) {
+            continue;
+        }
+        pos = prov_put( seq, pos, _fields[ i ].tag, value, strlen( value ) );
+    }
+    nvs_close( handle );
+
+    console_send_frame( seq, PROV_T_CONFIG, _reply, pos );
+}
+
+/**
+ * @brief Validate every TLV before touching NVS, then write them in order under one commit.
+ *        What was written before a storage error stays, it is reported and applied.
+ */
+static void prov_set( uint8_t seq, const uint8_t *payload, size_t len )
+{
+    const prov_field_t *changed[ PROV_MAX_FIELDS ];
+    size_t count = 0;
+    size_t pos = 0;
+
+    while ( pos < len ) {
+        if ( ( pos + 2 > len ) || ( pos + 2 + payload[ pos + 1 ] > len ) ) {
+            prov_result( seq, PROV_ERR_FORMAT, 0, 0 );
+            return;
+        }
+
+        uint8_t tag = payload[ pos ];
+        const prov_field_t *field = prov_find( tag );
+        prov_status_t status = prov_check( field, &payload[ pos + 2 ], payload[ pos + 1 ] );
+        if ( status != PROV_OK ) {
+            ESP_LOGW( TAG, "Rejected tag 0x%02x (%d)", tag, status );
+            prov_result( seq, status, tag, 0 );
+            return;
+        }
+        for ( size_t i = 0; i < count; i++ ) {
+            if ( changed[ i ] == field ) {
+                ESP_LOGW( TAG, "Tag 0x%02x given twice", tag );
+                prov_result( seq, PROV_ERR_DUPLICATE, tag, 0 );
+                return;
+            }
+        }
+        if ( count < PROV_MAX_FIELDS ) {
+            changed[ count++ ] = field;
+        }
+        pos += 2 + payload[ pos + 1 ];
+    }
+
+    nvs_handle_t handle;
+    if ( nvs_open( _namespace, NVS_READWRITE, &handle ) != ESP_OK ) {
+        prov_result( seq, PROV_ERR_STORAGE, 0, 0 );
+        return;
+    }
+
+    /* Second pass writes, the payload is known to be well formed */
+    prov_status_t status = PROV_OK;
+    uint8_t bad = 0;
+    size_t written = 0;     /* changed[ 0 .. written ), NVS keeps them even if a later one fails */
+    for ( pos = 0; pos < len; pos += 2 + payload[ pos + 1 ] ) {
+        char value[ PROV_VALUE_MAX + 1 ];
+        uint8_t vlen = payload[ pos + 1 ];
+
+        memcpy( value, &payload[ pos + 2 ], vlen );
+        value[ vlen ] = '\0';
+        if ( nvs_set_str( handle, prov_find( payload[ pos ] )->key, value ) != ESP_OK ) {
+            status = PROV_ERR_STORAGE;
+            bad = payload[ pos ];
+            break;
+        }
+        written++;
+    }
+    if ( status == PROV_OK ) {
+        TRACE_BEGIN( TRACE_EV_NVS_COMMIT, 0 );
+        if ( nvs_commit( handle ) != ESP_OK ) {
+            status = PROV_ERR_STORAGE;
+        }
+        TRACE_END( TRACE_EV_NVS_COMMIT, status == PROV_OK );
+    }
+    nvs_close( handle );
+
+    if ( status != PROV_OK ) {
+        ESP_LOGE( TAG, "Storing config failed, %u of %u fields stored", ( unsigned ) written, ( unsigned ) count );
+    } else {
+        ESP_LOGI( TAG, "Applied %u fields", ( unsigned ) written );
+    }
+    /* Stored values are used at the next boot anyway, follow them now */
+    if ( _onApply && ( written > 0 ) ) {
+        _onApply( changed, written );
+    }
+    prov_result( seq, status, bad, ( uint8_t ) written );
+}
+
+static void prov_frame( uint8_t seq, uint8_t type, const uint8_t *payload, size_t len )
+{
+    switch ( type ) {
+    case PROV_T_GET_CONFIG:
+        prov_get( seq );
+        break;
+    case PROV_T_SET_CONFIG:
+        prov_set( seq, payload, len );
+        break;
+    default:
+        prov_result( seq, PROV_ERR_TYPE, 0, 0 );
+        break;
+    }
+}
+
+/**
+ * @brief Answer provisioning frames on the console port
+ * @param nvs_namespace  where the fields live
+ * @param fields         tag to NVS key table, kept by reference
+ * @param count          at most PROV_MAX_FIELDS
+ * @param on_apply       may be NULL
+ */
+void prov_init( const char *nvs_namespace, const prov_field_t *fields, size_t count, prov_apply_cb_t on_apply )
+{
+    _namespace = nvs_namespace;
+    _fields = fields;
+    _fieldCount = ( count < PROV_MAX_FIELDS ) ? count : PROV_MAX_FIELDS;
+    _onApply = on_apply;
+
+    console_set_frame_handler( prov_frame );
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Provisioning messages, carried in console binary frames (see console.h)
+ *
+ * Payloads are TLV lists: tag u8, length u8, value. Values are the NVS strings
+ * as stored, numbers in ASCII decimal, so GET output can be fed back to SET.
+ *
+ *   PROV_T_GET_CONFIG  empty
+ *   PROV_T_CONFIG      PROV_TAG_MAC (6 bytes) followed by every readable field
+ *   PROV_T_CONFIG_MORE part of a config reply too long for one frame, same
+ *                      sequence number, a PROV_T_CONFIG frame ends it. A TLV is
+ *                      never split, the parts concatenated are the whole list.
+ *   PROV_T_SET_CONFIG  fields to change, each tag at most once
+ *   PROV_T_RESULT      status u8, offending tag u8 (0 when none), applied count u8
+ *
+ * A SET is checked as a whole before anything is written: a bad value, tag or
+ * duplicate stores nothing. The fields are then written in payload order. NVS
+ * keeps every write as it happens and has no rollback, so after
+ * PROV_ERR_STORAGE the first "applied" fields are stored (and in use) and the
+ * rest are not.
+ */
+#define PROV_T_GET_CONFIG      0x01
+#define PROV_T_SET_CONFIG      0x02
+#define PROV_T_CONFIG          0x81
+#define PROV_T_RESULT          0x82
+#define PROV_T_CONFIG_MORE     0x83
+
+#define PROV_TAG_MAC           0xF0
+#define PROV_VALUE_MAX         160    /* longest NVS string a field may hold */
+
+typedef enum {
+    PROV_OK = 0,
+    PROV_ERR_FORMAT,        /* TLV runs past the payload */
+    PROV_ERR_TAG,           /* unknown tag */
+    PROV_ERR_VALUE,         /* too long, not a number or out of range */
+    PROV_ERR_READONLY,
+    PROV_ERR_STORAGE,       /* NVS write or commit failed, only the first "applied" fields stored */
+    PROV_ERR_TYPE,          /* unknown message type */
+    PROV_ERR_DUPLICATE,     /* tag given twice in one SET */
+} prov_status_t;
+
+typedef enum {
+    PROV_STR,
+    PROV_NUM,               /* decimal, may carry a fraction */
+    PROV_INT,               /* integer within min .. max */
+} prov_type_t;
+
+#define PROV_READONLY          0x01
+
+typedef struct {
+    uint8_t tag;
+    const char *key;        /* NVS key */
+    prov_type_t type;
+    uint8_t flags;
+    uint8_t max_len;
+    int32_t min;            /* PROV_INT only */
+    int32_t max;
+    bool ( *valid )( const char *value );   /* extra check before anything is stored, may be NULL */
+} prov_field_t;
+
+/**
+ * @brief Called from the console worker after a SET was committed
+ * @param fields  the table entries that changed
+ */
+typedef void ( *prov_apply_cb_t )( const prov_field_t * const *fields, size_t count );
+
+void prov_init( const char *nvs_namespace, const prov_field_t *fields, size_t count, prov_apply_cb_t on_apply );
+
+#ifdef __cplusplus
+}
+#endif
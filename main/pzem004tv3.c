@@ -1,11 +1,27 @@
 #include "esp_log.h"
 #include "pzem004tv3.h"
+#include "trace.h"
+#include "dlog.h"
+#include "pm_mode.h"
 
 /* Declare static func in .c file (linker warnings) */
-static uint16_t crc16(const uint8_t *data, uint16_t len);
+static bool PzemTransact( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t rAddr, uint16_t count, uint8_t *resp );
+static void PzemStoreInputRegs( const uint8_t *resp );
+
+#define PZ_BUS_TIMEOUT    ( 4 * PZ_READ_TIMEOUT )
 
 uint16_t _lastRead = 0; /* Last time values were updated */
 
+/* The sensor bus is half duplex, only one request may be in flight */
+static SemaphoreHandle_t _busLock = NULL;
+static StaticSemaphore_t _busLockBuf;
+
+/* Raw copy of the last good RG_VOLTAGE .. RG_ALARM read, shared by all readers */
+static uint16_t _inputRegs[ PZ_INPUT_REGS ] = {0};
+static int64_t _inputRegsTime = -1;
+
+static pzem_bus_stats_t _busStats = {0};
+
 /**
  * @brief Initialize the UART, configured via struct pzemSetup_t
  * @param pzSetup
@@ -27,7 +43,7 @@ void PzemInit( pzem_setup_t *pzSetup )
         .parity     = UART_PARITY_DISABLE,
         .stop_bits  = UART_STOP_BITS_1,
         .flow_ctrl  = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_APB,
+        .source_clk = PZ_UART_SCLK,
     };
 
     int intr_alloc_flags = 0;
@@ -50,6 +66,27 @@ void PzemInit( pzem_setup_t *pzSetup )
     /* Set UART pins(TX: , RX: , RTS: -1, CTS: -1) */
     ESP_ERROR_CHECK( uart_set_pin( _uart_num, pzSetup->pzem_tx_pin, pzSetup->pzem_rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE ) );
 
+    if ( _busLock == NULL ) {
+        _busLock = xSemaphoreCreateMutexStatic( &_busLockBuf );
+    }
+}
+
+/* The owner of the bus also keeps the chip awake, UART2 does not wake it from light sleep */
+static bool PzemBusTake( void )
+{
+    if ( ( _busLock != NULL ) && ( xSemaphoreTake( _busLock, pdMS_TO_TICKS( PZ_BUS_TIMEOUT ) ) != pdTRUE ) ) {
+        return false;
+    }
+    pm_busy_begin( PM_BUSY_PZEM );
+    return true;
+}
+
+static void PzemBusGive( void )
+{
+    pm_busy_end( PM_BUSY_PZEM );
+    if ( _busLock != NULL ) {
+        xSemaphoreGive( _busLock );
+    }
 }
 
 
@@ -65,7 +102,9 @@ uint16_t PzemReceive( pzem_setup_t *pzSetup, uint8_t *resp, uint16_t len )
     static const char *LOG_TAG = "PZ_RECEIVE";
 
     /* Configure a temporary buffer for the incoming data */
+    TRACE_BEGIN( TRACE_EV_PZEM_RX, len );
     uint16_t rxBytes = uart_read_bytes( pzSetup->pzem_uart, resp, len, pdMS_TO_TICKS( PZ_READ_TIMEOUT ) );
+    TRACE_END( TRACE_EV_PZEM_RX, rxBytes );
 
     if ( rxBytes > 0 ) {
         resp[ rxBytes ] = 0;
@@ -84,17 +123,22 @@ uint16_t PzemReceive( pzem_setup_t *pzSetup, uint8_t *resp, uint16_t len )
  */
 uint8_t PzReadAddress( pzem_setup_t *pzSetup)
 {
-    static uint8_t response[ 7 ] = {0};
+    static uint8_t response[ 7 + 1 ] = {0}; /* PzemReceive() terminates the buffer */
     memset(response, 0, sizeof(response));
 
     uint8_t addr = 0;
 
-    /* Read 1 register */
-    if ( !PzemSendCmd8( pzSetup, CMD_RHR, WREG_ADDR, 0x01, false, 0xFFFF ) ) {
+    if ( !PzemBusTake() ) {
         return INVALID_ADDRESS;
     }
 
-    if ( PzemReceive( pzSetup, response, 7 ) != 7 ) { /* Something went wrong */
+    /* Read 1 register */
+    bool ok = PzemSendCmd8( pzSetup, CMD_RHR, WREG_ADDR, 0x01, false, 0xFFFF ) &&
+              ( PzemReceive( pzSetup, response, 7 ) == 7 );
+
+    PzemBusGive();
+
+    if ( !ok ) { /* Something went wrong */
         return INVALID_ADDRESS;
     }
 
@@ -125,7 +169,7 @@ bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr)
     }
 
     // Write the new address to the register
-    if (!PzemSendCmd8( pzSetup, CMD_WSR, WREG_ADDR, new_addr, true, 0xFFFF )) {
+    if (!PzemWriteRegister( pzSetup, WREG_ADDR, new_addr )) {
         ESP_LOGE(LOG_TAG, "Failed to set the new address !!!!");
         return false;
     }
@@ -141,8 +185,8 @@ bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr)
 bool PzResetEnergy( pzem_setup_t *pzSetup )
 {
     static const char *LOG_TAG = "PZ_RESET_ENERGY";
-    uint8_t buffer[4] = {0};
-    uint8_t reply[5] = {0};
+    uint8_t buffer[5] = {0};
+    uint8_t reply[5 + 1] = {0}; /* PzemReceive() terminates the buffer */
 
     memset(buffer, 0, sizeof(buffer));
     memset(reply, 0, sizeof(reply));
@@ -154,12 +198,19 @@ bool PzResetEnergy( pzem_setup_t *pzSetup )
     buffer[ 4 ] = 0x00;
 
     (void)PzemSetCRC( buffer, 4 );
+
+    if ( !PzemBusTake() ) {
+        return false;
+    }
+
     if (uart_write_bytes( pzSetup->pzem_uart, buffer, 4 ) == -1) {
         ESP_LOGE(LOG_TAG, "Failed to write to sensor/UART !!");
     }
 
     uint16_t length = PzemReceive( pzSetup, reply, 5 );
 
+    PzemBusGive();
+
     if ( ( length == 0 ) || ( length == 5 ) ) {
         return false;
     }
@@ -183,7 +234,7 @@ bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_
 
     /* send and receive buffers memory allocation */
     uint8_t txdata[TX_BUF_SIZE] = {0};
-    uint8_t rxdata[RX_BUF_SIZE] = {0};
+    uint8_t rxdata[RX_BUF_SIZE + 1] = {0}; /* PzemReceive() terminates the buffer */
 
     memset(txdata, 0, sizeof(txdata));
     memset(rxdata, 0, sizeof(rxdata));
@@ -204,7 +255,9 @@ bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_
     /* Add CRC to array */
     (void)PzemSetCRC( txdata, TX_BUF_SIZE );
 
+    TRACE_BEGIN( TRACE_EV_PZEM_TX, regAddr );
     const int txBytes = uart_write_bytes( pzSetup->pzem_uart, txdata, TX_BUF_SIZE );
+    TRACE_END( TRACE_EV_PZEM_TX, txBytes );
 
     ESP_LOGV( LOG_TAG, "Wrote %d bytes", txBytes );
     ESP_LOG_BUFFER_HEXDUMP( LOG_TAG, txdata, txBytes, ESP_LOG_VERBOSE );
@@ -244,94 +297,205 @@ bool PzemGetValues( pzem_setup_t *pzSetup, _current_values_t *pmonValues )
     /* Zero all values */
     (void)PzemZeroValues( ( _current_values_t * ) pmonValues );
 
-    uint8_t respbuff[RESP_BUF_SIZE] = {0};
+    uint8_t respbuff[RESP_BUF_SIZE + 1] = {0}; /* PzemReceive() terminates the buffer */
     memset(respbuff, 0, sizeof(respbuff));
 
+    if ( !PzemBusTake() ) {
+        ESP_LOGE(LOG_TAG, "Sensor bus busy !!");
+        return false;
+    }
 
     /* Tell the sensor to Read 10 Registers from 0x00 to 0x0A (all values) */
-    if (PzemSendCmd8( pzSetup, CMD_RIR, 0x00, 0x0A, false, 0xFFFF ) == false) {
-        ESP_LOGE(LOG_TAG, "Error writing to registers !!");
+    bool ok = PzemTransact( pzSetup, CMD_RIR, RG_VOLTAGE, PZ_INPUT_REGS, respbuff );
+    if ( ok ) {
+        PzemStoreInputRegs( respbuff );
     }
 
-    /* Read response from the sensor, if everything goes well we retreived 25 Bytes */
-    if ( PzemReceive( pzSetup, respbuff, RESP_BUF_SIZE ) != RESP_BUF_SIZE ) { /* Something went wrong */
+    PzemBusGive();
+
+    if ( !ok ) { /* Something went wrong */
         return false;
     }
 
-    if ( !PzemCheckCRC( respbuff, RESP_BUF_SIZE ) ) {
+    dlog( DLOG_PZEM_VALUES_OK );
+
+    /* From our own reply, _inputRegs may already hold a newer read */
+    uint16_t regs[ PZ_INPUT_REGS ];
+    core_unpack_regs( respbuff, PZ_INPUT_REGS, regs );
+    core_decode_input( regs, pmonValues );
+
+    return true;
+}
+
+/**
+ * @brief Send a read request and validate the reply, caller must own the bus
+ * @param pzSetup
+ * @param cmd       CMD_RHR or CMD_RIR
+ * @param rAddr     first register
+ * @param count     number of registers, at most PZ_MAX_READ_REGS
+ * @param resp      at least 5 + 2 * count + 1 bytes
+ * @return bool
+ */
+static bool PzemTransact( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t rAddr, uint16_t count, uint8_t *resp )
+{
+    static const char *LOG_TAG = "PZ_TRANSACT";
+    const uint16_t respLen = 5 + ( 2 * count );
+
+    /* Drop anything left over from an earlier timed out reply */
+    uart_flush_input( pzSetup->pzem_uart );
+
+    _busStats.transactions++;
+
+    if ( !PzemSendCmd8( pzSetup, cmd, rAddr, count, false, 0xFFFF ) ) {
+        ESP_LOGE( LOG_TAG, "Error writing to registers !!" );
+        return false;
+    }
+
+    if ( PzemReceive( pzSetup, resp, respLen ) != respLen ) {
+        _busStats.timeouts++;
+        return false;
+    }
+
+    /* Reply must echo the function code, exceptions set the high bit */
+    bool valid = PzemCheckCRC( resp, respLen ) && ( resp[ 1 ] == cmd ) && ( resp[ 2 ] == 2 * count );
+    TRACE_INSTANT( TRACE_EV_PZEM_CRC, valid );
+    if ( !valid ) {
         ESP_LOGV( LOG_TAG, "Retreived buffer CRC check failed" );
+        _busStats.crc_errors++;
         return false;
-    } else {
-        ESP_LOGI( LOG_TAG, "CRC check OK for GetValues()" );
     }
 
-    pmonValues->voltage = ( ( uint32_t ) respbuff[ 3 ] << 8 | /* Raw voltage in 0.1V */
-                            ( uint32_t ) respbuff[ 4 ] ) / 10.0;
+    return true;
+}
+
+/**
+ * @brief Keep a copy of a full input register read for PzemReadInputCached()
+ * @param resp  validated reply of PZ_INPUT_REGS registers starting at RG_VOLTAGE
+ */
+static void PzemStoreInputRegs( const uint8_t *resp )
+{
+    core_unpack_regs( resp, PZ_INPUT_REGS, _inputRegs );
+    _inputRegsTime = esp_timer_get_time();
+}
+
+/**
+ * @brief Read raw 16 bit registers
+ * @param pzSetup
+ * @param cmd       CMD_RHR (holding) or CMD_RIR (input)
+ * @param rAddr
+ * @param count     1 .. PZ_MAX_READ_REGS
+ * @param regs      receives count registers
+ * @return bool
+ */
+bool PzemReadRegisters( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t rAddr, uint16_t count, uint16_t *regs )
+{
+    uint8_t resp[ 5 + ( 2 * PZ_MAX_READ_REGS ) + 1 ] = {0};
 
-    pmonValues->current = ( ( uint32_t ) respbuff[ 5 ] << 8 | /* Raw current in 0.001A */
-                            ( uint32_t ) respbuff[ 6 ] |
-                            ( uint32_t ) respbuff[ 7 ] << 24 |
-                            ( uint32_t ) respbuff[ 8 ] << 16 ) / 1000.0;
+    if ( ( count == 0 ) || ( count > PZ_MAX_READ_REGS ) ) {
+        return false;
+    }
 
-    pmonValues->power = ( ( uint32_t ) respbuff[ 9 ] << 8 | /* Raw power in 0.1W */
-                          ( uint32_t ) respbuff[ 10 ] |
-                          ( uint32_t ) respbuff[ 11 ] << 24 |
-                          ( uint32_t ) respbuff[ 12 ] << 16 ) / 10.0;
+    if ( !PzemBusTake() ) {
+        return false;
+    }
 
-    pmonValues->energy = ( ( uint32_t ) respbuff[ 13 ] << 8 | /* Raw Energy in 1Wh */
-                           ( uint32_t ) respbuff[ 14 ] |
-                           ( uint32_t ) respbuff[ 15 ] << 24 |
-                           ( uint32_t ) respbuff[ 16 ] << 16 ) / 1000.0;
+    bool ok = PzemTransact( pzSetup, cmd, rAddr, count, resp );
+    if ( ok && ( cmd == CMD_RIR ) && ( rAddr == RG_VOLTAGE ) && ( count == PZ_INPUT_REGS ) ) {
+        PzemStoreInputRegs( resp );
+    }
 
-    pmonValues->frequency = ( ( uint32_t ) respbuff[ 17 ] << 8 | /* Raw Frequency in 0.1Hz */
-                              ( uint32_t ) respbuff[ 18 ] ) / 10.0;
+    PzemBusGive();
 
-    pmonValues->pf = ( ( uint32_t ) respbuff[ 19 ] << 8 | /* Raw pf in 0.01 */
-                       ( uint32_t ) respbuff[ 20 ] ) / 100.0;
+    if ( ok ) {
+        core_unpack_regs( resp, count, regs );
+    }
 
-    /* Currently we don't set alarams yet, not implemented */
-    pmonValues->alarms = ( ( uint32_t ) respbuff[ 21 ] << 8 | /* Raw alarm value */
-                           ( uint32_t ) respbuff[ 22 ] );
+    return ok;
+}
 
-    /* Extra values calculated because not produced by sensor */
-    /* Apparent Power*/
-    pmonValues->apparent_power = (pmonValues->voltage * pmonValues->current);
+/**
+ * @brief Write a single holding register (WREG_ALARM_THR, WREG_ADDR)
+ *        A new WREG_ADDR goes into pzSetup before the bus is released, so no
+ *        other caller builds a frame for the old address
+ * @param pzSetup
+ * @param rAddr
+ * @param val
+ * @return bool  true when the sensor echoed the request
+ */
+bool PzemWriteRegister( pzem_setup_t *pzSetup, uint16_t rAddr, uint16_t val )
+{
+    if ( !PzemBusTake() ) {
+        return false;
+    }
 
-    /* FI, Angle between Apparent and real Power
-        https://www.electricaltechnology.org/2013/07/power-factor.html
-    */
-    pmonValues->fi = 360.0F * (acosf(pmonValues->pf) / (2.0F * 3.14159265F));           // replaced acos() (double) with acosf() (float).
+    uart_flush_input( pzSetup->pzem_uart );
+    _busStats.transactions++;
+    bool ok = PzemSendCmd8( pzSetup, CMD_WSR, rAddr, val, true, 0xFFFF );
+    if ( !ok ) {
+        _busStats.timeouts++;
+    } else if ( rAddr == WREG_ADDR ) {
+        pzSetup->pzem_addr = ( uint8_t ) val;
+    }
 
-    /**
-     * Reactive Power (Q, VAr): also known as phantom power, dissipated power resulting from inductive and capacitive load measured in VAr.
-    */
-    pmonValues->reactive_power = pmonValues->apparent_power * sinf(pmonValues->fi);         // replacd sin() with sinf() as we mainly use floats instead of double
+    PzemBusGive();
 
-    return true;
+    return ok;
 }
 
 /**
- * @brief Add CRC to 8Bit command
- * @param buf
- * @param len
+ * @brief Get RG_VOLTAGE .. RG_ALARM, only touching the bus when the last read is too old.
+ *        Callers that queue up behind a running read get its result instead of
+ *        starting another transaction.
+ * @param pzSetup
+ * @param maxAgeMs  oldest acceptable snapshot
+ * @param regs      receives PZ_INPUT_REGS registers
+ * @return bool
  */
-void PzemSetCRC( uint8_t *buf, uint16_t len )
+bool PzemReadInputCached( pzem_setup_t *pzSetup, uint32_t maxAgeMs, uint16_t *regs )
 {
-    static const char *TAG = "[SETCRC]";
-    uint64_t start = esp_timer_get_time();
+    uint8_t resp[ RESP_BUF_SIZE + 1 ] = {0};
 
-    if ( len <= 2 ) { /* sanity check */
-        return;
+    if ( !PzemBusTake() ) {
+        return false;
     }
 
-    uint16_t crc = crc16( buf, len - 2 ); /* CRC of data */
+    /* Checked with the bus held, so a read that just finished counts */
+    bool ok = ( _inputRegsTime >= 0 ) &&
+              ( ( esp_timer_get_time() - _inputRegsTime ) <= ( ( int64_t ) maxAgeMs * 1000 ) );
 
-    /* Write high and low byte to last two positions */
-    buf[ len - 2 ] = crc & 0xFF;          /* Low byte first */
-    buf[ len - 1 ] = ( crc >> 8 ) & 0xFF; /* High byte second */
+    if ( !ok ) {
+        ok = PzemTransact( pzSetup, CMD_RIR, RG_VOLTAGE, PZ_INPUT_REGS, resp );
+        if ( ok ) {
+            PzemStoreInputRegs( resp );
+        }
+    }
+
+    if ( ok ) {
+        memcpy( regs, _inputRegs, sizeof( _inputRegs ) );
+    }
 
-    uint64_t stop = esp_timer_get_time();
-    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (stop - start));
+    PzemBusGive();
+
+    return ok;
+}
+
+/**
+ * @brief Counters of transactions issued through the bus lock
+ * @param stats
+ */
+void PzemGetBusStats( pzem_bus_stats_t *stats )
+{
+    *stats = _busStats;
+}
+
+/**
+ * @brief Add CRC to 8Bit command
+ * @param buf
+ * @param len
+ */
+void PzemSetCRC( uint8_t *buf, uint16_t len )
+{
+    core_set_crc( buf, len );
 }
 
 /**
@@ -342,18 +506,7 @@ void PzemSetCRC( uint8_t *buf, uint16_t len )
  */
 bool PzemCheckCRC( const uint8_t *buf, uint16_t len )
 {
-    static const char *TAG = "[CHECKCRC]";
-    uint64_t start = esp_timer_get_time();
-
-    if ( len <= 2 ) { /* Sanity check */
-        return false;
-    }
-    uint16_t crc = crc16( buf, len - 2 ); /* Compute CRC of data */
-
-    uint64_t stop = esp_timer_get_time();
-    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (stop - start));
-
-    return ( ( uint16_t ) buf[ len - 2 ] | ( uint16_t ) buf[ len - 1 ] << 8 ) == crc;
+    return core_check_crc( buf, len );
 }
 
 /**
@@ -373,23 +526,3 @@ void PzemZeroValues( _current_values_t *currentValues )
     currentValues->reactive_power = 0.0f;
     currentValues->fi = 0.0f;
 }
-
-/**
- * @brief Calculate CRC and compare to lookup table
- * @param data
- * @param len
- * @return crc result
- */
-static uint16_t crc16(const uint8_t *data, uint16_t len)
-{
-    uint8_t nTemp; // CRC table index
-    uint16_t crc = 0xFFFF; // Default value
-
-    while (len--) {
-        nTemp = *data++ ^ crc;
-        crc >>= 8;
-        crc ^= (uint16_t)pgm_read_word(&crcTable[nTemp]);
-    }
-
-    return crc;
-}
\ No newline at end of file
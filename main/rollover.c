@@ -0,0 +1,195 @@
+#include "rollover.h"
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_sntp.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "trace.h"
+
+#define ROLLOVER_NAMESPACE    "rollover"
+#define ROLLOVER_KEY_LAST     "last"
+#define ROLLOVER_DAY_S        ( 24 * 60 * 60 )
+
+static const char *TAG = "ROLLOVER";
+
+static rollover_cb_t _cb = NULL;
+static esp_timer_handle_t _timer = NULL;
+static int _hour = 0;
+static int _minute = 0;
+static time_t _next = 0;
+static time_t _last = 0;   /* last boundary handled, persisted */
+static portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t _lock = NULL;   /* timer, SNTP and console may all re-arm */
+static StaticSemaphore_t _lockBuf;
+
+static void rollover_store_last( time_t boundary )
+{
+    nvs_handle_t handle;
+
+    _last = boundary;
+    if ( nvs_open( ROLLOVER_NAMESPACE, NVS_READWRITE, &handle ) == ESP_OK ) {
+        nvs_set_i64( handle, ROLLOVER_KEY_LAST, ( int64_t ) boundary );
+        TRACE_BEGIN( TRACE_EV_NVS_COMMIT, 0 );
+        esp_err_t err = nvs_commit( handle );
+        TRACE_END( TRACE_EV_NVS_COMMIT, err == ESP_OK );
+        nvs_close( handle );
+    }
+}
+
+/**
+ * @brief Most recent boundary at or before now, local time
+ * @param now
+ * @return time_t
+ */
+static time_t rollover_prev_boundary( time_t now )
+{
+    struct tm tm;
+
+    localtime_r( &now, &tm );
+    tm.tm_hour = _hour;
+    tm.tm_min = _minute;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    time_t t = mktime( &tm );
+    if ( t > now ) {
+        tm.tm_mday -= 1;  /* mktime normalises across month and year ends */
+        t = mktime( &tm );
+    }
+    return t;
+}
+
+static time_t rollover_next_boundary( time_t prev )
+{
+    struct tm tm;
+
+    localtime_r( &prev, &tm );
+    tm.tm_mday += 1;
+    tm.tm_isdst = -1;
+    return mktime( &tm );
+}
+
+/**
+ * @brief Catch up on missed boundaries, then arm the timer for the next one.
+ *        Safe to call again at any time, e.g. after the clock jumped.
+ */
+static void rollover_arm( void )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+
+    time_t now = time( NULL );
+
+    esp_timer_stop( _timer );
+
+    if ( now < ROLLOVER_MIN_VALID ) {
+        ESP_LOGW( TAG, "Clock not set, waiting for SNTP" );
+        xSemaphoreGive( _lock );
+        return;
+    }
+
+    time_t prev = rollover_prev_boundary( now );
+
+    if ( ( _last != 0 ) && ( _last < prev ) ) {
+        uint32_t crossed = 1 + ( uint32_t ) ( ( prev - _last - 1 ) / ROLLOVER_DAY_S );
+        if ( crossed > 1 ) {
+            ESP_LOGW( TAG, "Catching up %u rollovers", ( unsigned ) crossed );
+        }
+        rollover_store_last( prev );
+        if ( _cb ) {
+            _cb( prev, crossed );
+        }
+    } else if ( _last == 0 ) {
+        /* First run, nothing to catch up on */
+        rollover_store_last( prev );
+    }
+
+    taskENTER_CRITICAL( &_mux );
+    _next = rollover_next_boundary( prev );
+    taskEXIT_CRITICAL( &_mux );
+
+    esp_timer_start_once( _timer, ( uint64_t ) ( _next - now ) * 1000000ULL );
+    ESP_LOGI( TAG, "Next rollover in %lld s", ( long long ) ( _next - now ) );
+
+    xSemaphoreGive( _lock );
+}
+
+static void rollover_timer_cb( void *arg )
+{
+    /* The wall clock may have moved while the monotonic timer ran, re-arm decides */
+    rollover_arm();
+}
+
+static void rollover_time_sync_cb( struct timeval *tv )
+{
+    ESP_LOGI( TAG, "Time synchronised" );
+    rollover_arm();
+}
+
+/**
+ * @brief Set the timezone once and start scheduling daily rollovers
+ * @param hour      local hour of the boundary
+ * @param minute
+ * @param cb
+ */
+void rollover_init( int hour, int minute, rollover_cb_t cb )
+{
+    nvs_handle_t handle;
+    int64_t last = 0;
+
+    setenv( "TZ", ROLLOVER_TZ, 1 );
+    tzset();
+
+    _lock = xSemaphoreCreateMutexStatic( &_lockBuf );
+    _cb = cb;
+    _hour = hour;
+    _minute = minute;
+
+    if ( nvs_open( ROLLOVER_NAMESPACE, NVS_READONLY, &handle ) == ESP_OK ) {
+        nvs_get_i64( handle, ROLLOVER_KEY_LAST, &last );
+        nvs_close( handle );
+    }
+    _last = ( time_t ) last;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = rollover_timer_cb,
+        .name = "rollover",
+    };
+    esp_timer_create( &timer_args, &_timer );
+
+    sntp_set_time_sync_notification_cb( rollover_time_sync_cb );
+    rollover_arm();
+}
+
+/**
+ * @brief Move the boundary, boundaries already handled are not replayed
+ * @param hour
+ * @param minute
+ */
+void rollover_set_time( int hour, int minute )
+{
+    if ( ( hour < 0 ) || ( hour > 23 ) || ( minute < 0 ) || ( minute > 59 ) ) {
+        return;
+    }
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _hour = hour;
+    _minute = minute;
+
+    time_t now = time( NULL );
+    if ( now >= ROLLOVER_MIN_VALID ) {
+        rollover_store_last( rollover_prev_boundary( now ) );
+    }
+    xSemaphoreGive( _lock );
+
+    rollover_arm();
+}
+
+time_t rollover_next( void )
+{
+    taskENTER_CRITICAL( &_mux );
+    time_t next = _next;
+    taskEXIT_CRITICAL( &_mux );
+    return next;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ROLLOVER_TZ            "WIB-7"
+#define ROLLOVER_MIN_VALID     1577836800  /* 2020-01-01, earlier means SNTP has not synced yet */
+
+/**
+ * @brief Called once when boundaries were crossed, crossed > 1 after downtime.
+ *        Runs in the esp_timer or SNTP task, keep it short.
+ */
+typedef void ( *rollover_cb_t )( time_t boundary, uint32_t crossed );
+
+void rollover_init( int hour, int minute, rollover_cb_t cb );
+void rollover_set_time( int hour, int minute );
+time_t rollover_next( void );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,95 @@
+#include "sample_timer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+static const char *TAG = "SAMPLE";
+
+static esp_timer_handle_t _timer = NULL;
+static TaskHandle_t _task = NULL;
+static int64_t _startUs = 0;
+static uint32_t _periodUs = 0;
+static volatile uint32_t _seq = 0;   /* written by the timer callback only */
+static uint32_t _taken = 0;          /* last seq handed to the sampler */
+static sample_timer_stats_t _stats = {0};
+
+static void sample_timer_cb( void *arg )
+{
+    _seq++;
+    xTaskNotifyGive( _task );
+}
+
+/**
+ * @brief Start the periodic timer, the calling task becomes the one that is notified
+ * @param period_ms
+ * @return esp_err_t
+ */
+esp_err_t sample_timer_start( uint32_t period_ms )
+{
+    if ( period_ms == 0 ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = sample_timer_cb,
+        .name = "sample",
+    };
+    esp_err_t err = esp_timer_create( &timer_args, &_timer );
+    if ( err != ESP_OK ) {
+        return err;
+    }
+
+    _task = xTaskGetCurrentTaskHandle();
+    _periodUs = period_ms * 1000;
+    _seq = 0;
+    _taken = 0;
+    _startUs = esp_timer_get_time();
+
+    err = esp_timer_start_periodic( _timer, _periodUs );
+    if ( err == ESP_OK ) {
+        ESP_LOGI( TAG, "Sampling every %u ms", ( unsigned ) period_ms );
+    }
+    return err;
+}
+
+/**
+ * @brief Block until the next period starts
+ * @param tick     filled on success
+ * @param timeout
+ * @return true    a period started, tick->ticks > 1 means samples were missed
+ */
+bool sample_timer_wait( sample_tick_t *tick, TickType_t timeout )
+{
+    if ( ulTaskNotifyTake( pdTRUE, timeout ) == 0 ) {
+        return false;
+    }
+
+    uint32_t seq = _seq;
+    uint32_t ticks = seq - _taken;
+    if ( ticks == 0 ) {
+        return false;   /* a stale notification, already consumed with the previous seq */
+    }
+    _taken = seq;
+
+    tick->seq = seq;
+    tick->ticks = ticks;
+    tick->period_us = _periodUs;
+    /* The timer re-arms from its last alarm, so this is when the alarm was due */
+    tick->t_us = _startUs + ( int64_t ) seq * _periodUs;
+
+    uint32_t late = ( uint32_t ) ( esp_timer_get_time() - tick->t_us );
+    _stats.ticks += ticks;
+    _stats.overruns += ticks - 1;
+    if ( late > _stats.late_max_us ) {
+        _stats.late_max_us = late;
+    }
+    if ( ticks > 1 ) {
+        ESP_LOGW( TAG, "Overrun, %u periods missed", ( unsigned ) ( ticks - 1 ) );
+    }
+    return true;
+}
+
+void sample_timer_get_stats( sample_timer_stats_t *stats )
+{
+    *stats = _stats;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sampling cadence from a periodic esp_timer. The timer re-arms from its
+ * previous alarm, not from when the callback ran, so the period does not drift
+ * and has microsecond resolution regardless of CONFIG_FREERTOS_HZ.
+ */
+typedef struct {
+    uint32_t seq;           /* periods since start */
+    uint32_t ticks;         /* periods since the previous wait, more than 1 after an overrun */
+    int64_t t_us;           /* nominal instant of seq on the esp_timer clock */
+    uint32_t period_us;
+} sample_tick_t;
+
+typedef struct {
+    uint32_t ticks;         /* timer periods elapsed */
+    uint32_t overruns;      /* periods that passed without a sample */
+    uint32_t late_max_us;   /* worst wake-up after the nominal instant */
+} sample_timer_stats_t;
+
+esp_err_t sample_timer_start( uint32_t period_ms );
+bool sample_timer_wait( sample_tick_t *tick, TickType_t timeout );
+void sample_timer_get_stats( sample_timer_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,261 @@
+#include "tariff.h"
+#include <string.h>
+
+#define TARIFF_RATE_MAX_SEN    10000000UL   /* Rp 100000 per kWh */
+#define TARIFF_BLOCK_MAX_KWH   1000000UL
+#define TARIFF_PCT_MAX         1000
+
+/**
+ * @brief Exactly n decimal digits
+ * @return false when fewer are there
+ */
+static bool tariff_digits( const char **p, int n, uint32_t *out )
+{
+    uint32_t v = 0;
+
+    for ( int i = 0; i < n; i++ ) {
+        char c = ( *p )[ i ];
+        if ( ( c < '0' ) || ( c > '9' ) ) {
+            return false;
+        }
+        v = v * 10 + ( c - '0' );
+    }
+    *p += n;
+    *out = v;
+    return true;
+}
+
+/**
+ * @brief One or more decimal digits, at most max
+ */
+static bool tariff_uint( const char **p, uint32_t max, uint32_t *out )
+{
+    uint32_t v = 0;
+    const char *start = *p;
+
+    while ( ( **p >= '0' ) && ( **p <= '9' ) ) {
+        v = v * 10 + ( *( *p )++ - '0' );
+        if ( v > max ) {
+            return false;
+        }
+    }
+    *out = v;
+    return *p != start;
+}
+
+/**
+ * @brief Rupiah with up to 2 decimals, as sen
+ */
+static bool tariff_rate( const char **p, uint32_t *sen )
+{
+    uint32_t rp;
+    uint32_t frac = 0;
+
+    if ( !tariff_uint( p, TARIFF_RATE_MAX_SEN / 100, &rp ) ) {
+        return false;
+    }
+    if ( **p == '.' ) {
+        ( *p )++;
+        for ( int i = 0; i < 2; i++ ) {
+            frac *= 10;
+            if ( ( **p >= '0' ) && ( **p <= '9' ) ) {
+                frac += *( *p )++ - '0';
+            }
+        }
+    }
+    *sen = rp * 100 + frac;
+    return *sen <= TARIFF_RATE_MAX_SEN;
+}
+
+/**
+ * @brief HHMM as minutes of the day, 2400 only when end is allowed
+ */
+static bool tariff_hhmm( const char **p, bool end, uint32_t *minute )
+{
+    uint32_t hhmm;
+
+    if ( !tariff_digits( p, 4, &hhmm ) ) {
+        return false;
+    }
+    uint32_t h = hhmm / 100;
+    uint32_t m = hhmm % 100;
+    *minute = h * 60 + m;
+    return ( m < 60 ) && ( ( h < 24 ) || ( end && ( hhmm == 2400 ) ) ) && ( ( *minute % TARIFF_SLOT_MIN ) == 0 );
+}
+
+static bool tariff_band_digit( const char **p, uint8_t *band )
+{
+    char c = **p;
+
+    if ( ( c < '0' ) || ( c >= '0' + TARIFF_MAX_BANDS ) ) {
+        return false;
+    }
+    ( *p )++;
+    *band = c - '0';
+    return true;
+}
+
+/**
+ * @brief One token at p, which is left after it
+ */
+static bool tariff_token( const char **p, tariff_table_t *t, uint8_t *defined, uint8_t *used )
+{
+    uint8_t band;
+    uint32_t a;
+    uint32_t b;
+
+    switch ( *( *p )++ ) {
+    case 'r':
+        if ( !tariff_band_digit( p, &band ) || ( *( *p )++ != '=' ) || !tariff_rate( p, &a ) ) {
+            return false;
+        }
+        t->rate_sen[ band ] = a;
+        *defined |= 1u << band;
+        return true;
+
+    case 'w':
+    case 'h': {
+        tariff_day_t day = ( ( *p )[ -1 ] == 'w' ) ? TARIFF_WEEKDAY : TARIFF_HOLIDAY;
+        if ( !tariff_hhmm( p, false, &a ) || ( *( *p )++ != '-' ) || !tariff_hhmm( p, true, &b ) || ( b <= a ) ||
+             ( *( *p )++ != '=' ) || !tariff_band_digit( p, &band ) ) {
+            return false;
+        }
+        memset( &t->band[ day ][ a / TARIFF_SLOT_MIN ], band, ( b - a ) / TARIFF_SLOT_MIN );
+        *used |= 1u << band;
+        return true;
+    }
+
+    case 'b':
+        if ( ( t->blocks == TARIFF_MAX_BLOCKS ) || !tariff_uint( p, TARIFF_BLOCK_MAX_KWH, &a ) ||
+             ( *( *p )++ != '=' ) || !tariff_uint( p, TARIFF_PCT_MAX, &b ) || ( b == 0 ) ) {
+            return false;
+        }
+        t->block[ t->blocks ].from_uwh = ( uint64_t ) a * 1000000000ULL;
+        t->block[ t->blocks ].pct = ( uint16_t ) b;
+        if ( ( t->blocks > 0 ) && ( t->block[ t->blocks ].from_uwh <= t->block[ t->blocks - 1 ].from_uwh ) ) {
+            return false;
+        }
+        t->blocks++;
+        return true;
+
+    case 'l':
+        if ( !tariff_digits( p, 4, &a ) || ( a / 100 < 1 ) || ( a / 100 > 12 ) || ( a % 100 < 1 ) || ( a % 100 > 31 ) ) {
+            return false;
+        }
+        t->holidays[ a / 100 - 1 ] |= 1UL << ( a % 100 - 1 );
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Build a lookup table from schedule text, see tariff.h
+ * @param spec
+ * @param t         left half written on failure, so compile into a table not in use
+ * @param err_pos   offset of the bad token, or the length when a rate is missing
+ * @return bool
+ */
+bool tariff_compile( const char *spec, tariff_table_t *t, int *err_pos )
+{
+    uint8_t defined = 0;
+    uint8_t used = 1;       /* uncovered slots are band 0 */
+    const char *p = spec;
+
+    memset( t, 0, sizeof( *t ) );
+    *err_pos = 0;
+
+    for ( ;; ) {
+        while ( *p == ' ' ) {
+            p++;
+        }
+        if ( *p == '\0' ) {
+            break;
+        }
+        const char *start = p;
+        if ( !tariff_token( &p, t, &defined, &used ) || ( ( *p != ' ' ) && ( *p != '\0' ) ) ) {
+            *err_pos = start - spec;
+            return false;
+        }
+    }
+
+    if ( ( used & ~defined ) != 0 ) {
+        *err_pos = p - spec;
+        return false;
+    }
+    for ( int b = TARIFF_MAX_BANDS - 1; b >= 0; b-- ) {
+        if ( ( used | defined ) & ( 1u << b ) ) {
+            t->bands = b + 1;
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Weekday or holiday schedule for a date
+ * @param t
+ * @param wday   0 Sunday .. 6 Saturday
+ * @param mon    1 .. 12
+ * @param mday   1 .. 31
+ */
+tariff_day_t tariff_day_type( const tariff_table_t *t, int wday, int mon, int mday )
+{
+    if ( ( wday == 0 ) || ( wday == 6 ) ) {
+        return TARIFF_HOLIDAY;
+    }
+    if ( ( mon >= 1 ) && ( mon <= 12 ) && ( mday >= 1 ) && ( mday <= 31 ) &&
+         ( t->holidays[ mon - 1 ] & ( 1UL << ( mday - 1 ) ) ) ) {
+        return TARIFF_HOLIDAY;
+    }
+    return TARIFF_WEEKDAY;
+}
+
+/**
+ * @brief Band rate with the block the month's energy is in
+ * @param t
+ * @param band
+ * @param month_uwh   energy this month before the sample
+ * @return uint32_t   sen per kWh
+ */
+uint32_t tariff_rate_sen( const tariff_table_t *t, uint8_t band, uint64_t month_uwh )
+{
+    uint32_t rate = t->rate_sen[ band % TARIFF_MAX_BANDS ];
+    uint32_t pct = 100;
+
+    for ( uint8_t i = 0; ( i < t->blocks ) && ( month_uwh >= t->block[ i ].from_uwh ); i++ ) {
+        pct = t->block[ i ].pct;
+    }
+    return ( pct == 100 ) ? rate : ( uint32_t ) ( ( ( uint64_t ) rate * pct + 50 ) / 100 );
+}
+
+/**
+ * @brief Cost of energy at a rate, rounded to the nearest micro rupiah
+ * @param uwh
+ * @param rate_sen
+ * @return int64_t   micro rupiah
+ */
+int64_t tariff_cost_urp( uint64_t uwh, uint32_t rate_sen )
+{
+    /* uWh x sen/kWh is 1e-11 Rp */
+    return ( int64_t ) ( ( uwh * rate_sen + 50000 ) / 100000 );
+}
+
+uint64_t tariff_acc_energy( const tariff_acc_t *acc )
+{
+    uint64_t sum = 0;
+    for ( int b = 0; b < TARIFF_MAX_BANDS; b++ ) {
+        sum += acc->energy_uwh[ b ];
+    }
+    return sum;
+}
+
+int64_t tariff_acc_cost( const tariff_acc_t *acc )
+{
+    int64_t sum = 0;
+    for ( int b = 0; b < TARIFF_MAX_BANDS; b++ ) {
+        sum += acc->cost_urp[ b ];
+    }
+    return sum;
+}
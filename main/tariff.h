@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Time-of-use and block tariff engine, plain C like core.c
+ *
+ * A schedule is compiled once into a table: for weekdays and for holidays
+ * (Saturday, Sunday and listed dates) one band per TARIFF_SLOT_MIN minutes,
+ * a holiday bit per date, a rate per band and up to TARIFF_MAX_BLOCKS blocks
+ * on the month's energy. A sample then costs two array reads and a short
+ * block scan, no parsing and no float math.
+ *
+ * Schedule text, tokens separated by spaces (no commas, it comes through the
+ * console as one field):
+ *
+ *   r<band>=<Rp per kWh>     rate, up to 2 decimals, r0 is required
+ *   w<HHMM>-<HHMM>=<band>    weekday window, minutes a multiple of TARIFF_SLOT_MIN
+ *   h<HHMM>-<HHMM>=<band>    holiday window, slots not covered stay in band 0
+ *   b<kWh>=<percent>         from this month's energy on, percent of the band rate
+ *   l<MMDD>                  holiday date
+ *
+ *   "r0=1444.70 r1=2166.00 w1700-2200=1 b900=150 l0101 l0817"
+ *
+ * Units are fixed point: rates in sen (0.01 Rp) per kWh, energy in uWh and
+ * cost in micro rupiah, so sums over a month carry no float error.
+ */
+#define TARIFF_MAX_BANDS       4
+#define TARIFF_MAX_BLOCKS      4
+#define TARIFF_SLOT_MIN        15
+#define TARIFF_SLOTS           ( 24 * 60 / TARIFF_SLOT_MIN )
+#define TARIFF_SPEC_MAX        160    /* text, NUL excluded */
+
+typedef enum {
+    TARIFF_WEEKDAY = 0,
+    TARIFF_HOLIDAY,
+    TARIFF_DAY_TYPES
+} tariff_day_t;
+
+typedef struct {
+    uint64_t from_uwh;      /* month energy where the block starts */
+    uint16_t pct;           /* of the band rate */
+} tariff_block_t;
+
+typedef struct {
+    uint8_t band[ TARIFF_DAY_TYPES ][ TARIFF_SLOTS ];
+    uint32_t rate_sen[ TARIFF_MAX_BANDS ];     /* 0.01 Rp per kWh */
+    uint8_t bands;                             /* highest band used + 1 */
+    uint8_t blocks;
+    tariff_block_t block[ TARIFF_MAX_BLOCKS ]; /* ascending from_uwh */
+    uint32_t holidays[ 12 ];                   /* month m day d is bit d - 1 of word m - 1 */
+} tariff_table_t;
+
+/* Energy and cost per band */
+typedef struct {
+    uint64_t energy_uwh[ TARIFF_MAX_BANDS ];
+    int64_t cost_urp[ TARIFF_MAX_BANDS ];
+} tariff_acc_t;
+
+bool tariff_compile( const char *spec, tariff_table_t *t, int *err_pos );
+
+tariff_day_t tariff_day_type( const tariff_table_t *t, int wday, int mon, int mday );
+uint32_t tariff_rate_sen( const tariff_table_t *t, uint8_t band, uint64_t month_uwh );
+int64_t tariff_cost_urp( uint64_t uwh, uint32_t rate_sen );
+
+uint64_t tariff_acc_energy( const tariff_acc_t *acc );
+int64_t tariff_acc_cost( const tariff_acc_t *acc );
+
+/**
+ * @brief Band of a minute of the day, O(1)
+ * @param t
+ * @param day
+ * @param minute   0 .. 1439
+ */
+static inline uint8_t tariff_band( const tariff_table_t *t, tariff_day_t day, uint32_t minute )
+{
+    return t->band[ day ][ ( minute / TARIFF_SLOT_MIN ) % TARIFF_SLOTS ];
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Task layout and static memory budget, every task this firmware creates is declared here
+ *
+ * Core 1 (APP_CPU) runs the sampler (PZEM read, billing, the relay) and, one
+ * priority above it, the over-power protect task. Core 0 (PRO_CPU) carries
+ * Wi-Fi (pinned there by sdkconfig), lwIP (pinned by sdkconfig), esp_timer,
+ * TLS and everything else of ours.
+ *
+ * System tasks for reference: Wi-Fi 23, esp_timer 22, event loop 20, lwIP 18.
+ * The sampler sits below them but nothing else of ours runs on its core, so
+ * only the protect task's short polls, NVS commits (both caches off) and
+ * interrupts can delay it.
+ *
+ * Stacks are in bytes, sized from <top> high-water marks with some margin.
+ * They are allocated statically from TASK_TABLE by mem_budget.c, <mem> shows
+ * what each subsystem uses. The httpd task belongs to esp_http_server and comes
+ * from the heap, it is charged to metrics by the heap measurement at start.
+ */
+#define TASK_CORE_SAMPLER          1
+#define TASK_CORE_NET              0
+
+/*                                 priority                 stack   core */
+#define TASK_PROTECT_PRIO          ( configMAX_PRIORITIES - 7 )
+#define TASK_PROTECT_STACK         2560
+#define TASK_PROTECT_CORE          TASK_CORE_SAMPLER
+
+#define TASK_POWERMON_PRIO         ( configMAX_PRIORITIES - 8 )
+#define TASK_POWERMON_STACK        5120
+#define TASK_POWERMON_CORE         TASK_CORE_SAMPLER
+
+#define TASK_CONSOLE_PRIO          10
+#define TASK_CONSOLE_STACK         3072
+#define TASK_CONSOLE_CORE          TASK_CORE_NET
+
+#define TASK_CONSOLE_WORKER_PRIO   5
+#define TASK_CONSOLE_WORKER_STACK  8192     /* NVS, HTTP and TLS from handlers */
+#define TASK_CONSOLE_WORKER_CORE   TASK_CORE_NET
+
+#define TASK_TELEGRAM_PRIO         4
+#define TASK_TELEGRAM_STACK        7168     /* TLS handshake, URL and body are in the network pool */
+#define TASK_TELEGRAM_CORE         TASK_CORE_NET
+
+#define TASK_MODBUS_TCP_PRIO       5
+#define TASK_MODBUS_TCP_STACK      4096
+#define TASK_MODBUS_TCP_CORE       TASK_CORE_NET
+
+#define TASK_TELEMETRY_PRIO        3
+#define TASK_TELEMETRY_STACK       4096
+#define TASK_TELEMETRY_CORE        TASK_CORE_NET
+
+#define TASK_HTTPD_PRIO            ( tskIDLE_PRIORITY + 1 )
+#define TASK_HTTPD_STACK           3072
+#define TASK_HTTPD_CORE            TASK_CORE_NET
+
+#define TASK_DISPLAY_PRIO          ( tskIDLE_PRIORITY + 1 )
+#define TASK_DISPLAY_STACK         2560
+#define TASK_DISPLAY_CORE          TASK_CORE_NET
+
+#define TASK_DLOG_PRIO             ( tskIDLE_PRIORITY + 1 )
+#define TASK_DLOG_STACK            3072     /* esp_log_write into the UART0 driver */
+#define TASK_DLOG_CORE             TASK_CORE_NET
+
+/*
+ * Static tasks, one row each: id, name, priority, stack, core, subsystem.
+ * The total must stay inside TASK_STACK_BUDGET, checked at compile time.
+ */
+#define TASK_TABLE( X ) \
+    X( PROTECT,        "protect",        TASK_PROTECT_PRIO,        TASK_PROTECT_STACK,        TASK_PROTECT_CORE,        METER ) \
+    X( POWERMON,       "PowerMon",       TASK_POWERMON_PRIO,       TASK_POWERMON_STACK,       TASK_POWERMON_CORE,       METER ) \
+    X( CONSOLE,        "console",        TASK_CONSOLE_PRIO,        TASK_CONSOLE_STACK,        TASK_CONSOLE_CORE,        CONSOLE ) \
+    X( CONSOLE_WORKER, "console_worker", TASK_CONSOLE_WORKER_PRIO, TASK_CONSOLE_WORKER_STACK, TASK_CONSOLE_WORKER_CORE, CONSOLE ) \
+    X( TELEGRAM,       "telegram",       TASK_TELEGRAM_PRIO,       TASK_TELEGRAM_STACK,       TASK_TELEGRAM_CORE,       NET ) \
+    X( MODBUS_TCP,     "modbus_tcp",     TASK_MODBUS_TCP_PRIO,     TASK_MODBUS_TCP_STACK,     TASK_MODBUS_TCP_CORE,     NET ) \
+    X( TELEMETRY,      "telemetry",      TASK_TELEMETRY_PRIO,      TASK_TELEMETRY_STACK,      TASK_TELEMETRY_CORE,      TELEMETRY ) \
+    X( DISPLAY,        "display",        TASK_DISPLAY_PRIO,        TASK_DISPLAY_STACK,        TASK_DISPLAY_CORE,        DISPLAY ) \
+    X( DLOG,           "dlog",           TASK_DLOG_PRIO,           TASK_DLOG_STACK,           TASK_DLOG_CORE,           CONSOLE )
+
+#define TASK_STACK_BUDGET          ( 41 * 1024 )
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,493 @@
+#include "telemetry.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "mem_budget.h"
+#include "pm_mode.h"
+#include "trace.h"
+#include <time.h>
+
+#define TLM_RECORD_MAX       ( 2 + 5 + ( 7 * 5 ) )
+#define TLM_SAMPLE_FIELDS    7
+#define TLM_RETRY_MIN_MS     5000
+#define TLM_RETRY_MAX_MS     120000
+#define TLM_NVS_NAMESPACE    "tlm_spool"
+
+static const char *TAG = "TELEMETRY";
+
+typedef struct {
+    uint16_t len;
+    uint16_t records;
+    uint8_t data[ TLM_FRAME_MAX ];
+} tlm_frame_t;
+
+/* Frame being filled by the producers */
+static tlm_frame_t _open;
+static int64_t _openFirstUs = 0;
+static int64_t _lastRecUs = 0;
+static int32_t _prev[ TLM_SAMPLE_FIELDS ];
+static uint32_t _seq = 0;
+
+/* Closed frames waiting for upload, _ramCount entries ending before _ramHead */
+static tlm_frame_t _ram[ TLM_RAM_FRAMES ];
+static uint8_t _ramHead = 0;
+static uint8_t _ramCount = 0;
+
+/* Flash spool ring, absolute counters stored next to the slots */
+static uint32_t _flashHead = 0;
+static uint32_t _flashTail = 0;
+
+static tlm_frame_t _tx;                /* uploader's private copy */
+static uint8_t _devId[ 6 ] = {0};
+static char _url[ TLM_URL_MAX ] = {0};          /* last set, under _lock */
+static bool _urlChanged = false;                /* under _lock */
+static char _urlActive[ TLM_URL_MAX ] = {0};    /* uploader's copy of _url */
+static tlm_stats_t _stats = {0};
+
+static SemaphoreHandle_t _lock = NULL;
+static StaticSemaphore_t _lockBuf;
+static TaskHandle_t _task = NULL;
+
+static uint8_t *tlm_put_uvarint( uint8_t *p, uint32_t v )
+{
+    while ( v >= 0x80 ) {
+        *p++ = ( v & 0x7F ) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *tlm_put_svarint( uint8_t *p, int32_t v )
+{
+    return tlm_put_uvarint( p, ( ( uint32_t ) v << 1 ) ^ ( uint32_t ) ( v >> 31 ) );
+}
+
+static void tlm_put_u32( uint8_t *p, uint32_t v )
+{
+    p[ 0 ] = v & 0xFF;
+    p[ 1 ] = ( v >> 8 ) & 0xFF;
+    p[ 2 ] = ( v >> 16 ) & 0xFF;
+    p[ 3 ] = ( v >> 24 ) & 0xFF;
+}
+
+/* Caller holds _lock */
+static void tlm_open_frame( void )
+{
+    uint8_t *p = _open.data;
+
+    *p++ = 'P';
+    *p++ = 'M';
+    *p++ = TLM_VERSION;
+    *p++ = 0;
+    memcpy( p, _devId, sizeof( _devId ) );
+    p += sizeof( _devId );
+    tlm_put_u32( p, _seq++ );
+    tlm_put_u32( p + 4, ( uint32_t ) time( NULL ) );
+
+    _open.len = TLM_HEADER_LEN;
+    _open.records = 0;
+    _openFirstUs = esp_timer_get_time();
+    _lastRecUs = _openFirstUs;
+    memset( _prev, 0, sizeof( _prev ) );
+}
+
+/* Caller holds _lock. Seals the open frame into the RAM ring. */
+static void tlm_close_frame( void )
+{
+    if ( _open.records == 0 ) {
+        return;
+    }
+
+    _open.data[ 18 ] = _open.records & 0xFF;
+    _open.data[ 19 ] = _open.records >> 8;
+    _open.len += 2;
+    PzemSetCRC( _open.data, _open.len );
+
+    if ( _ramCount == TLM_RAM_FRAMES ) {
+        /* Uploader did not get to spill it, lose the oldest */
+        _ramCount--;
+        _stats.frames_dropped++;
+    }
+
+    _ram[ _ramHead ] = _open;
+    _ramHead = ( _ramHead + 1 ) % TLM_RAM_FRAMES;
+    _ramCount++;
+
+    tlm_open_frame();
+
+    if ( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+/*
+ * Caller holds _lock. Returns write pointer after type and time delta.
+ * The reference advances by the whole milliseconds written, so truncation
+ * does not accumulate and a 1 s sampler decodes as exactly 1000 ms apart.
+ */
+static uint8_t *tlm_begin_record( uint8_t type, int64_t now )
+{
+    if ( _open.len + TLM_RECORD_MAX + 2 > TLM_FRAME_MAX ) {
+        tlm_close_frame();
+    }
+
+    if ( now < _lastRecUs ) {
+        now = _lastRecUs;   /* sampled before the frame was opened */
+    }
+    uint8_t *p = &_open.data[ _open.len ];
+    uint32_t dt_ms = ( uint32_t ) ( ( now - _lastRecUs ) / 1000 );
+
+    *p++ = type;
+    p = tlm_put_uvarint( p, dt_ms );
+    _lastRecUs += ( int64_t ) dt_ms * 1000;
+    return p;
+}
+
+static void tlm_end_record( uint8_t *p )
+{
+    _open.len = p - _open.data;
+    _open.records++;
+}
+
+/**
+ * @brief Append one measurement to the current frame, never blocks on the network
+ * @param values
+ * @param saldo_wh
+ * @param t_us      nominal sample instant from the sample timer, esp_timer clock
+ */
+void telemetry_push_sample( const _current_values_t *values, float saldo_wh, int64_t t_us )
+{
+    if ( _lock == NULL ) {
+        return;
+    }
+
+    const int32_t cur[ TLM_SAMPLE_FIELDS ] = {
+        lroundf( values->voltage * 10.0f ),
+        lroundf( values->current * 1000.0f ),
+        lroundf( values->power * 10.0f ),
+        lroundf( values->energy * 1000.0f ),
+        lroundf( values->frequency * 10.0f ),
+        lroundf( values->pf * 100.0f ),
+        lroundf( saldo_wh ),
+    };
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+
+    uint8_t *p = tlm_begin_record( TLM_REC_SAMPLE, t_us );
+    for ( int i = 0; i < TLM_SAMPLE_FIELDS; i++ ) {
+        p = tlm_put_svarint( p, cur[ i ] - _prev[ i ] );
+        _prev[ i ] = cur[ i ];
+    }
+    tlm_end_record( p );
+
+    xSemaphoreGive( _lock );
+}
+
+/**
+ * @brief Append an event record to the current frame
+ * @param code
+ * @param arg
+ */
+void telemetry_push_event( tlm_event_t code, int32_t arg )
+{
+    if ( _lock == NULL ) {
+        return;
+    }
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+
+    uint8_t *p = tlm_begin_record( TLM_REC_EVENT, esp_timer_get_time() );
+    p = tlm_put_uvarint( p, code );
+    p = tlm_put_svarint( p, arg );
+    tlm_end_record( p );
+
+    xSemaphoreGive( _lock );
+
+    /* Events are rare and interesting, ship them with the next upload */
+    if ( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+static void tlm_flash_load_ring( void )
+{
+    nvs_handle_t handle;
+
+    if ( nvs_open( TLM_NVS_NAMESPACE, NVS_READONLY, &handle ) == ESP_OK ) {
+        nvs_get_u32( handle, "head", &_flashHead );
+        nvs_get_u32( handle, "tail", &_flashTail );
+        nvs_close( handle );
+    }
+}
+
+static bool tlm_flash_store_ring( nvs_handle_t handle )
+{
+    TRACE_BEGIN( TRACE_EV_NVS_COMMIT, 0 );
+    bool ok = ( nvs_set_u32( handle, "head", _flashHead ) == ESP_OK ) &&
+              ( nvs_set_u32( handle, "tail", _flashTail ) == ESP_OK ) &&
+              ( nvs_commit( handle ) == ESP_OK );
+    TRACE_END( TRACE_EV_NVS_COMMIT, ok );
+    return ok;
+}
+
+/**
+ * @brief Move the oldest RAM frame to the flash spool (uploader context)
+ */
+static void tlm_spill_oldest( void )
+{
+    char key[ 8 ];
+    nvs_handle_t handle;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    if ( _ramCount == 0 ) {
+        xSemaphoreGive( _lock );
+        return;
+    }
+    _tx = _ram[ ( _ramHead + TLM_RAM_FRAMES - _ramCount ) % TLM_RAM_FRAMES ];
+    _ramCount--;
+    xSemaphoreGive( _lock );
+
+    if ( nvs_open( TLM_NVS_NAMESPACE, NVS_READWRITE, &handle ) != ESP_OK ) {
+        _stats.frames_dropped++;
+        return;
+    }
+
+    if ( _flashHead - _flashTail >= TLM_FLASH_FRAMES ) {
+        _flashTail++;
+        _stats.frames_dropped++;
+    }
+
+    snprintf( key, sizeof( key ), "f%u", ( unsigned ) ( _flashHead % TLM_FLASH_FRAMES ) );
+    if ( nvs_set_blob( handle, key, _tx.data, _tx.len ) == ESP_OK ) {
+        _flashHead++;
+        _stats.frames_spooled++;
+    } else {
+        _stats.frames_dropped++;
+    }
+    tlm_flash_store_ring( handle );
+    nvs_close( handle );
+}
+
+/**
+ * @brief Copy the oldest pending frame into _tx, flash first since it is older
+ * @param fromFlash  set when the frame came from the flash spool
+ * @return bool false when nothing is pending
+ */
+static bool tlm_peek_oldest( bool *fromFlash )
+{
+    if ( _flashHead != _flashTail ) {
+        char key[ 8 ];
+        nvs_handle_t handle;
+        size_t len = sizeof( _tx.data );
+
+        snprintf( key, sizeof( key ), "f%u", ( unsigned ) ( _flashTail % TLM_FLASH_FRAMES ) );
+        if ( ( nvs_open( TLM_NVS_NAMESPACE, NVS_READONLY, &handle ) == ESP_OK ) ) {
+            esp_err_t err = nvs_get_blob( handle, key, _tx.data, &len );
+            nvs_close( handle );
+            if ( err == ESP_OK ) {
+                _tx.len = len;
+                _tx.records = _tx.data[ 18 ] | ( _tx.data[ 19 ] << 8 );
+                *fromFlash = true;
+                return true;
+            }
+        }
+
+        /* Unreadable slot, skip it */
+        _flashTail++;
+        _stats.frames_dropped++;
+        return false;
+    }
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    bool found = _ramCount > 0;
+    if ( found ) {
+        _tx = _ram[ ( _ramHead + TLM_RAM_FRAMES - _ramCount ) % TLM_RAM_FRAMES ];
+    }
+    xSemaphoreGive( _lock );
+
+    *fromFlash = false;
+    return found;
+}
+
+static void tlm_pop_oldest( bool fromFlash )
+{
+    if ( fromFlash ) {
+        nvs_handle_t handle;
+        _flashTail++;
+        if ( nvs_open( TLM_NVS_NAMESPACE, NVS_READWRITE, &handle ) == ESP_OK ) {
+            tlm_flash_store_ring( handle );
+            nvs_close( handle );
+        }
+        return;
+    }
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    /* The frame may have been dropped by a producer meanwhile, it is still the oldest otherwise */
+    if ( ( _ramCount > 0 ) &&
+            ( memcmp( _ram[ ( _ramHead + TLM_RAM_FRAMES - _ramCount ) % TLM_RAM_FRAMES ].data + 10, _tx.data + 10, 4 ) == 0 ) ) {
+        _ramCount--;
+    }
+    xSemaphoreGive( _lock );
+}
+
+/* Connect, headers sent, data and finish land between the HTTP begin and end */
+static esp_err_t tlm_http_event( esp_http_client_event_t *evt )
+{
+    TRACE_INSTANT( TRACE_EV_HTTP_PHASE, evt->event_id );
+    return ESP_OK;
+}
+
+/**
+ * @brief POST _tx over the kept-alive connection
+ * @param client  recreated when NULL or after an error
+ * @return bool
+ */
+static bool tlm_post( esp_http_client_handle_t *client )
+{
+    if ( *client == NULL ) {
+        esp_http_client_config_t config = {
+            .url = _urlActive,
+            .method = HTTP_METHOD_POST,
+            .timeout_ms = 5000,
+            .keep_alive_enable = true,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+            .event_handler = tlm_http_event,
+        };
+
+        *client = esp_http_client_init( &config );
+        if ( *client == NULL ) {
+            return false;
+        }
+        esp_http_client_set_header( *client, "Content-Type", "application/octet-stream" );
+    }
+
+    esp_http_client_set_post_field( *client, ( const char * ) _tx.data, _tx.len );
+
+    TRACE_BEGIN( TRACE_EV_HTTP, TRACE_HTTP_TELEMETRY );
+    esp_err_t err = esp_http_client_perform( *client );
+    int status = ( err == ESP_OK ) ? esp_http_client_get_status_code( *client ) : 0;
+    TRACE_END( TRACE_EV_HTTP, status );
+
+    if ( ( status < 200 ) || ( status > 299 ) ) {
+        ESP_LOGW( TAG, "Upload failed: %s, status %d", esp_err_to_name( err ), status );
+        esp_http_client_cleanup( *client );
+        *client = NULL;
+        _stats.post_errors++;
+        return false;
+    }
+
+    _stats.frames_sent++;
+    _stats.records_sent += _tx.records;
+    _stats.bytes_sent += _tx.len;
+    return true;
+}
+
+static void telemetry_task( void *arg )
+{
+    esp_http_client_handle_t client = NULL;
+    uint32_t retryMs = TLM_RETRY_MIN_MS;
+
+    while ( 1 ) {
+        ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( TLM_BATCH_MAX_MS ) );
+
+        xSemaphoreTake( _lock, portMAX_DELAY );
+        if ( ( esp_timer_get_time() - _openFirstUs ) >= ( ( int64_t ) TLM_BATCH_MAX_MS * 1000 ) ) {
+            tlm_close_frame();
+        }
+        /* Copy and clear together, a URL set after this is picked up on the next round */
+        bool urlChanged = _urlChanged;
+        if ( urlChanged ) {
+            memcpy( _urlActive, _url, sizeof( _urlActive ) );
+            _urlChanged = false;
+        }
+        xSemaphoreGive( _lock );
+
+        if ( urlChanged && ( client != NULL ) ) {
+            esp_http_client_cleanup( client );
+            client = NULL;
+        }
+
+        /* Without a collector nothing is uploaded, frames are still spooled below */
+        bool online = ( _urlActive[ 0 ] != '\0' );
+        if ( online ) {
+            bool fromFlash;
+            pm_busy_begin( PM_BUSY_NET );
+            while ( tlm_peek_oldest( &fromFlash ) ) {
+                if ( !tlm_post( &client ) ) {
+                    break;
+                }
+                tlm_pop_oldest( fromFlash );
+                retryMs = TLM_RETRY_MIN_MS;
+            }
+            pm_busy_end( PM_BUSY_NET );
+
+            if ( ( _ramCount == 0 ) && ( _flashHead == _flashTail ) ) {
+                continue;
+            }
+        }
+
+        /* Offline: keep one RAM slot free for the next frame, older ones go to flash */
+        while ( _ramCount >= TLM_RAM_FRAMES - 1 ) {
+            tlm_spill_oldest();
+        }
+
+        if ( !online ) {
+            continue;
+        }
+
+        vTaskDelay( pdMS_TO_TICKS( retryMs ) );
+        retryMs = ( retryMs * 2 > TLM_RETRY_MAX_MS ) ? TLM_RETRY_MAX_MS : retryMs * 2;
+    }
+}
+
+/**
+ * @brief Start batching and the uploader task
+ * @param url  collector endpoint, empty keeps everything spooled
+ */
+void telemetry_init( const char *url )
+{
+    esp_read_mac( _devId, ESP_MAC_WIFI_STA );
+    _lock = xSemaphoreCreateMutexStatic( &_lockBuf );
+    telemetry_set_url( url );
+    tlm_flash_load_ring();
+
+    MEM_STATIC( MEM_SUB_TELEMETRY, _ram );
+    MEM_STATIC( MEM_SUB_TELEMETRY, _open );
+    MEM_STATIC( MEM_SUB_TELEMETRY, _tx );
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    tlm_open_frame();
+    xSemaphoreGive( _lock );
+
+    _task = mem_task_start( MEM_TASK_TELEMETRY, telemetry_task, NULL );
+    telemetry_push_event( TLM_EV_BOOT, 0 );
+}
+
+/**
+ * @brief New collector endpoint, the uploader reconnects before its next POST
+ * @param url  empty stops uploading, frames keep being spooled
+ */
+void telemetry_set_url( const char *url )
+{
+    if ( _lock == NULL ) {
+        return;
+    }
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    strncpy( _url, url, sizeof( _url ) - 1 );
+    _url[ sizeof( _url ) - 1 ] = '\0';
+    _urlChanged = true;
+    xSemaphoreGive( _lock );
+
+    if ( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+void telemetry_get_stats( tlm_stats_t *stats )
+{
+    *stats = _stats;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "pzem004tv3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TLM_FRAME_MAX          512    /* one HTTP body */
+#define TLM_BATCH_MAX_MS       30000  /* a partial batch is closed after this long */
+#define TLM_RAM_FRAMES         8      /* closed frames kept in RAM */
+#define TLM_FLASH_FRAMES       32     /* spill slots in NVS for long outages */
+#define TLM_URL_MAX            128
+
+/*
+ * Frame layout, all multi byte header fields little endian
+ *   0  'P' 'M'
+ *   2  version (TLM_VERSION)
+ *   3  flags (reserved, 0)
+ *   4  device id, 6 bytes (Wi-Fi STA MAC)
+ *  10  frame sequence, u32
+ *  14  base time, u32 unix seconds of the first record
+ *  18  record count, u16
+ *  20  records ...
+ *   n  CRC16/MODBUS of everything before it, low byte first
+ *
+ * Record: type u8, dt_ms uvarint since the previous record (first: since base time), then
+ *   TLM_REC_SAMPLE  zigzag varint deltas against the previous sample of the frame:
+ *                   voltage 0.1V, current mA, power 0.1W, energy Wh, frequency 0.1Hz, pf 0.01, balance Wh
+ *   TLM_REC_EVENT   code uvarint, argument zigzag varint
+ */
+#define TLM_VERSION            1
+#define TLM_HEADER_LEN         20
+#define TLM_REC_SAMPLE         0x01
+#define TLM_REC_EVENT          0x02
+
+typedef enum {
+    TLM_EV_BOOT = 1,
+    TLM_EV_DAILY_LIMIT,
+    TLM_EV_DEPLETED,
+    TLM_EV_TOPUP,           /* arg: Wh added */
+    TLM_EV_RESET_KWH,
+    TLM_EV_OVERLOAD,        /* arg: W */
+} tlm_event_t;
+
+typedef struct {
+    uint32_t frames_sent;
+    uint32_t records_sent;
+    uint32_t bytes_sent;
+    uint32_t post_errors;
+    uint32_t frames_spooled;   /* moved to flash while offline */
+    uint32_t frames_dropped;
+} tlm_stats_t;
+
+void telemetry_init( const char *url );
+void telemetry_set_url( const char *url );
+void telemetry_push_sample( const _current_values_t *values, float saldo_wh, int64_t t_us );
+void telemetry_push_event( tlm_event_t code, int32_t arg );
+void telemetry_get_stats( tlm_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,190 @@
+#include "trace.h"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mem_budget.h"
+
+#define TRACE_DUMP_PER_LINE    16     /* records per hex line */
+#define TRACE_DUMP_TASKS       24
+
+_Static_assert( ( TRACE_RING_RECORDS & ( TRACE_RING_RECORDS - 1 ) ) == 0, "TRACE_RING_RECORDS must be a power of two" );
+_Static_assert( sizeof( trace_rec_t ) == 8, "trace_rec_t is dumped as 8 bytes" );
+
+static const char *TAG = "TRACE";
+
+typedef struct {
+    uint32_t head;          /* records written, the slot is head % TRACE_RING_RECORDS */
+    uint32_t syncCycles;
+    uint16_t syncMhz;       /* CCOUNT rate since the last sync */
+    bool synced;
+    trace_rec_t rec[ TRACE_RING_RECORDS ];
+} trace_ring_t;
+
+static volatile bool _enabled = true;
+
+#if TRACE_ENABLE
+/* Only the owning core writes its ring, with its interrupts masked */
+static trace_ring_t _rings[ portNUM_PROCESSORS ];
+static TaskStatus_t _taskStatus[ TRACE_DUMP_TASKS ];
+
+static inline void IRAM_ATTR trace_put( trace_ring_t *r, uint32_t cycles, uint8_t code, uint8_t task, uint16_t arg )
+{
+    trace_rec_t *rec = &r->rec[ r->head++ & ( TRACE_RING_RECORDS - 1 ) ];
+    rec->cycles = cycles;
+    rec->code = code;
+    rec->task = task;
+    rec->arg = arg;
+}
+
+/* Interrupts on this core are masked by the caller */
+static void IRAM_ATTR trace_put_sync( trace_ring_t *r, uint32_t cycles, uint16_t mhz )
+{
+    uint64_t us = ( uint64_t ) esp_timer_get_time();
+    trace_put( r, cycles, TRACE_EV_SYNC, 0, mhz );
+    trace_put( r, ( uint32_t ) us, TRACE_EV_SYNC_US, 0, ( uint16_t ) ( us >> 32 ) );
+    r->syncCycles = cycles;
+    r->syncMhz = mhz;
+    r->synced = true;
+}
+#endif
+
+/**
+ * @brief Account the rings, call once from app_main
+ */
+void trace_init( void )
+{
+#if TRACE_ENABLE
+    MEM_STATIC( MEM_SUB_METRICS, _rings );
+    MEM_STATIC( MEM_SUB_METRICS, _taskStatus );
+#endif
+}
+
+/**
+ * @brief Record one event, use the TRACE_* macros. Tasks and ISRs that run from flash only.
+ * @param code  trace_kind_t << 6 | trace_event_t
+ * @param arg
+ */
+void IRAM_ATTR trace_emit( uint8_t code, uint16_t arg )
+{
+#if TRACE_ENABLE
+    if ( !_enabled ) {
+        return;
+    }
+
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    uint8_t task = ( self != NULL ) ? ( uint8_t ) uxTaskGetTaskNumber( self ) : 0;
+
+    UBaseType_t irq = portSET_INTERRUPT_MASK_FROM_ISR();
+    trace_ring_t *r = &_rings[ esp_cpu_get_core_id() ];
+    uint32_t now = esp_cpu_get_cycle_count();
+    /* DFS updates the ROM tick rate on every switch, a new rate starts a new sync */
+    uint16_t mhz = ( uint16_t ) esp_rom_get_cpu_ticks_per_us();
+    if ( !r->synced || ( now - r->syncCycles >= TRACE_SYNC_CYCLES ) || ( mhz != r->syncMhz ) ) {
+        trace_put_sync( r, now, mhz );
+    }
+    trace_put( r, now, code, task, arg );
+    portCLEAR_INTERRUPT_MASK_FROM_ISR( irq );
+#else
+    ( void ) code;
+    ( void ) arg;
+#endif
+}
+
+/**
+ * @brief Sync pair for this core now, after a wake-up from light sleep or a frequency change
+ */
+void trace_sync( void )
+{
+#if TRACE_ENABLE
+    if ( !_enabled ) {
+        return;
+    }
+
+    UBaseType_t irq = portSET_INTERRUPT_MASK_FROM_ISR();
+    trace_put_sync( &_rings[ esp_cpu_get_core_id() ], esp_cpu_get_cycle_count(), ( uint16_t ) esp_rom_get_cpu_ticks_per_us() );
+    portCLEAR_INTERRUPT_MASK_FROM_ISR( irq );
+#endif
+}
+
+void trace_set_enabled( bool on )
+{
+    _enabled = on;
+}
+
+#if TRACE_ENABLE
+/* Stop writers and give one already past the check time to finish its record */
+static bool trace_pause( void )
+{
+    bool was = _enabled;
+    _enabled = false;
+    vTaskDelay( 1 );
+    return was;
+}
+#endif
+
+/**
+ * @brief Drop everything recorded, the next point on each core starts with a sync
+ */
+void trace_clear( void )
+{
+#if TRACE_ENABLE
+    bool was = trace_pause();
+    for ( int core = 0; core < portNUM_PROCESSORS; core++ ) {
+        _rings[ core ].head = 0;
+        _rings[ core ].synced = false;
+    }
+    _enabled = was;
+#endif
+}
+
+/**
+ * @brief Print task numbers and both rings as hex, oldest first, for tools/trace2chrome.py.
+ *        Tracing is paused while the rings are printed.
+ */
+void trace_dump( void )
+{
+#if TRACE_ENABLE
+    static const char hex[] = "0123456789abcdef";
+    char line[ TRACE_DUMP_PER_LINE * sizeof( trace_rec_t ) * 2 + 1 ];
+
+    bool was = trace_pause();
+
+    /* v2: every sync carries its CPU MHz, mhz here only times v1 dumps */
+    ESP_LOGI( TAG, "begin v2 cores %d records %d mhz %d", portNUM_PROCESSORS, TRACE_RING_RECORDS,
+              CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ );
+
+    UBaseType_t n = uxTaskGetSystemState( _taskStatus, TRACE_DUMP_TASKS, NULL );
+    for ( UBaseType_t i = 0; i < n; i++ ) {
+        ESP_LOGI( TAG, "task %u %s", ( unsigned ) ( _taskStatus[ i ].xTaskNumber & 0xFF ), _taskStatus[ i ].pcTaskName );
+    }
+
+    for ( int core = 0; core < portNUM_PROCESSORS; core++ ) {
+        const trace_ring_t *r = &_rings[ core ];
+        uint32_t count = ( r->head < TRACE_RING_RECORDS ) ? r->head : TRACE_RING_RECORDS;
+
+        ESP_LOGI( TAG, "ring %d written %u", core, ( unsigned ) r->head );
+        for ( uint32_t i = r->head - count; i != r->head; ) {
+            int pos = 0;
+            for ( int k = 0; ( k < TRACE_DUMP_PER_LINE ) && ( i != r->head ); k++, i++ ) {
+                const uint8_t *b = ( const uint8_t * ) &r->rec[ i & ( TRACE_RING_RECORDS - 1 ) ];
+                for ( size_t j = 0; j < sizeof( trace_rec_t ); j++ ) {
+                    line[ pos++ ] = hex[ b[ j ] >> 4 ];
+                    line[ pos++ ] = hex[ b[ j ] & 0x0F ];
+                }
+            }
+            line[ pos ] = '\0';
+            ESP_LOGI( TAG, "rec %d %s", core, line );
+        }
+    }
+
+    ESP_LOGI( TAG, "end" );
+    _enabled = was;
+#else
+    ESP_LOGW( TAG, "built with TRACE_ENABLE 0" );
+#endif
+}
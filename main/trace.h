@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary event trace
+ *
+ * Every trace point writes one 8 byte record into the ring of the core it runs
+ * on: CCOUNT, kind and event, task number and a 16 bit argument. Writing masks
+ * interrupts on that core only for the store, no lock is shared between cores,
+ * and costs a few tens of cycles. Build with TRACE_ENABLE 0 and the points
+ * compile to nothing.
+ *
+ * CCOUNT is per core, follows DFS and stops in light sleep, so each ring gets
+ * a sync pair (CCOUNT with the CPU MHz, esp_timer us) at least every
+ * TRACE_SYNC_CYCLES, on TRACE_SYNC() and at the first point after the CPU
+ * frequency changed. tools/trace2chrome.py times each record from the sync
+ * before it at that sync's clock, work without a busy lock included, and
+ * turns a <trace> dump into Chrome / Perfetto JSON.
+ */
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE           1
+#endif
+
+#define TRACE_RING_RECORDS     256            /* per core, power of two */
+#define TRACE_SYNC_CYCLES      ( 1UL << 24 )  /* 70 ms at 240 MHz, 420 ms at 40 MHz */
+
+typedef enum {
+    TRACE_K_INSTANT = 0,
+    TRACE_K_BEGIN,
+    TRACE_K_END,
+} trace_kind_t;
+
+/* Keep in sync with EVENTS in tools/trace2chrome.py */
+typedef enum {
+    TRACE_EV_SYNC = 0,      /* cycles at the sync point, arg: CPU MHz, followed by TRACE_EV_SYNC_US */
+    TRACE_EV_SYNC_US,       /* cycles: us bits 0..31, arg: bits 32..47 */
+    TRACE_EV_SAMPLE,        /* B/E PMonTask iteration, arg: sequence */
+    TRACE_EV_PZEM_TX,       /* B: first register, E: bytes queued */
+    TRACE_EV_PZEM_RX,       /* B: bytes wanted, E: bytes received */
+    TRACE_EV_PZEM_CRC,      /* I, arg: 1 valid, 0 bad */
+    TRACE_EV_NVS_COMMIT,    /* B/E, E arg: 1 stored */
+    TRACE_EV_LCD_FLUSH,     /* B: I2C bytes, E: 1 acked */
+    TRACE_EV_HTTP,          /* B: client (TRACE_HTTP_*), E: status, 0 on error */
+    TRACE_EV_HTTP_PHASE,    /* I, arg: esp_http_client_event_id_t */
+    TRACE_EV_RELAY,         /* I, arg: level written */
+    TRACE_EV_PROTECT_POLL,  /* B: prot_state_t, E: 1 over the limit */
+    TRACE_EV_COUNT
+} trace_event_t;
+
+#define TRACE_HTTP_TELEMETRY   0
+#define TRACE_HTTP_TELEGRAM    1
+
+/* Little-endian as dumped */
+typedef struct {
+    uint32_t cycles;
+    uint8_t code;           /* trace_kind_t << 6 | trace_event_t */
+    uint8_t task;           /* uxTaskGetTaskNumber, 0 before the scheduler */
+    uint16_t arg;
+} trace_rec_t;
+
+void trace_init( void );
+void trace_emit( uint8_t code, uint16_t arg );
+void trace_sync( void );
+
+void trace_set_enabled( bool on );
+void trace_clear( void );
+void trace_dump( void );
+
+#if TRACE_ENABLE
+#define TRACE_BEGIN( ev, arg )     trace_emit( ( TRACE_K_BEGIN << 6 ) | ( ev ), ( uint16_t ) ( arg ) )
+#define TRACE_END( ev, arg )       trace_emit( ( TRACE_K_END << 6 ) | ( ev ), ( uint16_t ) ( arg ) )
+#define TRACE_INSTANT( ev, arg )   trace_emit( ( TRACE_K_INSTANT << 6 ) | ( ev ), ( uint16_t ) ( arg ) )
+#define TRACE_SYNC()               trace_sync()
+#else
+/* sizeof keeps variables only traced from warning without evaluating anything */
+#define TRACE_BEGIN( ev, arg )     do { ( void ) sizeof( arg ); } while ( 0 )
+#define TRACE_END( ev, arg )       do { ( void ) sizeof( arg ); } while ( 0 )
+#define TRACE_INSTANT( ev, arg )   do { ( void ) sizeof( arg ); } while ( 0 )
+#define TRACE_SYNC()               do { } while ( 0 )
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,256 @@
+#include "wifi_sta.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "pm_mode.h"
+#include "trace.h"
+
+#define WIFI_CACHE_NAMESPACE   "wifi_cache"
+#define WIFI_CACHE_KEY         "ap"
+#define WIFI_CACHE_VERSION     1
+
+static const char *TAG = "WIFI_STA";
+
+/* Last AP that gave us an address */
+typedef struct {
+    uint8_t version;
+    uint8_t channel;
+    uint8_t bssid[ 6 ];
+    char ssid[ 33 ];
+    esp_netif_ip_info_t ip;
+    esp_ip4_addr_t dns;
+} wifi_cache_t;
+
+static wifi_cache_t _cache;
+static bool _cacheValid = false;
+static bool _usingCache = false;
+
+static uint8_t _pendingBssid[ 6 ];
+static uint8_t _pendingChannel = 0;
+
+static esp_netif_t *_netif = NULL;
+static esp_timer_handle_t _retryTimer = NULL;
+static wifi_config_t _config;
+static volatile bool _connected = false;
+static uint32_t _failures = 0;
+static int64_t _offlineSinceUs = 0;
+static wifi_sta_stats_t _stats = {0};
+
+static void wifi_cache_load( const char *ssid )
+{
+    nvs_handle_t handle;
+    size_t len = sizeof( _cache );
+
+    if ( nvs_open( WIFI_CACHE_NAMESPACE, NVS_READONLY, &handle ) != ESP_OK ) {
+        return;
+    }
+
+    _cacheValid = ( nvs_get_blob( handle, WIFI_CACHE_KEY, &_cache, &len ) == ESP_OK ) &&
+                  ( len == sizeof( _cache ) ) &&
+                  ( _cache.version == WIFI_CACHE_VERSION ) &&
+                  ( strncmp( _cache.ssid, ssid, sizeof( _cache.ssid ) ) == 0 );
+    nvs_close( handle );
+}
+
+static void wifi_cache_store( void )
+{
+    nvs_handle_t handle;
+    wifi_cache_t fresh = {0};
+    esp_netif_dns_info_t dns = {0};
+
+    fresh.version = WIFI_CACHE_VERSION;
+    fresh.channel = _pendingChannel;
+    memcpy( fresh.bssid, _pendingBssid, sizeof( fresh.bssid ) );
+    strncpy( fresh.ssid, ( const char * ) _config.sta.ssid, sizeof( fresh.ssid ) - 1 );
+    esp_netif_get_ip_info( _netif, &fresh.ip );
+    if ( esp_netif_get_dns_info( _netif, ESP_NETIF_DNS_MAIN, &dns ) == ESP_OK ) {
+        fresh.dns = dns.ip.u_addr.ip4;
+    }
+
+    /* Reconnects to the same AP must not wear the flash */
+    if ( _cacheValid && ( memcmp( &fresh, &_cache, sizeof( fresh ) ) == 0 ) ) {
+        return;
+    }
+
+    if ( nvs_open( WIFI_CACHE_NAMESPACE, NVS_READWRITE, &handle ) != ESP_OK ) {
+        return;
+    }
+    TRACE_BEGIN( TRACE_EV_NVS_COMMIT, 0 );
+    bool stored = ( nvs_set_blob( handle, WIFI_CACHE_KEY, &fresh, sizeof( fresh ) ) == ESP_OK ) &&
+                  ( nvs_commit( handle ) == ESP_OK );
+    TRACE_END( TRACE_EV_NVS_COMMIT, stored );
+    if ( stored ) {
+        _cache = fresh;
+        _cacheValid = true;
+        ESP_LOGI( TAG, "Cached AP channel %d", fresh.channel );
+    }
+    nvs_close( handle );
+}
+
+/**
+ * @brief Stop steering the driver to the cached AP, next attempt does a full scan
+ */
+static void wifi_cache_drop( void )
+{
+    _usingCache = false;
+    _stats.full_scans++;
+
+    _config.sta.bssid_set = false;
+    _config.sta.channel = 0;
+    esp_wifi_set_config( WIFI_IF_STA, &_config );
+
+#if WIFI_REUSE_IP_LEASE
+    esp_netif_dhcpc_start( _netif );
+#endif
+
+    ESP_LOGW( TAG, "Cached AP not reachable, falling back to a full scan" );
+}
+
+static void wifi_connect( void )
+{
+    _stats.connect_attempts++;
+    esp_wifi_connect();
+}
+
+static void wifi_retry_cb( void *arg )
+{
+    wifi_connect();
+}
+
+/**
+ * @brief Equal jitter backoff: half of the exponential step is random
+ * @return delay in ms
+ */
+static uint32_t wifi_backoff_ms( void )
+{
+    uint32_t shift = ( _failures > 16 ) ? 16 : _failures;
+    uint32_t step = WIFI_RETRY_BASE_MS << shift;
+
+    if ( step > WIFI_RETRY_MAX_MS ) {
+        step = WIFI_RETRY_MAX_MS;
+    }
+    return ( step / 2 ) + ( esp_random() % ( ( step / 2 ) + 1 ) );
+}
+
+static void wifi_event_handler( void *arg, esp_event_base_t event_base,
+                                int32_t event_id, void *event_data )
+{
+    if ( event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START ) {
+        wifi_connect();
+    } else if ( event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED ) {
+        wifi_event_sta_connected_t *ev = ( wifi_event_sta_connected_t * ) event_data;
+        memcpy( _pendingBssid, ev->bssid, sizeof( _pendingBssid ) );
+        _pendingChannel = ev->channel;
+    } else if ( event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP ) {
+        uint32_t ms = ( esp_timer_get_time() - _offlineSinceUs ) / 1000;
+
+        _connected = true;
+        _failures = 0;
+        _stats.last_online_ms = ms;
+        if ( ms > _stats.max_online_ms ) {
+            _stats.max_online_ms = ms;
+        }
+        if ( _usingCache ) {
+            _stats.fast_connects++;
+        }
+
+        ESP_LOGI( TAG, "Wi-Fi Connected in %u ms (ch %d)", ( unsigned ) ms, _pendingChannel );
+        wifi_cache_store();
+    } else if ( event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED ) {
+        wifi_event_sta_disconnected_t *ev = ( wifi_event_sta_disconnected_t * ) event_data;
+
+        if ( _connected ) {
+            _connected = false;
+            _offlineSinceUs = esp_timer_get_time();
+        }
+        _stats.disconnects++;
+        _stats.last_reason = ev->reason;
+        _failures++;
+
+        if ( _usingCache && ( _failures >= WIFI_CACHED_AP_TRIES ) ) {
+            wifi_cache_drop();
+        }
+
+        /* Retrying right away only spins the radio while the AP is down */
+        uint32_t delay = wifi_backoff_ms();
+        ESP_LOGI( TAG, "Wi-Fi Disconnected (reason %d), retry in %u ms", ev->reason, ( unsigned ) delay );
+        esp_timer_stop( _retryTimer );
+        esp_timer_start_once( _retryTimer, ( uint64_t ) delay * 1000 );
+    }
+}
+
+/**
+ * @brief Bring up the station, steering it to the last good AP when one is cached
+ * @param ssid
+ * @param password
+ */
+void wifi_sta_start( const char *ssid, const char *password )
+{
+    _offlineSinceUs = esp_timer_get_time();
+
+    esp_netif_init();
+    esp_event_loop_create_default();
+    _netif = esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    esp_wifi_init( &cfg );
+
+    esp_event_handler_instance_register( WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, NULL );
+    esp_event_handler_instance_register( IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, NULL );
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = wifi_retry_cb,
+        .name = "wifi_retry",
+    };
+    esp_timer_create( &timer_args, &_retryTimer );
+
+    memset( &_config, 0, sizeof( _config ) );
+    strncpy( ( char * ) _config.sta.ssid, ssid, sizeof( _config.sta.ssid ) );
+    _config.sta.ssid[ sizeof( _config.sta.ssid ) - 1 ] = '\0';
+    strncpy( ( char * ) _config.sta.password, password, sizeof( _config.sta.password ) );
+    _config.sta.password[ sizeof( _config.sta.password ) - 1 ] = '\0';
+    _config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+    _config.sta.listen_interval = PM_WIFI_LISTEN_INTERVAL;   /* used by max modem sleep only */
+
+    wifi_cache_load( ( const char * ) _config.sta.ssid );
+    if ( _cacheValid && ( _cache.channel != 0 ) ) {
+        /* Skips the all-channel scan, the driver probes one channel for one BSSID */
+        _usingCache = true;
+        _config.sta.scan_method = WIFI_FAST_SCAN;
+        _config.sta.channel = _cache.channel;
+        _config.sta.bssid_set = true;
+        memcpy( _config.sta.bssid, _cache.bssid, sizeof( _config.sta.bssid ) );
+
+#if WIFI_REUSE_IP_LEASE
+        if ( _cache.ip.ip.addr != 0 ) {
+            esp_netif_dns_info_t dns = {0};
+            dns.ip.u_addr.ip4 = _cache.dns;
+            esp_netif_dhcpc_stop( _netif );
+            esp_netif_set_ip_info( _netif, &_cache.ip );
+            esp_netif_set_dns_info( _netif, ESP_NETIF_DNS_MAIN, &dns );
+        }
+#endif
+    } else {
+        _stats.full_scans++;
+    }
+
+    esp_wifi_set_mode( WIFI_MODE_STA );
+    esp_wifi_set_config( WIFI_IF_STA, &_config );
+    esp_wifi_start();
+    pm_mode_apply_wifi();
+}
+
+bool wifi_sta_is_connected( void )
+{
+    return _connected;
+}
+
+void wifi_sta_get_stats( wifi_sta_stats_t *stats )
+{
+    *stats = _stats;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WIFI_RETRY_BASE_MS        500
+#define WIFI_RETRY_MAX_MS         60000
+#define WIFI_CACHED_AP_TRIES      2      /* failures on the cached BSSID before a full scan */
+#define WIFI_REUSE_IP_LEASE       0      /* 1: skip DHCP with the last lease, only for reserved addresses */
+
+typedef struct {
+    uint32_t connect_attempts;
+    uint32_t disconnects;
+    uint32_t fast_connects;        /* came up on the cached channel/BSSID */
+    uint32_t full_scans;
+    uint32_t last_online_ms;       /* from start or disconnect until an IP was assigned */
+    uint32_t max_online_ms;
+    uint8_t last_reason;           /* wifi_err_reason_t of the last disconnect */
+} wifi_sta_stats_t;
+
+void wifi_sta_start( const char *ssid, const char *password );
+bool wifi_sta_is_connected( void );
+void wifi_sta_get_stats( wifi_sta_stats_t *stats );
+
+#ifdef __cplusplus
+}
+#endif
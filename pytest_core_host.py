@@ -0,0 +1,28 @@
+# SPDX-License-Identifier: CC0-1.0
+# Host unit test of the metering core: builds tools/core_test.c with the host
+# compiler and runs it, no target or QEMU needed.
+import os
+import shutil
+import subprocess
+from pathlib import Path
+
+import pytest
+
+ROOT = Path(__file__).resolve().parent
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+def test_core_host(tmp_path: Path) -> None:
+    cc = os.environ.get('CC') or shutil.which('cc') or shutil.which('gcc')
+    if cc is None:
+        pytest.skip('no host C compiler')
+
+    exe = tmp_path / 'core_test'
+    subprocess.run(
+        [cc, '-O2', '-Wall', '-I', str(ROOT / 'main'), str(ROOT / 'main' / 'core.c'),
+         str(ROOT / 'tools' / 'core_test.c'), '-lm', '-o', str(exe)],
+        check=True,
+    )
+    result = subprocess.run([str(exe)], capture_output=True, text=True)
+    assert result.returncode == 0, result.stdout
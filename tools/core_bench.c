@@ -0,0 +1,308 @@
+/*
+ * Host benchmark and cross check of main/core.c, the metering core without ESP-IDF,
+ * and of the tariff engine in main/tariff.c.
+ *
+ *   cc -O2 -I main main/core.c main/tariff.c main/fmt_fixed.c tools/core_bench.c -lm -o core_bench && ./core_bench
+ *
+ * Each hot function is checked against the code it replaced in the firmware
+ * (bitwise CRC, byte-wise register decode, the inline billing arithmetic), the
+ * tariff table against a slot by slot reading of its schedule, and then timed in ns/op. The exit status is 1 on any difference, or when an
+ * op is slower than its limit given with -l name=ns, so a build script can
+ * fail on a regression. Desktop numbers only show the relative cost.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "core.h"
+#include "fmt_fixed.h"
+#include "tariff.h"
+
+#define N_INPUTS 1024
+#define ROUNDS   2000
+#define MAX_LIMITS 16
+
+#define BENCH_TARIFF "r0=1444.70 r1=2166.05 r2=1035 w1700-2200=1 w2200-2400=2 w0000-0600=2 h1800-2100=1 b900=150 b2000=200 l0101 l0817"
+
+typedef struct {
+    const char *name;
+    double ns;
+} bench_limit_t;
+
+static bench_limit_t _limits[ MAX_LIMITS ];
+static int _limitCount = 0;
+static int _failed = 0;
+
+static double now_s( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report( const char *name, double seconds, double ops )
+{
+    double ns = seconds / ops * 1e9;
+    const char *verdict = "";
+
+    for ( int i = 0; i < _limitCount; i++ ) {
+        if ( strcmp( _limits[ i ].name, name ) == 0 && ns > _limits[ i ].ns ) {
+            verdict = "  SLOWER than limit";
+            _failed = 1;
+        }
+    }
+    printf( "%-22s: %8.1f ns/op%s\n", name, ns, verdict );
+}
+
+/* What the firmware had before the table driven one */
+static uint16_t crc16_bitwise( const uint8_t *buf, uint16_t len )
+{
+    uint16_t crc = 0xFFFF;
+    for ( uint16_t pos = 0; pos < len; pos++ ) {
+        crc ^= buf[ pos ];
+        for ( int i = 0; i < 8; i++ ) {
+            crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/* PzemGetValues() before the split, straight from the reply bytes, with the float
+   literals and the reactive power from the power factor that the core uses now */
+static void decode_bytes( const uint8_t *r, _current_values_t *v )
+{
+    v->voltage = ( ( uint32_t ) r[ 3 ] << 8 | ( uint32_t ) r[ 4 ] ) / 10.0f;
+    v->current = ( ( uint32_t ) r[ 5 ] << 8 | ( uint32_t ) r[ 6 ] | ( uint32_t ) r[ 7 ] << 24 | ( uint32_t ) r[ 8 ] << 16 ) / 1000.0f;
+    v->power = ( ( uint32_t ) r[ 9 ] << 8 | ( uint32_t ) r[ 10 ] | ( uint32_t ) r[ 11 ] << 24 | ( uint32_t ) r[ 12 ] << 16 ) / 10.0f;
+    v->energy = ( ( uint32_t ) r[ 13 ] << 8 | ( uint32_t ) r[ 14 ] | ( uint32_t ) r[ 15 ] << 24 | ( uint32_t ) r[ 16 ] << 16 ) / 1000.0f;
+    v->frequency = ( ( uint32_t ) r[ 17 ] << 8 | ( uint32_t ) r[ 18 ] ) / 10.0f;
+    v->pf = ( ( uint32_t ) r[ 19 ] << 8 | ( uint32_t ) r[ 20 ] ) / 100.0f;
+    v->alarms = ( ( uint32_t ) r[ 21 ] << 8 | ( uint32_t ) r[ 22 ] );
+    v->apparent_power = v->voltage * v->current;
+    v->fi = 360.0F * ( acosf( v->pf ) / ( 2.0F * 3.14159265F ) );
+    v->reactive_power = ( v->pf < 1.0f ) ? v->apparent_power * sqrtf( 1.0f - v->pf * v->pf ) : 0;
+}
+
+/* Band of a minute straight from BENCH_TARIFF, later windows win */
+static uint8_t band_by_hand( tariff_day_t day, uint32_t minute )
+{
+    if ( day == TARIFF_HOLIDAY ) {
+        return ( minute >= 1080 && minute < 1260 ) ? 1 : 0;
+    }
+    if ( minute < 360 || minute >= 1320 ) {
+        return 2;
+    }
+    return ( minute >= 1020 ) ? 1 : 0;
+}
+
+static void make_reply( uint8_t *r )
+{
+    uint16_t regs[ CORE_INPUT_REGS ] = {
+        ( uint16_t ) ( 2000 + rand() % 500 ), ( uint16_t ) rand(), ( uint16_t ) ( rand() % 3 ), ( uint16_t ) rand(),
+        ( uint16_t ) ( rand() % 2 ), ( uint16_t ) rand(), ( uint16_t ) ( rand() % 4 ), ( uint16_t ) ( 495 + rand() % 10 ),
+        ( uint16_t ) ( rand() % 101 ), ( uint16_t ) ( rand() % 2 ),
+    };
+    r[ 0 ] = 0xF8;
+    r[ 1 ] = 0x04;
+    r[ 2 ] = 2 * CORE_INPUT_REGS;
+    for ( int i = 0; i < CORE_INPUT_REGS; i++ ) {
+        r[ 3 + 2 * i ] = regs[ i ] >> 8;
+        r[ 4 + 2 * i ] = regs[ i ] & 0xFF;
+    }
+    core_set_crc( r, 25 );
+}
+
+int main( int argc, char **argv )
+{
+    static uint8_t replies[ N_INPUTS ][ 25 ];
+    static float powers[ N_INPUTS ];
+    static float balances[ N_INPUTS ];
+    unsigned differences = 0;
+    volatile uint32_t sink = 0;
+    volatile float fsink = 0;
+    char text[ 32 ];
+
+    for ( int i = 1; i < argc; i++ ) {
+        char *eq = strchr( argv[ i ], '=' );
+        if ( strcmp( argv[ i - 1 ], "-l" ) != 0 || eq == NULL || _limitCount == MAX_LIMITS ) {
+            continue;
+        }
+        *eq = '\0';
+        _limits[ _limitCount ].name = argv[ i ];
+        _limits[ _limitCount++ ].ns = atof( eq + 1 );
+    }
+
+    srand( 1 );
+    for ( int i = 0; i < N_INPUTS; i++ ) {
+        make_reply( replies[ i ] );
+        powers[ i ] = ( float ) rand() / RAND_MAX * 2500.0f;
+        balances[ i ] = ( float ) rand() / RAND_MAX * 200000.0f - 50.0f;
+    }
+
+    /* Cross checks */
+    for ( int i = 0; i < N_INPUTS; i++ ) {
+        _current_values_t a;
+        _current_values_t b;
+        uint16_t regs[ CORE_INPUT_REGS ];
+
+        memset( &a, 0, sizeof( a ) );
+        memset( &b, 0, sizeof( b ) );
+        differences += core_crc16( replies[ i ], 23 ) != crc16_bitwise( replies[ i ], 23 );
+        differences += !core_check_crc( replies[ i ], 25 );
+        core_unpack_regs( replies[ i ], CORE_INPUT_REGS, regs );
+        core_decode_input( regs, &a );
+        decode_bytes( replies[ i ], &b );
+        differences += memcmp( &a, &b, sizeof( a ) ) != 0;
+
+        /* PMonTask before the split */
+        float daily_limit = 3000.0f;
+        float used = balances[ i ] / 100.0f;
+        float energy = powers[ i ] * ( 1 * ( 1000000 / 1000000.0f ) ) / 3600.0f;
+        core_bill_t bill = core_bill_sample( used, daily_limit, core_sample_energy_wh( powers[ i ], 1, 1000000 ) );
+        differences += bill.used_today_wh != used + energy;
+        differences += bill.consume_wh != ( ( used + energy >= daily_limit ) ? 0 : energy );
+        float left = balances[ i ] - energy;
+        differences += core_balance_after( balances[ i ], energy ) != ( left < 0 ? 0 : left );
+        differences += core_balance_kwh_shown( balances[ i ] ) != floorf( balances[ i ] / 1000.0f * 10 ) / 10;
+    }
+
+    char line[] = "2,0.5,3000,1000,1444,0,0";
+    char *fields[ 8 ];
+    differences += core_split_fields( line, fields, 8 ) != 7;
+    differences += !core_args_valid( "nninii", true, 7, fields );
+    differences += core_args_valid( "nnnnnn", false, 2, fields );
+    differences += core_class_limit_w( 1300 ) != 1100 || core_class_limit_w( 1000 ) != 0;
+
+    /* Tariff: compile, reject, every slot, blocks and cost rounding */
+    static tariff_table_t tt;
+    int err_pos;
+    differences += !tariff_compile( BENCH_TARIFF, &tt, &err_pos ) || tt.bands != 3 || tt.blocks != 2;
+    differences += tt.rate_sen[ 0 ] != 144470 || tt.rate_sen[ 1 ] != 216605 || tt.rate_sen[ 2 ] != 103500;
+    for ( uint32_t m = 0; m < 24 * 60; m++ ) {
+        differences += tariff_band( &tt, TARIFF_WEEKDAY, m ) != band_by_hand( TARIFF_WEEKDAY, m );
+        differences += tariff_band( &tt, TARIFF_HOLIDAY, m ) != band_by_hand( TARIFF_HOLIDAY, m );
+    }
+    differences += tariff_day_type( &tt, 3, 8, 17 ) != TARIFF_HOLIDAY || tariff_day_type( &tt, 3, 8, 18 ) != TARIFF_WEEKDAY;
+    differences += tariff_day_type( &tt, 6, 8, 18 ) != TARIFF_HOLIDAY;
+    differences += tariff_rate_sen( &tt, 0, 899999999999ULL ) != 144470;
+    differences += tariff_rate_sen( &tt, 0, 900000000000ULL ) != 216705;
+    differences += tariff_rate_sen( &tt, 1, 2500000000000ULL ) != 433210;
+    differences += tariff_cost_urp( 1000000, 144470 ) != 1444700;     /* 1 Wh at Rp 1444.70/kWh */
+    differences += tariff_cost_urp( 1, 144470 ) != 1;
+    differences += tariff_compile( "r0=1444 r1=2000 w1700-2200=2", &tt, &err_pos ) || err_pos != 28;
+    differences += tariff_compile( "r0=1444 w1705-2200=1", &tt, &err_pos ) || err_pos != 8;
+    differences += tariff_compile( "r0=1444 b900=150 b800=120", &tt, &err_pos ) || err_pos != 17;
+    differences += tariff_compile( "r1=1444", &tt, &err_pos );
+    differences += !tariff_compile( "r0=1444", &tt, &err_pos ) || tt.bands != 1 || tariff_band( &tt, TARIFF_HOLIDAY, 1439 ) != 0;
+
+    /* A day of 1 s samples, summed per band against the total */
+    static tariff_acc_t acc;
+    uint64_t uwh_total = 0;
+    tariff_compile( BENCH_TARIFF, &tt, &err_pos );
+    for ( uint32_t sec = 0; sec < 24 * 3600; sec++ ) {
+        uint64_t uwh = ( uint64_t ) ( powers[ sec % N_INPUTS ] * 1e6 / 3600.0 );
+        uint8_t band = tariff_band( &tt, TARIFF_WEEKDAY, sec / 60 );
+        acc.energy_uwh[ band ] += uwh;
+        acc.cost_urp[ band ] += tariff_cost_urp( uwh, tariff_rate_sen( &tt, band, tariff_acc_energy( &acc ) ) );
+        uwh_total += uwh;
+    }
+    differences += tariff_acc_energy( &acc ) != uwh_total || tariff_acc_cost( &acc ) <= 0;
+    printf( "differences: %u\n", differences );
+
+    /* Timings, every loop feeds its result into a volatile so nothing is dropped */
+    double n = ( double ) ROUNDS * N_INPUTS;
+    double t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            sink += core_crc16( replies[ i ], 6 );
+        }
+    }
+    report( "crc16 request (6 B)", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            sink += core_check_crc( replies[ i ], 25 );
+        }
+    }
+    report( "check_crc reply (25 B)", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            uint16_t regs[ CORE_INPUT_REGS ];
+            _current_values_t v;
+            core_unpack_regs( replies[ i ], CORE_INPUT_REGS, regs );
+            core_decode_input( regs, &v );
+            fsink += v.reactive_power;
+        }
+    }
+    report( "unpack + decode", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            core_bill_t bill = core_bill_sample( balances[ i ] / 100.0f, 3000.0f,
+                                                 core_sample_energy_wh( powers[ i ], 1, 1000000 ) );
+            fsink += core_balance_after( balances[ i ], bill.consume_wh ) + core_balance_low( balances[ i ], 5.0f );
+        }
+    }
+    report( "billing step", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            fsink += core_balance_kwh_shown( balances[ i ] );
+        }
+    }
+    report( "balance_kwh_shown", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            sink += core_class_limit_w( ( i & 1 ) ? 3500 : 450 );
+        }
+    }
+    report( "class_limit_w", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            char cmd[] = "2,0.5,3000,1000,1444,0,0";
+            sink += core_args_valid( "nninii", true, core_split_fields( cmd, fields, 8 ), fields );
+        }
+    }
+    report( "console split + args", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            tariff_day_t day = tariff_day_type( &tt, i % 7, 1 + i % 12, 1 + i % 28 );
+            uint8_t band = tariff_band( &tt, day, ( uint32_t ) ( i * 7 ) % 1440 );
+            uint32_t rate = tariff_rate_sen( &tt, band, ( uint64_t ) balances[ i ] * 10000000ULL );
+            sink += ( uint32_t ) tariff_cost_urp( ( uint64_t ) ( powers[ i ] * 277.78f ), rate );
+        }
+    }
+    report( "tariff band + cost", now_s() - t, n );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS / 100; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            sink += tariff_compile( BENCH_TARIFF, &tt, &err_pos );
+        }
+    }
+    report( "tariff compile", now_s() - t, n / 100 );
+
+    t = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_INPUTS; i++ ) {
+            sink += fmt_float_str( text, sizeof( text ), balances[ i ], 2 );
+        }
+    }
+    report( "fmt_float_str (NVS)", now_s() - t, n );
+
+    ( void ) sink;
+    ( void ) fsink;
+    return ( differences != 0 ) || _failed;
+}
@@ -0,0 +1,224 @@
+/*
+ * Host unit test of main/core.c with fixed expected values, without ESP-IDF.
+ *
+ *   cc -O2 -I main main/core.c tools/core_test.c -lm -o core_test && ./core_test
+ *
+ * core_bench.c checks the core against the code it replaced; this one checks
+ * it against known answers: Modbus CRC vectors, a PZEM reply decoded by hand,
+ * the energy, billing and daily limit edges, power classes and the console
+ * field splitting and schema letters. Every failed check prints its line, the
+ * exit status is 1 when one failed. pytest_core_host.py runs it under the
+ * linux / host_test markers.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "core.h"
+
+static int _checks = 0;
+static int _failed = 0;
+
+#define CHECK( cond ) check( ( cond ), #cond, __LINE__ )
+#define CHECK_NEAR( got, want, tol ) check_near( ( got ), ( want ), ( tol ), #got, __LINE__ )
+
+static void check( int ok, const char *what, int line )
+{
+    _checks++;
+    if ( !ok ) {
+        _failed++;
+        printf( "core_test.c:%d: FAIL %s\n", line, what );
+    }
+}
+
+static void check_near( double got, double want, double tol, const char *what, int line )
+{
+    _checks++;
+    if ( fabs( got - want ) > tol ) {
+        _failed++;
+        printf( "core_test.c:%d: FAIL %s = %.6f, want %.6f\n", line, what, got, want );
+    }
+}
+
+static void test_crc( void )
+{
+    /* Catalogue check value of CRC-16/MODBUS */
+    CHECK( core_crc16( ( const uint8_t * ) "123456789", 9 ) == 0x4B37 );
+    CHECK( core_crc16( NULL, 0 ) == 0xFFFF );
+
+    /* Read input registers 0..9 of address 1, as PzemGetValues() sends it */
+    uint8_t req[ 8 ] = { 0x01, 0x04, 0x00, 0x00, 0x00, 0x0A, 0, 0 };
+    core_set_crc( req, sizeof( req ) );
+    CHECK( ( req[ 6 ] == 0x70 ) && ( req[ 7 ] == 0x0D ) );
+    CHECK( core_check_crc( req, sizeof( req ) ) );
+
+    req[ 3 ] ^= 0x01;
+    CHECK( !core_check_crc( req, sizeof( req ) ) );
+    CHECK( !core_check_crc( req, 2 ) );
+
+    /* Too short to carry a CRC, left alone */
+    uint8_t two[ 2 ] = { 0xAA, 0x55 };
+    core_set_crc( two, sizeof( two ) );
+    CHECK( ( two[ 0 ] == 0xAA ) && ( two[ 1 ] == 0x55 ) );
+}
+
+static void test_decode( void )
+{
+    /* 230.1 V, 1.500 A, 345.0 W, 70000 -> 70 kWh, 50.0 Hz, pf 1.00, alarm on */
+    const uint8_t resp[ 3 + 2 * CORE_INPUT_REGS ] = {
+        0x01, 0x04, 0x14,
+        0x08, 0xFD,             /* voltage */
+        0x05, 0xDC, 0x00, 0x00, /* current lo, hi */
+        0x0D, 0x7A, 0x00, 0x00, /* power lo, hi */
+        0x11, 0x70, 0x00, 0x01, /* energy lo, hi */
+        0x01, 0xF4,             /* frequency */
+        0x00, 0x64,             /* pf */
+        0xFF, 0xFF,             /* alarm */
+    };
+    uint16_t regs[ CORE_INPUT_REGS ];
+    _current_values_t v;
+
+    core_unpack_regs( resp, CORE_INPUT_REGS, regs );
+    CHECK( regs[ 0 ] == 2301 );
+    CHECK( ( regs[ 5 ] == 0x1170 ) && ( regs[ 6 ] == 0x0001 ) );
+    CHECK( core_reg32( 0x5678, 0x1234 ) == 0x12345678 );
+
+    core_decode_input( regs, &v );
+    CHECK_NEAR( v.voltage, 230.1, 1e-4 );
+    CHECK_NEAR( v.current, 1.5, 1e-6 );
+    CHECK_NEAR( v.power, 345.0, 1e-4 );
+    CHECK_NEAR( v.energy, 70.0, 1e-4 );
+    CHECK_NEAR( v.frequency, 50.0, 1e-4 );
+    CHECK_NEAR( v.pf, 1.0, 1e-6 );
+    CHECK( v.alarms == 0xFFFF );
+    CHECK_NEAR( v.apparent_power, 345.15, 1e-3 );
+    CHECK_NEAR( v.reactive_power, 0.0, 1e-3 );
+
+    /* pf 0.80: fi 36.87 degrees, Q = S x 0.6 */
+    regs[ 8 ] = 80;
+    core_decode_input( regs, &v );
+    CHECK_NEAR( v.pf, 0.8, 1e-6 );
+    CHECK_NEAR( v.fi, 36.8699, 1e-3 );
+    CHECK_NEAR( v.reactive_power, 207.09, 1e-2 );
+
+    /* Current above 65.535 A needs the high word */
+    regs[ 1 ] = 0x86A0;
+    regs[ 2 ] = 0x0001;
+    core_decode_input( regs, &v );
+    CHECK_NEAR( v.current, 100.0, 1e-4 );
+}
+
+static void test_energy( void )
+{
+    CHECK_NEAR( core_sample_energy_wh( 3600, 1, 1000000 ), 1.0, 1e-6 );
+    CHECK_NEAR( core_sample_energy_wh( 1000, 3, 1000000 ), 0.833333, 1e-5 );   /* two missed periods */
+    CHECK_NEAR( core_sample_energy_wh( 900, 4, 250000 ), 0.25, 1e-6 );
+    CHECK( core_sample_energy_wh( 1000, 0, 1000000 ) == 0 );
+    CHECK( core_sample_energy_wh( 0, 5, 1000000 ) == 0 );
+}
+
+static void test_billing( void )
+{
+    core_bill_t b;
+
+    b = core_bill_sample( 9.5f, 10.0f, 0.25f );
+    CHECK( !b.daily_limit );
+    CHECK( b.consume_wh == 0.25f );
+    CHECK( b.used_today_wh == 9.75f );
+
+    /* Reaching the limit exactly is already the limit, the sample is not billed */
+    b = core_bill_sample( 9.5f, 10.0f, 0.5f );
+    CHECK( b.daily_limit );
+    CHECK( b.consume_wh == 0 );
+    CHECK( b.used_today_wh == 10.0f );
+
+    b = core_bill_sample( 12.0f, 10.0f, 1.0f );
+    CHECK( b.daily_limit && ( b.consume_wh == 0 ) && ( b.used_today_wh == 13.0f ) );
+
+    /* A zero limit stops billing at once */
+    b = core_bill_sample( 0, 0, 0 );
+    CHECK( b.daily_limit && ( b.consume_wh == 0 ) );
+
+    CHECK( core_balance_after( 5.0f, 2.0f ) == 3.0f );
+    CHECK( core_balance_after( 2.0f, 2.0f ) == 0 );
+    CHECK( core_balance_after( 1.0f, 2.0f ) == 0 );
+
+    CHECK( core_balance_low( 999.0f, 1.0f ) );
+    CHECK( !core_balance_low( 1000.0f, 1.0f ) );
+    CHECK( !core_balance_low( 0, 0 ) );
+
+    CHECK_NEAR( core_balance_kwh_shown( 1250.0f ), 1.2, 1e-6 );
+    CHECK_NEAR( core_balance_kwh_shown( 999.0f ), 0.9, 1e-6 );
+    CHECK_NEAR( core_balance_kwh_shown( 12345.0f ), 12.3, 1e-5 );
+    CHECK( core_balance_kwh_shown( 0 ) == 0 );
+}
+
+static void test_classes( void )
+{
+    CHECK( core_class_limit_w( 450 ) == 400 );
+    CHECK( core_class_limit_w( 900 ) == 700 );
+    CHECK( core_class_limit_w( 1300 ) == 1100 );
+    CHECK( core_class_limit_w( 2200 ) == 1800 );
+    CHECK( core_class_limit_w( 3500 ) == 2500 );
+    CHECK( core_class_limit_w( 1000 ) == 0 );
+    CHECK( core_class_limit_w( 0 ) == 0 );
+}
+
+static void test_fields( void )
+{
+    char *argv[ 4 ];
+    char line[ 32 ];
+
+    strcpy( line, "3,1.5,,x" );
+    CHECK( core_split_fields( line, argv, 4 ) == 4 );
+    CHECK( ( strcmp( argv[ 0 ], "3" ) == 0 ) && ( strcmp( argv[ 1 ], "1.5" ) == 0 ) );
+    CHECK( ( argv[ 2 ][ 0 ] == '\0' ) && ( strcmp( argv[ 3 ], "x" ) == 0 ) );
+
+    strcpy( line, "" );
+    CHECK( core_split_fields( line, argv, 4 ) == 1 );
+    CHECK( argv[ 0 ][ 0 ] == '\0' );
+
+    strcpy( line, "a,b," );
+    CHECK( core_split_fields( line, argv, 4 ) == 3 );
+    CHECK( argv[ 2 ][ 0 ] == '\0' );
+
+    strcpy( line, "a,b,c,d,e" );
+    CHECK( core_split_fields( line, argv, 4 ) == -1 );
+
+    CHECK( core_arg_valid( 's', "" ) );
+    CHECK( core_arg_valid( 'n', "1444.70" ) );
+    CHECK( core_arg_valid( 'n', "-2" ) );
+    CHECK( !core_arg_valid( 'n', "" ) );
+    CHECK( !core_arg_valid( 'n', "12a" ) );
+    CHECK( core_arg_valid( 'i', "3600" ) );
+    CHECK( !core_arg_valid( 'i', "1.5" ) );
+    CHECK( !core_arg_valid( 'i', " " ) );
+    CHECK( !core_arg_valid( 'x', "1" ) );
+
+    char cmd[] = "2";
+    char num[] = "1444.70";
+    char whole[] = "23";
+    char bad[] = "2x";
+    char *ok_args[] = { cmd, num, whole };
+    char *bad_args[] = { cmd, num, bad };
+
+    CHECK( core_args_valid( "ni", false, 3, ok_args ) );
+    CHECK( !core_args_valid( "ni", false, 3, bad_args ) );
+    CHECK( !core_args_valid( "ni", false, 2, ok_args ) );
+    CHECK( !core_args_valid( "n", false, 3, ok_args ) );
+    CHECK( core_args_valid( "ni", true, 1, ok_args ) );
+    CHECK( !core_args_valid( "ni", false, 1, ok_args ) );
+    CHECK( core_args_valid( "", false, 1, ok_args ) );
+}
+
+int main( void )
+{
+    test_crc();
+    test_decode();
+    test_energy();
+    test_billing();
+    test_classes();
+    test_fields();
+
+    printf( "%d checks, %d failed\n", _checks, _failed );
+    return _failed != 0;
+}
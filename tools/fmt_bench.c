@@ -0,0 +1,81 @@
+/*
+ * Host benchmark and cross check of main/fmt_fixed.c against snprintf.
+ *
+ *   cc -O2 -I main main/fmt_fixed.c tools/fmt_bench.c -lm -o fmt_bench && ./fmt_bench
+ *
+ * Numbers on a desktop only show the relative cost, on the ESP32 snprintf
+ * with "%f" also goes through soft-float double math.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fmt_fixed.h"
+
+#define N_VALUES 4096
+#define ROUNDS   200
+
+static double now_s( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( void )
+{
+    static float values[ N_VALUES ];
+    char a[ 32 ];
+    char b[ 32 ];
+    unsigned mismatches = 0;
+    unsigned ties = 0;
+    volatile unsigned sink = 0;
+
+    srand( 1 );
+    for ( int i = 0; i < N_VALUES; i++ ) {
+        values[ i ] = ( ( float ) rand() / RAND_MAX - 0.2f ) * 250000.0f / ( 1 + ( i % 7 ) * 10 );
+    }
+
+    /* Exact ties round half away from zero here, glibc rounds them to even */
+    for ( int d = 0; d <= 3; d++ ) {
+        for ( int i = 0; i < N_VALUES; i++ ) {
+            snprintf( a, sizeof( a ), "%.*f", d, values[ i ] );
+            fmt_float_str( b, sizeof( b ), values[ i ], d );
+            if ( strcmp( a, b ) == 0 || strcmp( a, "-0" ) == 0 || strncmp( a, "-0.", 3 ) == 0 ) {
+                continue;
+            }
+            double scaled = fabs( ( double ) values[ i ] ) * pow( 10, d );
+            if ( scaled - floor( scaled ) == 0.5 ) {
+                ties++;
+            }
+            if ( mismatches++ < 5 ) {
+                printf( "  %.9g d=%d fmt=%s\n", values[ i ], d, b );
+            }
+        }
+    }
+    printf( "differences: %u of %d (%u exact ties)\n", mismatches, 4 * N_VALUES, ties );
+
+    double t0 = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_VALUES; i++ ) {
+            sink += snprintf( a, sizeof( a ), "%.2f", values[ i ] );
+        }
+    }
+    double t1 = now_s();
+    for ( int r = 0; r < ROUNDS; r++ ) {
+        for ( int i = 0; i < N_VALUES; i++ ) {
+            sink += fmt_float_str( a, sizeof( a ), values[ i ], 2 );
+        }
+    }
+    double t2 = now_s();
+
+    double n = ( double ) ROUNDS * N_VALUES;
+    printf( "snprintf %%.2f : %7.1f ns/call\n", ( t1 - t0 ) / n * 1e9 );
+    printf( "fmt_float_str : %7.1f ns/call\n", ( t2 - t1 ) / n * 1e9 );
+
+    /* Overflow is reported and never cut */
+    int ret = fmt_float_str( a, 6, 123456.7f, 1 );
+    printf( "overflow: ret=%d text=\"%s\"\n", ret, a );
+    return 0;
+}
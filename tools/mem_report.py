@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+"""Static RAM per subsystem from the linker map, the build-time half of <mem>.
+
+    idf.py build && tools/mem_report.py [build/meteran_online.map]
+
+Counts .data and .bss of main/ objects. Task stacks and TCBs live in
+mem_budget.c and are charged to the subsystem of their TASK_TABLE row, the
+network pool to net, like the runtime report does. The stack total is checked
+against TASK_STACK_BUDGET by the compiler already.
+"""
+import argparse
+import os
+import re
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Must match mem_sub_t in main/mem_budget.h and the MEM_STATIC calls
+OBJECTS = {
+    'meteran_online': 'meter', 'pzem004tv3': 'meter', 'meter_state': 'meter',
+    'sample_timer': 'meter', 'profiler': 'meter', 'pm_mode': 'meter',
+    'rollover': 'meter', 'fmt_fixed': 'meter', 'protection': 'meter', 'core': 'meter',
+    'tariff': 'meter', 'billing': 'meter', 'nilm': 'meter',
+    'console': 'console', 'prov': 'console', 'dlog': 'console',
+    'display': 'display', 'i2c-lcd': 'display',
+    'modbus_tcp': 'net', 'mem_budget': 'net',
+    'telemetry': 'telemetry',
+    'metrics': 'metrics', 'trace': 'metrics',
+    'wifi_sta': 'wifi',
+}
+SUBSYSTEMS = ['meter', 'console', 'display', 'net', 'telemetry', 'metrics', 'wifi']
+
+SECTION = re.compile(r'^\s*\.(bss|data|dram\d?\.\w+|sbss|sdata)\.?(\S*)\s*$')
+ENTRY = re.compile(r'^\s*(?:\.(bss|data|dram\d?\.\w+|sbss|sdata)\.?(\S*))?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+\S*lib(?:__idf_)?main\.a\((\S+?)\.c\.obj\)')
+
+
+def task_subsystems():
+    """TASK_TABLE rows: id -> subsystem"""
+    path = os.path.join(ROOT, 'main', 'task_config.h')
+    rows = re.findall(r'X\(\s*(\w+),\s*"[^"]*",[^)]*,\s*(\w+)\s*\)', open(path).read())
+    return {task_id: sub.lower() for task_id, sub in rows}
+
+
+def parse(map_path, tasks):
+    static = dict.fromkeys(SUBSYSTEMS, 0)
+    symbols = []
+    pending = None   # long section names put address and size on the next line
+
+    with open(map_path, errors='replace') as f:
+        for line in f:
+            head = SECTION.match(line)
+            if head and '0x' not in line:
+                pending = head.groups()
+                continue
+            m = ENTRY.match(line)
+            if not m:
+                pending = None
+                continue
+            kind, name = (m.group(1), m.group(2)) if m.group(1) else (pending or (None, ''))
+            pending = None
+            if kind is None or 'rodata' in kind:
+                continue
+            size = int(m.group(4), 16)
+            obj = m.group(5)
+            sub = OBJECTS.get(obj, 'meter')
+            ident = re.match(r'_(?:stack|tcb)_(\w+)$', name)
+            if obj == 'mem_budget' and ident and ident.group(1) in tasks:
+                sub = tasks[ident.group(1)]
+            static[sub] += size
+            symbols.append((size, sub, obj, name))
+    return static, symbols
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('map', nargs='?', default=os.path.join(ROOT, 'build', 'meteran_online.map'))
+    ap.add_argument('--top', type=int, default=10, help='largest objects to list')
+    args = ap.parse_args()
+
+    if not os.path.exists(args.map):
+        sys.exit('%s not found, run idf.py build first' % args.map)
+
+    static, symbols = parse(args.map, task_subsystems())
+    print('%-10s %8s' % ('subsystem', 'static'))
+    for sub in SUBSYSTEMS:
+        print('%-10s %8d' % (sub, static[sub]))
+    print('%-10s %8d' % ('total', sum(static.values())))
+
+    print('\n%8s  %-10s %s' % ('bytes', 'subsystem', 'symbol'))
+    for size, sub, obj, name in sorted(symbols, reverse=True)[:args.top]:
+        print('%8d  %-10s %s:%s' % (size, sub, obj, name or '?'))
+
+
+if __name__ == '__main__':
+    main()
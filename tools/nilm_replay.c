@@ -0,0 +1,196 @@
+/*
+ * Host replay of main/nilm.c, the appliance event detector, without ESP-IDF.
+ *
+ *   cc -O2 -I main main/nilm.c tools/nilm_replay.c -lm -o nilm_replay
+ *   ./nilm_replay                 synthetic day with known appliances, checked
+ *   ./nilm_replay trace.csv [-v]  recorded trace, t_ms,power,pf per line
+ *
+ * A trace is what telemetry_collector.py --csv writes from the device's
+ * samples; lines that do not start with a number (a header) are skipped.
+ * The synthetic day mixes a base load, a cycling fridge and a few appliances
+ * with noise; the exit status is 1 when one of them has no signature or its
+ * energy is off by more than 10 %. -v prints every event. Each nilm_feed()
+ * is timed; the maximum also catches host scheduling, rerun when it is odd.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nilm.h"
+
+#define DAY_S 86400
+
+typedef struct {
+    const char *name;
+    float p_w;
+    float pf;
+    int on_s[ 2 ];          /* second of the day, two runs */
+    int off_s[ 2 ];
+    int cycle_s;            /* > 0: on for on_s[ 0 ] seconds every cycle_s, from off_s[ 0 ] */
+    double wh;              /* ground truth */
+} appliance_t;
+
+static appliance_t _day[] = {
+    { "kulkas",       110, 0.70f, { 15 * 60, 0 }, { 7 * 60, 0 }, 45 * 60, 0 },
+    { "rice cooker",  350, 0.98f, { 5 * 3600, 17 * 3600 }, { 5 * 3600 + 2400, 17 * 3600 + 2400 }, 0, 0 },
+    { "setrika",     1000, 1.00f, { 7 * 3600 + 300, 0 }, { 7 * 3600 + 2100, 0 }, 0, 0 },
+    { "TV",            85, 0.60f, { 18 * 3600 + 120, 0 }, { 23 * 3600 + 120, 0 }, 0, 0 },
+    { "AC",           750, 0.88f, { 13 * 3600 + 600, 20 * 3600 + 900 }, { 16 * 3600, 23 * 3600 + 1800 }, 0, 0 },
+};
+#define APPLIANCES ( int ) ( sizeof( _day ) / sizeof( _day[ 0 ] ) )
+#define BASE_W  60.0f
+#define BASE_PF 0.95f
+
+static int _verbose = 0;
+static double _nsSum = 0;
+static double _nsMax = 0;
+static unsigned long _samples = 0;
+
+static double now_ns( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int appliance_on( const appliance_t *a, int t )
+{
+    if ( a->cycle_s > 0 ) {
+        return ( t >= a->off_s[ 0 ] ) && ( ( t - a->off_s[ 0 ] ) % a->cycle_s < a->on_s[ 0 ] );
+    }
+    for ( int r = 0; r < 2; r++ ) {
+        if ( ( a->off_s[ r ] > a->on_s[ r ] ) && ( t >= a->on_s[ r ] ) && ( t < a->off_s[ r ] ) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Uniform noise, +-pct of the value */
+static float noise( float value, float pct )
+{
+    return value * ( 1.0f + pct / 100.0f * ( 2.0f * rand() / RAND_MAX - 1.0f ) );
+}
+
+static void feed( nilm_t *n, double t_s, float power, float pf, float energy_wh )
+{
+    nilm_event_t ev;
+
+    double t0 = now_ns();
+    int event = nilm_feed( n, power, pf, energy_wh, &ev );
+    double ns = now_ns() - t0;
+    _nsSum += ns;
+    _nsMax = ( ns > _nsMax ) ? ns : _nsMax;
+    _samples++;
+
+    if ( event && _verbose ) {
+        printf( "%02d:%02d:%02d  %-3s #%-2d dP %7.1f W  dQ %7.1f var\n", ( int ) t_s / 3600, ( int ) t_s / 60 % 60,
+                ( int ) t_s % 60, ev.on ? "on" : "off", ev.sig, ev.dp_w, ev.dq_var );
+    }
+}
+
+static void synthetic( nilm_t *n )
+{
+    srand( 1 );
+    for ( int t = 0; t < DAY_S; t++ ) {
+        float p = BASE_W;
+        float q = BASE_W * sqrtf( 1 - BASE_PF * BASE_PF ) / BASE_PF;
+        for ( int i = 0; i < APPLIANCES; i++ ) {
+            appliance_t *a = &_day[ i ];
+            if ( appliance_on( a, t ) ) {
+                float pa = noise( a->p_w, 1.0f );
+                p += pa;
+                q += pa * sqrtf( 1 - a->pf * a->pf ) / a->pf;
+                a->wh += pa / 3600.0;
+            }
+        }
+        p = roundf( p * 10 ) / 10;     /* PZEM resolution */
+        float pf = roundf( p / sqrtf( p * p + q * q ) * 100 ) / 100;
+        feed( n, t, p, pf, p / 3600.0f );
+    }
+}
+
+static int replay( nilm_t *n, const char *path )
+{
+    FILE *f = fopen( path, "r" );
+    char line[ 128 ];
+    double prev_ms = -1;
+    double first_ms = 0;
+    double period_ms = 1000;
+
+    if ( f == NULL ) {
+        perror( path );
+        return -1;
+    }
+    while ( fgets( line, sizeof( line ), f ) != NULL ) {
+        char *end;
+        double t_ms = strtod( line, &end );
+        if ( ( end == line ) || ( *end != ',' ) ) {
+            continue;
+        }
+        float power = strtof( end + 1, &end );
+        float pf = ( *end == ',' ) ? strtof( end + 1, NULL ) : 1.0f;
+
+        if ( prev_ms < 0 ) {
+            first_ms = t_ms;
+        } else if ( t_ms > prev_ms ) {
+            period_ms = t_ms - prev_ms;
+        }
+        prev_ms = t_ms;
+        feed( n, ( t_ms - first_ms ) / 1000.0, power, pf, power * period_ms / 3600000.0 );
+    }
+    fclose( f );
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    static nilm_t n;
+    const char *path = NULL;
+    int failed = 0;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp( argv[ i ], "-v" ) == 0 ) {
+            _verbose = 1;
+        } else {
+            path = argv[ i ];
+        }
+    }
+
+    nilm_init( &n );
+    if ( path == NULL ) {
+        synthetic( &n );
+    } else if ( replay( &n, path ) != 0 ) {
+        return 1;
+    }
+
+    printf( "%lu samples, %u events, %u unmatched\n", _samples, ( unsigned ) n.events, ( unsigned ) n.unmatched );
+    printf( " #   P (W)  Q (var)  on  events  energy (Wh)\n" );
+    for ( int i = 0; i < n.sigs; i++ ) {
+        const nilm_sig_t *s = &n.sig[ i ];
+        printf( "%2d %7.1f %8.1f %3u %7u %12.1f\n", i, s->p_w, s->q_var, s->running, s->events, s->total_uwh / 1e6 );
+    }
+    printf( "other                           %12.1f\n", n.other_total_uwh / 1e6 );
+
+    if ( path == NULL ) {
+        printf( "\nappliance       truth (Wh)  signature  found (Wh)\n" );
+        for ( int i = 0; i < APPLIANCES; i++ ) {
+            const appliance_t *a = &_day[ i ];
+            int best = -1;
+            for ( int k = 0; k < n.sigs; k++ ) {
+                if ( ( fabsf( n.sig[ k ].p_w - a->p_w ) < a->p_w * 0.1f ) &&
+                     ( ( best < 0 ) || ( n.sig[ k ].total_uwh > n.sig[ best ].total_uwh ) ) ) {
+                    best = k;
+                }
+            }
+            double found = ( best >= 0 ) ? n.sig[ best ].total_uwh / 1e6 : 0;
+            int ok = ( best >= 0 ) && ( fabs( found - a->wh ) <= a->wh * 0.1 );
+            failed |= !ok;
+            printf( "%-14s %11.1f  %9d  %10.1f%s\n", a->name, a->wh, best, found, ok ? "" : "  MISMATCH" );
+        }
+    }
+
+    printf( "\nnilm_feed: %.1f ns/sample mean, %.1f ns max\n", _nsSum / ( _samples ? _samples : 1 ), _nsMax );
+    return failed;
+}
@@ -0,0 +1,284 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+"""Read or write a meter's whole configuration over UART0 in one round trip.
+
+Frame layout is documented in main/console.h, messages and TLVs in main/prov.h.
+
+    provision.py get -p /dev/ttyUSB0                      print the config as JSON
+    provision.py set config.json -p /dev/ttyUSB0 [-p ...] write, then --verify reads it back
+
+Several -p options commission a rack one unit after another. Log output shares
+the port, so replies are searched for in the byte stream and requests retried.
+"""
+import argparse
+import json
+import os
+import select
+import struct
+import sys
+import termios
+import time
+
+SYNC = b'\xA5\x5A'
+ETX = 0x3E
+T_GET_CONFIG = 0x01
+T_SET_CONFIG = 0x02
+T_CONFIG = 0x81
+T_RESULT = 0x82
+T_CONFIG_MORE = 0x83
+T_BUSY = 0x7E
+TAG_MAC = 0xF0
+
+# Must match prov_fields[] in main/meteran_online.c
+FIELDS = {
+    'ssid': 0x01,
+    'password': 0x02,
+    'bot_token': 0x03,
+    'recipient_id': 0x04,
+    'kwh_minimum': 0x05,
+    'daily_limit': 0x06,
+    'time_sampling': 0x07,
+    'tdl': 0x08,
+    'hour': 0x09,
+    'minute': 0x0A,
+    'collector_url': 0x0B,
+    'last_kwh': 0x0C,
+    'pm_mode': 0x0D,
+    'kapasitas': 0x0E,
+    'tou': 0x0F,
+}
+READONLY = {'last_kwh', 'mac', 'port'}   # printed by get, skipped by set
+NAMES = {tag: name for name, tag in FIELDS.items()}
+STATUS = ['ok', 'format', 'unknown tag', 'bad value', 'read only', 'storage', 'unknown type', 'duplicate tag']
+
+
+def crc16_modbus(data: bytes) -> int:
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def build_frame(seq: int, ftype: int, payload: bytes = b'') -> bytes:
+    body = SYNC + struct.pack('<HBB', len(payload) + 2, seq, ftype) + payload
+    return body + struct.pack('<H', crc16_modbus(body)) + bytes([ETX])
+
+
+def encode_tlv(config: dict) -> bytes:
+    out = bytearray()
+    for name, value in config.items():
+        if name in READONLY:
+            continue
+        if name not in FIELDS:
+            raise ValueError(f'unknown field {name!r}')
+        raw = str(value).encode()
+        if len(raw) > 255:
+            raise ValueError(f'{name} too long')
+        out += bytes([FIELDS[name], len(raw)]) + raw
+    return bytes(out)
+
+
+def decode_tlv(payload: bytes) -> dict:
+    config, pos = {}, 0
+    while pos + 2 <= len(payload):
+        tag, length = payload[pos], payload[pos + 1]
+        value = payload[pos + 2:pos + 2 + length]
+        if tag == TAG_MAC:
+            config['mac'] = value.hex(':')
+        else:
+            config[NAMES.get(tag, f'tag_{tag:#04x}')] = value.decode(errors='replace')
+        pos += 2 + length
+    return config
+
+
+class Port:
+    def __init__(self, path: str, baud: int = 115200):
+        self.path = path
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        attrs = termios.tcgetattr(self.fd)
+        speed = getattr(termios, f'B{baud}')
+        attrs[0] = 0                                  # iflag
+        attrs[1] = 0                                  # oflag
+        attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attrs[3] = 0                                  # lflag, raw
+        attrs[4] = attrs[5] = speed
+        attrs[6][termios.VMIN] = 0
+        attrs[6][termios.VTIME] = 0
+        termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+        self.buf = bytearray()
+
+    def close(self):
+        os.close(self.fd)
+
+    def drain(self):
+        termios.tcflush(self.fd, termios.TCIFLUSH)
+        self.buf.clear()
+
+    def write(self, data: bytes):
+        os.write(self.fd, data)
+        termios.tcdrain(self.fd)
+
+    def read_frame(self, seq: int, timeout: float):
+        """Next good frame with our sequence number, log text and stale replies skipped."""
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self._parse(seq)
+            if frame is not None:
+                return frame
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            ready, _, _ = select.select([self.fd], [], [], left)
+            if ready:
+                self.buf += os.read(self.fd, 4096)
+
+    def _parse(self, seq: int):
+        while True:
+            start = self.buf.find(SYNC)
+            if start < 0:
+                del self.buf[:max(0, len(self.buf) - 1)]
+                return None
+            del self.buf[:start]
+            if len(self.buf) < 6:
+                return None
+            length = self.buf[2] | self.buf[3] << 8
+            total = 4 + length + 3
+            if length < 2 or total > 512:
+                del self.buf[:1]
+                continue
+            if len(self.buf) < total:
+                return None
+            frame = bytes(self.buf[:total])
+            good = (frame[-1] == ETX and
+                    crc16_modbus(frame[:-3]) == frame[-3] | frame[-2] << 8)
+            if not good:
+                del self.buf[:1]
+                continue
+            del self.buf[:total]
+            if frame[4] == seq:
+                return frame[5], frame[6:-3]
+
+
+class Device:
+    def __init__(self, port: Port, retries: int, timeout: float):
+        self.port = port
+        self.retries = retries
+        self.timeout = timeout
+        self.seq = int.from_bytes(os.urandom(1), 'little')
+
+    def request(self, ftype: int, payload: bytes = b''):
+        for attempt in range(self.retries):
+            self.seq = (self.seq + 1) & 0xFF
+            self.port.write(build_frame(self.seq, ftype, payload))
+            reply = self.port.read_frame(self.seq, self.timeout)
+            if reply is None:
+                continue
+            rtype, body = reply
+            if rtype == T_BUSY:
+                time.sleep(0.1 * (attempt + 1))
+                continue
+            return rtype, body
+        raise TimeoutError(f'{self.port.path}: no reply after {self.retries} attempts')
+
+    def get(self) -> dict:
+        rtype, body = self.request(T_GET_CONFIG)
+        # A long config comes in several frames, TLVs are never split across them
+        parts = []
+        while rtype == T_CONFIG_MORE:
+            parts.append(body)
+            reply = self.port.read_frame(self.seq, self.timeout)
+            if reply is None:
+                raise TimeoutError(f'{self.port.path}: config reply cut short')
+            rtype, body = reply
+        if rtype != T_CONFIG:
+            raise RuntimeError(f'unexpected reply type {rtype:#x}')
+        return decode_tlv(b''.join(parts) + body)
+
+    def set(self, config: dict) -> int:
+        rtype, body = self.request(T_SET_CONFIG, encode_tlv(config))
+        if rtype != T_RESULT or len(body) < 3:
+            raise RuntimeError(f'unexpected reply type {rtype:#x}')
+        status, tag, applied = body[0], body[1], body[2]
+        if status != 0:
+            what = STATUS[status] if status < len(STATUS) else status
+            stored = f', first {applied} fields stored' if applied else ''
+            raise RuntimeError(f'rejected: {what} ({NAMES.get(tag, tag)}){stored}')
+        return applied
+
+
+def open_device(path: str, args) -> Device:
+    port = Port(path, args.baud)
+    if args.settle:
+        # Opening the port pulses DTR/RTS on most dev boards, wait out the boot log
+        time.sleep(args.settle)
+    port.drain()
+    return Device(port, args.retries, args.timeout)
+
+
+def cmd_get(args) -> int:
+    rc = 0
+    for path in args.port:
+        dev = open_device(path, args)
+        try:
+            print(json.dumps({'port': path, **dev.get()}, indent=2))
+        except (TimeoutError, RuntimeError) as e:
+            print(f'{path}: {e}', file=sys.stderr)
+            rc = 1
+        finally:
+            dev.port.close()
+    return rc
+
+
+def cmd_set(args) -> int:
+    with open(args.config) as f:
+        config = json.load(f)
+    encode_tlv(config)   # fail on unknown fields before touching any unit
+
+    rc = 0
+    for path in args.port:
+        start = time.monotonic()
+        dev = open_device(path, args)
+        try:
+            applied = dev.set(config)
+            readback = dev.get() if args.verify else {}
+            diff = [k for k in config if k not in READONLY and readback.get(k) != str(config[k])] if args.verify else []
+            if diff:
+                raise RuntimeError(f'verify failed: {", ".join(diff)}')
+            mac = readback.get('mac', '?')
+            print(f'{path}: {mac} {applied} fields{" verified" if args.verify else ""}'
+                  f' in {time.monotonic() - start:.2f} s')
+        except (TimeoutError, RuntimeError) as e:
+            print(f'{path}: {e}', file=sys.stderr)
+            rc = 1
+        finally:
+            dev.port.close()
+    return rc
+
+
+def main() -> int:
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument('--baud', type=int, default=115200)
+    ap.add_argument('--timeout', type=float, default=1.0, help='seconds per attempt')
+    ap.add_argument('--retries', type=int, default=5)
+    ap.add_argument('--settle', type=float, default=0.0,
+                    help='seconds to wait after opening, for boards that reset on open')
+    sub = ap.add_subparsers(dest='cmd', required=True)
+
+    g = sub.add_parser('get')
+    g.add_argument('-p', '--port', action='append', required=True)
+    g.set_defaults(func=cmd_get)
+
+    s = sub.add_parser('set')
+    s.add_argument('config', help='JSON object, keys as printed by get')
+    s.add_argument('-p', '--port', action='append', required=True)
+    s.add_argument('--verify', action='store_true', help='read back and compare')
+    s.set_defaults(func=cmd_set)
+
+    args = ap.parse_args()
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
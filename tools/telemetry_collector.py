@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+"""Decoder and local stand-in collector for the binary telemetry frames.
+
+The frame layout is documented in main/telemetry.h.
+
+    telemetry_collector.py serve [--port 8080]    accept POSTs, print records and throughput
+    telemetry_collector.py decode frame.bin ...   decode frames saved to files
+
+Both take --csv FILE to append the samples as t_ms,power,pf lines, the trace
+format tools/nilm_replay.c reads.
+"""
+import argparse
+import http.server
+import struct
+import sys
+import time
+
+HEADER = struct.Struct('<2sBB6sIIH')
+REC_SAMPLE = 0x01
+REC_EVENT = 0x02
+SAMPLE_FIELDS = ('voltage', 'current', 'power', 'energy', 'frequency', 'pf', 'balance_wh')
+SAMPLE_SCALE = (10.0, 1000.0, 10.0, 1.0, 10.0, 100.0, 1.0)
+EVENTS = {1: 'boot', 2: 'daily_limit', 3: 'depleted', 4: 'topup', 5: 'reset_kwh', 6: 'overload'}
+
+
+def crc16_modbus(data: bytes) -> int:
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def _uvarint(buf: bytes, pos: int):
+    value = shift = 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        if b < 0x80:
+            return value, pos
+        shift += 7
+
+
+def _svarint(buf: bytes, pos: int):
+    v, pos = _uvarint(buf, pos)
+    return (v >> 1) ^ -(v & 1), pos
+
+
+def decode_frame(frame: bytes) -> dict:
+    if len(frame) < HEADER.size + 2:
+        raise ValueError('frame too short')
+    if crc16_modbus(frame[:-2]) != frame[-2] | frame[-1] << 8:
+        raise ValueError('CRC mismatch')
+
+    magic, version, _flags, dev, seq, base, count = HEADER.unpack_from(frame)
+    if magic != b'PM' or version != 1:
+        raise ValueError('not a telemetry frame')
+
+    pos, t_ms, prev = HEADER.size, base * 1000, [0] * len(SAMPLE_FIELDS)
+    records = []
+    for _ in range(count):
+        rtype = frame[pos]
+        dt, pos = _uvarint(frame, pos + 1)
+        t_ms += dt
+        if rtype == REC_SAMPLE:
+            for i in range(len(prev)):
+                delta, pos = _svarint(frame, pos)
+                prev[i] += delta
+            rec = {f: prev[i] / SAMPLE_SCALE[i] for i, f in enumerate(SAMPLE_FIELDS)}
+            rec['type'] = 'sample'
+        elif rtype == REC_EVENT:
+            code, pos = _uvarint(frame, pos)
+            arg, pos = _svarint(frame, pos)
+            rec = {'type': 'event', 'event': EVENTS.get(code, code), 'arg': arg}
+        else:
+            raise ValueError(f'unknown record type {rtype:#x}')
+        rec['t_ms'] = t_ms
+        records.append(rec)
+
+    return {'device': dev.hex(':'), 'seq': seq, 'base': base, 'records': records}
+
+
+def write_csv(out, frame: dict) -> None:
+    for r in frame['records']:
+        if r['type'] == 'sample':
+            out.write(f"{r['t_ms']},{r['power']:.1f},{r['pf']:.2f}\n")
+    out.flush()
+
+
+class Collector(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'  # keep-alive, the device reuses its connection
+    started = time.monotonic()
+    samples = frames = body_bytes = 0
+    quiet = False
+    csv = None
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        try:
+            frame = decode_frame(body)
+        except (ValueError, IndexError) as e:
+            self.send_response(400)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            print(f'bad frame: {e}', file=sys.stderr)
+            return
+
+        cls = type(self)
+        n = sum(r['type'] == 'sample' for r in frame['records'])
+        cls.frames += 1
+        cls.samples += n
+        cls.body_bytes += len(body)
+        if cls.csv is not None:
+            write_csv(cls.csv, frame)
+
+        if not cls.quiet:
+            for r in frame['records']:
+                print(frame['device'], frame['seq'], r)
+        elapsed = max(time.monotonic() - cls.started, 1e-6)
+        print(f"[{frame['device']} seq {frame['seq']}] {len(body)} B, {n} samples | "
+              f'total {cls.samples / elapsed:.1f} samples/s, '
+              f'{cls.body_bytes / max(cls.samples, 1):.1f} bytes/sample')
+
+        self.send_response(204)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+def main() -> int:
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest='cmd', required=True)
+    s = sub.add_parser('serve')
+    s.add_argument('--port', type=int, default=8080)
+    s.add_argument('--quiet', action='store_true', help='only print throughput lines')
+    d = sub.add_parser('decode')
+    d.add_argument('files', nargs='+')
+    for p in (s, d):
+        p.add_argument('--csv', type=argparse.FileType('a'), help='append samples as t_ms,power,pf')
+    args = ap.parse_args()
+
+    if args.cmd == 'decode':
+        for name in args.files:
+            with open(name, 'rb') as f:
+                frame = decode_frame(f.read())
+            for r in frame['records']:
+                print(frame['device'], frame['seq'], r)
+            if args.csv is not None:
+                write_csv(args.csv, frame)
+        return 0
+
+    Collector.quiet = args.quiet
+    Collector.csv = args.csv
+    server = http.server.ThreadingHTTPServer(('', args.port), Collector)
+    print(f'collector listening on :{args.port}, set the device URL with <5,http://<host>:{args.port}/>')
+    server.serve_forever()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+"""Convert a <trace> dump into Chrome / Perfetto trace JSON.
+
+The record layout and event list are documented in main/trace.h.
+
+    trace2chrome.py monitor.log -o trace.json        dump captured from the console
+    trace2chrome.py -p /dev/ttyUSB0 -o trace.json    send <trace> and capture the reply
+
+Open the result in https://ui.perfetto.dev or chrome://tracing. Tracks are
+tasks, relay changes also get a counter track. The longest spans per event
+are printed on stderr.
+"""
+import argparse
+import json
+import os
+import re
+import select
+import struct
+import sys
+import termios
+import time
+
+RECORD = struct.Struct('<IBBH')
+
+# Must match trace_event_t in main/trace.h
+EVENTS = ['sync', 'sync_us', 'sample', 'pzem_tx', 'pzem_rx', 'pzem_crc', 'nvs_commit', 'lcd_flush',
+          'http', 'http_phase', 'relay', 'protect_poll']
+EV_SYNC, EV_SYNC_US = 0, 1
+EV_HTTP, EV_HTTP_PHASE, EV_RELAY = 8, 9, 10
+KINDS = {0: 'i', 1: 'B', 2: 'E'}
+HTTP_CLIENTS = {0: 'telemetry', 1: 'telegram'}
+HTTP_PHASES = ['error', 'connected', 'headers_sent', 'header', 'data', 'finish', 'disconnected', 'redirect']
+
+LINE = re.compile(r'TRACE: (begin|task|ring|rec|end)\b ?(.*)')
+ANSI = re.compile(r'\x1b\[[0-9;]*m')
+
+
+def parse_dump(lines):
+    """Last complete dump in the text: header, task names, records per core."""
+    dump = None
+    for raw in lines:
+        m = LINE.search(ANSI.sub('', raw))
+        if not m:
+            continue
+        kind, rest = m.group(1), m.group(2).strip()
+        if kind == 'begin':
+            fields = rest.split()
+            header = dict(zip(fields[1::2], (int(v) for v in fields[2::2])))
+            dump = {'header': header, 'tasks': {}, 'rings': {}, 'complete': False}
+        elif dump is None:
+            continue
+        elif kind == 'task':
+            num, _, name = rest.partition(' ')
+            dump['tasks'][int(num)] = name
+        elif kind == 'ring':
+            dump['rings'][int(rest.split()[0])] = []
+        elif kind == 'rec':
+            core, _, data = rest.partition(' ')
+            blob = bytes.fromhex(data)
+            dump['rings'][int(core)] += list(RECORD.iter_unpack(blob))
+        elif kind == 'end':
+            dump['complete'] = True
+    if dump is None or not dump['complete']:
+        sys.exit('no complete trace dump found')
+    return dump
+
+
+def timed_records(records, default_mhz):
+    """(us, code, task, arg) for records after the first sync pair, from the sync before each one.
+
+    A sync carries the CPU MHz it was taken at, a v1 dump has 0 there and runs at default_mhz."""
+    out = []
+    sync_cycles = None
+    sync_us = None
+    sync_mhz = default_mhz
+    next_cycles = None
+    next_mhz = default_mhz
+    for cycles, code, task, arg in records:
+        ev = code & 0x3F
+        if ev == EV_SYNC:
+            next_cycles, next_mhz = cycles, arg or default_mhz
+            continue
+        if ev == EV_SYNC_US:
+            if next_cycles is not None:
+                sync_cycles, sync_us, sync_mhz = next_cycles, cycles | (arg << 32), next_mhz
+            next_cycles = None
+            continue
+        if sync_us is None:
+            continue        # older than the first surviving sync
+        delta = (cycles - sync_cycles) & 0xFFFFFFFF
+        out.append((sync_us + delta / sync_mhz, code, task, arg))
+    return out
+
+
+def convert(dump):
+    mhz = dump['header'].get('mhz', 240)
+    tasks = dump['tasks']
+    events = []
+    spans = {}
+    dropped = 0
+
+    for num, name in sorted(tasks.items()):
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': num, 'args': {'name': name}})
+    events.append({'name': 'process_name', 'ph': 'M', 'pid': 0, 'args': {'name': 'meter'}})
+
+    for core, records in sorted(dump['rings'].items()):
+        open_spans = {}
+        for us, code, task, arg in timed_records(records, mhz):
+            ev = code & 0x3F
+            ph = KINDS.get(code >> 6, 'i')
+            name = EVENTS[ev] if ev < len(EVENTS) else 'ev%d' % ev
+            args = {'core': core, 'arg': arg}
+            if ev == EV_HTTP and ph == 'B':
+                args['client'] = HTTP_CLIENTS.get(arg, arg)
+            if ev == EV_HTTP_PHASE:
+                name = 'http_' + (HTTP_PHASES[arg] if arg < len(HTTP_PHASES) else str(arg))
+
+            key = (task, ev)
+            if ph == 'B':
+                open_spans.setdefault(key, []).append(us)
+            elif ph == 'E':
+                if not open_spans.get(key):
+                    dropped += 1      # began before the oldest record kept
+                    continue
+                start = open_spans[key].pop()
+                spans.setdefault(name, []).append((us - start, start))
+
+            item = {'name': name, 'ph': ph, 'ts': us, 'pid': 0, 'tid': task, 'args': args}
+            if ph == 'i':
+                item['s'] = 't'
+            events.append(item)
+            if ev == EV_RELAY:
+                events.append({'name': 'relay', 'ph': 'C', 'ts': us, 'pid': 0, 'args': {'on': arg}})
+
+    return {'traceEvents': events, 'displayTimeUnit': 'ms'}, spans, dropped
+
+
+def capture(path, baud, timeout):
+    """Send <trace> and return the console text up to the end line."""
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    try:
+        attrs = termios.tcgetattr(fd)
+        speed = getattr(termios, f'B{baud}')
+        attrs[0] = attrs[1] = attrs[3] = 0
+        attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attrs[4] = attrs[5] = speed
+        attrs[6][termios.VMIN] = 0
+        attrs[6][termios.VTIME] = 0
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+        termios.tcflush(fd, termios.TCIFLUSH)
+        os.write(fd, b'<trace>')
+
+        buf = b''
+        deadline = time.monotonic() + timeout
+        while b'TRACE: end' not in buf:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                break
+            ready, _, _ = select.select([fd], [], [], left)
+            if ready:
+                buf += os.read(fd, 4096)
+        return buf.decode(errors='replace').splitlines()
+    finally:
+        os.close(fd)
+
+
+def main() -> int:
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument('log', nargs='?', help='console capture, stdin when omitted')
+    ap.add_argument('-p', '--port', help='serial port to request the dump from instead')
+    ap.add_argument('--baud', type=int, default=115200)
+    ap.add_argument('--timeout', type=float, default=5.0, help='seconds to wait for the dump')
+    ap.add_argument('-o', '--output', default='trace.json')
+    ap.add_argument('--top', type=int, default=3, help='longest spans listed per event')
+    args = ap.parse_args()
+
+    if args.port:
+        lines = capture(args.port, args.baud, args.timeout)
+    elif args.log:
+        with open(args.log, errors='replace') as f:
+            lines = f.readlines()
+    else:
+        lines = sys.stdin.readlines()
+
+    trace, spans, dropped = convert(parse_dump(lines))
+    with open(args.output, 'w') as f:
+        json.dump(trace, f)
+
+    print('%d events written to %s, %d unmatched ends dropped' % (len(trace['traceEvents']), args.output, dropped),
+          file=sys.stderr)
+    for name, items in sorted(spans.items()):
+        longest = sorted(items, reverse=True)[:args.top]
+        print('%-12s n=%-5d %s' % (name, len(items), '  '.join('%.0f us @%.3f s' % (d, t / 1e6) for d, t in longest)),
+              file=sys.stderr)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())